@@ -26,6 +26,7 @@
 #include "libicd_network_wireguard.h"
 
 struct wireguard_method_callbacks {
+	const gchar *interface;
 	const gchar *method_name;
 	DBusHandleMessageFunction call;
 };
@@ -34,9 +35,17 @@ static DBusHandlerResult error_callback(DBusConnection * connection,
 					DBusMessage * message, void *user_data);
 
 static struct wireguard_method_callbacks callbacks[] = {
-	{"Start", &start_callback},
-	{"Stop", &stop_callback},
-	{"GetStatus", &getstatus_callback},
+	{ICD_WIREGUARD_DBUS_INTERFACE, "Start", &start_callback},
+	{ICD_WIREGUARD_DBUS_INTERFACE, "Stop", &stop_callback},
+	{ICD_WIREGUARD_DBUS_INTERFACE, "GetStatus", &getstatus_callback},
+	{ICD_WIREGUARD_DBUS_INTERFACE, "GetStatistics", &getstatistics_callback},
+	{ICD_WIREGUARD_DBUS_INTERFACE, "GetTimings", &gettimings_callback},
+	{ICD_WIREGUARD_DBUS_INTERFACE, "GetConfigChecks", &getconfigchecks_callback},
+	{ICD_WIREGUARD_DBUS_INTERFACE, "GetProfile", &getprofile_callback},
+
+	{DBUS_INTERFACE_PROPERTIES, "Get", &properties_get_callback},
+	{DBUS_INTERFACE_PROPERTIES, "GetAll", &properties_getall_callback},
+	{DBUS_INTERFACE_PROPERTIES, "Set", &properties_set_callback},
 
 	{NULL,}
 };
@@ -58,15 +67,24 @@ static DBusHandlerResult wireguard_icd_dbus_api_request(DBusConnection * connect
 
 	WN_DEBUG("ICD2 Wireguard dbus api request\n");
 
+	const char *interface = dbus_message_get_interface(message);
 	const char *member = dbus_message_get_member(message);
 
 	int i = 0;
 
 	while (callbacks[i].method_name != NULL) {
-		if (strcmp(member, callbacks[i].method_name) == 0) {
+		/* The interface is optional for method calls, in which case the
+		 * first method with a matching name wins */
+		if (strcmp(member, callbacks[i].method_name) == 0 &&
+		    (interface == NULL || strcmp(interface, callbacks[i].interface) == 0)) {
+			DBusHandlerResult result;
+
 			WN_DEBUG("Match for method %s", member);
-			return callbacks[i].call(connection, message,
-						 user_data);
+			WG_TRACE1(dbus_method_enter, member);
+			result = callbacks[i].call(connection, message, user_data);
+			WG_TRACE2(dbus_method_exit, member, result);
+
+			return result;
 		}
 
 		i++;
@@ -91,6 +109,17 @@ static DBusHandlerResult error_callback(DBusConnection * connection,
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
+/* ICD_WIREGUARD_DBUS_PATH, user_data is the module, the request goes to
+ * whichever tunnel is the main one right now */
+static DBusHandlerResult wireguard_icd_dbus_main_request(DBusConnection * connection,
+							 DBusMessage * message,
+							 void *user_data)
+{
+	network_wireguard_private *priv = user_data;
+
+	return wireguard_icd_dbus_api_request(connection, message, wireguard_main_tunnel(priv));
+}
+
 int setup_wireguard_dbus(void *user_data)
 {
 	WN_DEBUG("Registering ICD2 Wireguard dbus service");
@@ -98,7 +127,7 @@ int setup_wireguard_dbus(void *user_data)
 					     ICD_WIREGUARD_DBUS_INTERFACE,
 					     DBUS_NAME_FLAG_REPLACE_EXISTING |
 					     DBUS_NAME_FLAG_DO_NOT_QUEUE,
-					     wireguard_icd_dbus_api_request,
+					     wireguard_icd_dbus_main_request,
 					     user_data) == FALSE) {
 		WN_ERR("Failed to register DBUS interface\n");
 		return 1;
@@ -114,3 +143,25 @@ int free_wireguard_dbus(void)
 					   ICD_WIREGUARD_DBUS_INTERFACE);
 	return 0;
 }
+
+/**
+ * Serve the same methods for one tunnel on its own object path.
+ *
+ * @param path       object path
+ * @param user_data  the tunnel
+ * @return 0 on success, 1 on error
+ */
+int setup_wireguard_dbus_path(const char *path, void *user_data)
+{
+	if (icd_dbus_register_system_service(path, NULL, 0, wireguard_icd_dbus_api_request, user_data) == FALSE) {
+		WN_ERR("Failed to register %s\n", path);
+		return 1;
+	}
+
+	return 0;
+}
+
+void free_wireguard_dbus_path(const char *path)
+{
+	icd_dbus_unregister_system_service(path, NULL);
+}
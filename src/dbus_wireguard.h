@@ -28,6 +28,8 @@
 
 int setup_wireguard_dbus(void *user_data);
 int free_wireguard_dbus(void);
+int setup_wireguard_dbus_path(const char *path, void *user_data);
+void free_wireguard_dbus_path(const char *path);
 
 #if 0
 void broadcast_status_changed(... status)
@@ -0,0 +1,392 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * icd-wireguard-helper: started once by the network module, runs wg-quick
+ * and writes its configs for it, see libicd_wireguard_helper.h. It exits
+ * when the module closes its end; wg-quick runs that are still going are
+ * left to finish.
+ */
+
+#include <sys/signalfd.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "libicd_wireguard_helper.h"
+
+/* The tests build a helper of their own, with a stand-in for wg-quick */
+#ifndef WG_QUICK
+#define WG_QUICK "/usr/bin/wg-quick"
+#endif
+#ifndef CONFIG_DIR
+#define CONFIG_DIR "/etc/wireguard"
+#endif
+
+extern char **environ;
+
+/* A wg-quick that is running, or an interface whose configure failed */
+struct entry {
+	struct entry *next;
+	uint32_t id;
+	uint32_t type;
+	pid_t pid;
+	char interface[sizeof(((struct wireguard_helper_msg *) 0)->interface)];
+};
+
+static struct entry *running;
+static struct entry *unconfigured;
+
+static int sock = STDIN_FILENO;
+
+static void answer(const struct wireguard_helper_msg *request, int32_t value)
+{
+	struct wireguard_helper_msg msg = *request;
+	const char *p = (const char *)&msg;
+	size_t len = sizeof(msg);
+
+	msg.value = value;
+	msg.length = 0;
+
+	while (len) {
+		ssize_t ret = write(sock, p, len);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		/* The module is gone */
+		if (ret < 0)
+			exit(0);
+		p += ret;
+		len -= ret;
+	}
+}
+
+static struct entry **find(struct entry **list, const char *interface, uint32_t id)
+{
+	for (; *list; list = &(*list)->next) {
+		if (interface ? strcmp((*list)->interface, interface) == 0 : (*list)->id == id)
+			return list;
+	}
+
+	return list;
+}
+
+static void forget(struct entry **list, const char *interface, uint32_t id)
+{
+	struct entry **entry = find(list, interface, id);
+	struct entry *found = *entry;
+
+	if (found) {
+		*entry = found->next;
+		free(found);
+	}
+}
+
+static struct entry *remember(struct entry **list, const struct wireguard_helper_msg *msg)
+{
+	struct entry *entry = calloc(1, sizeof(*entry));
+
+	if (entry == NULL)
+		return NULL;
+
+	entry->id = msg->id;
+	entry->type = msg->type;
+	memcpy(entry->interface, msg->interface, sizeof(entry->interface));
+	entry->next = *list;
+	*list = entry;
+
+	return entry;
+}
+
+/* icdwgN and nothing else, it ends up in a path and on a command line */
+static int valid_interface(const char *interface)
+{
+	size_t prefix = strlen(WIREGUARD_INTERFACE_PREFIX);
+	const char *p;
+
+	if (memchr(interface, '\0', sizeof(((struct wireguard_helper_msg *) 0)->interface)) == NULL
+	    || strncmp(interface, WIREGUARD_INTERFACE_PREFIX, prefix) != 0 || interface[prefix] == '\0')
+		return 0;
+
+	for (p = interface + prefix; *p; p++) {
+		if (*p < '0' || *p > '9')
+			return 0;
+	}
+
+	return 1;
+}
+
+/* Write the config next to where it goes and move it there, returns 0 or
+ * an errno */
+static int configure(const struct wireguard_helper_msg *msg, const char *config)
+{
+	char path[sizeof(CONFIG_DIR) + sizeof(msg->interface) + 16];
+	char tmp[sizeof(path) + 4];
+	size_t len = msg->length;
+	int fd, err = 0;
+
+	snprintf(path, sizeof(path), CONFIG_DIR "/%s.conf", msg->interface);
+	snprintf(tmp, sizeof(tmp), "%s.tmp", path);
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return errno;
+
+	while (len && err == 0) {
+		ssize_t ret = write(fd, config, len);
+
+		if (ret < 0 && errno != EINTR)
+			err = errno;
+		else if (ret > 0) {
+			config += ret;
+			len -= ret;
+		}
+	}
+
+	if (close(fd) < 0 && err == 0)
+		err = errno;
+	if (err == 0 && rename(tmp, path) < 0)
+		err = errno;
+	if (err)
+		unlink(tmp);
+
+	return err;
+}
+
+static void run(const struct wireguard_helper_msg *msg)
+{
+	char *args[] = { WG_QUICK, msg->type == WIREGUARD_HELPER_UP ? "up" : "down", (char *)msg->interface, NULL };
+	struct wireguard_helper_msg started;
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	struct entry *entry;
+	pid_t pid;
+	int ret;
+
+	if (msg->type == WIREGUARD_HELPER_UP && *find(&unconfigured, msg->interface, 0)) {
+		answer(msg, W_EXITCODE(1, 0));
+		return;
+	}
+
+	entry = remember(&running, msg);
+	if (entry == NULL) {
+		answer(msg, W_EXITCODE(ENOMEM, 0));
+		return;
+	}
+
+	/* Our stdin is the module's socket, neither wg-quick nor the hooks it
+	 * runs may read or write requests on it */
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_addopen(&actions, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+
+	/* SIGCHLD is blocked here, for the signalfd */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attr, &signals);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+
+	ret = posix_spawn(&pid, WG_QUICK, &actions, &attr, args, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	if (ret != 0) {
+		fprintf(stderr, "Unable to run " WG_QUICK ": %s\n", strerror(ret));
+		forget(&running, NULL, msg->id);
+		answer(msg, W_EXITCODE(127, 0));
+		return;
+	}
+
+	entry->pid = pid;
+
+	started = *msg;
+	started.type = WIREGUARD_HELPER_STARTED;
+	answer(&started, pid);
+}
+
+static void handle(const struct wireguard_helper_msg *msg, const char *payload)
+{
+	struct entry *entry;
+	int err;
+
+	if (msg->type != WIREGUARD_HELPER_CANCEL && msg->type != WIREGUARD_HELPER_KILL
+	    && !valid_interface(msg->interface)) {
+		fprintf(stderr, "Refusing request %u, not an interface of ours\n", msg->id);
+		answer(msg, msg->type == WIREGUARD_HELPER_CONFIGURE ? EINVAL : W_EXITCODE(1, 0));
+		return;
+	}
+
+	switch (msg->type) {
+	case WIREGUARD_HELPER_CONFIGURE:
+		err = configure(msg, payload);
+		forget(&unconfigured, msg->interface, 0);
+		if (err)
+			remember(&unconfigured, msg);
+		answer(msg, err);
+		break;
+	case WIREGUARD_HELPER_UP:
+	case WIREGUARD_HELPER_DOWN:
+		run(msg);
+		break;
+	case WIREGUARD_HELPER_CANCEL:
+	case WIREGUARD_HELPER_KILL:
+		entry = *find(&running, NULL, (uint32_t) msg->value);
+		if (entry)
+			kill(entry->pid, msg->type == WIREGUARD_HELPER_KILL ? SIGKILL : SIGTERM);
+		break;
+	default:
+		fprintf(stderr, "Unknown request %u\n", msg->type);
+	}
+}
+
+/* Answer for every wg-quick that exited */
+static void reap(void)
+{
+	int status;
+	pid_t pid;
+
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0) {
+		struct entry **entry;
+
+		for (entry = &running; *entry && (*entry)->pid != pid; entry = &(*entry)->next) ;
+		if (*entry) {
+			struct wireguard_helper_msg msg;
+
+			memset(&msg, 0, sizeof(msg));
+			msg.type = (*entry)->type;
+			msg.id = (*entry)->id;
+			memcpy(msg.interface, (*entry)->interface, sizeof(msg.interface));
+			answer(&msg, status);
+			forget(&running, NULL, msg.id);
+		}
+	}
+}
+
+/* Whatever we were started with besides stdin, stdout and stderr is not
+ * for wg-quick; our own fds are all opened close-on-exec */
+static void close_on_exec_inherited(void)
+{
+	long max = sysconf(_SC_OPEN_MAX);
+	int fd;
+
+	if (max < 0 || max > 65536)
+		max = 65536;
+
+	for (fd = STDERR_FILENO + 1; fd < max; fd++) {
+		int flags = fcntl(fd, F_GETFD);
+
+		if (flags >= 0 && !(flags & FD_CLOEXEC))
+			fcntl(fd, F_SETFD, flags | FD_CLOEXEC);
+	}
+}
+
+int main(void)
+{
+	struct pollfd fds[2];
+	char *input = NULL;
+	size_t used = 0, size = 0;
+	sigset_t signals;
+
+	close_on_exec_inherited();
+
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGCHLD);
+	sigprocmask(SIG_BLOCK, &signals, NULL);
+	/* A write to the module after it is gone fails instead */
+	signal(SIGPIPE, SIG_IGN);
+
+	fds[0].fd = sock;
+	fds[0].events = POLLIN;
+	fds[1].fd = signalfd(-1, &signals, SFD_CLOEXEC);
+	fds[1].events = POLLIN;
+	if (fds[1].fd < 0) {
+		perror("signalfd");
+		return 1;
+	}
+
+	for (;;) {
+		const struct wireguard_helper_msg *msg;
+		ssize_t ret;
+
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			perror("poll");
+			return 1;
+		}
+
+		if (fds[1].revents & POLLIN) {
+			struct signalfd_siginfo info;
+
+			while (read(fds[1].fd, &info, sizeof(info)) < 0 && errno == EINTR) ;
+			reap();
+		}
+
+		if (!(fds[0].revents & (POLLIN | POLLHUP | POLLERR)))
+			continue;
+
+		if (size - used < 4096) {
+			char *grown = realloc(input, size ? size * 2 : 65536);
+
+			if (grown == NULL) {
+				perror("realloc");
+				return 1;
+			}
+			input = grown;
+			size = size ? size * 2 : 65536;
+		}
+
+		ret = read(sock, input + used, size - used);
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret <= 0)
+			return 0;
+		used += ret;
+
+		/* Every complete request */
+		for (;;) {
+			size_t len;
+
+			if (used < sizeof(*msg))
+				break;
+			msg = (const struct wireguard_helper_msg *)input;
+			if (msg->length > WIREGUARD_HELPER_MAX_PAYLOAD) {
+				fprintf(stderr, "Request %u too large\n", msg->id);
+				return 1;
+			}
+			len = sizeof(*msg) + msg->length;
+			if (used < len)
+				break;
+
+			handle(msg, input + sizeof(*msg));
+			memmove(input, input + len, used - len);
+			used -= len;
+		}
+	}
+}
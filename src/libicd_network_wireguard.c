@@ -21,255 +21,526 @@
 
 #include "libicd_network_wireguard.h"
 
-void wireguard_state_change(network_wireguard_private * private,
-			    wireguard_network_data * network_data, network_wireguard_state new_state, int source)
+static const char *state_names[WIREGUARD_STATE_COUNT] = {
+	[WIREGUARD_STATE_IDLE] = "idle",
+	[WIREGUARD_STATE_STOPPED] = "stopped",
+	[WIREGUARD_STATE_CONNECTING] = "connecting",
+	[WIREGUARD_STATE_STARTING] = "starting",
+	[WIREGUARD_STATE_RUNNING] = "running",
+};
+
+static const char *event_names[EVENT_SOURCE_COUNT] = {
+	[EVENT_SOURCE_IP_UP] = "ip_up",
+	[EVENT_SOURCE_IP_DOWN] = "ip_down",
+	[EVENT_SOURCE_GCONF_CHANGE] = "gconf_change",
+	[EVENT_SOURCE_WIREGUARD_UP] = "interface_up",
+	[EVENT_SOURCE_WIREGUARD_DOWN] = "interface_down",
+	[EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT] = "wg_quick_exit",
+	[EVENT_SOURCE_DBUS_CALL_START] = "dbus_start",
+	[EVENT_SOURCE_DBUS_CALL_STOP] = "dbus_stop",
+};
+
+const char *wireguard_tunnel_state_string(enum wireguard_tunnel_state state)
 {
-	network_wireguard_state current_state = private->state;
+	return state < WIREGUARD_STATE_COUNT ? state_names[state] : "unknown";
+}
 
-	if (source == EVENT_SOURCE_IP_UP) {
-		if (current_state.iap_connected) {
-			WN_ERR("ip_up called when we are already connected\n");
-			/* Figure out how to handle this */
-		}
+static void set_active_config(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	g_free(tunnel->state.active_config);
+	tunnel->state.active_config = event->active_config;
+	event->active_config = NULL;
+}
 
-		/* Add network to network_data */
-		private->network_data_list = g_slist_prepend(private->network_data_list, network_data);
-
-		if (new_state.service_provider_mode) {
-			/* Return right away, wait for dbus calls */
-			network_data->ip_up_cb(ICD_NW_SUCCESS, NULL, network_data->ip_up_cb_token, NULL);
-
-		} else {
-
-			/* Check if we want to start Tor (system wide enabled), or if we just
-			 * call the callback right now */
-			if (current_state.system_wide_enabled) {
-				int start_ret = 0;
-
-				start_ret = startup_wireguard(network_data, new_state.active_config);
-
-				if (start_ret != 0) {
-					icd_nw_ip_up_cb_fn up_cb = network_data->ip_up_cb;
-					gpointer up_token = network_data->ip_up_cb_token;
-
-					if (start_ret == 1) {
-						network_free_all(network_data);
-					}
-
-					new_state.iap_connected = FALSE;
-					up_cb(ICD_NW_ERROR, NULL, up_token);
-				} else {
-					new_state.wg_quick_running = TRUE;
-					new_state.wireguard_running = TRUE;
-					new_state.wireguard_up = FALSE;
-					/* ip_up_cb will be called later in the bootstrap pid exit */
-				}
-			} else {
-				/* System wide is disabled, so let's just call ip_up_cb right away */
-				network_data->ip_up_cb(ICD_NW_SUCCESS, NULL, network_data->ip_up_cb_token, NULL);
-			}
-		}
+static void wg_quick_failed(wireguard_tunnel * tunnel, const wireguard_event * event)
+{
+	gchar *error;
+
+	/* Never spawned, startup_wireguard() said why */
+	if (event->exit_status < 0)
+		return;
+
+	if (event->timeout)
+		error = g_strdup_printf("wg-quick timed out after %u s", event->timeout);
+	else
+		error = g_strdup_printf("wg-quick failed with exit status %d", event->exit_status);
+
+	WN_WARN("%s: %s\n", tunnel->interface_name, error);
+	wireguard_set_last_error(tunnel, error);
+	g_free(error);
+}
+
+/*
+ * Transitions. Each one is called for one event in one state, does what the
+ * event calls for and returns the new state. Callbacks into icd2 may post new
+ * events, those are handled after the transition returned.
+ */
+typedef enum wireguard_tunnel_state (*wireguard_transition_fn) (wireguard_tunnel * tunnel, wireguard_event * event);
 
-		emit_status_signal(new_state);
-	} else if (source == EVENT_SOURCE_IP_DOWN) {
-		icd_nw_ip_down_cb_fn down_cb = network_data->ip_down_cb;
-		gpointer down_token = network_data->ip_down_cb_token;
+static enum wireguard_tunnel_state ip_up_start(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+
+	tunnel->state.service_provider_mode = event->service_provider_mode;
+	set_active_config(tunnel, event);
+
+	/* A provider IAP waits for Start over D-Bus, and with system wide
+	 * disabled there is nothing to start */
+	if (tunnel->state.service_provider_mode || !tunnel->state.system_wide_enabled) {
+		network_data->ip_up_cb(ICD_NW_SUCCESS, NULL, network_data->ip_up_cb_token, NULL);
+		return WIREGUARD_STATE_STOPPED;
+	}
+
+	if (wireguard_tunnel_up(tunnel, network_data, tunnel->state.active_config) != 0) {
+		icd_nw_ip_up_cb_fn up_cb = network_data->ip_up_cb;
+		gpointer up_token = network_data->ip_up_cb_token;
 
-		/* Stop Tor etc, free network data */
-		network_stop_all(network_data);
 		network_free_all(network_data);
+		up_cb(ICD_NW_ERROR, NULL, up_token);
+		return WIREGUARD_STATE_IDLE;
+	}
 
-		new_state.wireguard_up = FALSE;
-		new_state.wg_quick_running = FALSE;
-		new_state.wireguard_running = FALSE;
-		new_state.service_provider_mode = FALSE;
-
-		down_cb(ICD_NW_SUCCESS, down_token);
-
-		emit_status_signal(new_state);
-	} else if (source == EVENT_SOURCE_GCONF_CHANGE) {
-		WN_INFO("Wireguard system_wide status changed via gconf");
-
-		/* We don't act on this in service provider mode */
-		if (!current_state.service_provider_mode && current_state.iap_connected) {
-			wireguard_network_data *network_data = icd_wireguard_find_first_network_data(private);
-
-			if (network_data == NULL) {
-				WN_ERR("iap_connected is TRUE, but we have no network_data");
-			} else {
-				if (new_state.system_wide_enabled
-				    && current_state.system_wide_enabled != new_state.system_wide_enabled) {
-					int start_ret = 0;
-
-					new_state.gconf_transition_ongoing = TRUE;
-
-					start_ret = startup_wireguard(network_data, new_state.active_config);
-
-					if (start_ret == 1) {
-						WN_ERR("Could not start Tor triggered through gconf change");
-						private->close_cb(ICD_NW_ERROR,
-								  "Could not launch Tor on gconf request",
-								  network_data->network_type,
-								  network_data->network_attrs,
-								  network_data->network_id);
-					} else if (start_ret == 0) {
-						new_state.wg_quick_running = TRUE;
-						new_state.wireguard_running = TRUE;
-						new_state.wireguard_up = FALSE;
-					}
-				} else {
-					new_state.gconf_transition_ongoing = TRUE;
-					network_stop_all(network_data);
-					/* TODO: review this, this is just ugly, but the reason we do this is
-					 * because we cannot detect interface going down if it never goes up
-					 * successfully, since we guard that with wireguard_interface_up, so
-					 * that needs fixing, but for now we work around it here */
-
-					new_state.wireguard_running = FALSE;
-					new_state.wireguard_up = FALSE;
-					new_state.wireguard_interface_up = FALSE;
-				}
-
-				emit_status_signal(new_state);
-			}
-		}
-	} else if (source == EVENT_SOURCE_DBUS_CALL_START) {
-		if (!current_state.service_provider_mode) {
-			WN_ERR("Got EVENT_SOURCE_DBUS_CALL_START while not in provider mode");
-			goto done;
-		}
+	/* ip_up is answered when wg-quick exits */
+	return WIREGUARD_STATE_CONNECTING;
+}
 
-		wireguard_network_data *network_data = icd_wireguard_find_first_network_data(private);
-		if (network_data == NULL) {
-			WN_ERR("service_provider_module is TRUE, but we have no network_data");
-			goto done;
-		}
+static enum wireguard_tunnel_state ip_up_refuse(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+	icd_nw_ip_up_cb_fn up_cb = network_data->ip_up_cb;
+	gpointer up_token = network_data->ip_up_cb_token;
 
-		int start_ret = 0;
-		start_ret = startup_wireguard(network_data, new_state.active_config);
+	WN_ERR("ip_up for %s while it is connected already\n", network_data->network_id);
 
-		if (start_ret != 0) {
-			new_state.dbus_failed_to_start = TRUE;
-			goto done;
-		}
+	network_free_all(network_data);
+	up_cb(ICD_NW_ERROR, NULL, up_token);
 
-		new_state.wg_quick_running = TRUE;
-		new_state.wireguard_running = TRUE;
-		new_state.wireguard_up = FALSE;
+	return tunnel->state.tunnel;
+}
 
-		emit_status_signal(new_state);
-	} else if (source == EVENT_SOURCE_DBUS_CALL_STOP) {
-		if (!current_state.service_provider_mode) {
-			WN_ERR("Got EVENT_SOURCE_DBUS_CALL_STOP while not in provider mode");
-			goto done;
-		}
+static enum wireguard_tunnel_state ip_down(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+	icd_nw_ip_down_cb_fn down_cb = network_data->ip_down_cb;
+	gpointer down_token = network_data->ip_down_cb_token;
 
-		wireguard_network_data *network_data = icd_wireguard_find_first_network_data(private);
-		if (network_data == NULL) {
-			WN_ERR("service_provider_module is TRUE, but we have no network_data");
-			goto done;
-		}
+	wireguard_tunnel_down(tunnel);
+	network_free_all(network_data);
+	tunnel->state.service_provider_mode = FALSE;
 
-		network_stop_all(network_data);
-		/* TODO: review this, this is just ugly, but the reason we do this is
-		 * because we cannot detect interface going down if it never goes up
-		 * successfully, since we guard that with wireguard_interface_up, so
-		 * that needs fixing, but for now we work around it here */
-		new_state.wireguard_running = FALSE;
-		new_state.wireguard_up = FALSE;
-		new_state.wireguard_interface_up = FALSE;
-	} else if (source == EVENT_SOURCE_WIREGUARD_UP) {
-		WN_INFO("Wireguard interface went up");
-
-		wireguard_network_data *network_data = icd_wireguard_find_first_network_data(private);
-		if (network_data == NULL) {
-			WN_ERR("We have no network data");
-			goto done;
-		}
+	down_cb(ICD_NW_SUCCESS, down_token);
 
-		emit_status_signal(new_state);
-	} else if (source == EVENT_SOURCE_WIREGUARD_DOWN) {
-		WN_INFO("Wireguard interface went down");
+	return WIREGUARD_STATE_IDLE;
+}
 
-		wireguard_network_data *network_data = icd_wireguard_find_first_network_data(private);
-		if (network_data == NULL) {
-			WN_ERR("We have no network data");
-			goto done;
-		}
+static enum wireguard_tunnel_state gconf_record(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	tunnel->state.system_wide_enabled = event->system_wide_enabled;
 
-		/* In service provider mode, I suppose this is fatal, but we can just
-		 * emit the signal and have the service provider bring down the network */
-
-		if (!current_state.wireguard_running) {
-			WN_ERR("Received wireguard interface down but we did not know it was up");
-			/* Figure out how to handle this */
-		} else {
-			if (current_state.service_provider_mode) {
-				/* Nothing more to do, service provider will pick it up */
-			} else if (current_state.gconf_transition_ongoing) {
-				new_state.gconf_transition_ongoing = FALSE;
-			} else {
-				/* This will call ip down, so we don't free/stop here, since
-				 * ip_down should be called */
-				private->close_cb(ICD_NW_ERROR,
-						  "Wireguard interface down (unexpectedly)",
-						  network_data->network_type,
-						  network_data->network_attrs, network_data->network_id);
-			}
-		}
+	return tunnel->state.tunnel;
+}
 
-		emit_status_signal(new_state);
-	} else if (source == EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT) {
-		network_data->wg_quick_pid = 0;
-
-		if (new_state.wireguard_up) {
-			new_state.iap_connected = TRUE;
-
-			if (current_state.service_provider_mode) {
-				/* Nothing more to do here */
-			} else if (current_state.gconf_transition_ongoing) {
-				new_state.gconf_transition_ongoing = FALSE;
-			} else {
-				network_data->ip_up_cb(ICD_NW_SUCCESS, NULL, network_data->ip_up_cb_token, NULL);
-			}
-		} else {
-			if (current_state.service_provider_mode) {
-				/* We should probably signal service_provider that we could
-				 * not connect to Tor somehow, although the Stopped signal
-				 * should tell it enough? */
-			} else if (current_state.gconf_transition_ongoing) {
-				new_state.gconf_transition_ongoing = FALSE;
-			} else {
-				icd_nw_ip_up_cb_fn up_cb = network_data->ip_up_cb;
-				gpointer up_token = network_data->ip_up_cb_token;
-
-				/* Maybe we should not free here */
-				new_state.iap_connected = FALSE;
-				network_stop_all(network_data);
-				/* TODO: review this, this is just ugly, but the reason we do this is
-				 * because we cannot detect interface going down if it never goes up
-				 * successfully, since we guard that with wireguard_interface_up, so
-				 * that needs fixing, but for now we work around it here */
-				new_state.wireguard_running = FALSE;
-				new_state.wireguard_up = FALSE;
-				new_state.wireguard_interface_up = FALSE;
-
-				network_free_all(network_data);
-
-				up_cb(ICD_NW_ERROR, NULL, up_token);
-			}
-		}
+static enum wireguard_tunnel_state gconf_enable(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+	gboolean was_enabled = tunnel->state.system_wide_enabled;
+
+	tunnel->state.system_wide_enabled = event->system_wide_enabled;
+
+	/* We don't act on this in service provider mode */
+	if (was_enabled || !tunnel->state.system_wide_enabled || tunnel->state.service_provider_mode)
+		return WIREGUARD_STATE_STOPPED;
+
+	if (wireguard_tunnel_up(tunnel, network_data, tunnel->state.active_config) != 0) {
+		WN_ERR("Could not start Wireguard triggered through gconf change");
+		tunnel->private->close_cb(ICD_NW_ERROR, "Could not start Wireguard on gconf request",
+					  network_data->network_type, network_data->network_attrs, network_data->network_id);
+		return WIREGUARD_STATE_STOPPED;
+	}
+
+	return WIREGUARD_STATE_STARTING;
+}
+
+static enum wireguard_tunnel_state gconf_disable(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+	enum wireguard_tunnel_state state = tunnel->state.tunnel;
+
+	tunnel->state.system_wide_enabled = event->system_wide_enabled;
+
+	if (tunnel->state.system_wide_enabled || tunnel->state.service_provider_mode)
+		return state;
+
+	wireguard_tunnel_down(tunnel);
+
+	/* Like an ip_up while disabled, the IAP comes up without the tunnel */
+	if (state == WIREGUARD_STATE_CONNECTING)
+		network_data->ip_up_cb(ICD_NW_SUCCESS, NULL, network_data->ip_up_cb_token, NULL);
+
+	return WIREGUARD_STATE_STOPPED;
+}
+
+static enum wireguard_tunnel_state interface_up(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	WN_INFO("Wireguard interface %s went up", tunnel->interface_name);
+
+	tunnel->state.wireguard_interface_up = TRUE;
+	tunnel->state.wireguard_interface_index = event->interface_index;
+	wireguard_timing_interface_up(tunnel);
+
+	return tunnel->state.tunnel;
+}
+
+/* wg-quick is still running or we stopped the tunnel ourselves; either way
+ * the interface going away is no news */
+static enum wireguard_tunnel_state interface_down(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	WN_INFO("Wireguard interface %s went down", tunnel->interface_name);
+
+	tunnel->state.wireguard_interface_up = FALSE;
+	tunnel->state.wireguard_interface_index = -1;
+
+	return tunnel->state.tunnel;
+}
+
+static enum wireguard_tunnel_state interface_lost(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+
+	interface_down(tunnel, event);
+
+	/* The service provider picks up the Stopped signal */
+	if (tunnel->state.service_provider_mode)
+		return WIREGUARD_STATE_STOPPED;
+
+	/* This will call ip down, so we don't free/stop here, since
+	 * ip_down should be called */
+	wireguard_set_last_error(tunnel, "Wireguard interface down (unexpectedly)");
+	tunnel->private->close_cb(ICD_NW_ERROR, "Wireguard interface down (unexpectedly)",
+				  network_data->network_type, network_data->network_attrs, network_data->network_id);
+
+	return WIREGUARD_STATE_STOPPED;
+}
+
+static enum wireguard_tunnel_state connect_done(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+	icd_nw_ip_up_cb_fn up_cb = network_data->ip_up_cb;
+	gpointer up_token = network_data->ip_up_cb_token;
+
+	network_data->wg_quick_pid = 0;
+	wireguard_timing_wg_quick_exit(tunnel, event->exit_status == 0);
+
+	if (event->exit_status == 0) {
+		up_cb(ICD_NW_SUCCESS, NULL, up_token, NULL);
+		return WIREGUARD_STATE_RUNNING;
+	}
+
+	wg_quick_failed(tunnel, event);
+	wireguard_tunnel_down(tunnel);
+	network_free_all(network_data);
+	up_cb(ICD_NW_ERROR, NULL, up_token);
+
+	return WIREGUARD_STATE_IDLE;
+}
+
+static enum wireguard_tunnel_state start_done(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	wireguard_network_data *network_data = event->network_data;
+
+	network_data->wg_quick_pid = 0;
+	wireguard_timing_wg_quick_exit(tunnel, event->exit_status == 0);
+
+	if (event->exit_status == 0)
+		return WIREGUARD_STATE_RUNNING;
+
+	/* The IAP stays up; a service provider closes its service when it sees
+	 * Stopped */
+	wg_quick_failed(tunnel, event);
+	wireguard_tunnel_down(tunnel);
+
+	return WIREGUARD_STATE_STOPPED;
+}
+
+/* A wg-quick up we stopped caring about because the tunnel was stopped in the
+ * meantime */
+static enum wireguard_tunnel_state wg_quick_stale(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	WN_INFO("%s: wg-quick exited with %d after the tunnel was stopped", tunnel->interface_name,
+		event->exit_status);
+	event->network_data->wg_quick_pid = 0;
+
+	return tunnel->state.tunnel;
+}
+
+static enum wireguard_tunnel_state dbus_start(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	if (!tunnel->state.service_provider_mode) {
+		WN_ERR("Got EVENT_SOURCE_DBUS_CALL_START while not in provider mode");
+		return WIREGUARD_STATE_STOPPED;
+	}
+
+	set_active_config(tunnel, event);
+
+	if (wireguard_tunnel_up(tunnel, event->network_data, tunnel->state.active_config) != 0)
+		return WIREGUARD_STATE_STOPPED;
+
+	return WIREGUARD_STATE_STARTING;
+}
+
+static enum wireguard_tunnel_state dbus_stop(wireguard_tunnel * tunnel, wireguard_event * event)
+{
+	if (!tunnel->state.service_provider_mode) {
+		WN_ERR("Got EVENT_SOURCE_DBUS_CALL_STOP while not in provider mode");
+		return tunnel->state.tunnel;
+	}
+
+	wireguard_tunnel_down(tunnel);
+
+	return WIREGUARD_STATE_STOPPED;
+}
+
+/* Events without an entry are ignored in that state */
+static const wireguard_transition_fn transitions[WIREGUARD_STATE_COUNT][EVENT_SOURCE_COUNT] = {
+	[WIREGUARD_STATE_IDLE] = {
+		[EVENT_SOURCE_IP_UP] = ip_up_start,
+		[EVENT_SOURCE_GCONF_CHANGE] = gconf_record,
+		[EVENT_SOURCE_WIREGUARD_UP] = interface_up,
+		[EVENT_SOURCE_WIREGUARD_DOWN] = interface_down,
+	},
+	[WIREGUARD_STATE_STOPPED] = {
+		[EVENT_SOURCE_IP_UP] = ip_up_refuse,
+		[EVENT_SOURCE_IP_DOWN] = ip_down,
+		[EVENT_SOURCE_GCONF_CHANGE] = gconf_enable,
+		[EVENT_SOURCE_WIREGUARD_UP] = interface_up,
+		[EVENT_SOURCE_WIREGUARD_DOWN] = interface_down,
+		[EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT] = wg_quick_stale,
+		[EVENT_SOURCE_DBUS_CALL_START] = dbus_start,
+	},
+	[WIREGUARD_STATE_CONNECTING] = {
+		[EVENT_SOURCE_IP_UP] = ip_up_refuse,
+		[EVENT_SOURCE_IP_DOWN] = ip_down,
+		[EVENT_SOURCE_GCONF_CHANGE] = gconf_disable,
+		[EVENT_SOURCE_WIREGUARD_UP] = interface_up,
+		[EVENT_SOURCE_WIREGUARD_DOWN] = interface_down,
+		[EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT] = connect_done,
+	},
+	[WIREGUARD_STATE_STARTING] = {
+		[EVENT_SOURCE_IP_UP] = ip_up_refuse,
+		[EVENT_SOURCE_IP_DOWN] = ip_down,
+		[EVENT_SOURCE_GCONF_CHANGE] = gconf_disable,
+		[EVENT_SOURCE_WIREGUARD_UP] = interface_up,
+		[EVENT_SOURCE_WIREGUARD_DOWN] = interface_down,
+		[EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT] = start_done,
+		[EVENT_SOURCE_DBUS_CALL_STOP] = dbus_stop,
+	},
+	[WIREGUARD_STATE_RUNNING] = {
+		[EVENT_SOURCE_IP_UP] = ip_up_refuse,
+		[EVENT_SOURCE_IP_DOWN] = ip_down,
+		[EVENT_SOURCE_GCONF_CHANGE] = gconf_disable,
+		[EVENT_SOURCE_WIREGUARD_UP] = interface_up,
+		[EVENT_SOURCE_WIREGUARD_DOWN] = interface_lost,
+		[EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT] = wg_quick_stale,
+		[EVENT_SOURCE_DBUS_CALL_STOP] = dbus_stop,
+	},
+};
+
+/**
+ * Handle one event: run the transition for it in the current state of its
+ * tunnel and publish the result. Only called by wireguard_state_post().
+ *
+ * @param private  network module private data
+ * @param event    the event
+ */
+void wireguard_state_change(network_wireguard_private * private, wireguard_event * event)
+{
+	wireguard_tunnel *tunnel = event->tunnel;
+	wireguard_tunnel *main_tunnel = wireguard_main_tunnel(private);
+	enum wireguard_tunnel_state old_state = tunnel->state.tunnel;
+	wireguard_transition_fn transition = transitions[old_state][event->source];
+	const char *old_status = wireguard_status_string(&tunnel->state);
+	const char *old_mode = wireguard_mode_string(&tunnel->state);
+	const char *old_main_status = wireguard_status_string(&main_tunnel->state);
+	const char *old_main_mode = wireguard_mode_string(&main_tunnel->state);
+	gint64 start, duration;
+
+	WG_TRACE2(state_change_enter, event->source, old_state);
+
+	if (transition == NULL) {
+		WN_DEBUG("%s: ignoring %s while %s", tunnel->interface_name, event_names[event->source],
+			 state_names[old_state]);
+		return;
+	}
+
+	if (event->network_data == NULL)
+		event->network_data = tunnel->network_data;
+
+	/* Only ip_up brings its own network data while idle */
+	if (event->network_data == NULL && old_state != WIREGUARD_STATE_IDLE) {
+		WN_ERR("%s: got %s while %s, but we have no network_data", tunnel->interface_name,
+		       event_names[event->source], state_names[old_state]);
+		return;
+	}
+
+	start = g_get_monotonic_time();
+	tunnel->state.tunnel = transition(tunnel, event);
+	duration = g_get_monotonic_time() - start;
+
+	WN_INFO("%s: %s: %s -> %s in %" G_GINT64_FORMAT " us", tunnel->interface_name, event_names[event->source],
+		state_names[old_state], state_names[tunnel->state.tunnel], duration);
+
+	/* Status and mode strings are static, comparing pointers is enough */
+	if (wireguard_status_string(&tunnel->state) != old_status || wireguard_mode_string(&tunnel->state) != old_mode)
+		emit_status_signal(tunnel->object_path, &tunnel->state);
+
+	main_tunnel = wireguard_main_tunnel(private);
+	if (wireguard_status_string(&main_tunnel->state) != old_main_status
+	    || wireguard_mode_string(&main_tunnel->state) != old_main_mode)
+		emit_status_signal(ICD_WIREGUARD_DBUS_PATH, &main_tunnel->state);
+
+	properties_update(tunnel);
+	status_page_update(private);
+	/* Routes need the lists */
+	wireguard_prefix_lists_update(private);
+	wireguard_routing_update(private);
+
+	WG_TRACE4(state_change_exit, event->source, old_state, tunnel->state.tunnel, duration);
+}
+
+static void event_free(wireguard_event * event)
+{
+	g_free(event->active_config);
+	g_free(event);
+}
+
+/* Handle queued events, unless we are already in the middle of one */
+static void dispatch_events(network_wireguard_private * private)
+{
+	wireguard_event *queued;
 
-		emit_status_signal(new_state);
+	if (private->events_dispatching)
+		return;
+
+	private->events_dispatching = TRUE;
+	while ((queued = g_queue_pop_head(&private->events)) != NULL) {
+		wireguard_state_change(private, queued);
+		event_free(queued);
 	}
+	private->events_dispatching = FALSE;
+}
+
+/**
+ * Queue an event and, unless we are already in the middle of one, handle it
+ * and everything queued while doing so. Transitions call back into icd2,
+ * which may call us again; queueing keeps every transition from starting
+ * before the previous one is done.
+ *
+ * @param private  network module private data
+ * @param event    the event, copied; the queue takes over active_config
+ */
+void wireguard_state_post(network_wireguard_private * private, const wireguard_event * event)
+{
+	g_queue_push_tail(&private->events, g_memdup(event, sizeof(*event)));
+	dispatch_events(private);
+}
+
+/**
+ * Post an event to every tunnel, for what is not about one tunnel, like a
+ * gconf change.
+ *
+ * @param private  network module private data
+ * @param event    the event, without tunnel and active_config
+ */
+void wireguard_state_post_all(network_wireguard_private * private, const wireguard_event * event)
+{
+	GHashTableIter iter;
+	wireguard_tunnel *tunnel;
 
- done:
-	/* Free old active_config if it is not the same pointer as in new_state */
-	if (current_state.active_config != NULL && current_state.active_config != new_state.active_config) {
-		free(current_state.active_config);
+	g_hash_table_iter_init(&iter, private->tunnels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		wireguard_event *queued = g_memdup(event, sizeof(*event));
+
+		queued->tunnel = tunnel;
+		g_queue_push_tail(&private->events, queued);
 	}
-	/* Move to new state */
-	memcpy(&private->state, &new_state, sizeof(network_wireguard_state));
+
+	dispatch_events(private);
+}
+
+static void gconf_callback(GConfClient * client, guint cnxn_id, GConfEntry * entry, gpointer user_data)
+{
+	WG_PROFILE();
+	network_wireguard_private *priv = user_data;
+	wireguard_event event = {
+		.source = EVENT_SOURCE_GCONF_CHANGE,
+		.system_wide_enabled = gconf_value_get_bool(entry->value),
+	};
+
+	WN_INFO("Wireguard system_wide status changed via gconf");
+	priv->system_wide_enabled = event.system_wide_enabled;
+	wireguard_state_post_all(priv, &event);
+}
+
+/**
+ * Read gconf and follow it, and open the status page. None of this is
+ * needed to answer D-Bus, so icd_nw_init() leaves it for when the main loop
+ * is idle, unless an ip_up comes first.
+ *
+ * @param priv  network module private data
+ */
+static void wireguard_start(network_wireguard_private * priv)
+{
+	GHashTableIter iter;
+	wireguard_tunnel *tunnel;
+	GError *error = NULL;
+
+	if (priv->started)
+		return;
+	priv->started = TRUE;
+
+	if (priv->start_idle != 0) {
+		g_source_remove(priv->start_idle);
+		priv->start_idle = 0;
+	}
+
+	wireguard_profile_init(get_profile_slow_threshold());
+
+	/* No IAP came before us, so no tunnel acted on the old value */
+	priv->system_wide_enabled = get_system_wide_enabled();
+	priv->stats_interval = get_statistics_interval();
+	g_hash_table_iter_init(&iter, priv->tunnels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		tunnel->state.system_wide_enabled = priv->system_wide_enabled;
+		tunnel->stats.interval = priv->stats_interval;
+	}
+
+	/* Without it we do not see the system wide setting change, which is
+	 * not worth failing ip_up for */
+	priv->gconf_client = gconf_client_get_default();
+	gconf_client_add_dir(priv->gconf_client, GC_NETWORK_TYPE, GCONF_CLIENT_PRELOAD_NONE, &error);
+	if (error == NULL)
+		priv->gconf_cb_id_systemwide = gconf_client_notify_add(priv->gconf_client, GC_WIREGUARD_SYSTEM,
+								       gconf_callback, (void *)priv, NULL, &error);
+	if (error != NULL) {
+		WN_ERR("Could not monitor gconf for changes: %s", error->message);
+		g_clear_error(&error);
+	}
+
+	/* Checked ahead of the first connect to each */
+	wireguard_config_checks_start(priv);
+
+	status_page_open(priv);
+	status_page_update(priv);
+}
+
+static gboolean start_idle_cb(gpointer user_data)
+{
+	network_wireguard_private *priv = user_data;
+
+	priv->start_idle = 0;
+	wireguard_start(priv);
+
+	return FALSE;
 }
 
 /** Function for configuring an IP address.
@@ -288,9 +559,19 @@ static void wireguard_ip_up(const gchar * network_type,
 			    const gchar * interface_name,
 			    icd_nw_ip_up_cb_fn ip_up_cb, gpointer ip_up_cb_token, gpointer * private)
 {
+	WG_PROFILE();
 	network_wireguard_private *priv = *private;
 	WN_DEBUG("wireguard_ip_up");
 
+	wireguard_start(priv);
+
+	/* Nothing to listen to before there is a tunnel to watch */
+	if (priv->netlink_channel == NULL && open_netlink_listener(priv)) {
+		WN_ERR("Could not listen for interface changes");
+		ip_up_cb(ICD_NW_ERROR, NULL, ip_up_cb_token, NULL);
+		return;
+	}
+
 	wireguard_network_data *network_data = g_new0(wireguard_network_data, 1);
 
 	network_data->network_type = g_strdup(network_type);
@@ -301,19 +582,22 @@ static void wireguard_ip_up(const gchar * network_type,
 	network_data->ip_up_cb_token = ip_up_cb_token;
 	network_data->private = priv;
 
-	network_wireguard_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-	new_state.iap_connected = TRUE;
+	wireguard_tunnel *tunnel = wireguard_tunnel_for_iap(priv, network_id);
 
-	if (network_is_wireguard_provider(network_id, NULL)) {
-		new_state.service_provider_mode = TRUE;
-		new_state.active_config = NULL;
-	} else {
-		new_state.service_provider_mode = FALSE;
-		new_state.active_config = get_active_config();
-	}
+	/* An IAP that already has its tunnel is refused, without taking the
+	 * tunnel from it */
+	if (tunnel->network_data == NULL)
+		wireguard_tunnel_attach(tunnel, network_data);
+
+	wireguard_event event = { .source = EVENT_SOURCE_IP_UP, .tunnel = tunnel, .network_data = network_data };
 
-	wireguard_state_change(priv, network_data, new_state, EVENT_SOURCE_IP_UP);
+	if (network_is_wireguard_provider(network_id, NULL))
+		event.service_provider_mode = TRUE;
+	else
+		event.active_config = get_active_config();
+
+	wireguard_state_post(priv, &event);
+	wireguard_tunnels_reap(priv);
 
 	return;
 }
@@ -338,21 +622,30 @@ wireguard_ip_down(const gchar * network_type, guint network_attrs,
 		  const gchar * network_id, const gchar * interface_name,
 		  icd_nw_ip_down_cb_fn ip_down_cb, gpointer ip_down_cb_token, gpointer * private)
 {
+	WG_PROFILE();
 	WN_DEBUG("wireguard_ip_down");
 	network_wireguard_private *priv = *private;
 
 	wireguard_network_data *network_data = icd_wireguard_find_network_data(network_type, network_attrs, network_id,
 									       priv);
 
+	/* Nothing to take down, e.g. ip_up failed */
+	if (network_data == NULL) {
+		WN_WARN("ip_down for unknown network %s\n", network_id);
+		ip_down_cb(ICD_NW_SUCCESS, ip_down_cb_token);
+		return;
+	}
+
 	network_data->ip_down_cb = ip_down_cb;
 	network_data->ip_down_cb_token = ip_down_cb_token;
 
-	network_wireguard_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-	new_state.iap_connected = FALSE;
-	new_state.service_provider_mode = FALSE;
-
-	wireguard_state_change(priv, network_data, new_state, EVENT_SOURCE_IP_DOWN);
+	wireguard_event event = {
+		.source = EVENT_SOURCE_IP_DOWN,
+		.tunnel = network_data->tunnel,
+		.network_data = network_data,
+	};
+	wireguard_state_post(priv, &event);
+	wireguard_tunnels_reap(priv);
 }
 
 static void wireguard_network_destruct(gpointer * private)
@@ -361,6 +654,8 @@ static void wireguard_network_destruct(gpointer * private)
 
 	WN_DEBUG("wireguard_network_destruct");
 
+	if (priv->start_idle != 0)
+		g_source_remove(priv->start_idle);
 	if (priv->gconf_client != NULL) {
 		if (priv->gconf_cb_id_systemwide != 0) {
 			gconf_client_notify_remove(priv->gconf_client, priv->gconf_cb_id_systemwide);
@@ -369,10 +664,23 @@ static void wireguard_network_destruct(gpointer * private)
 
 		g_object_unref(priv->gconf_client);
 	}
+	close_netlink_listener(priv);
+	status_page_close(priv);
+
+	if (!g_queue_is_empty(&priv->events))
+		WN_CRIT("%u events left unhandled", g_queue_get_length(&priv->events));
+	g_queue_foreach(&priv->events, (GFunc) event_free, NULL);
+	g_queue_clear(&priv->events);
+
+	wireguard_routing_free(priv);
+	wireguard_tunnels_free(priv);
+	wireguard_prefix_lists_free(priv);
+	wireguard_config_checks_free(priv);
+	wireguard_helper_free(priv);
+	wireguard_spawn_free(priv);
 	free_wireguard_dbus();
-
-	if (priv->network_data_list)
-		WN_CRIT("ipv4 still has connected networks");
+	properties_free(&priv->properties);
+	wireguard_profile_free();
 
 	g_free(priv);
 }
@@ -386,65 +694,15 @@ static void wireguard_network_destruct(gpointer * private)
  */
 static void wireguard_child_exit(const pid_t pid, const gint exit_status, gpointer * private)
 {
-	GSList *l;
+	WG_PROFILE();
 	network_wireguard_private *priv = *private;
-	wireguard_network_data *network_data;
-
-	enum pidtype { UNKNOWN, WG_QUICK_PID };
-
-	int pid_type = UNKNOWN;
-
-	for (l = priv->network_data_list; l; l = l->next) {
-		network_data = (wireguard_network_data *) l->data;
-		if (network_data) {
-			if (network_data->wg_quick_pid == pid) {
-				pid_type = WG_QUICK_PID;
-				break;
-			}
-			/* Do we want to do anything with unknown pids? */
-
-		} else {
-			/* This can happen if we are manually disconnecting, and we already
-			   free the network data and kill tor, then we won't have the
-			   network_data anymore */
-			WN_DEBUG("wireguard_child_exit: network_data_list contains empty network_data");
-		}
-	}
-
-	if (!l) {
-		WN_ERR("wireguard_child_exit: got pid %d but did not find network_data\n", pid);
-		return;
-	}
 
-	if (pid_type == WG_QUICK_PID) {
-		WN_INFO("Got wg-quick pid: %d with status %d", pid, exit_status);
+	WG_TRACE2(child_exit, pid, exit_status);
 
-		network_wireguard_state new_state;
-		memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-		new_state.wg_quick_running = FALSE;
+	if (!wireguard_helper_child_exit(priv, pid, exit_status) && !wireguard_tunnel_child_exit(priv, pid, exit_status))
+		WN_ERR("wireguard_child_exit: got pid %d but it is not our wg-quick\n", pid);
 
-		if (exit_status == 0) {
-			new_state.wireguard_up = TRUE;
-		} else {
-			WN_WARN("wg-quick failed with %d\n", exit_status);
-			new_state.wireguard_up = FALSE;
-		}
-
-		wireguard_state_change(priv, network_data, new_state, EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT);
-	}
-
-	return;
-}
-
-static void gconf_callback(GConfClient * client, guint cnxn_id, GConfEntry * entry, gpointer user_data)
-{
-	network_wireguard_private *priv = user_data;
-	gboolean system_wide_enabled = gconf_value_get_bool(entry->value);
-
-	network_wireguard_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-	new_state.system_wide_enabled = system_wide_enabled;
-	wireguard_state_change(priv, NULL, new_state, EVENT_SOURCE_GCONF_CHANGE);
+	wireguard_tunnels_reap(priv);
 }
 
 /** Tor network module initialization function.
@@ -466,41 +724,23 @@ gboolean icd_nw_init(struct icd_nw_api *network_api,
 	network_api->ip_up = wireguard_ip_up;
 	network_api->ip_down = wireguard_ip_down;
 
-	priv->state.system_wide_enabled = get_system_wide_enabled();
-	priv->state.active_config = NULL;
-	priv->state.iap_connected = FALSE;
-	priv->state.service_provider_mode = FALSE;
-
-	priv->state.wg_quick_running = FALSE;
-	priv->state.wireguard_running = FALSE;
-	priv->state.wireguard_up = FALSE;
-	priv->state.wireguard_interface_up = FALSE;
-	priv->state.wireguard_interface_index = -1;
-	priv->state.gconf_transition_ongoing = FALSE;
-	priv->state.dbus_failed_to_start = FALSE;
-
-	priv->gconf_client = gconf_client_get_default();
-	GError *error = NULL;
-	gconf_client_add_dir(priv->gconf_client, GC_NETWORK_TYPE, GCONF_CLIENT_PRELOAD_NONE, &error);
-	if (error != NULL) {
-		WN_ERR("Could not monitor gconf dir for changes");
-		g_clear_error(&error);
-		goto err;
-	}
-	priv->gconf_cb_id_systemwide =
-	    gconf_client_notify_add(priv->gconf_client, GC_WIREGUARD_SYSTEM, gconf_callback, (void *)priv, NULL, &error);
-	if (error != NULL) {
-		WN_ERR("Could not monitor gconf system wide key for changes");
-		g_clear_error(&error);
-		goto err;
-	}
+	g_queue_init(&priv->events);
 
+	/* Only what icd2 and D-Bus clients need right away, wireguard_start()
+	 * does the rest */
 	if (setup_wireguard_dbus(priv)) {
 		WN_ERR("Could not request dbus interface");
-		goto err;
+		g_free(priv);
+		return FALSE;
 	}
 
-	open_netlink_listener(priv);
+	/* Registers the tunnel object paths, so after the dbus service */
+	wireguard_prefix_lists_init(priv);
+	wireguard_tunnels_init(priv);
+	wireguard_routing_init(priv);
+	wireguard_config_checks_init(priv);
+
+	priv->start_idle = g_idle_add_full(G_PRIORITY_LOW, start_idle_cb, priv, NULL);
 
 	network_api->network_destruct = wireguard_network_destruct;
 	network_api->child_exit = wireguard_child_exit;
@@ -517,14 +757,4 @@ gboolean icd_nw_init(struct icd_nw_api *network_api,
 #endif
 
 	return TRUE;
-
- err:
-	if (priv->gconf_client) {
-		g_object_unref(priv->gconf_client);
-		priv->gconf_client = NULL;
-	}
-
-	g_free(priv);
-
-	return FALSE;
 }
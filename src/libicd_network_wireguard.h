@@ -25,6 +25,7 @@
 #include <stdio.h>
 #include <glib.h>
 #include <pwd.h>
+#include <sys/socket.h>
 
 #include <gconf/gconf-client.h>
 #include <dbus/dbus-glib-lowlevel.h>
@@ -35,26 +36,111 @@
 
 #include "dbus_wireguard.h"
 #include "libicd_wireguard.h"
+#include "libicd_wireguard_trace.h"
+#include "libicd_wireguard_profile.h"
+#include "libicd_wireguard_helper.h"
+
+/* Tunnels are WIREGUARD_INTERFACE_PREFIX N: icdwg0, icdwg1, ...; icdwg0
+ * always exists */
+#define WIREGUARD_INTERFACE_NAME WIREGUARD_INTERFACE_PREFIX "0"
+
+/* Policy routing: tunnels are routed through our own table, their own
+ * traffic, marked with WIREGUARD_FWMARK | N, through the main table; like
+ * wg-quick does for a single tunnel with a default route */
+#define WIREGUARD_ROUTE_TABLE 51821
+#define WIREGUARD_FWMARK 0xca6d0000
+#define WIREGUARD_FWMARK_MASK 0xffff0000
+#define WIREGUARD_RULE_PRIORITY 31000
+/* Milliseconds between checks of paths and endpoints */
+#define WIREGUARD_ROUTING_CHECK_INTERVAL 5000
+/* A path without a handshake for this long (seconds) is dropped, unless it
+ * connected less than WIREGUARD_MULTIPATH_GRACE seconds ago */
+#define WIREGUARD_MULTIPATH_STALE 180
+#define WIREGUARD_MULTIPATH_GRACE 30
+/* Keeps handshakes going on idle paths, so the above tells dead from idle */
+#define WIREGUARD_MULTIPATH_KEEPALIVE 25
+
+/* AllowedIPs of a GC_PEER_IPS_FILE per WG_CMD_SET_DEVICE message, about
+ * 20 KiB of attributes */
+#define WIREGUARD_ALLOWED_IPS_CHUNK 512
+/* Bytes and messages of a netlink batch per send; the errors of that many
+ * messages fit in the default socket receive buffer */
+#define WIREGUARD_NL_BATCH_SIZE 65536
+#define WIREGUARD_NL_BATCH_MESSAGES 128
+/* Seconds wg-quick that overran its GC_WIREGUARD_OP_TIMEOUT gets to exit
+ * on SIGTERM, and then on SIGKILL, before we give up on it; less if the
+ * timeout is shorter */
+#define WIREGUARD_OP_KILL_GRACE 5
+/* Parsed GC_PEER_IPS_FILE lists are kept here, below the user cache dir */
+#define WIREGUARD_PREFIX_CACHE_DIR "icd-wireguard"
+
+/* Number of snapshots the traffic rates are computed over */
+#define WIREGUARD_STATS_SAMPLES 5
+
+/* Phases of a connect attempt we keep latency histograms for */
+enum wireguard_timing_phase {
+	/* Synchronous parts of startup_wireguard(); through the helper,
+	 * writing the config and the spawn end when it answers */
+	WIREGUARD_TIMING_GENERATE_CONFIG,
+	WIREGUARD_TIMING_WRITE_CONFIG,
+	WIREGUARD_TIMING_SPAWN,
+	/* From the spawn until wg-quick exits */
+	WIREGUARD_TIMING_WG_QUICK,
+	/* From the spawn until netlink reports the interface running */
+	WIREGUARD_TIMING_INTERFACE_UP,
+	/* From the start of the attempt until wg-quick succeeded */
+	WIREGUARD_TIMING_CONNECT,
+	/* From wg-quick succeeding until the first handshake */
+	WIREGUARD_TIMING_HANDSHAKE,
+
+	WIREGUARD_TIMING_PHASE_COUNT
+};
+
+#define WIREGUARD_TIMING_BUCKETS 160
+
+/* What the tunnel is doing; the transitions between these are in the table
+ * in libicd_network_wireguard.c */
+enum wireguard_tunnel_state {
+	/* No IAP */
+	WIREGUARD_STATE_IDLE,
+	/* IAP up without a tunnel: system wide disabled, stopped through gconf
+	 * or a provider IAP waiting for Start */
+	WIREGUARD_STATE_STOPPED,
+	/* wg-quick up running for an ip_up icd2 is waiting on */
+	WIREGUARD_STATE_CONNECTING,
+	/* wg-quick up running for an IAP that is already up */
+	WIREGUARD_STATE_STARTING,
+	/* wg-quick up succeeded */
+	WIREGUARD_STATE_RUNNING,
+
+	WIREGUARD_STATE_COUNT
+};
+
+enum icd_wireguard_event_source_type {
+	EVENT_SOURCE_IP_UP,
+	EVENT_SOURCE_IP_DOWN,
+	EVENT_SOURCE_GCONF_CHANGE,
+	EVENT_SOURCE_WIREGUARD_UP,
+	EVENT_SOURCE_WIREGUARD_DOWN,
+	EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT,
+	EVENT_SOURCE_DBUS_CALL_START,
+	EVENT_SOURCE_DBUS_CALL_STOP,
+
+	EVENT_SOURCE_COUNT
+};
 
 struct _network_wireguard_state {
+	enum wireguard_tunnel_state tunnel;
+
 	/* State data here, since without IAP we do not have wireguard_network_data */
 	gboolean system_wide_enabled;
 	gchar *active_config;
-	gboolean iap_connected;
 	gboolean service_provider_mode;
 
-	gboolean wg_quick_running;
-	gboolean wireguard_running;
-	gboolean wireguard_up;
-
-	/* We only have this status atm for handling netlink data, since I could not
-	 * parse it properly*/
+	/* What netlink last reported for the interface, whatever the tunnel
+	 * state is */
 	gboolean wireguard_interface_up;
 	gint wireguard_interface_index;
-
-	gboolean gconf_transition_ongoing;
-
-	gboolean dbus_failed_to_start;
 #if 0
 	gboolean network_is_tor_service_provider;
 #endif
@@ -65,6 +151,220 @@ struct _network_wireguard_state {
 };
 typedef struct _network_wireguard_state network_wireguard_state;
 
+enum wireguard_op_type {
+	WIREGUARD_OP_UP,
+	WIREGUARD_OP_DOWN,
+};
+
+/* A wg-quick run, see libicd_network_wireguard_ops.c */
+struct _wireguard_op {
+	enum wireguard_op_type type;
+	/* WIREGUARD_OP_UP: the IAP and configuration name; network_data is
+	 * only set while the op is queued */
+	struct _wireguard_network_data *network_data;
+	gchar *config;
+	/* Set once it runs: the pid of wg-quick, or the negated id of the
+	 * wireguard_helper request running it */
+	pid_t pid;
+	/* Asked to stop early, wg-quick down cleans up after it */
+	gboolean cancelled;
+	/* Seconds it may run, 0 for no limit, and the timer enforcing it; how
+	 * often the timer fired so far */
+	guint timeout;
+	guint watchdog;
+	guint overruns;
+};
+typedef struct _wireguard_op wireguard_op;
+
+/* icd-wireguard-helper, which runs wg-quick for us when it is installed */
+struct _wireguard_helper {
+	/* Until icd2 reaped it */
+	pid_t pid;
+	/* Our end of its stdin, non-blocking, NULL once it is gone */
+	GIOChannel *channel;
+	guint watch;
+	GByteArray *input;
+	/* Requests it has no room for yet, sent once it has */
+	GByteArray *output;
+	guint output_watch;
+	guint32 next_id;
+	/* Ids of the ups and downs it runs */
+	GArray *running;
+	/* Not installed or would not start, we spawn wg-quick ourselves */
+	gboolean unavailable;
+};
+typedef struct _wireguard_helper wireguard_helper;
+
+/* Values last published through org.freedesktop.DBus.Properties, used to only
+ * signal the properties that actually changed */
+struct _wireguard_properties {
+	const char *state;
+	const char *mode;
+	gchar *active_config;
+	dbus_int32_t interface_index;
+	dbus_uint64_t connect_timestamp;
+	gchar *last_error;
+	dbus_uint32_t timeouts;
+};
+typedef struct _wireguard_properties wireguard_properties;
+
+/* A peer as reported by WG_CMD_GET_DEVICE */
+struct _wireguard_peer_info {
+	guint8 public_key[32];
+	struct sockaddr_storage endpoint;
+	guint64 rx_bytes;
+	guint64 tx_bytes;
+	/* Wall clock seconds, 0 if there was no handshake yet */
+	gint64 last_handshake;
+};
+typedef struct _wireguard_peer_info wireguard_peer_info;
+
+struct _wireguard_peer_stats {
+	wireguard_peer_info info;
+
+	/* Ring buffer of (monotonic) sample times and counters */
+	gint64 sample_time[WIREGUARD_STATS_SAMPLES];
+	guint64 sample_rx[WIREGUARD_STATS_SAMPLES];
+	guint64 sample_tx[WIREGUARD_STATS_SAMPLES];
+	guint sample_head;
+	guint sample_count;
+
+	/* Bytes per second over the samples in the ring buffer */
+	gdouble rx_rate;
+	gdouble tx_rate;
+};
+typedef struct _wireguard_peer_stats wireguard_peer_stats;
+
+/* Latency histogram in microseconds */
+struct _wireguard_histogram {
+	guint64 count;
+	guint64 max;
+	guint64 buckets[WIREGUARD_TIMING_BUCKETS];
+};
+typedef struct _wireguard_histogram wireguard_histogram;
+
+/* The current connect attempt of a tunnel */
+struct _wireguard_timing {
+	/* Monotonic timestamps */
+	gint64 connect_start;
+	gint64 phase_start;
+	gint64 spawned;
+	gint64 connected;
+	/* The helper request running wg-quick up, until it started it */
+	pid_t helper_up;
+
+	/* Durations, -1 if a phase was not reached */
+	gint64 current[WIREGUARD_TIMING_PHASE_COUNT];
+
+	/* Polling for the first handshake, backing off */
+	guint handshake_timer;
+	guint handshake_interval;
+};
+typedef struct _wireguard_timing wireguard_timing;
+
+struct _wireguard_stats {
+	/* Generic netlink socket, opened on first use */
+	int fd;
+	guint16 family_id;
+
+	/* Minimum time between kernel queries, in milliseconds */
+	guint interval;
+	gint64 last_refresh;
+
+	GSList *peers;
+};
+typedef struct _wireguard_stats wireguard_stats;
+
+/* The parsed prefixes of a GC_PEER_IPS_FILE, mapped from our cache of it */
+struct _wireguard_prefix_list {
+	gchar *path;
+	/* The file the cache was built from */
+	guint64 dev;
+	guint64 ino;
+	gint64 mtime;
+	guint64 size;
+
+	const wireguard_prefix *prefixes;
+	guint count;
+
+	gpointer map;
+	gsize map_size;
+	guint refcount;
+};
+typedef struct _wireguard_prefix_list wireguard_prefix_list;
+
+/* A config checked and compiled from gconf, see
+ * libicd_network_wireguard_compiled.c */
+typedef struct _wireguard_compiled_config wireguard_compiled_config;
+
+/* Tunnels up with the same config, and what we routed over them */
+struct _wireguard_bond {
+	gchar *config;
+	/* wireguard_prefix routed, and the interface index of every path they
+	 * are routed over, sorted */
+	GArray *prefixes;
+	GArray *paths;
+	/* wireguard_prefix thrown back to the main table, sorted */
+	GArray *excludes;
+	/* wireguard_prefix_list routed along with prefixes */
+	GPtrArray *lists;
+};
+typedef struct _wireguard_bond wireguard_bond;
+
+/* Netlink requests sent together, see libicd_network_wireguard_batch.c */
+typedef struct _wireguard_nl_batch wireguard_nl_batch;
+/* A message added for item was refused with error, a negative errno */
+typedef void (*wireguard_nl_batch_error_fn) (gpointer item, guint16 type, int error, gpointer user_data);
+
+/* An icdwgN interface with its own configuration file, state machine and
+ * D-Bus object, serving at most one IAP */
+struct _wireguard_tunnel {
+	struct _network_wireguard_private *private;
+
+	/* N in icdwgN */
+	guint index;
+	gchar *interface_name;
+	gchar *config_path;
+	gchar *object_path;
+
+	/* The IAP, NULL if there is none */
+	struct _wireguard_network_data *network_data;
+
+	network_wireguard_state state;
+
+	/* Wall clock time (seconds) at which the tunnel became connected, 0 if
+	 * it is not connected */
+	guint64 connect_timestamp;
+	/* Reason of the last failure, NULL if nothing failed yet */
+	gchar *last_error;
+	/* wg-quick runs that overran their timeout */
+	guint timeouts;
+
+	/* What we last published on object_path */
+	wireguard_properties properties;
+
+	wireguard_stats stats;
+	wireguard_timing timing;
+
+	/* Routed by us rather than wg-quick, bonded with the other tunnels of
+	 * its config, and the wireguard_prefix to route and to keep off it */
+	gboolean routed;
+	gboolean multipath;
+	GArray *prefixes;
+	GArray *excludes;
+
+	/* wireguard_prefix_file of the config, and once they are pushed to
+	 * the interface the wireguard_prefix_list of each */
+	GSList *prefix_files;
+	GPtrArray *prefix_lists;
+
+	/* wg-quick that is running, if any, and the wireguard_op queued
+	 * behind it */
+	wireguard_op *op_running;
+	GQueue ops;
+};
+typedef struct _wireguard_tunnel wireguard_tunnel;
+
 struct _network_wireguard_private {
 	/* For pid monitoring */
 	icd_nw_watch_pid_fn watch_cb;
@@ -76,17 +376,81 @@ struct _network_wireguard_private {
 	icd_srv_limited_conn_fn limited_conn_fn;
 #endif
 
-	GSList *network_data_list;
+	/* All tunnels by interface name, owning them, and the ones serving an
+	 * IAP by network_id */
+	GHashTable *tunnels;
+	GHashTable *tunnels_by_iap;
+	wireguard_tunnel *first_tunnel;
+
+	/* Whether wireguard_start() ran, or is still left for idle time */
+	gboolean started;
+	guint start_idle;
 
 	GConfClient *gconf_client;
 	guint gconf_cb_id_systemwide;
+	/* What gconf last said, new tunnels start out with it */
+	gboolean system_wide_enabled;
+	/* Statistics interval, read by wireguard_start(); until then tunnels
+	 * query the kernel on every snapshot */
+	guint stats_interval;
 
-	network_wireguard_state state;
+	/* Config name to its wireguard_config_verdict, of the configs checked
+	 * since they last changed; those changed since are pending, and
+	 * checked in idle time */
+	GHashTable *config_checks;
+	GHashTable *config_checks_pending;
+	guint config_checks_idle;
+	GConfClient *config_checks_gconf;
+	guint config_checks_notify;
+
+	/* What we last published on ICD_WIREGUARD_DBUS_PATH, which shows
+	 * wireguard_main_tunnel() */
+	wireguard_properties properties;
+
+	/* Describes wireguard_main_tunnel() too, published at
+	 * status_page_path */
+	struct icd_wireguard_status_page *status_page;
+	gchar *status_page_path;
+	guint status_page_timer;
+
+	/* wireguard_bond by config, the policy rules they need, and the path
+	 * and endpoint check */
+	GHashTable *bonds;
+	gboolean routing_rules;
+	guint routing_timer;
+
+	/* wireguard_prefix_list by path, the latest of every file */
+	GHashTable *prefix_lists;
+
+	/* Who spawn_as() last ran as, resolved once */
+	gchar *spawn_user;
+	uid_t spawn_uid;
+	gid_t spawn_gid;
+	/* Children whose stderr is still being read */
+	GSList *spawn_readers;
+	wireguard_helper helper;
+
+	/* Connect timings of all tunnels, over the lifetime of the module */
+	wireguard_histogram timings[WIREGUARD_TIMING_PHASE_COUNT];
+
+	/* rtnetlink listener */
+	GIOChannel *netlink_channel;
+	guint netlink_watch;
+
+	/* Pids of wg-quick runs given up on after they overran, still
+	 * reported when they exit after all */
+	GSList *abandoned;
+
+	/* wireguard_event queue, and whether we are working through it */
+	GQueue events;
+	gboolean events_dispatching;
 };
 typedef struct _network_wireguard_private network_wireguard_private;
 
 struct _wireguard_network_data {
 	network_wireguard_private *private;
+	/* Set once the IAP got it */
+	wireguard_tunnel *tunnel;
 
 	icd_nw_ip_up_cb_fn ip_up_cb;
 	gpointer ip_up_cb_token;
@@ -104,42 +468,179 @@ struct _wireguard_network_data {
 };
 typedef struct _wireguard_network_data wireguard_network_data;
 
+/* Something that happened to the tunnel, see wireguard_state_post() */
+struct _wireguard_event {
+	enum icd_wireguard_event_source_type source;
+	wireguard_tunnel *tunnel;
+	/* The IAP the event is about; filled in with the tunnel's when NULL */
+	wireguard_network_data *network_data;
+
+	/* EVENT_SOURCE_IP_UP and EVENT_SOURCE_DBUS_CALL_START, owned by the
+	 * event */
+	gchar *active_config;
+	/* EVENT_SOURCE_IP_UP */
+	gboolean service_provider_mode;
+	/* EVENT_SOURCE_GCONF_CHANGE */
+	gboolean system_wide_enabled;
+	/* EVENT_SOURCE_WIREGUARD_UP */
+	gint interface_index;
+	/* EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT, and the timeout it overran,
+	 * 0 if it exited in time */
+	gint exit_status;
+	guint timeout;
+};
+typedef struct _wireguard_event wireguard_event;
+
 gboolean icd_nw_init(struct icd_nw_api *network_api,
 		     icd_nw_watch_pid_fn watch_fn, gpointer watch_fn_token,
 		     icd_nw_close_fn close_fn, icd_nw_status_change_fn status_change_fn, icd_nw_renew_fn renew_fn);
 
-void wireguard_state_change(network_wireguard_private * private, wireguard_network_data * network_data,
-			    network_wireguard_state new_state, int source);
+void wireguard_state_post(network_wireguard_private * private, const wireguard_event * event);
+void wireguard_state_post_all(network_wireguard_private * private, const wireguard_event * event);
+void wireguard_state_change(network_wireguard_private * private, wireguard_event * event);
+const char *wireguard_tunnel_state_string(enum wireguard_tunnel_state state);
 
 /* Helpers */
-void network_stop_all(wireguard_network_data * network_data);
 void network_free_all(wireguard_network_data * network_data);
-pid_t spawn_as(const char *username, const char *pathname, char *args[]);
-wireguard_network_data *icd_wireguard_find_first_network_data(network_wireguard_private * private);
 wireguard_network_data *icd_wireguard_find_network_data(const gchar * network_type,
 							guint network_attrs,
 							const gchar * network_id, network_wireguard_private * private);
 gboolean string_equal(const char *a, const char *b);
-int startup_wireguard(wireguard_network_data * network_data, char *config);
+int wireguard_write_all(int fd, const void *data, size_t len);
+pid_t startup_wireguard(wireguard_tunnel * tunnel, const char *config);
+pid_t shutdown_wireguard(wireguard_tunnel * tunnel);
 
-enum icd_wireguard_event_source_type {
-	EVENT_SOURCE_IP_UP,
-	EVENT_SOURCE_IP_DOWN,
-	EVENT_SOURCE_GCONF_CHANGE,
-	EVENT_SOURCE_WIREGUARD_UP,
-	EVENT_SOURCE_WIREGUARD_DOWN,
-	EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT,
-	EVENT_SOURCE_DBUS_CALL_START,
-	EVENT_SOURCE_DBUS_CALL_STOP,
-};
+/* Tunnels */
+void wireguard_tunnels_init(network_wireguard_private * private);
+void wireguard_tunnels_free(network_wireguard_private * private);
+wireguard_tunnel *wireguard_tunnel_for_iap(network_wireguard_private * private, const gchar * network_id);
+void wireguard_tunnel_attach(wireguard_tunnel * tunnel, wireguard_network_data * network_data);
+void wireguard_tunnel_detach(wireguard_network_data * network_data);
+wireguard_tunnel *wireguard_tunnel_by_interface(network_wireguard_private * private, const char *interface_name);
+wireguard_tunnel *wireguard_tunnel_by_index(network_wireguard_private * private, int interface_index);
+wireguard_tunnel *wireguard_main_tunnel(network_wireguard_private * private);
+void wireguard_tunnels_reap(network_wireguard_private * private);
+
+/* Tunnel operations */
+int wireguard_tunnel_up(wireguard_tunnel * tunnel, wireguard_network_data * network_data, const char *config);
+void wireguard_tunnel_down(wireguard_tunnel * tunnel);
+gboolean wireguard_tunnel_child_exit(network_wireguard_private * private, pid_t pid, gint exit_status);
+void wireguard_tunnel_ops_free(wireguard_tunnel * tunnel);
 
 /* DBus methods */
 DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
 DBusHandlerResult stop_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
 DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
-void emit_status_signal(network_wireguard_state state);
+DBusHandlerResult getprofile_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+void emit_status_signal(const char *path, const network_wireguard_state * state);
+const char *wireguard_status_string(const network_wireguard_state * state);
+const char *wireguard_mode_string(const network_wireguard_state * state);
+
+/* DBus properties */
+DBusHandlerResult properties_get_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult properties_getall_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+DBusHandlerResult properties_set_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+void wireguard_set_last_error(wireguard_tunnel * tunnel, const char *error);
+void properties_update(wireguard_tunnel * tunnel);
+void properties_free(wireguard_properties * properties);
+
+/* Statistics */
+typedef void (*wireguard_genl_peer_fn) (const wireguard_peer_info * peer, gpointer user_data);
+int wireguard_genl_open(guint16 * family_id);
+int wireguard_genl_get_device(int fd, guint16 family_id, const char *ifname,
+			      wireguard_genl_peer_fn peer_fn, gpointer user_data);
+void wireguard_genl_add_allowed_ips(wireguard_nl_batch * batch, guint16 family_id, const char *ifname,
+				    const guint8 * public_key, const wireguard_prefix * prefixes, guint count);
+void wireguard_stats_init(wireguard_tunnel * tunnel);
+void wireguard_stats_free(wireguard_tunnel * tunnel);
+GSList *wireguard_stats_snapshot(wireguard_tunnel * tunnel);
+DBusHandlerResult getstatistics_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+
+/* Connect timings */
+void wireguard_timing_begin(wireguard_tunnel * tunnel);
+void wireguard_timing_phase_done(wireguard_tunnel * tunnel, enum wireguard_timing_phase phase);
+void wireguard_timing_helper_queued(wireguard_tunnel * tunnel, pid_t pid);
+void wireguard_timing_helper_done(wireguard_tunnel * tunnel, enum wireguard_timing_phase phase, pid_t pid);
+void wireguard_timing_interface_up(wireguard_tunnel * tunnel);
+void wireguard_timing_wg_quick_exit(wireguard_tunnel * tunnel, gboolean success);
+void wireguard_timing_free(wireguard_tunnel * tunnel);
+DBusHandlerResult gettimings_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+
+/* Policy routing and multipath */
+gchar *wireguard_routing_config(wireguard_tunnel * tunnel, const char *config, const char *excludes);
+void wireguard_routing_init(network_wireguard_private * private);
+void wireguard_routing_update(network_wireguard_private * private);
+void wireguard_routing_free(network_wireguard_private * private);
+
+/* AllowedIPs files */
+void wireguard_prefix_lists_init(network_wireguard_private * private);
+void wireguard_prefix_lists_update(network_wireguard_private * private);
+void wireguard_prefix_lists_free(network_wireguard_private * private);
+wireguard_prefix_list *wireguard_prefix_list_get(network_wireguard_private * private, const char *path);
+wireguard_prefix_list *wireguard_prefix_list_ref(wireguard_prefix_list * list);
+void wireguard_prefix_list_unref(wireguard_prefix_list * list);
+
+/* Compiled configs */
+wireguard_compiled_config *wireguard_config_compile(const char *config_name, gchar ** error);
+gchar *wireguard_compiled_config_text(const wireguard_compiled_config * config);
+void wireguard_compiled_config_free(wireguard_compiled_config * config);
+gchar *wireguard_config_generate(const char *config_name, gchar ** error);
+gboolean wireguard_config_check(const char *config_name, gchar ** error, gchar ** warnings);
+
+/* Config checks */
+typedef struct {
+	/* Why the config cannot be used, NULL if it can */
+	gchar *error;
+	/* What else is wrong with it, NULL if nothing */
+	gchar *warnings;
+} wireguard_config_verdict;
+
+void wireguard_config_checks_init(network_wireguard_private * private);
+void wireguard_config_checks_start(network_wireguard_private * private);
+const wireguard_config_verdict *wireguard_config_checks_get(network_wireguard_private * private,
+							    const char *config_name);
+void wireguard_config_checks_free(network_wireguard_private * private);
+DBusHandlerResult getconfigchecks_callback(DBusConnection * connection, DBusMessage * message, void *user_data);
+
+/* Child processes */
+pid_t spawn_as(network_wireguard_private * private, const char *username, const char *pathname, char *args[]);
+pid_t spawn_as_with_input(network_wireguard_private * private, const char *username, const char *pathname,
+			  char *args[], int input_fd);
+void wireguard_spawn_kill(network_wireguard_private * private, pid_t pid, int sig);
+void wireguard_spawn_free(network_wireguard_private * private);
+
+/* icd-wireguard-helper */
+pid_t wireguard_helper_up(wireguard_tunnel * tunnel, const char *config);
+pid_t wireguard_helper_down(wireguard_tunnel * tunnel);
+gboolean wireguard_helper_cancel(network_wireguard_private * private, pid_t pid);
+gboolean wireguard_helper_kill(network_wireguard_private * private, pid_t pid);
+gboolean wireguard_helper_child_exit(network_wireguard_private * private, pid_t pid, gint exit_status);
+void wireguard_helper_free(network_wireguard_private * private);
+
+/* Batched netlink requests */
+wireguard_nl_batch *wireguard_nl_batch_new(int fd, wireguard_nl_batch_error_fn error_fn, gpointer user_data);
+struct nlmsghdr *wireguard_nl_batch_add(wireguard_nl_batch * batch, guint16 type, guint16 flags, size_t size,
+					gpointer item);
+void wireguard_nl_batch_fail(wireguard_nl_batch * batch, gpointer item, guint16 type, int error);
+int wireguard_nl_batch_commit(wireguard_nl_batch * batch);
+void wireguard_nl_batch_free(wireguard_nl_batch * batch);
+
+/* rtnetlink requests */
+int wireguard_rtnl_open(void);
+void wireguard_rtnl_route(wireguard_nl_batch * batch, int type, guint32 table, const wireguard_prefix * prefix,
+			  const int *paths, guint count, gpointer item);
+void wireguard_rtnl_rule(wireguard_nl_batch * batch, int type, int family, guint32 priority, guint32 table,
+			 guint32 fwmark, guint32 fwmask, gboolean suppress_default, gpointer item);
+void wireguard_rtnl_link_delete(wireguard_nl_batch * batch, const char *ifname, gpointer item);
+
+/* Status page */
+void status_page_open(network_wireguard_private * private);
+void status_page_open_at(network_wireguard_private * private, const char *path);
+void status_page_update(network_wireguard_private * private);
+void status_page_close(network_wireguard_private * private);
 
-int open_netlink_listener(void *user_data);
-void close_netlink_listener(void);
+int open_netlink_listener(network_wireguard_private * private);
+void netlink_listener_attach(network_wireguard_private * private, int fd);
+void close_netlink_listener(network_wireguard_private * private);
 
 #endif
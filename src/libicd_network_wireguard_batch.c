@@ -0,0 +1,288 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Batched netlink requests. Messages are packed back to back into one
+ * buffer and sent with a single sendto(), without NLM_F_ACK: the kernel
+ * still answers every message that fails, and handles the messages of a
+ * send in order. A NLMSG_NOOP with NLM_F_ACK behind the last message is
+ * the barrier, once its ACK is read every error of the send is in. Errors
+ * are matched to their message by sequence number and handed to the
+ * error callback with the item the message was added for.
+ */
+
+#include <glib.h>
+
+#include "libicd_wireguard.h"
+#include "libicd_network_wireguard.h"
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define BATCH_RECV_BUFSIZE 8192
+
+struct _wireguard_nl_batch {
+	int fd;
+	wireguard_nl_batch_error_fn error_fn;
+	gpointer user_data;
+
+	/* Messages not sent yet, the last one may still be built on */
+	char *buf;
+	size_t size;
+	size_t used;
+	struct nlmsghdr *current;
+
+	/* What every unsent message was added for, it has sequence number
+	 * seq + its index */
+	gpointer items[WIREGUARD_NL_BATCH_MESSAGES];
+	guint16 types[WIREGUARD_NL_BATCH_MESSAGES];
+	guint count;
+	guint32 seq;
+
+	/* First socket error */
+	int error;
+};
+
+/* Shared by all batches, so replies to an earlier one never match */
+static guint32 batch_seq;
+
+/**
+ * Start a batch of requests on a netlink socket.
+ *
+ * @param fd         netlink socket, the batch takes it over and closes it
+ *                   in wireguard_nl_batch_free()
+ * @param error_fn   called for every message the kernel refused, may be
+ *                   NULL
+ * @param user_data  passed to error_fn
+ * @return the batch
+ */
+wireguard_nl_batch *wireguard_nl_batch_new(int fd, wireguard_nl_batch_error_fn error_fn, gpointer user_data)
+{
+	wireguard_nl_batch *batch = g_new0(wireguard_nl_batch, 1);
+	int one = 1;
+
+	batch->fd = fd;
+	batch->error_fn = error_fn;
+	batch->user_data = user_data;
+	batch->size = WIREGUARD_NL_BATCH_SIZE;
+	batch->buf = g_malloc(batch->size);
+	batch->seq = ++batch_seq;
+
+	/* Errors come back without the request, which may be a large one */
+	setsockopt(fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+
+	return batch;
+}
+
+/**
+ * Report a message as failed without sending it, as if the kernel refused
+ * it.
+ *
+ * @param batch  the batch
+ * @param item   what the message was for
+ * @param type   its nlmsg_type
+ * @param error  negative errno
+ */
+void wireguard_nl_batch_fail(wireguard_nl_batch * batch, gpointer item, guint16 type, int error)
+{
+	if (batch->error_fn)
+		batch->error_fn(item, type, error, batch->user_data);
+}
+
+static void finish_current(wireguard_nl_batch * batch)
+{
+	if (batch->current == NULL)
+		return;
+
+	batch->used += NLMSG_ALIGN(batch->current->nlmsg_len);
+	batch->current = NULL;
+}
+
+/* Read replies until the ACK of the barrier */
+static int receive_replies(wireguard_nl_batch * batch, guint32 barrier)
+{
+	char *buf = g_malloc(BATCH_RECV_BUFSIZE);
+	int ret = 0;
+
+	while (1) {
+		struct nlmsghdr *header;
+		int len = recv(batch->fd, buf, BATCH_RECV_BUFSIZE, 0);
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		if (len == 0) {
+			ret = -EIO;
+			break;
+		}
+
+		for (header = (struct nlmsghdr *)buf; NLMSG_OK(header, (unsigned int)len);
+		     header = NLMSG_NEXT(header, len)) {
+			struct nlmsgerr *err = NLMSG_DATA(header);
+			guint32 index = header->nlmsg_seq - batch->seq;
+
+			if (header->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			if (header->nlmsg_seq == barrier)
+				goto out;
+
+			/* Left over from a batch that gave up reading */
+			if (index >= batch->count || err->error == 0)
+				continue;
+
+			wireguard_nl_batch_fail(batch, batch->items[index], batch->types[index], err->error);
+		}
+	}
+
+ out:
+	g_free(buf);
+	return ret;
+}
+
+/* Send the messages so far and wait for their errors */
+static void flush(wireguard_nl_batch * batch)
+{
+	struct sockaddr_nl addr;
+	struct nlmsghdr *barrier;
+	guint i;
+	int ret;
+
+	finish_current(batch);
+	if (batch->count == 0)
+		return;
+
+	/* Room for it is always kept */
+	barrier = (struct nlmsghdr *)(batch->buf + batch->used);
+	memset(barrier, 0, NLMSG_HDRLEN);
+	barrier->nlmsg_len = NLMSG_HDRLEN;
+	barrier->nlmsg_type = NLMSG_NOOP;
+	barrier->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	barrier->nlmsg_seq = batch->seq + batch->count;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (sendto(batch->fd, batch->buf, batch->used + NLMSG_HDRLEN, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		ret = -errno;
+		for (i = 0; i < batch->count; i++)
+			wireguard_nl_batch_fail(batch, batch->items[i], batch->types[i], ret);
+	} else {
+		ret = receive_replies(batch, barrier->nlmsg_seq);
+		if (ret < 0)
+			WN_WARN("Lost netlink replies to %u messages: %s", batch->count, strerror(-ret));
+	}
+
+	if (ret < 0 && batch->error == 0)
+		batch->error = ret;
+
+	batch_seq += batch->count + 1;
+	batch->seq = batch_seq;
+	batch->used = 0;
+	batch->count = 0;
+}
+
+/**
+ * Add a request to the batch. Whatever was added before is sent first if
+ * the message does not fit anymore. The message is only complete once the
+ * next one is added or the batch is committed, until then its nlmsg_len
+ * may grow up to size.
+ *
+ * @param batch  the batch
+ * @param type   nlmsg_type
+ * @param flags  nlmsg_flags besides NLM_F_REQUEST
+ * @param size   room needed for the message, header included
+ * @param item   what the message is for, handed to the error callback
+ * @return the message header with nlmsg_len covering only itself, the
+ *         rest of size zeroed
+ */
+struct nlmsghdr *wireguard_nl_batch_add(wireguard_nl_batch * batch, guint16 type, guint16 flags, size_t size,
+					gpointer item)
+{
+	struct nlmsghdr *header;
+
+	finish_current(batch);
+
+	size = NLMSG_ALIGN(size);
+	if (batch->count == WIREGUARD_NL_BATCH_MESSAGES || batch->used + size + NLMSG_HDRLEN > batch->size)
+		flush(batch);
+
+	/* Only a message that is larger than a batch on its own */
+	if (size + NLMSG_HDRLEN > batch->size) {
+		batch->size = size + NLMSG_HDRLEN;
+		batch->buf = g_realloc(batch->buf, batch->size);
+	}
+
+	header = (struct nlmsghdr *)(batch->buf + batch->used);
+	memset(header, 0, size);
+	header->nlmsg_len = NLMSG_HDRLEN;
+	header->nlmsg_type = type;
+	header->nlmsg_flags = NLM_F_REQUEST | flags;
+	header->nlmsg_seq = batch->seq + batch->count;
+
+	batch->items[batch->count] = item;
+	batch->types[batch->count] = type;
+	batch->count++;
+	batch->current = header;
+
+	return header;
+}
+
+/**
+ * Send what was added and wait until the kernel handled all of it, having
+ * reported the messages it refused to the error callback.
+ *
+ * @param batch  the batch
+ * @return 0, or a negative errno if the socket failed since the batch was
+ *         started, in which case errors may have gone unreported
+ */
+int wireguard_nl_batch_commit(wireguard_nl_batch * batch)
+{
+	int ret;
+
+	flush(batch);
+
+	ret = batch->error;
+	batch->error = 0;
+
+	return ret;
+}
+
+/**
+ * Free a batch and close its socket. Whatever was added since the last
+ * commit is dropped.
+ *
+ * @param batch  the batch
+ */
+void wireguard_nl_batch_free(wireguard_nl_batch * batch)
+{
+	if (batch == NULL)
+		return;
+
+	close(batch->fd);
+	g_free(batch->buf);
+	g_free(batch);
+}
@@ -0,0 +1,285 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Config checks. A config below GC_WIREGUARD is checked as soon as it
+ * changes, rather than found out about when wg-quick fails on it halfway a
+ * connect. A gconf notify marks it pending, and pending configs are checked
+ * with wireguard_config_check() once the main loop is idle: a config is
+ * written a key at a time, that way all of them make one check. A verdict
+ * that a config is fine is kept until the config changes again. One that it
+ * is not is checked again before it is acted on: the file of a config file
+ * override can appear without gconf telling us, and a Start can come before
+ * the notify for the write that fixed its config. GetConfigChecks lists the
+ * verdicts.
+ */
+
+#include "libicd_network_wireguard.h"
+
+static void verdict_free(wireguard_config_verdict * verdict)
+{
+	g_free(verdict->error);
+	g_free(verdict->warnings);
+	g_free(verdict);
+}
+
+/* Check a config now, NULL if there is no such config */
+static const wireguard_config_verdict *check(network_wireguard_private * private, const char *config_name)
+{
+	wireguard_config_verdict *verdict = g_new0(wireguard_config_verdict, 1);
+
+	if (!wireguard_config_check(config_name, &verdict->error, &verdict->warnings)) {
+		g_hash_table_remove(private->config_checks, config_name);
+		verdict_free(verdict);
+		return NULL;
+	}
+
+	if (verdict->error)
+		WN_WARN("Config %s is invalid: %s\n", config_name, verdict->error);
+	else if (verdict->warnings)
+		WN_INFO("Config %s: %s\n", config_name, verdict->warnings);
+
+	g_hash_table_replace(private->config_checks, g_strdup(config_name), verdict);
+
+	return verdict;
+}
+
+static void check_pending(network_wireguard_private * private)
+{
+	GHashTable *pending = private->config_checks_pending;
+	GHashTableIter iter;
+	gpointer config_name;
+
+	private->config_checks_pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+
+	g_hash_table_iter_init(&iter, pending);
+	while (g_hash_table_iter_next(&iter, &config_name, NULL))
+		check(private, config_name);
+
+	g_hash_table_destroy(pending);
+}
+
+/* Check the configs found invalid again, they may have been fixed since */
+static void check_failed(network_wireguard_private * private)
+{
+	GHashTableIter iter;
+	gpointer config_name, verdict;
+	GSList *failed = NULL, *l;
+
+	g_hash_table_iter_init(&iter, private->config_checks);
+	while (g_hash_table_iter_next(&iter, &config_name, &verdict)) {
+		if (((wireguard_config_verdict *) verdict)->error)
+			failed = g_slist_prepend(failed, g_strdup(config_name));
+	}
+
+	for (l = failed; l; l = l->next)
+		check(private, l->data);
+	g_slist_free_full(failed, g_free);
+}
+
+static gboolean check_idle_cb(gpointer user_data)
+{
+	network_wireguard_private *private = user_data;
+
+	private->config_checks_idle = 0;
+	check_pending(private);
+
+	return FALSE;
+}
+
+/* Forget the verdict on config_name, it is checked again when idle */
+static void mark_pending(network_wireguard_private * private, const char *config_name)
+{
+	g_hash_table_remove(private->config_checks, config_name);
+	g_hash_table_replace(private->config_checks_pending, g_strdup(config_name), NULL);
+
+	if (private->config_checks_idle == 0)
+		private->config_checks_idle = g_idle_add_full(G_PRIORITY_LOW, check_idle_cb, private, NULL);
+}
+
+static void config_changed_cb(GConfClient * client, guint cnxn_id, GConfEntry * entry, gpointer user_data)
+{
+	WG_PROFILE();
+	network_wireguard_private *private = user_data;
+	const char *key = gconf_entry_get_key(entry);
+	const char *name, *slash;
+	gchar *config_name;
+
+	if (!g_str_has_prefix(key, GC_WIREGUARD "/"))
+		return;
+
+	/* Only keys of a config, not values next to them */
+	name = key + strlen(GC_WIREGUARD "/");
+	slash = strchr(name, '/');
+	if (slash == NULL || slash == name)
+		return;
+
+	config_name = g_strndup(name, slash - name);
+	mark_pending(private, config_name);
+	g_free(config_name);
+}
+
+void wireguard_config_checks_init(network_wireguard_private * private)
+{
+	private->config_checks = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+						       (GDestroyNotify) verdict_free);
+	private->config_checks_pending = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+}
+
+/**
+ * Follow changes to the configs, and check all of them in idle time. Until
+ * this succeeds nothing is known about any config.
+ *
+ * @param private  network module private data
+ */
+void wireguard_config_checks_start(network_wireguard_private * private)
+{
+	GError *error = NULL;
+	GSList *configs, *iter;
+
+	if (private->config_checks_notify != 0)
+		return;
+
+	if (private->config_checks_gconf == NULL)
+		private->config_checks_gconf = gconf_client_get_default();
+
+	gconf_client_add_dir(private->config_checks_gconf, GC_WIREGUARD, GCONF_CLIENT_PRELOAD_NONE, &error);
+	if (error == NULL)
+		private->config_checks_notify = gconf_client_notify_add(private->config_checks_gconf, GC_WIREGUARD,
+									config_changed_cb, private, NULL, &error);
+	if (error != NULL) {
+		WN_ERR("Could not monitor configs for changes: %s", error->message);
+		g_clear_error(&error);
+		return;
+	}
+
+	configs = gconf_client_all_dirs(private->config_checks_gconf, GC_WIREGUARD, NULL);
+	for (iter = configs; iter; iter = iter->next) {
+		gchar *config_name = g_path_get_basename(iter->data);
+
+		mark_pending(private, config_name);
+		g_free(config_name);
+	}
+	g_slist_free_full(configs, g_free);
+}
+
+/**
+ * What is known about a config, checking it first if it changed since it
+ * was last checked or was found invalid.
+ *
+ * @param private      network module private data
+ * @param config_name  the config
+ * @return the verdict, NULL if there is no such config or changes to it
+ *         cannot be followed
+ */
+const wireguard_config_verdict *wireguard_config_checks_get(network_wireguard_private * private,
+							    const char *config_name)
+{
+	const wireguard_config_verdict *verdict;
+
+	wireguard_config_checks_start(private);
+
+	/* It could go stale without us knowing */
+	if (private->config_checks_notify == 0)
+		return NULL;
+
+	verdict = g_hash_table_lookup(private->config_checks, config_name);
+	if (verdict && verdict->error == NULL)
+		return verdict;
+
+	/* Pending, gone, or possibly fixed */
+	g_hash_table_remove(private->config_checks_pending, config_name);
+
+	return check(private, config_name);
+}
+
+void wireguard_config_checks_free(network_wireguard_private * private)
+{
+	if (private->config_checks_idle != 0) {
+		g_source_remove(private->config_checks_idle);
+		private->config_checks_idle = 0;
+	}
+
+	if (private->config_checks_gconf != NULL) {
+		if (private->config_checks_notify != 0) {
+			gconf_client_notify_remove(private->config_checks_gconf, private->config_checks_notify);
+			private->config_checks_notify = 0;
+		}
+		g_object_unref(private->config_checks_gconf);
+		private->config_checks_gconf = NULL;
+	}
+
+	g_hash_table_destroy(private->config_checks);
+	g_hash_table_destroy(private->config_checks_pending);
+}
+
+static gint compare_names(gconstpointer a, gconstpointer b)
+{
+	return strcmp(a, b);
+}
+
+DBusHandlerResult getconfigchecks_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
+	network_wireguard_private *private = tunnel->private;
+	DBusMessageIter iter, array, entry;
+	GList *names, *l;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	/* Whoever asks wants to know about the configs as they are now */
+	wireguard_config_checks_start(private);
+	check_pending(private);
+	check_failed(private);
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, ICD_WIREGUARD_CONFIG_CHECKS_SIGNATURE, &array);
+
+	names = g_list_sort(g_hash_table_get_keys(private->config_checks), compare_names);
+	for (l = names; l; l = l->next) {
+		const char *config_name = l->data;
+		const wireguard_config_verdict *verdict = g_hash_table_lookup(private->config_checks, config_name);
+		const char *error = verdict->error ? verdict->error : "";
+		const char *warnings = verdict->warnings ? verdict->warnings : "";
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &config_name);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &error);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &warnings);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+	g_list_free(names);
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
@@ -0,0 +1,870 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Compiled configs. The gconf subtree of a config is checked and compiled
+ * once into a flat binary form: decoded keys, endpoints split into host and
+ * port, and the AllowedIPs of all peers parsed and collapsed. That is cached
+ * below the user cache dir under the SHA-256 of the gconf values it came
+ * from, so as long as those do not change a connect reads the gconf values,
+ * hashes them and maps the cache, without parsing any of them again. The
+ * private key is neither cached nor hashed: it is read from gconf and
+ * decoded on every connect, so the cache holds no secret.
+ *
+ * wireguard_config_check() compiles a config as soon as it changes, which
+ * also fills the cache for the next connect, and tells what is wrong with
+ * it besides what keeps it from being compiled.
+ *
+ * Layout: struct compiled_header, the peers, the prefixes they index into,
+ * then the NUL terminated strings the header and peers point into.
+ */
+
+#include "libicd_network_wireguard.h"
+
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define COMPILED_MAGIC "WGCFG\0\0\2"
+#define KEY_LEN 32
+/* Base64 of a key, with its one '=' of padding */
+#define KEY_BASE64_LEN 44
+/* SHA-256 */
+#define DIGEST_LEN 32
+#define NO_STRING G_MAXUINT32
+#define PRIVATE_KEY_INVALID GC_PRIVATEKEY " is not a base64 32 byte key"
+
+struct compiled_header {
+	char magic[8];
+	/* Of the gconf values compiled, see hash_source() */
+	guint8 digest[DIGEST_LEN];
+	guint32 peer_count;
+	guint32 prefix_count;
+	guint32 strings_size;
+	/* Offsets into the strings, the Address and DNS values as configured,
+	 * and what wireguard_config_check() reports besides errors */
+	guint32 address;
+	guint32 dns;
+	guint32 warnings;
+};
+
+struct compiled_peer {
+	guint8 public_key[KEY_LEN];
+	guint32 endpoint_host;
+	guint16 endpoint_port;
+	guint16 reserved;
+	guint32 first_prefix;
+	guint32 prefix_count;
+};
+
+struct _wireguard_compiled_config {
+	const struct compiled_header *header;
+	const struct compiled_peer *peers;
+	const wireguard_prefix *prefixes;
+	const char *strings;
+
+	/* Mapped from the cache, or compiled just now and ours */
+	gpointer data;
+	gsize size;
+	gboolean mapped;
+
+	/* From gconf, never in data */
+	guint8 private_key[KEY_LEN];
+};
+
+/* What gconf has for a peer */
+struct source_peer {
+	gchar *dir;
+	gchar *allowed_ips;
+	gchar *endpoint;
+	gchar *public_key;
+	gboolean has_file;
+};
+
+/* What gconf has for a config */
+struct source {
+	gchar *private_key;
+	gchar *address;
+	gchar *dns;
+	GPtrArray *peers;
+};
+
+/* A peer on its way into the compiled form */
+struct peer {
+	struct compiled_peer compiled;
+	gchar *endpoint_host;
+	GArray *allowed_ips;
+};
+
+static void source_peer_free(struct source_peer *peer)
+{
+	g_free(peer->dir);
+	g_free(peer->allowed_ips);
+	g_free(peer->endpoint);
+	g_free(peer->public_key);
+	g_free(peer);
+}
+
+static void source_free(struct source *source)
+{
+	g_free(source->private_key);
+	g_free(source->address);
+	g_free(source->dns);
+	g_ptr_array_free(source->peers, TRUE);
+}
+
+static void peer_free(struct peer *peer)
+{
+	g_free(peer->endpoint_host);
+	g_array_free(peer->allowed_ips, TRUE);
+	g_free(peer);
+}
+
+/* Read the config, the same keys a wg-quick config was always generated from */
+static void read_source(GConfClient * gconf, const char *cfgpath, struct source *source)
+{
+	GSList *peers, *iter;
+
+	gchar *gc_privatekey = g_strjoin("/", cfgpath, GC_PRIVATEKEY, NULL);
+	source->private_key = gconf_client_get_string(gconf, gc_privatekey, NULL);
+	g_free(gc_privatekey);
+
+	gchar *gc_address = g_strjoin("/", cfgpath, GC_ADDRESS, NULL);
+	source->address = gconf_client_get_string(gconf, gc_address, NULL);
+	g_free(gc_address);
+
+	gchar *gc_dns = g_strjoin("/", cfgpath, GC_DNS, NULL);
+	source->dns = gconf_client_get_string(gconf, gc_dns, NULL);
+	g_free(gc_dns);
+
+	source->peers = g_ptr_array_new_with_free_func((GDestroyNotify) source_peer_free);
+	if (source->private_key == NULL || source->address == NULL)
+		return;
+
+	gchar *gc_peers = g_strjoin("/", cfgpath, GC_PEERS, NULL);
+	peers = gconf_client_all_dirs(gconf, gc_peers, NULL);
+	g_free(gc_peers);
+
+	for (iter = peers; iter; iter = iter->next) {
+		struct source_peer *peer = g_new0(struct source_peer, 1);
+
+		peer->dir = iter->data;
+
+		gchar *gc_peer_ips = g_strjoin("/", peer->dir, GC_PEER_IPS, NULL);
+		peer->allowed_ips = gconf_client_get_string(gconf, gc_peer_ips, NULL);
+		g_free(gc_peer_ips);
+
+		gchar *gc_endpoint = g_strjoin("/", peer->dir, GC_PEER_ENDPOINT, NULL);
+		peer->endpoint = gconf_client_get_string(gconf, gc_endpoint, NULL);
+		g_free(gc_endpoint);
+
+		gchar *gc_pubkey = g_strjoin("/", peer->dir, GC_PEER_PUBKEY, NULL);
+		peer->public_key = gconf_client_get_string(gconf, gc_pubkey, NULL);
+		g_free(gc_pubkey);
+
+		/* Only a file is fine too, the network module pushes those */
+		if (peer->allowed_ips == NULL) {
+			gchar *gc_file = g_strjoin("/", peer->dir, GC_PEER_IPS_FILE, NULL);
+			gchar *file = gconf_client_get_string(gconf, gc_file, NULL);
+			g_free(gc_file);
+
+			peer->has_file = file != NULL;
+			g_free(file);
+		}
+
+		g_ptr_array_add(source->peers, peer);
+	}
+	g_slist_free(peers);
+}
+
+static void hash_value(GChecksum * checksum, const char *name, const char *value)
+{
+	g_checksum_update(checksum, (const guchar *)name, strlen(name) + 1);
+	if (value)
+		g_checksum_update(checksum, (const guchar *)value, strlen(value) + 1);
+	else
+		g_checksum_update(checksum, (const guchar *)"\1", 1);
+}
+
+/* The cache key: everything the compiled form is made from, in the order
+ * gconf gave it, which decides what collapsing AllowedIPs does. The private
+ * key is not part of it. */
+static void hash_source(const struct source *source, guint8 * digest)
+{
+	GChecksum *checksum = g_checksum_new(G_CHECKSUM_SHA256);
+	gsize len = DIGEST_LEN;
+	guint i;
+
+	g_checksum_update(checksum, (const guchar *)COMPILED_MAGIC, sizeof(COMPILED_MAGIC) - 1);
+	hash_value(checksum, GC_ADDRESS, source->address);
+	hash_value(checksum, GC_DNS, source->dns);
+
+	for (i = 0; i < source->peers->len; i++) {
+		const struct source_peer *peer = g_ptr_array_index(source->peers, i);
+
+		hash_value(checksum, GC_PEERS, peer->dir);
+		hash_value(checksum, GC_PEER_IPS, peer->allowed_ips);
+		hash_value(checksum, GC_PEER_ENDPOINT, peer->endpoint);
+		hash_value(checksum, GC_PEER_PUBKEY, peer->public_key);
+		hash_value(checksum, GC_PEER_IPS_FILE, peer->has_file ? "" : NULL);
+	}
+
+	g_checksum_get_digest(checksum, digest, &len);
+	g_checksum_free(checksum);
+}
+
+/* A base64 WireGuard key, strictly: g_base64_decode() skips what it does
+ * not know */
+static gboolean decode_key(const char *text, guint8 * key)
+{
+	static const char alphabet[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+	guchar *raw;
+	gsize len = 0;
+	gboolean ok;
+
+	if (strlen(text) != KEY_BASE64_LEN || strspn(text, alphabet) != KEY_BASE64_LEN - 1
+	    || text[KEY_BASE64_LEN - 1] != '=')
+		return FALSE;
+
+	raw = g_base64_decode(text, &len);
+	ok = len == KEY_LEN;
+	if (ok)
+		memcpy(key, raw, KEY_LEN);
+	g_free(raw);
+
+	return ok;
+}
+
+/* host:port, with an IPv6 host in brackets */
+static gboolean parse_endpoint(const char *text, gchar ** host, guint16 * port)
+{
+	const char *colon = strrchr(text, ':');
+	const char *start = text, *end = colon;
+	struct in6_addr addr6;
+	guint64 value;
+	gchar *rest;
+
+	if (colon == NULL || colon[1] == '\0')
+		return FALSE;
+
+	if (*text == '[') {
+		if (colon == text || colon[-1] != ']')
+			return FALSE;
+		start = text + 1;
+		end = colon - 1;
+	} else if (memchr(text, ':', colon - text)) {
+		return FALSE;
+	}
+	if (end == start)
+		return FALSE;
+
+	value = g_ascii_strtoull(colon + 1, &rest, 10);
+	if (*rest != '\0' || value == 0 || value > G_MAXUINT16)
+		return FALSE;
+
+	*host = g_strndup(start, end - start);
+	if (*text == '[' && inet_pton(AF_INET6, *host, &addr6) != 1) {
+		g_free(*host);
+		*host = NULL;
+		return FALSE;
+	}
+	*port = value;
+
+	return TRUE;
+}
+
+/* Comma separated addresses with an optional prefix length, at least one */
+static gboolean address_valid(const char *text)
+{
+	gchar **entries = g_strsplit(text, ",", -1);
+	wireguard_prefix prefix;
+	guint i, count = 0;
+	gboolean ok = TRUE;
+
+	for (i = 0; entries[i] && ok; i++) {
+		if (*g_strstrip(entries[i]) == '\0')
+			continue;
+		ok = wireguard_prefix_parse(entries[i], &prefix);
+		count++;
+	}
+	g_strfreev(entries);
+
+	return ok && count;
+}
+
+struct overlaps {
+	const char *config_name;
+	guint duplicates;
+	guint nested;
+};
+
+static void overlap_cb(const wireguard_prefix * prefix, guint set, const wireguard_prefix * outer, guint outer_set,
+		       gpointer user_data)
+{
+	struct overlaps *overlaps = user_data;
+
+	if (prefix->len != outer->len) {
+		overlaps->nested++;
+		return;
+	}
+
+	/* Only the first, there may be thousands */
+	if (overlaps->duplicates++ == 0) {
+		char buf[WIREGUARD_PREFIX_STRLEN];
+
+		wireguard_prefix_format(prefix, buf);
+		WN_WARN("%s: peers %u and %u both have %s, only peer %u gets it\n", overlaps->config_name,
+			outer_set, set, buf, set);
+	}
+}
+
+/* Collapse the AllowedIPs of all peers together, so the kernel gets no more
+ * entries than it needs to route the same way. Returns the number of entries
+ * more than one peer has. */
+static guint collapse_allowed_ips(const char *config_name, GPtrArray * peers)
+{
+	GArray **sets = g_new(GArray *, peers->len);
+	struct overlaps overlaps = { config_name, 0, 0 };
+	guint i, before = 0, after = 0;
+
+	for (i = 0; i < peers->len; i++) {
+		sets[i] = ((struct peer *)g_ptr_array_index(peers, i))->allowed_ips;
+		before += sets[i]->len;
+	}
+
+	wireguard_prefix_sets_collapse(sets, peers->len, overlap_cb, &overlaps);
+
+	for (i = 0; i < peers->len; i++)
+		after += sets[i]->len;
+	g_free(sets);
+
+	if (overlaps.duplicates)
+		WN_WARN("%s: %u AllowedIPs entries on more than one peer\n", config_name, overlaps.duplicates);
+	if (before != after || overlaps.nested)
+		WN_INFO("%s: AllowedIPs collapsed from %u to %u entries, %u within those of another peer\n",
+			config_name, before, after, overlaps.nested);
+
+	return overlaps.duplicates;
+}
+
+/* Add to what is wrong with a config that still compiles */
+static void G_GNUC_PRINTF(2, 3) warn(GString * warnings, const char *format, ...)
+{
+	va_list args;
+
+	if (warnings->len)
+		g_string_append(warnings, "; ");
+	va_start(args, format);
+	g_string_append_vprintf(warnings, format, args);
+	va_end(args);
+}
+
+static guint32 add_string(GString * strings, const char *value)
+{
+	guint32 offset = strings->len;
+
+	if (value == NULL)
+		return NO_STRING;
+
+	g_string_append_len(strings, value, strlen(value) + 1);
+
+	return offset;
+}
+
+/* Point config at the sections of its data, which have been checked */
+static void config_layout(wireguard_compiled_config * config)
+{
+	const char *data = config->data;
+
+	config->header = config->data;
+	config->peers = (const struct compiled_peer *)(data + sizeof(struct compiled_header));
+	config->prefixes = (const wireguard_prefix *)(config->peers + config->header->peer_count);
+	config->strings = (const char *)(config->prefixes + config->header->prefix_count);
+}
+
+/* Check and compile source, *error says why if it cannot be. What does not
+ * keep it from compiling is kept in the header. */
+static wireguard_compiled_config *compile(const char *config_name, const struct source *source,
+					  const guint8 * digest, gchar ** error)
+{
+	struct compiled_header header;
+	wireguard_compiled_config *config;
+	guint8 private_key[KEY_LEN];
+	GString *strings, *warnings;
+	GPtrArray *peers;
+	GByteArray *data;
+	guint i, duplicates;
+
+	memset(&header, 0, sizeof(header));
+	memcpy(header.magic, COMPILED_MAGIC, sizeof(header.magic));
+	memcpy(header.digest, digest, sizeof(header.digest));
+
+	if (!decode_key(source->private_key, private_key)) {
+		*error = g_strdup(PRIVATE_KEY_INVALID);
+		return NULL;
+	}
+	if (!address_valid(source->address)) {
+		*error = g_strdup_printf(GC_ADDRESS " '%s' is not a list of addresses", source->address);
+		return NULL;
+	}
+
+	peers = g_ptr_array_new_with_free_func((GDestroyNotify) peer_free);
+	warnings = g_string_new(NULL);
+	for (i = 0; i < source->peers->len; i++) {
+		const struct source_peer *from = g_ptr_array_index(source->peers, i);
+		const char *name = strrchr(from->dir, '/');
+		const char *missing = NULL;
+		struct peer *peer;
+		guint invalid;
+
+		name = name ? name + 1 : from->dir;
+
+		if (from->public_key == NULL)
+			missing = GC_PEER_PUBKEY;
+		else if (from->endpoint == NULL)
+			missing = GC_PEER_ENDPOINT;
+		else if (!(from->allowed_ips || from->has_file))
+			missing = GC_PEER_IPS;
+
+		/* Not provisioned yet, rather than wrong */
+		if (missing) {
+			warn(warnings, "%s: no %s yet, left out", name, missing);
+			continue;
+		}
+
+		peer = g_new0(struct peer, 1);
+		peer->allowed_ips = g_array_new(FALSE, FALSE, sizeof(wireguard_prefix));
+		g_ptr_array_add(peers, peer);
+
+		if (!decode_key(from->public_key, peer->compiled.public_key)) {
+			*error = g_strdup_printf("%s: " GC_PEER_PUBKEY " is not a base64 32 byte key", name);
+			break;
+		}
+		if (!parse_endpoint(from->endpoint, &peer->endpoint_host, &peer->compiled.endpoint_port)) {
+			*error = g_strdup_printf("%s: " GC_PEER_ENDPOINT " '%s' is not host:port", name,
+						 from->endpoint);
+			break;
+		}
+
+		/* wg-quick would refuse the config over any of them */
+		invalid = from->allowed_ips ? wireguard_prefixes_parse(peer->allowed_ips, from->allowed_ips) : 0;
+		if (invalid) {
+			*error = g_strdup_printf("%s: %u " GC_PEER_IPS " entries are not prefixes", name, invalid);
+			break;
+		}
+	}
+
+	if (*error) {
+		g_string_free(warnings, TRUE);
+		g_ptr_array_free(peers, TRUE);
+		return NULL;
+	}
+
+	if (peers->len == 0)
+		warn(warnings, "no peers");
+	duplicates = collapse_allowed_ips(config_name, peers);
+	if (duplicates)
+		warn(warnings, "%u " GC_PEER_IPS " entries on more than one peer, the last one gets them", duplicates);
+
+	strings = g_string_new(NULL);
+	header.address = add_string(strings, source->address);
+	header.dns = add_string(strings, source->dns);
+	header.warnings = add_string(strings, warnings->len ? warnings->str : NULL);
+	header.peer_count = peers->len;
+
+	data = g_byte_array_new();
+	g_byte_array_append(data, (const guint8 *)&header, sizeof(header));
+	for (i = 0; i < peers->len; i++) {
+		struct peer *peer = g_ptr_array_index(peers, i);
+
+		peer->compiled.endpoint_host = add_string(strings, peer->endpoint_host);
+		peer->compiled.first_prefix = header.prefix_count;
+		peer->compiled.prefix_count = peer->allowed_ips->len;
+		header.prefix_count += peer->allowed_ips->len;
+		g_byte_array_append(data, (const guint8 *)&peer->compiled, sizeof(peer->compiled));
+	}
+	for (i = 0; i < peers->len; i++) {
+		struct peer *peer = g_ptr_array_index(peers, i);
+
+		g_byte_array_append(data, (const guint8 *)peer->allowed_ips->data,
+				    peer->allowed_ips->len * sizeof(wireguard_prefix));
+	}
+	g_byte_array_append(data, (const guint8 *)strings->str, strings->len);
+
+	header.strings_size = strings->len;
+	memcpy(data->data, &header, sizeof(header));
+
+	g_string_free(strings, TRUE);
+	g_string_free(warnings, TRUE);
+	g_ptr_array_free(peers, TRUE);
+
+	config = g_new0(wireguard_compiled_config, 1);
+	config->size = data->len;
+	config->data = g_byte_array_free(data, FALSE);
+	memcpy(config->private_key, private_key, KEY_LEN);
+	config_layout(config);
+
+	return config;
+}
+
+/* The file ends in a NUL, so any offset in the strings is a string */
+static gboolean string_valid(const struct compiled_header *header, guint32 offset, gboolean optional)
+{
+	if (offset == NO_STRING)
+		return optional;
+
+	return offset < header->strings_size;
+}
+
+/* Map the cache if it was compiled from digest and is whole */
+static wireguard_compiled_config *map_cache(const char *cache, const guint8 * digest)
+{
+	const struct compiled_header *header;
+	wireguard_compiled_config *config;
+	struct stat st;
+	gpointer map;
+	guint64 size;
+	guint i;
+	int fd;
+
+	fd = open(cache, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = map;
+	size = sizeof(*header) + (guint64) header->peer_count * sizeof(struct compiled_peer)
+	    + (guint64) header->prefix_count * sizeof(wireguard_prefix) + header->strings_size;
+	if (memcmp(header->magic, COMPILED_MAGIC, sizeof(header->magic)) != 0
+	    || memcmp(header->digest, digest, sizeof(header->digest)) != 0 || size != (guint64) st.st_size
+	    || header->strings_size == 0 || ((const char *)map)[st.st_size - 1] != '\0') {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	config = g_new0(wireguard_compiled_config, 1);
+	config->data = map;
+	config->size = st.st_size;
+	config->mapped = TRUE;
+	config_layout(config);
+
+	/* Whoever wrote it, nothing may point outside of it */
+	for (i = 0; i < header->peer_count; i++) {
+		const struct compiled_peer *peer = &config->peers[i];
+
+		if ((guint64) peer->first_prefix + peer->prefix_count > header->prefix_count
+		    || !string_valid(header, peer->endpoint_host, FALSE))
+			break;
+	}
+	if (i < header->peer_count || !string_valid(header, header->address, FALSE)
+	    || !string_valid(header, header->dns, TRUE) || !string_valid(header, header->warnings, TRUE)) {
+		wireguard_compiled_config_free(config);
+		return NULL;
+	}
+
+	return config;
+}
+
+/* Replace the cache with config at once, not fatal if we cannot */
+static void write_cache(const char *cache, const wireguard_compiled_config * config)
+{
+	gchar *tmp = g_strconcat(cache, ".tmp", NULL);
+	int out, ret;
+
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (out < 0) {
+		WN_WARN("Unable to create %s: %s", tmp, strerror(errno));
+		g_free(tmp);
+		return;
+	}
+
+	ret = wireguard_write_all(out, config->data, config->size);
+	if (close(out) < 0 && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(tmp, cache) < 0)
+		ret = -errno;
+
+	if (ret < 0) {
+		WN_WARN("Unable to write %s: %s", cache, strerror(-ret));
+		unlink(tmp);
+	}
+	g_free(tmp);
+}
+
+static gchar *cache_path(const char *config_name)
+{
+	gchar *dir = g_build_filename(g_get_user_cache_dir(), WIREGUARD_PREFIX_CACHE_DIR, NULL);
+	gchar *escaped = g_uri_escape_string(config_name, NULL, FALSE);
+	gchar *name = g_strconcat(escaped, ".config", NULL);
+	gchar *path;
+
+	if (g_mkdir_with_parents(dir, 0700) < 0)
+		WN_WARN("Unable to create %s: %s", dir, strerror(errno));
+
+	path = g_build_filename(dir, name, NULL);
+	g_free(name);
+	g_free(escaped);
+	g_free(dir);
+
+	return path;
+}
+
+static void read_config(const char *config_name, struct source *source)
+{
+	GConfClient *gconf = gconf_client_get_default();
+	gchar *cfgpath = g_strjoin("/", GC_WIREGUARD, config_name, NULL);
+
+	read_source(gconf, cfgpath, source);
+	g_free(cfgpath);
+	g_object_unref(gconf);
+}
+
+/**
+ * A config in compiled form, from the cache if its gconf values did not
+ * change since it was compiled.
+ *
+ * @param config_name  the config
+ * @param error        set to why the config is invalid, if it is
+ * @return the config, NULL if it has no PrivateKey or Address yet or is
+ *         invalid; free with wireguard_compiled_config_free()
+ */
+wireguard_compiled_config *wireguard_config_compile(const char *config_name, gchar ** error)
+{
+	wireguard_compiled_config *config;
+	struct source source;
+	guint8 digest[DIGEST_LEN];
+	gchar *cache;
+
+	*error = NULL;
+
+	read_config(config_name, &source);
+
+	if (source.private_key == NULL || source.address == NULL) {
+		source_free(&source);
+		return NULL;
+	}
+
+	hash_source(&source, digest);
+	cache = cache_path(config_name);
+
+	config = map_cache(cache, digest);
+	if (config && !decode_key(source.private_key, config->private_key)) {
+		*error = g_strdup(PRIVATE_KEY_INVALID);
+		wireguard_compiled_config_free(config);
+		config = NULL;
+	} else if (config == NULL) {
+		config = compile(config_name, &source, digest, error);
+		if (config)
+			write_cache(cache, config);
+	}
+
+	g_free(cache);
+	source_free(&source);
+
+	return config;
+}
+
+/**
+ * Check a config without connecting to it: what keeps it from being used,
+ * and what is wrong with it nonetheless, like peers that are left out or
+ * AllowedIPs more than one peer has. Only compiles the config if the cache
+ * is not up to date, and caches what it compiled, so the next connect only
+ * maps it.
+ *
+ * @param config_name  the config
+ * @param error        set to why the config cannot be used, NULL if it can
+ * @param warnings     set to what else is wrong with it, NULL if nothing
+ * @return FALSE if there is no such config
+ */
+gboolean wireguard_config_check(const char *config_name, gchar ** error, gchar ** warnings)
+{
+	wireguard_compiled_config *config;
+	GConfClient *gconf;
+	struct source source;
+	guint8 digest[DIGEST_LEN];
+	gchar *override, *cache;
+
+	*error = NULL;
+	*warnings = NULL;
+
+	/* Used as it is, all there is to check is that it is there */
+	gconf = gconf_client_get_default();
+	gchar *gc_configoverride = g_strjoin("/", GC_WIREGUARD, config_name, GC_CONFIG_FILE_OVERRIDE, NULL);
+	override = gconf_client_get_string(gconf, gc_configoverride, NULL);
+	g_free(gc_configoverride);
+	g_object_unref(gconf);
+
+	if (override) {
+		if (!g_file_test(override, G_FILE_TEST_IS_REGULAR))
+			*error = g_strdup_printf(GC_CONFIG_FILE_OVERRIDE " '%s' is not a file", override);
+		g_free(override);
+		return TRUE;
+	}
+
+	read_config(config_name, &source);
+
+	if (source.private_key == NULL && source.address == NULL) {
+		source_free(&source);
+		return FALSE;
+	}
+	if (source.private_key == NULL || source.address == NULL) {
+		*error = g_strdup_printf("%s missing", source.private_key == NULL ? GC_PRIVATEKEY : GC_ADDRESS);
+		source_free(&source);
+		return TRUE;
+	}
+
+	hash_source(&source, digest);
+	cache = cache_path(config_name);
+
+	/* The key is not part of the digest */
+	config = map_cache(cache, digest);
+	if (config && !decode_key(source.private_key, config->private_key)) {
+		*error = g_strdup(PRIVATE_KEY_INVALID);
+	} else if (config == NULL) {
+		config = compile(config_name, &source, digest, error);
+		if (config)
+			write_cache(cache, config);
+	}
+
+	if (config) {
+		if (*error == NULL && config->header->warnings != NO_STRING)
+			*warnings = g_strdup(config->strings + config->header->warnings);
+		wireguard_compiled_config_free(config);
+	}
+
+	g_free(cache);
+	source_free(&source);
+
+	return TRUE;
+}
+
+/**
+ * The wg-quick config for a compiled config.
+ *
+ * @param config  the compiled config
+ * @return the config text
+ */
+gchar *wireguard_compiled_config_text(const wireguard_compiled_config * config)
+{
+	const struct compiled_header *header = config->header;
+	GString *text = g_string_new("[Interface]");
+	gchar *key;
+	guint i;
+
+	key = g_base64_encode(config->private_key, KEY_LEN);
+	g_string_append_printf(text, "\nPrivateKey = %s", key);
+	g_free(key);
+	g_string_append_printf(text, "\nAddress = %s", config->strings + header->address);
+	if (header->dns != NO_STRING)
+		g_string_append_printf(text, "\nDNS = %s\n", config->strings + header->dns);
+
+	for (i = 0; i < header->peer_count; i++) {
+		const struct compiled_peer *peer = &config->peers[i];
+		const char *host = config->strings + peer->endpoint_host;
+		guint j;
+
+		key = g_base64_encode(peer->public_key, KEY_LEN);
+		g_string_append(text, "\n[Peer]");
+		g_string_append_printf(text, "\nPublicKey = %s", key);
+		g_string_append_printf(text, strchr(host, ':') ? "\nEndPoint = [%s]:%u" : "\nEndPoint = %s:%u", host,
+				       peer->endpoint_port);
+		g_free(key);
+
+		/* Later peers may have taken all of them */
+		for (j = 0; j < peer->prefix_count; j++) {
+			char buf[WIREGUARD_PREFIX_STRLEN];
+
+			wireguard_prefix_format(&config->prefixes[peer->first_prefix + j], buf);
+			g_string_append(text, j ? ", " : "\nAllowedIPs = ");
+			g_string_append(text, buf);
+		}
+		g_string_append_c(text, '\n');
+	}
+
+	return g_string_free(text, FALSE);
+}
+
+void wireguard_compiled_config_free(wireguard_compiled_config * config)
+{
+	if (config->mapped)
+		munmap(config->data, config->size);
+	else
+		g_free(config->data);
+	g_free(config);
+}
+
+/**
+ * The wg-quick config for a config: the config_file_override file if it has
+ * one, otherwise generated from its compiled form.
+ *
+ * @param config_name  the config
+ * @param error        set to why the config is invalid, if it is
+ * @return the config text, NULL if there is none
+ */
+gchar *wireguard_config_generate(const char *config_name, gchar ** error)
+{
+	wireguard_compiled_config *config;
+	GConfClient *gconf;
+	gchar *configoverride, *text;
+
+	*error = NULL;
+
+	gconf = gconf_client_get_default();
+	gchar *gc_configoverride = g_strjoin("/", GC_WIREGUARD, config_name, GC_CONFIG_FILE_OVERRIDE, NULL);
+	configoverride = gconf_client_get_string(gconf, gc_configoverride, NULL);
+	g_free(gc_configoverride);
+	g_object_unref(gconf);
+
+	if (configoverride) {
+		GError *gerror = NULL;
+		char *config_contents = NULL;
+
+		g_file_get_contents(configoverride, &config_contents, NULL, &gerror);
+		if (gerror != NULL) {
+			WN_WARN("Unable to read config override: %s\n", gerror->message);
+			g_clear_error(&gerror);
+		}
+		g_free(configoverride);
+
+		return config_contents;
+	}
+
+	config = wireguard_config_compile(config_name, error);
+	if (config == NULL)
+		return NULL;
+
+	text = wireguard_compiled_config_text(config);
+	wireguard_compiled_config_free(config);
+
+	return text;
+}
@@ -24,6 +24,27 @@
 #include "dbus_wireguard.h"
 #include "libicd_network_wireguard.h"
 
+const char *wireguard_status_string(const network_wireguard_state * state)
+{
+	switch (state->tunnel) {
+	case WIREGUARD_STATE_CONNECTING:
+	case WIREGUARD_STATE_STARTING:
+		return ICD_WIREGUARD_SIGNALS_STATUS_STATE_STARTED;
+	case WIREGUARD_STATE_RUNNING:
+		return ICD_WIREGUARD_SIGNALS_STATUS_STATE_CONNECTED;
+	default:
+		return ICD_WIREGUARD_SIGNALS_STATUS_STATE_STOPPED;
+	}
+}
+
+const char *wireguard_mode_string(const network_wireguard_state * state)
+{
+	if (!state->service_provider_mode)
+		return ICD_WIREGUARD_SIGNALS_STATUS_MODE_NORMAL;
+
+	return ICD_WIREGUARD_SIGNALS_STATUS_MODE_PROVIDER;
+}
+
 static DBusHandlerResult start_reply(dbus_int32_t return_code, DBusMessage * reply)
 {
 	dbus_message_append_args(reply, DBUS_TYPE_INT32, &return_code, DBUS_TYPE_INVALID);
@@ -39,7 +60,8 @@ static DBusHandlerResult start_reply(dbus_int32_t return_code, DBusMessage * rep
 
 DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
 {
-	network_wireguard_private *priv = user_data;
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
 	DBusError error;
 	const char *config;
 
@@ -49,7 +71,7 @@ DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * mess
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 	}
 
-	if (!priv->state.service_provider_mode) {
+	if (!tunnel->state.service_provider_mode) {
 		/* We do not accept dbus commands from non-providers */
 
 		return start_reply(WIREGUARD_DBUS_METHOD_START_RESULT_REFUSED, reply);
@@ -58,7 +80,7 @@ DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * mess
 	/* We are in provider mode */
 
 	/* Wireguard already running? */
-	if (priv->state.wireguard_running == TRUE) {
+	if (tunnel->state.tunnel != WIREGUARD_STATE_STOPPED) {
 		return start_reply(WIREGUARD_DBUS_METHOD_START_RESULT_ALREADY_RUNNING, reply);
 	}
 
@@ -74,23 +96,37 @@ DBusHandlerResult start_callback(DBusConnection * connection, DBusMessage * mess
 		return start_reply(WIREGUARD_DBUS_METHOD_START_RESULT_INVALID_CONFIG, reply);
 	}
 
-	/* Actually start Tor */
-	network_wireguard_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-	new_state.active_config = g_strdup(config);
-	wireguard_state_change(priv, NULL, new_state, EVENT_SOURCE_DBUS_CALL_START);
+	/* Known to fail, no need to find out again */
+	const wireguard_config_verdict *verdict = wireguard_config_checks_get(tunnel->private, config);
+	if (verdict && verdict->error) {
+		gchar *invalid = g_strdup_printf("Invalid config %s: %s", config, verdict->error);
 
-	if (priv->state.dbus_failed_to_start) {
-		priv->state.dbus_failed_to_start = FALSE;
-		return start_reply(WIREGUARD_DBUS_METHOD_START_RESULT_FAILED, reply);
+		WN_WARN("Not starting %s\n", invalid);
+		wireguard_set_last_error(tunnel, invalid);
+		g_free(invalid);
+
+		return start_reply(WIREGUARD_DBUS_METHOD_START_RESULT_INVALID_CONFIG, reply);
 	}
 
+	/* Actually start Wireguard */
+	wireguard_event event = {
+		.source = EVENT_SOURCE_DBUS_CALL_START,
+		.tunnel = tunnel,
+		.active_config = g_strdup(config),
+	};
+	wireguard_state_post(tunnel->private, &event);
+
+	/* We are called from the main loop, so the event was handled right away */
+	if (tunnel->state.tunnel != WIREGUARD_STATE_STARTING)
+		return start_reply(WIREGUARD_DBUS_METHOD_START_RESULT_FAILED, reply);
+
 	return start_reply(WIREGUARD_DBUS_METHOD_START_RESULT_OK, reply);
 }
 
 DBusHandlerResult stop_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
 {
-	network_wireguard_private *priv = user_data;
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
 
 	DBusMessage *reply = dbus_message_new_method_return(message);
 	if (!reply) {
@@ -98,30 +134,30 @@ DBusHandlerResult stop_callback(DBusConnection * connection, DBusMessage * messa
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 	}
 
-	if (!priv->state.service_provider_mode) {
+	if (!tunnel->state.service_provider_mode) {
 		/* We do not accept dbus commands from non-providers */
 
 		return start_reply(WIREGUARD_DBUS_METHOD_STOP_RESULT_REFUSED, reply);
 	}
 
 	/* Wireguard not running? */
-	if (priv->state.wireguard_running == FALSE) {
+	if (tunnel->state.tunnel != WIREGUARD_STATE_STARTING && tunnel->state.tunnel != WIREGUARD_STATE_RUNNING) {
 		return start_reply(WIREGUARD_DBUS_METHOD_STOP_RESULT_NOT_RUNNING, reply);
 	}
 
 	/* Actually stop Wireguard */
-	network_wireguard_state new_state;
-	memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-	wireguard_state_change(priv, NULL, new_state, EVENT_SOURCE_DBUS_CALL_STOP);
+	wireguard_event event = { .source = EVENT_SOURCE_DBUS_CALL_STOP, .tunnel = tunnel };
+	wireguard_state_post(tunnel->private, &event);
 
 	return start_reply(WIREGUARD_DBUS_METHOD_STOP_RESULT_OK, reply);
 }
 
 DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
 {
+	WG_PROFILE();
 	const char *state = NULL;
 	const char *mode = NULL;
-	network_wireguard_private *priv = user_data;
+	wireguard_tunnel *tunnel = user_data;
 
 	DBusMessage *reply = dbus_message_new_method_return(message);
 	if (!reply) {
@@ -129,22 +165,8 @@ DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage *
 		return DBUS_HANDLER_RESULT_NEED_MEMORY;
 	}
 
-	/* TODO: DRY this */
-	if (!priv->state.wireguard_running) {
-		state = ICD_WIREGUARD_SIGNALS_STATUS_STATE_STOPPED;
-	} else {
-		if (priv->state.wg_quick_running) {
-			state = ICD_WIREGUARD_SIGNALS_STATUS_STATE_STARTED;
-		} else {
-			state = ICD_WIREGUARD_SIGNALS_STATUS_STATE_CONNECTED;
-		}
-	}
-
-	if (!priv->state.service_provider_mode) {
-		mode = ICD_WIREGUARD_SIGNALS_STATUS_MODE_NORMAL;
-	} else {
-		mode = ICD_WIREGUARD_SIGNALS_STATUS_MODE_PROVIDER;
-	}
+	state = wireguard_status_string(&tunnel->state);
+	mode = wireguard_mode_string(&tunnel->state);
 
 	dbus_message_append_args(reply, DBUS_TYPE_STRING, &state, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID);
 
@@ -160,34 +182,27 @@ DBusHandlerResult getstatus_callback(DBusConnection * connection, DBusMessage *
 	return DBUS_HANDLER_RESULT_HANDLED;
 }
 
-void emit_status_signal(network_wireguard_state state)
+DBusHandlerResult getprofile_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	WG_PROFILE();
+
+	return wireguard_profile_reply(message);
+}
+
+void emit_status_signal(const char *path, const network_wireguard_state * state)
 {
 	const char *status = NULL;
 	const char *mode = NULL;
 	DBusMessage *msg = NULL;
 
-	msg = dbus_message_new_signal(ICD_WIREGUARD_DBUS_PATH, ICD_WIREGUARD_DBUS_INTERFACE, "StatusChanged");
+	msg = dbus_message_new_signal(path, ICD_WIREGUARD_DBUS_INTERFACE, "StatusChanged");
 	if (msg == NULL) {
 		WN_WARN("Could not construct dbus message for StatusChanged signal");
 		return;
 	}
 
-	/* TODO: DRY this */
-	if (!state.wireguard_running) {
-		status = ICD_WIREGUARD_SIGNALS_STATUS_STATE_STOPPED;
-	} else {
-		if (state.wg_quick_running) {
-			status = ICD_WIREGUARD_SIGNALS_STATUS_STATE_STARTED;
-		} else {
-			status = ICD_WIREGUARD_SIGNALS_STATUS_STATE_CONNECTED;
-		}
-	}
-
-	if (!state.service_provider_mode) {
-		mode = ICD_WIREGUARD_SIGNALS_STATUS_MODE_NORMAL;
-	} else {
-		mode = ICD_WIREGUARD_SIGNALS_STATUS_MODE_PROVIDER;
-	}
+	status = wireguard_status_string(state);
+	mode = wireguard_mode_string(state);
 
 	dbus_message_append_args(msg, DBUS_TYPE_STRING, &status, DBUS_TYPE_STRING, &mode, DBUS_TYPE_INVALID);
 
@@ -0,0 +1,367 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+#include <glib.h>
+
+#include "libicd_wireguard.h"
+#include "libicd_network_wireguard.h"
+
+#include <asm/types.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/genetlink.h>
+#include <linux/wireguard.h>
+#include <linux/time_types.h>
+#include <net/if.h>
+#include <errno.h>
+#include <unistd.h>
+
+#define GENL_BUFSIZE 32768
+/* The kernel answers right away; this only bounds how long a lost reply can
+ * stall icd2's main loop */
+#define GENL_RECV_TIMEOUT_MS 200
+
+#define NLA_DATA(nla) ((void *)((char *)(nla) + NLA_HDRLEN))
+#define NLA_PAYLOAD(nla) ((int)(nla)->nla_len - NLA_HDRLEN)
+#define NLA_SPACE(len) NLA_ALIGN(NLA_HDRLEN + (len))
+#define NLA_OK(nla, len) ((len) >= (int)sizeof(struct nlattr) && \
+			  (nla)->nla_len >= sizeof(struct nlattr) && \
+			  (nla)->nla_len <= (len))
+#define NLA_NEXT(nla, len) ((len) -= NLA_ALIGN((nla)->nla_len), \
+			    (struct nlattr *)((char *)(nla) + NLA_ALIGN((nla)->nla_len)))
+
+static void put_attr(struct nlmsghdr *header, int type, const void *data, size_t len)
+{
+	struct nlattr *nla = (struct nlattr *)((char *)header + NLMSG_ALIGN(header->nlmsg_len));
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	memcpy(NLA_DATA(nla), data, len);
+	header->nlmsg_len = NLMSG_ALIGN(header->nlmsg_len) + NLA_ALIGN(nla->nla_len);
+}
+
+static int genl_request(int fd, guint16 type, guint8 cmd, guint8 version, guint16 flags,
+			int attr_type, const void *attr, size_t attr_len)
+{
+	char buf[NLMSG_SPACE(GENL_HDRLEN) + NLA_HDRLEN + NLA_ALIGN(GENL_NAMSIZ)];
+	struct nlmsghdr *header = (struct nlmsghdr *)buf;
+	struct genlmsghdr *genl;
+	struct sockaddr_nl addr;
+
+	memset(buf, 0, sizeof(buf));
+	header->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+	header->nlmsg_type = type;
+	header->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+
+	genl = NLMSG_DATA(header);
+	genl->cmd = cmd;
+	genl->version = version;
+
+	put_attr(header, attr_type, attr, attr_len);
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (sendto(fd, buf, header->nlmsg_len, 0, (struct sockaddr *)&addr, sizeof(addr)) < 0)
+		return -errno;
+
+	return 0;
+}
+
+/* Receive until the ACK or NLMSG_DONE, handing every genetlink message to
+ * message_fn. Returns 0 or a negative errno, -EAGAIN if the kernel did not
+ * answer within GENL_RECV_TIMEOUT_MS. */
+static int genl_receive(int fd, void (*message_fn)(struct genlmsghdr *, int, gpointer), gpointer user_data)
+{
+	char *buf = g_malloc(GENL_BUFSIZE);
+	int ret = 0;
+
+	while (1) {
+		int len = recv(fd, buf, GENL_BUFSIZE, 0);
+		struct nlmsghdr *header;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+
+		for (header = (struct nlmsghdr *)buf; NLMSG_OK(header, (unsigned int)len);
+		     header = NLMSG_NEXT(header, len)) {
+			if (header->nlmsg_type == NLMSG_DONE)
+				goto out;
+
+			if (header->nlmsg_type == NLMSG_ERROR) {
+				struct nlmsgerr *err = NLMSG_DATA(header);
+				ret = err->error;
+				goto out;
+			}
+
+			message_fn(NLMSG_DATA(header), header->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN), user_data);
+		}
+	}
+
+ out:
+	g_free(buf);
+	return ret;
+}
+
+static void family_message(struct genlmsghdr *genl, int len, gpointer user_data)
+{
+	guint16 *family_id = user_data;
+	struct nlattr *nla;
+
+	for (nla = (struct nlattr *)((char *)genl + GENL_HDRLEN); NLA_OK(nla, len); nla = NLA_NEXT(nla, len)) {
+		if ((nla->nla_type & NLA_TYPE_MASK) == CTRL_ATTR_FAMILY_ID)
+			*family_id = *(guint16 *) NLA_DATA(nla);
+	}
+}
+
+/**
+ * Open a generic netlink socket and resolve the wireguard family. Reads
+ * from the socket time out after GENL_RECV_TIMEOUT_MS; after a timeout the
+ * socket may still receive the late reply, so close it.
+ *
+ * @param family_id  the resolved family id is stored here
+ * @return the socket, or -1 on error
+ */
+int wireguard_genl_open(guint16 * family_id)
+{
+	struct timeval timeout = { 0, GENL_RECV_TIMEOUT_MS * 1000 };
+	struct sockaddr_nl addr;
+	int fd;
+	int ret;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_GENERIC);
+	if (fd < 0) {
+		WN_ERR("Unable to open generic netlink socket: %s", strerror(errno));
+		return -1;
+	}
+
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout)) < 0) {
+		WN_ERR("Unable to set the generic netlink receive timeout: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		WN_ERR("Unable to bind generic netlink socket: %s", strerror(errno));
+		close(fd);
+		return -1;
+	}
+
+	*family_id = 0;
+	ret = genl_request(fd, GENL_ID_CTRL, CTRL_CMD_GETFAMILY, 1, 0,
+			   CTRL_ATTR_FAMILY_NAME, WG_GENL_NAME, sizeof(WG_GENL_NAME));
+	if (ret == 0)
+		ret = genl_receive(fd, family_message, family_id);
+
+	if (ret != 0 || *family_id == 0) {
+		WN_ERR("Unable to resolve the " WG_GENL_NAME " generic netlink family: %s", strerror(-ret));
+		close(fd);
+		return -1;
+	}
+
+	return fd;
+}
+
+struct device_dump {
+	wireguard_genl_peer_fn peer_fn;
+	gpointer user_data;
+};
+
+static void parse_peer(struct nlattr *peer_attr, struct device_dump *dump)
+{
+	wireguard_peer_info peer;
+	struct nlattr *nla;
+	int len = NLA_PAYLOAD(peer_attr);
+	gboolean have_key = FALSE;
+
+	memset(&peer, 0, sizeof(peer));
+
+	for (nla = NLA_DATA(peer_attr); NLA_OK(nla, len); nla = NLA_NEXT(nla, len)) {
+		switch (nla->nla_type & NLA_TYPE_MASK) {
+		case WGPEER_A_PUBLIC_KEY:
+			if (NLA_PAYLOAD(nla) == WG_KEY_LEN) {
+				memcpy(peer.public_key, NLA_DATA(nla), WG_KEY_LEN);
+				have_key = TRUE;
+			}
+			break;
+		case WGPEER_A_ENDPOINT:
+			if (NLA_PAYLOAD(nla) <= (int)sizeof(peer.endpoint))
+				memcpy(&peer.endpoint, NLA_DATA(nla), NLA_PAYLOAD(nla));
+			break;
+		case WGPEER_A_LAST_HANDSHAKE_TIME:
+			if (NLA_PAYLOAD(nla) == sizeof(struct __kernel_timespec))
+				peer.last_handshake = ((struct __kernel_timespec *)NLA_DATA(nla))->tv_sec;
+			break;
+		case WGPEER_A_RX_BYTES:
+			peer.rx_bytes = *(guint64 *) NLA_DATA(nla);
+			break;
+		case WGPEER_A_TX_BYTES:
+			peer.tx_bytes = *(guint64 *) NLA_DATA(nla);
+			break;
+		}
+	}
+
+	if (have_key)
+		dump->peer_fn(&peer, dump->user_data);
+}
+
+static void device_message(struct genlmsghdr *genl, int len, gpointer user_data)
+{
+	struct device_dump *dump = user_data;
+	struct nlattr *nla, *peer_attr;
+
+	for (nla = (struct nlattr *)((char *)genl + GENL_HDRLEN); NLA_OK(nla, len); nla = NLA_NEXT(nla, len)) {
+		int peers_len;
+
+		if ((nla->nla_type & NLA_TYPE_MASK) != WGDEVICE_A_PEERS)
+			continue;
+
+		peers_len = NLA_PAYLOAD(nla);
+		for (peer_attr = NLA_DATA(nla); NLA_OK(peer_attr, peers_len);
+		     peer_attr = NLA_NEXT(peer_attr, peers_len)) {
+			parse_peer(peer_attr, dump);
+		}
+	}
+}
+
+/**
+ * Dump a wireguard device with WG_CMD_GET_DEVICE. The kernel may split a peer
+ * over several messages (when it has many allowed ips), in which case
+ * peer_fn is called more than once with the same public key; the counters
+ * are only present in the first part.
+ *
+ * @param fd         socket from wireguard_genl_open()
+ * @param family_id  family id from wireguard_genl_open()
+ * @param ifname     wireguard interface name
+ * @param peer_fn    called for every peer
+ * @param user_data  passed to peer_fn
+ * @return 0 on success or a negative errno
+ */
+int wireguard_genl_get_device(int fd, guint16 family_id, const char *ifname,
+			      wireguard_genl_peer_fn peer_fn, gpointer user_data)
+{
+	struct device_dump dump = { peer_fn, user_data };
+	int ret;
+
+	ret = genl_request(fd, family_id, WG_CMD_GET_DEVICE, WG_GENL_VERSION, NLM_F_DUMP,
+			   WGDEVICE_A_IFNAME, ifname, strlen(ifname) + 1);
+	if (ret != 0)
+		return ret;
+
+	return genl_receive(fd, device_message, &dump);
+}
+
+static struct nlattr *nest_start(struct nlmsghdr *header, int type)
+{
+	struct nlattr *nest = (struct nlattr *)((char *)header + NLMSG_ALIGN(header->nlmsg_len));
+
+	nest->nla_type = type | NLA_F_NESTED;
+	header->nlmsg_len = NLMSG_ALIGN(header->nlmsg_len) + NLA_HDRLEN;
+
+	return nest;
+}
+
+static void nest_end(struct nlmsghdr *header, struct nlattr *nest)
+{
+	nest->nla_len = (char *)header + header->nlmsg_len - (char *)nest;
+}
+
+/* Fill in the WG_CMD_SET_DEVICE message adding count prefixes to a peer */
+static void build_allowed_ips(struct nlmsghdr *header, const char *ifname, const guint8 * public_key,
+			      const wireguard_prefix * prefixes, guint count)
+{
+	struct genlmsghdr *genl;
+	struct nlattr *peers, *peer, *allowed_ips;
+	guint32 flags = WGPEER_F_UPDATE_ONLY;
+	guint i;
+
+	header->nlmsg_len = NLMSG_LENGTH(GENL_HDRLEN);
+
+	genl = NLMSG_DATA(header);
+	genl->cmd = WG_CMD_SET_DEVICE;
+	genl->version = WG_GENL_VERSION;
+
+	put_attr(header, WGDEVICE_A_IFNAME, ifname, strlen(ifname) + 1);
+	peers = nest_start(header, WGDEVICE_A_PEERS);
+	peer = nest_start(header, 0);
+	put_attr(header, WGPEER_A_PUBLIC_KEY, public_key, WG_KEY_LEN);
+	put_attr(header, WGPEER_A_FLAGS, &flags, sizeof(flags));
+	allowed_ips = nest_start(header, WGPEER_A_ALLOWEDIPS);
+
+	for (i = 0; i < count; i++) {
+		struct nlattr *allowed_ip = nest_start(header, 0);
+		guint16 family = prefixes[i].family;
+		guint8 cidr = prefixes[i].len;
+
+		put_attr(header, WGALLOWEDIP_A_FAMILY, &family, sizeof(family));
+		put_attr(header, WGALLOWEDIP_A_IPADDR, prefixes[i].addr, family == AF_INET ? 4 : 16);
+		put_attr(header, WGALLOWEDIP_A_CIDR_MASK, &cidr, sizeof(cidr));
+		nest_end(header, allowed_ip);
+	}
+
+	nest_end(header, allowed_ips);
+	nest_end(header, peer);
+	nest_end(header, peers);
+}
+
+/**
+ * Add allowed ips to a peer with WG_CMD_SET_DEVICE, WIREGUARD_ALLOWED_IPS_CHUNK
+ * per message. The messages go out with the rest of the batch; one that
+ * fails is reported to its error callback with the first prefix of the
+ * message as item, and does not keep the others from being added. The peer
+ * keeps the ones it has; it is not created if it does not exist.
+ *
+ * @param batch       batch on a socket from wireguard_genl_open()
+ * @param family_id   family id from wireguard_genl_open()
+ * @param ifname      wireguard interface name
+ * @param public_key  the peer, WG_KEY_LEN bytes
+ * @param prefixes    allowed ips to add, must stay around until the batch
+ *                    is committed
+ * @param count       number of prefixes
+ */
+void wireguard_genl_add_allowed_ips(wireguard_nl_batch * batch, guint16 family_id, const char *ifname,
+				    const guint8 * public_key, const wireguard_prefix * prefixes, guint count)
+{
+	/* Every allowed ip is a nest of the family, the address and the mask */
+	size_t size = NLMSG_SPACE(GENL_HDRLEN) + NLA_SPACE(IFNAMSIZ) + 3 * NLA_HDRLEN + NLA_SPACE(WG_KEY_LEN)
+	    + NLA_SPACE(sizeof(guint32)) + WIREGUARD_ALLOWED_IPS_CHUNK * (NLA_HDRLEN + NLA_SPACE(sizeof(guint16))
+									  + NLA_SPACE(16) + NLA_SPACE(sizeof(guint8)));
+	guint first;
+
+	for (first = 0; first < count; first += WIREGUARD_ALLOWED_IPS_CHUNK) {
+		gpointer item = (gpointer) & prefixes[first];
+
+		if (strlen(ifname) >= IFNAMSIZ) {
+			wireguard_nl_batch_fail(batch, item, family_id, -EINVAL);
+			continue;
+		}
+
+		build_allowed_ips(wireguard_nl_batch_add(batch, family_id, 0, size, item), ifname, public_key,
+				  prefixes + first, MIN(WIREGUARD_ALLOWED_IPS_CHUNK, count - first));
+	}
+}
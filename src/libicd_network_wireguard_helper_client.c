@@ -0,0 +1,410 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+/*
+ * Our side of icd-wireguard-helper. It is started on first use and writes
+ * configs and runs wg-quick for us, so icd2 spawns nothing on the connect
+ * path. Its requests stand in for wg-quick pids in wireguard_op, negated so
+ * they never clash with real ones, and their answers are handled like a
+ * child exit. If it is not installed wg-quick is spawned as before, and if
+ * it dies what it ran is reported as failed.
+ */
+
+#include "libicd_network_wireguard.h"
+
+#include <sys/wait.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+/* Status of what the helper ran when it is gone */
+#define HELPER_LOST_STATUS W_EXITCODE(255, 0)
+
+static gboolean input_cb(GIOChannel * channel, GIOCondition condition, gpointer user_data);
+static gboolean output_cb(GIOChannel * channel, GIOCondition condition, gpointer user_data);
+
+static int helper_start(network_wireguard_private * private)
+{
+	wireguard_helper *helper = &private->helper;
+	char *args[] = { WIREGUARD_HELPER_PATH, NULL };
+	int fds[2];
+	pid_t pid;
+
+	if (access(WIREGUARD_HELPER_PATH, X_OK) < 0) {
+		WN_INFO("No " WIREGUARD_HELPER_PATH ", running wg-quick ourselves\n");
+		helper->unavailable = TRUE;
+		return 1;
+	}
+
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0) {
+		WN_WARN("Unable to create a socket for the helper: %s\n", strerror(errno));
+		return 1;
+	}
+
+	pid = spawn_as_with_input(private, "root", WIREGUARD_HELPER_PATH, args, fds[1]);
+	close(fds[1]);
+	if (pid == 0) {
+		close(fds[0]);
+		helper->unavailable = TRUE;
+		return 1;
+	}
+
+	WN_INFO("Started " WIREGUARD_HELPER_PATH " %d\n", pid);
+	private->watch_cb(pid, private->watch_cb_token);
+
+	/* A config can be large and the helper busy, the main loop must not
+	 * wait for it */
+	fcntl(fds[0], F_SETFL, fcntl(fds[0], F_GETFL) | O_NONBLOCK);
+
+	helper->pid = pid;
+	helper->channel = g_io_channel_unix_new(fds[0]);
+	g_io_channel_set_close_on_unref(helper->channel, TRUE);
+	helper->watch = g_io_add_watch(helper->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, input_cb, private);
+	if (helper->input == NULL) {
+		helper->input = g_byte_array_new();
+		helper->output = g_byte_array_new();
+		helper->running = g_array_new(FALSE, FALSE, sizeof(guint32));
+	}
+
+	return 0;
+}
+
+static void helper_close(wireguard_helper * helper)
+{
+	if (helper->watch)
+		g_source_remove(helper->watch);
+	helper->watch = 0;
+	if (helper->output_watch)
+		g_source_remove(helper->output_watch);
+	helper->output_watch = 0;
+	if (helper->channel)
+		g_io_channel_unref(helper->channel);
+	helper->channel = NULL;
+	if (helper->input)
+		g_byte_array_set_size(helper->input, 0);
+	if (helper->output)
+		g_byte_array_set_size(helper->output, 0);
+}
+
+/* Stop running request id, TRUE if it was */
+static gboolean forget_running(wireguard_helper * helper, guint32 id)
+{
+	guint i;
+
+	for (i = 0; i < helper->running->len; i++) {
+		if (g_array_index(helper->running, guint32, i) == id) {
+			g_array_remove_index_fast(helper->running, i);
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* The helper is gone, and with it what it was running as far as we know.
+ * May be called while an op starts, so it leaves reaping tunnels to the
+ * caller. */
+static void helper_lost(network_wireguard_private * private)
+{
+	wireguard_helper *helper = &private->helper;
+
+	WN_WARN("Lost " WIREGUARD_HELPER_PATH ", %u wg-quick runs with it\n", helper->running->len);
+	helper_close(helper);
+
+	while (helper->running->len) {
+		guint32 id = g_array_index(helper->running, guint32, 0);
+
+		g_array_remove_index_fast(helper->running, 0);
+		wireguard_tunnel_child_exit(private, -(pid_t) id, HELPER_LOST_STATUS);
+	}
+}
+
+/* The tunnel a message is about, NULL if it is none of ours */
+static wireguard_tunnel *msg_tunnel(network_wireguard_private * private, const struct wireguard_helper_msg *msg)
+{
+	char interface[sizeof(msg->interface) + 1];
+
+	memcpy(interface, msg->interface, sizeof(msg->interface));
+	interface[sizeof(msg->interface)] = '\0';
+
+	return wireguard_tunnel_by_interface(private, interface);
+}
+
+static void handle_answer(network_wireguard_private * private, const struct wireguard_helper_msg *msg)
+{
+	wireguard_tunnel *tunnel;
+
+	if (msg->type == WIREGUARD_HELPER_CONFIGURE || msg->type == WIREGUARD_HELPER_STARTED) {
+		if (msg->type == WIREGUARD_HELPER_CONFIGURE && msg->value != 0) {
+			WN_WARN("%.16s: helper could not write the config: %s\n", msg->interface,
+				strerror(msg->value));
+		}
+
+		tunnel = msg_tunnel(private, msg);
+		if (tunnel)
+			wireguard_timing_helper_done(tunnel, msg->type == WIREGUARD_HELPER_CONFIGURE ?
+						     WIREGUARD_TIMING_WRITE_CONFIG : WIREGUARD_TIMING_SPAWN,
+						     -(pid_t) msg->id);
+		return;
+	}
+
+	if (!forget_running(&private->helper, msg->id)) {
+		WN_ERR("Helper answered request %u, which it does not run\n", msg->id);
+		return;
+	}
+
+	wireguard_tunnel_child_exit(private, -(pid_t) msg->id, msg->value);
+}
+
+static gboolean input_cb(GIOChannel * channel, GIOCondition condition, gpointer user_data)
+{
+	network_wireguard_private *private = user_data;
+	GByteArray *input = private->helper.input;
+	guint8 buf[4096];
+	ssize_t len;
+
+	len = read(g_io_channel_unix_get_fd(channel), buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return TRUE;
+	if (len <= 0) {
+		private->helper.watch = 0;
+		helper_lost(private);
+		wireguard_tunnels_reap(private);
+		return FALSE;
+	}
+
+	g_byte_array_append(input, buf, len);
+	while (input->len >= sizeof(struct wireguard_helper_msg)) {
+		struct wireguard_helper_msg msg;
+
+		/* Answers never have a payload */
+		memcpy(&msg, input->data, sizeof(msg));
+		g_byte_array_remove_range(input, 0, sizeof(msg));
+		handle_answer(private, &msg);
+	}
+	wireguard_tunnels_reap(private);
+
+	return TRUE;
+}
+
+/* Send what the socket takes of the queued requests, and wait for room for
+ * the rest. FALSE if the helper is lost. */
+static gboolean flush_output(network_wireguard_private * private)
+{
+	wireguard_helper *helper = &private->helper;
+	GByteArray *output = helper->output;
+	gsize sent = 0;
+
+	while (sent < output->len) {
+		ssize_t ret = send(g_io_channel_unix_get_fd(helper->channel), output->data + sent, output->len - sent,
+				   MSG_NOSIGNAL);
+
+		if (ret < 0 && errno == EINTR)
+			continue;
+		if (ret < 0 && errno == EAGAIN)
+			break;
+		if (ret < 0) {
+			WN_WARN("Unable to talk to the helper: %s\n", strerror(errno));
+			helper_lost(private);
+			return FALSE;
+		}
+		sent += ret;
+	}
+
+	g_byte_array_remove_range(output, 0, sent);
+	if (output->len && helper->output_watch == 0)
+		helper->output_watch = g_io_add_watch(helper->channel, G_IO_OUT, output_cb, private);
+
+	return TRUE;
+}
+
+static gboolean output_cb(GIOChannel * channel, GIOCondition condition, gpointer user_data)
+{
+	WG_PROFILE();
+	network_wireguard_private *private = user_data;
+
+	/* flush_output() watches again if there is more */
+	private->helper.output_watch = 0;
+	if (!flush_output(private))
+		wireguard_tunnels_reap(private);
+
+	return FALSE;
+}
+
+/* Queue the requests in out, starting the helper first if needed */
+static gboolean send_requests(network_wireguard_private * private, const GByteArray * out)
+{
+	wireguard_helper *helper = &private->helper;
+
+	if (helper->channel == NULL && (helper->unavailable || helper->pid != 0 || helper_start(private) != 0))
+		return FALSE;
+
+	g_byte_array_append(helper->output, out->data, out->len);
+
+	return helper->output_watch != 0 || flush_output(private);
+}
+
+static void add_request(GByteArray * out, enum wireguard_helper_type type, guint32 id, gint32 value,
+			const char *interface, const char *payload, gsize length)
+{
+	struct wireguard_helper_msg msg;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.type = type;
+	msg.id = id;
+	msg.value = value;
+	msg.length = length;
+	if (interface)
+		strncpy(msg.interface, interface, sizeof(msg.interface) - 1);
+
+	g_byte_array_append(out, (const guint8 *)&msg, sizeof(msg));
+	if (length)
+		g_byte_array_append(out, (const guint8 *)payload, length);
+}
+
+static guint32 next_id(wireguard_helper * helper)
+{
+	/* Negated it has to be a valid pid_t */
+	if (helper->next_id == 0 || helper->next_id >= G_MAXINT32)
+		helper->next_id = 1;
+
+	return helper->next_id++;
+}
+
+/* Run wg-quick type, after writing config if it is not NULL */
+static pid_t run(wireguard_tunnel * tunnel, enum wireguard_helper_type type, const char *config)
+{
+	wireguard_helper *helper = &tunnel->private->helper;
+	GByteArray *out = g_byte_array_new();
+	guint32 id = next_id(helper);
+	gboolean sent;
+
+	if (config)
+		add_request(out, WIREGUARD_HELPER_CONFIGURE, next_id(helper), 0, tunnel->interface_name, config,
+			    strlen(config));
+	add_request(out, type, id, 0, tunnel->interface_name, NULL, 0);
+
+	sent = send_requests(tunnel->private, out);
+	g_byte_array_free(out, TRUE);
+	if (!sent)
+		return 0;
+
+	g_array_append_val(helper->running, id);
+
+	return -(pid_t) id;
+}
+
+/**
+ * Have the helper write config for the tunnel and bring it up, one request
+ * right after the other.
+ *
+ * @param tunnel  the tunnel
+ * @param config  contents of its config file
+ * @return what stands in for the wg-quick pid, 0 if the helper is not
+ *         available and wg-quick should be spawned directly
+ */
+pid_t wireguard_helper_up(wireguard_tunnel * tunnel, const char *config)
+{
+	return run(tunnel, WIREGUARD_HELPER_UP, config);
+}
+
+/* Like wireguard_helper_up(), for wg-quick down */
+pid_t wireguard_helper_down(wireguard_tunnel * tunnel)
+{
+	return run(tunnel, WIREGUARD_HELPER_DOWN, NULL);
+}
+
+/* Send a request about a running wg-quick, which is not answered */
+static gboolean signal_run(network_wireguard_private * private, enum wireguard_helper_type type, pid_t pid)
+{
+	GByteArray *out;
+	gboolean sent;
+
+	if (pid >= 0 || private->helper.channel == NULL)
+		return FALSE;
+
+	out = g_byte_array_new();
+	add_request(out, type, next_id(&private->helper), -pid, NULL, NULL, 0);
+	sent = send_requests(private, out);
+	g_byte_array_free(out, TRUE);
+
+	return sent;
+}
+
+/**
+ * Stop a wg-quick the helper runs, its exit is still reported. Does nothing
+ * for one we spawned ourselves.
+ *
+ * @param private  network module private data
+ * @param pid      from wireguard_helper_up() or wireguard_helper_down()
+ * @return TRUE if the helper was asked to stop it
+ */
+gboolean wireguard_helper_cancel(network_wireguard_private * private, pid_t pid)
+{
+	return signal_run(private, WIREGUARD_HELPER_CANCEL, pid);
+}
+
+/* Like wireguard_helper_cancel(), with SIGKILL rather than SIGTERM */
+gboolean wireguard_helper_kill(network_wireguard_private * private, pid_t pid)
+{
+	return signal_run(private, WIREGUARD_HELPER_KILL, pid);
+}
+
+/**
+ * icd2 reaped a child, tell if it was the helper.
+ *
+ * @param private      network module private data
+ * @param pid          the process that exited
+ * @param exit_status  its exit status
+ * @return TRUE if it was the helper
+ */
+gboolean wireguard_helper_child_exit(network_wireguard_private * private, pid_t pid, gint exit_status)
+{
+	wireguard_helper *helper = &private->helper;
+
+	if (pid == 0 || pid != helper->pid)
+		return FALSE;
+
+	WN_INFO(WIREGUARD_HELPER_PATH " %d exited with %d\n", pid, exit_status);
+	helper->pid = 0;
+	if (helper->channel)
+		helper_lost(private);
+
+	return TRUE;
+}
+
+/* Close our end, the helper exits once it sees that */
+void wireguard_helper_free(network_wireguard_private * private)
+{
+	wireguard_helper *helper = &private->helper;
+
+	helper_close(helper);
+	if (helper->input)
+		g_byte_array_free(helper->input, TRUE);
+	if (helper->output)
+		g_byte_array_free(helper->output, TRUE);
+	if (helper->running)
+		g_array_free(helper->running, TRUE);
+	helper->input = NULL;
+	helper->output = NULL;
+	helper->running = NULL;
+}
@@ -21,6 +21,9 @@
 
 #include "libicd_network_wireguard.h"
 
+#include <errno.h>
+#include <unistd.h>
+
 /* XXX: Taken from ipv4 module */
 gboolean string_equal(const char *a, const char *b)
 {
@@ -33,86 +36,46 @@ gboolean string_equal(const char *a, const char *b)
 	return FALSE;
 }
 
-wireguard_network_data *icd_wireguard_find_first_network_data(network_wireguard_private * private)
+/* write() all of data, returns 0 or a negative errno */
+int wireguard_write_all(int fd, const void *data, size_t len)
 {
-	GSList *l;
+	const char *p = data;
 
-	for (l = private->network_data_list; l; l = l->next) {
-		wireguard_network_data *found = (wireguard_network_data *) l->data;
+	while (len) {
+		ssize_t ret = write(fd, p, len);
 
-		if (!found)
-			WN_WARN("wireguard network data is NULL");
-		else {
-			return found;
+		if (ret < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
 		}
+		p += ret;
+		len -= ret;
 	}
 
-	return NULL;
+	return 0;
 }
 
 wireguard_network_data *icd_wireguard_find_network_data(const gchar * network_type,
 							guint network_attrs,
 							const gchar * network_id, network_wireguard_private * private)
 {
-	GSList *l;
-
-	for (l = private->network_data_list; l; l = l->next) {
-		wireguard_network_data *found = (wireguard_network_data *) l->data;
-
-		if (!found)
-			WN_WARN("wireguard network data is NULL");
-		else {
-			if (found->network_attrs == network_attrs &&
-			    string_equal(found->network_type, network_type) &&
-			    string_equal(found->network_id, network_id)) {
-				return found;
-			}
-		}
-	}
+	wireguard_tunnel *tunnel = g_hash_table_lookup(private->tunnels_by_iap, network_id);
+	wireguard_network_data *found;
 
-	return NULL;
-}
-
-/* pathname and arg are like in execv, returns pid, 0 is error */
-pid_t spawn_as(const char *username, const char *pathname, char *args[])
-{
-	struct passwd *ent = getpwnam(username);
-	if (ent == NULL) {
-		WN_CRIT("spawn_as: getpwnam failed\n");
-		return 0;
-	}
-
-	pid_t pid = fork();
-	if (pid < 0) {
-		WN_CRIT("spawn_as: fork() failed\n");
-		return 0;
-	} else if (pid == 0) {
-		if (setgid(ent->pw_gid)) {
-			WN_CRIT("setgid failed\n");
-			exit(1);
-		}
-		if (setuid(ent->pw_uid)) {
-			WN_CRIT("setuid failed\n");
-			exit(1);
-		}
-		execv(pathname, args);
+	if (tunnel == NULL)
+		return NULL;
 
-		WN_CRIT("execv failed\n");
-		exit(1);
-	} else {
-		WN_DEBUG("spawn_as got pid: %d\n", pid);
-		return pid;
-	}
+	found = tunnel->network_data;
+	if (found->network_attrs == network_attrs && string_equal(found->network_type, network_type))
+		return found;
 
-	return 0;		// Failure
+	return NULL;
 }
 
 void network_free_all(wireguard_network_data * network_data)
 {
-	network_wireguard_private *priv = network_data->private;
-	if (priv->network_data_list) {
-		priv->network_data_list = g_slist_remove(priv->network_data_list, network_data);
-	}
+	wireguard_tunnel_detach(network_data);
 
 	g_free(network_data->network_type);
 	g_free(network_data->network_id);
@@ -122,46 +85,112 @@ void network_free_all(wireguard_network_data * network_data)
 	g_free(network_data);
 }
 
-void network_stop_all(wireguard_network_data * network_data)
+/* Write the config and spawn wg-quick up, returns its pid or 0 on error */
+pid_t startup_wireguard(wireguard_tunnel * tunnel, const char *config)
 {
-	char *argss[] = { "/usr/bin/wg-quick", "down", "icdwg0", NULL };
-	pid_t pid = spawn_as("root", "/usr/bin/wg-quick", argss);
-	if (pid == 0) {
-		WN_WARN("Failed to attempt to stop Wireguard\n");
-		return;
+	GError *error = NULL;
+
+	wireguard_timing_begin(tunnel);
+
+	/* Checked when it last changed, it is no use trying */
+	const wireguard_config_verdict *verdict = wireguard_config_checks_get(tunnel->private, config);
+	if (verdict && verdict->error) {
+		gchar *error = g_strdup_printf("Invalid config %s: %s", config, verdict->error);
+
+		WN_WARN("%s\n", error);
+		wireguard_set_last_error(tunnel, error);
+		g_free(error);
+		return 0;
 	}
-}
 
-int startup_wireguard(wireguard_network_data * network_data, char *config)
-{
-	const char *config_filename = "/etc/wireguard/icdwg0.conf";
-	GError *error = NULL;
+	gchar *invalid = NULL;
+	char *config_content = wireguard_config_generate(config, &invalid);
 
-	char *config_content = generate_config(config);
+	/* Pushed and routed by us once the interface is up, wg-quick would
+	 * not route them */
+	g_slist_free_full(tunnel->prefix_files, (GDestroyNotify) wireguard_prefix_file_free);
+	tunnel->prefix_files = get_config_prefix_files(config);
 
+	tunnel->multipath = get_multipath_enabled();
+	tunnel->routed = tunnel->multipath || tunnel->prefix_files || get_policy_routing_enabled();
+	if (config_content && tunnel->routed) {
+		gchar *excludes = get_config_excludes(config);
+		gchar *routed = wireguard_routing_config(tunnel, config_content, excludes);
+
+		g_free(excludes);
+		free(config_content);
+		config_content = routed;
+	}
+	wireguard_timing_phase_done(tunnel, WIREGUARD_TIMING_GENERATE_CONFIG);
+
+	if (invalid) {
+		gchar *error = g_strdup_printf("Invalid config %s: %s", config, invalid);
+
+		WN_WARN("%s\n", error);
+		wireguard_set_last_error(tunnel, error);
+		g_free(error);
+		g_free(invalid);
+		return 0;
+	}
 	if (!config_content) {
 		WN_WARN("Unable to generate config\n");
-		return 1;
+		wireguard_set_last_error(tunnel, "Unable to generate config");
+		return 0;
+	}
+
+	/* The helper writes the config and runs wg-quick for us */
+	pid_t pid = wireguard_helper_up(tunnel, config_content);
+	if (pid != 0) {
+		free(config_content);
+		/* Timed by its answers instead */
+		wireguard_timing_helper_queued(tunnel, pid);
+		WN_INFO("wg-quick up for %s is helper request %d\n", tunnel->interface_name, -pid);
+		return pid;
 	}
 
-	g_file_set_contents(config_filename, config_content, strlen(config_content), &error);
+	g_file_set_contents(tunnel->config_path, config_content, strlen(config_content), &error);
 	free(config_content);
+	wireguard_timing_phase_done(tunnel, WIREGUARD_TIMING_WRITE_CONFIG);
 	if (error != NULL) {
 		g_clear_error(&error);
 		WN_WARN("Unable to write Wireguard config file\n");
-		return 1;
+		wireguard_set_last_error(tunnel, "Unable to write Wireguard config file");
+		return 0;
 	}
 
-	char *argss[] = { "/usr/bin/wg-quick", "up", "icdwg0", NULL };
-	pid_t pid = spawn_as("root", "/usr/bin/wg-quick", argss);
+	char *argss[] = { "/usr/bin/wg-quick", "up", tunnel->interface_name, NULL };
+	pid = spawn_as(tunnel->private, "root", "/usr/bin/wg-quick", argss);
+	wireguard_timing_phase_done(tunnel, WIREGUARD_TIMING_SPAWN);
 	if (pid == 0) {
 		WN_WARN("Failed to start Wireguard\n");
-		return 1;
+		wireguard_set_last_error(tunnel, "Failed to start wg-quick");
+		return 0;
 	}
 
-	WN_INFO("Got wg_quick_pid: %d\n", pid);
-	network_data->wg_quick_pid = pid;
-	network_data->private->watch_cb(pid, network_data->private->watch_cb_token);
+	WN_INFO("Got wg_quick_pid for %s: %d\n", tunnel->interface_name, pid);
+	tunnel->private->watch_cb(pid, tunnel->private->watch_cb_token);
 
-	return 0;
+	return pid;
+}
+
+/* wg-quick down cleans up whatever wg-quick up left behind, also when it
+ * failed. Returns its pid, 0 if it could not be started. */
+pid_t shutdown_wireguard(wireguard_tunnel * tunnel)
+{
+	char *argss[] = { "/usr/bin/wg-quick", "down", tunnel->interface_name, NULL };
+	pid_t pid = wireguard_helper_down(tunnel);
+
+	if (pid != 0) {
+		WN_INFO("wg-quick down for %s is helper request %d\n", tunnel->interface_name, -pid);
+		return pid;
+	}
+
+	pid = spawn_as(tunnel->private, "root", "/usr/bin/wg-quick", argss);
+	if (pid == 0)
+		return 0;
+
+	WN_INFO("Got wg-quick down pid for %s: %d\n", tunnel->interface_name, pid);
+	tunnel->private->watch_cb(pid, tunnel->private->watch_cb_token);
+
+	return pid;
 }
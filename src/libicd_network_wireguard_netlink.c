@@ -29,6 +29,28 @@
 #include <linux/rtnetlink.h>
 #include <net/if.h>
 #include <errno.h>
+#include <unistd.h>
+
+/* Copy IFLA_IFNAME into name (IF_NAMESIZE bytes), the kernel always sends it
+ * and unlike if_indextoname() it still works when the link is already gone */
+static gboolean link_name(struct nlmsghdr *header, char *name)
+{
+	struct rtattr *rta;
+	int len = IFLA_PAYLOAD(header);
+
+	for (rta = IFLA_RTA(NLMSG_DATA(header)); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			size_t size = MIN(RTA_PAYLOAD(rta), IF_NAMESIZE - 1);
+
+			/* Don't trust the attribute to be terminated */
+			memcpy(name, RTA_DATA(rta), size);
+			name[size] = '\0';
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
 
 static int read_event(int sockint, char **iface_name, int *iface_status, int *iface_index)
 {
@@ -44,6 +66,7 @@ static int read_event(int sockint, char **iface_name, int *iface_status, int *if
 	struct msghdr msg = { (void *)&snl, sizeof snl, &iov, 1, NULL, 0, 0 };
 
 	status = recvmsg(sockint, &msg, 0);
+	WG_TRACE2(netlink_receive, sockint, status);
 
 	if (status < 0) {
 		if (errno == EWOULDBLOCK || errno == EAGAIN) {
@@ -59,6 +82,8 @@ static int read_event(int sockint, char **iface_name, int *iface_status, int *if
 
 	for (header = (struct nlmsghdr *)buf; NLMSG_OK(header, (unsigned int)status);
 	     header = NLMSG_NEXT(header, status)) {
+		WG_TRACE2(netlink_message, header->nlmsg_type, header->nlmsg_len);
+
 		if (header->nlmsg_type == NLMSG_DONE)
 			return ret;
 
@@ -66,14 +91,20 @@ static int read_event(int sockint, char **iface_name, int *iface_status, int *if
 			return -1;
 		}
 
-		if (header->nlmsg_type == RTM_NEWLINK) {
+		if (header->nlmsg_type == RTM_NEWLINK || header->nlmsg_type == RTM_DELLINK) {
+			if (header->nlmsg_len < NLMSG_LENGTH(sizeof(*info)))
+				continue;
+
 			info = NLMSG_DATA(header);
 
+			/* A deleted link is not running, whatever its flags say */
 			*iface_index = info->ifi_index;
-			*iface_status = (info->ifi_flags & IFF_RUNNING) ? 1 : 0;
+			*iface_status = header->nlmsg_type == RTM_NEWLINK && (info->ifi_flags & IFF_RUNNING) ? 1 : 0;
+			WG_TRACE2(netlink_newlink, info->ifi_index, *iface_status);
 
+			free(*iface_name);
 			*iface_name = malloc(IF_NAMESIZE);
-			if (if_indextoname(info->ifi_index, *iface_name) == 0) {
+			if (!link_name(header, *iface_name) && if_indextoname(info->ifi_index, *iface_name) == 0) {
 				WN_INFO("if_indextoname failed");
 				free(*iface_name);
 				*iface_name = NULL;
@@ -88,6 +119,7 @@ static int read_event(int sockint, char **iface_name, int *iface_status, int *if
 
 static gboolean netlink_cb(GIOChannel * chan, GIOCondition cond, gpointer data)
 {
+	WG_PROFILE();
 	network_wireguard_private *priv = data;
 
 	int fd;
@@ -101,41 +133,39 @@ static gboolean netlink_cb(GIOChannel * chan, GIOCondition cond, gpointer data)
 	 * read_event */
 	while (1) {
 		int ret = read_event(fd, &iface, &state, &index);
+		wireguard_tunnel *tunnel;
 
 		/* Sometimes we cannot get the interface name since it is already gone
 		 * (at least with if_indextoname, so we remember the index and use that.
 		 * */
-		if (state == 0 && index == priv->state.wireguard_interface_index && priv->state.wireguard_interface_up) {
-			network_wireguard_state new_state;
-			memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-			new_state.wireguard_interface_up = FALSE;
-			new_state.wireguard_interface_index = -1;
-			new_state.wireguard_running = FALSE;
-			wireguard_state_change(priv, NULL, new_state, EVENT_SOURCE_WIREGUARD_DOWN);
+		if (state == 0 && (tunnel = wireguard_tunnel_by_index(priv, index)) != NULL) {
+			wireguard_event event = { .source = EVENT_SOURCE_WIREGUARD_DOWN, .tunnel = tunnel };
+			wireguard_state_post(priv, &event);
 
 		} else if (iface) {
 			WN_DEBUG("iface: %s (%d), status: %d", iface, index, state);
 
-			if (strcmp("icdwg0", iface) == 0) {
-				WN_DEBUG("wireguard_interface_up: %d", priv->state.wireguard_interface_up);
+			tunnel = wireguard_tunnel_by_interface(priv, iface);
+			if (tunnel) {
+				WN_DEBUG("wireguard_interface_up: %d", tunnel->state.wireguard_interface_up);
 
 				/* We check for the wireguard up state here, because I have not
 				 * figured out how to differentiate between interface created
 				 * and interface down, and when we go up, we get created (which
 				 * I see as down) and then up. */
 				if (state == 1) {
-					network_wireguard_state new_state;
-					memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-					new_state.wireguard_interface_up = TRUE;
-					new_state.wireguard_interface_index = index;
-					wireguard_state_change(priv, NULL, new_state, EVENT_SOURCE_WIREGUARD_UP);
-				} else if (state == 0 && priv->state.wireguard_interface_up) {
-					network_wireguard_state new_state;
-					memcpy(&new_state, &priv->state, sizeof(network_wireguard_state));
-					new_state.wireguard_interface_up = FALSE;
-					new_state.wireguard_interface_index = -1;
-					new_state.wireguard_running = FALSE;
-					wireguard_state_change(priv, NULL, new_state, EVENT_SOURCE_WIREGUARD_DOWN);
+					wireguard_event event = {
+						.source = EVENT_SOURCE_WIREGUARD_UP,
+						.tunnel = tunnel,
+						.interface_index = index,
+					};
+					wireguard_state_post(priv, &event);
+				} else if (state == 0 && tunnel->state.wireguard_interface_up) {
+					wireguard_event event = {
+						.source = EVENT_SOURCE_WIREGUARD_DOWN,
+						.tunnel = tunnel,
+					};
+					wireguard_state_post(priv, &event);
 				}
 			}
 
@@ -143,7 +173,7 @@ static gboolean netlink_cb(GIOChannel * chan, GIOCondition cond, gpointer data)
 			iface = NULL;
 		}
 
-		if (!ret)
+		if (ret <= 0)
 			break;
 
 	}
@@ -151,17 +181,21 @@ static gboolean netlink_cb(GIOChannel * chan, GIOCondition cond, gpointer data)
 	return TRUE;
 }
 
-int open_netlink_listener(void *user_data)
+/**
+ * Open the rtnetlink socket and start listening for link changes.
+ *
+ * @param private  network module private data
+ * @return 0 on success, -1 on error
+ */
+int open_netlink_listener(network_wireguard_private * private)
 {
-	GIOChannel *io;
-
 	struct sockaddr_nl addr;
 	int fd;
-	int event_id;
 
-	fd = socket(AF_NETLINK, SOCK_RAW, NETLINK_ROUTE);
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
 	if (fd < 0) {
-		/* TODO: socket creation failed */
+		WN_ERR("Unable to open rtnetlink socket: %s", strerror(errno));
+		return -1;
 	}
 
 	memset(&addr, 0, sizeof(addr));
@@ -169,21 +203,44 @@ int open_netlink_listener(void *user_data)
 	addr.nl_groups = RTMGRP_LINK;
 
 	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
-		/* TODO: bind() failed */
+		WN_ERR("Unable to bind rtnetlink socket: %s", strerror(errno));
+		close(fd);
+		return -1;
 	}
 
-	// TODO: when do we free addr here?
+	netlink_listener_attach(private, fd);
 
-	io = g_io_channel_unix_new(fd);
-	event_id = g_io_add_watch(io, G_IO_IN | G_IO_ERR | G_IO_HUP, netlink_cb, user_data);
+	return 0;
+}
 
-	(void)event_id;
+/**
+ * Listen for link changes on an already opened socket, which the listener
+ * takes ownership of. Any previous socket is closed. Besides
+ * open_netlink_listener(), the test harness uses this to feed recorded or
+ * synthetic rtnetlink messages through a socketpair.
+ *
+ * @param private  network module private data
+ * @param fd       socket that delivers rtnetlink messages
+ */
+void netlink_listener_attach(network_wireguard_private * private, int fd)
+{
+	close_netlink_listener(private);
 
-	// TODO
-	return 0;
+	private->netlink_channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(private->netlink_channel, TRUE);
+	private->netlink_watch = g_io_add_watch(private->netlink_channel, G_IO_IN | G_IO_ERR | G_IO_HUP,
+						netlink_cb, private);
 }
 
-void close_netlink_listener(void)
+void close_netlink_listener(network_wireguard_private * private)
 {
-	// TODO, unregister monitor, free GIOChannel, close socket, remove event_id
+	if (private->netlink_watch != 0) {
+		g_source_remove(private->netlink_watch);
+		private->netlink_watch = 0;
+	}
+
+	if (private->netlink_channel != NULL) {
+		g_io_channel_unref(private->netlink_channel);
+		private->netlink_channel = NULL;
+	}
 }
@@ -0,0 +1,368 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * wg-quick runs. Only one runs at a time per tunnel; what is asked for in the
+ * meantime is queued, and an up and a down that are both still queued cancel
+ * out, so once the running one exits only the last requested state is acted
+ * on.
+ *
+ * A run that overruns GC_WIREGUARD_OP_TIMEOUT gets SIGTERM, then SIGKILL,
+ * and if it still did not exit after that we delete its interface and carry
+ * on as if it failed, so nothing waits on a wg-quick that hangs.
+ */
+
+#include "libicd_network_wireguard.h"
+
+#include <signal.h>
+
+static const char *op_names[] = {
+	[WIREGUARD_OP_UP] = "up",
+	[WIREGUARD_OP_DOWN] = "down",
+};
+
+static void op_free(wireguard_op * op)
+{
+	if (op->watchdog)
+		g_source_remove(op->watchdog);
+	g_free(op->config);
+	g_free(op);
+}
+
+/* The state the tunnel ends up in once everything queued ran, NULL if
+ * nothing runs or is queued */
+static wireguard_op *last_op(wireguard_tunnel * tunnel)
+{
+	wireguard_op *op = g_queue_peek_tail(&tunnel->ops);
+
+	return op ? op : tunnel->op_running;
+}
+
+/* Drop the last queued operation if it is of the given type */
+static gboolean cancel_queued(wireguard_tunnel * tunnel, enum wireguard_op_type type)
+{
+	wireguard_op *op = g_queue_peek_tail(&tunnel->ops);
+
+	if (op == NULL || op->type != type)
+		return FALSE;
+
+	WN_INFO("Cancelled queued wg-quick %s\n", op_names[type]);
+	op_free(g_queue_pop_tail(&tunnel->ops));
+
+	return TRUE;
+}
+
+static wireguard_op *op_new(enum wireguard_op_type type, wireguard_network_data * network_data, const char *config)
+{
+	wireguard_op *op = g_new0(wireguard_op, 1);
+
+	op->type = type;
+	op->network_data = network_data;
+	op->config = g_strdup(config);
+
+	return op;
+}
+
+static gboolean watchdog_cb(gpointer user_data);
+
+/* Time the running op gets until the watchdog fires next */
+static void arm_watchdog(wireguard_tunnel * tunnel, guint seconds)
+{
+	tunnel->op_running->watchdog = g_timeout_add(seconds * 1000, watchdog_cb, tunnel);
+}
+
+/* Spawn op, returns 0 on success */
+static int start_op(wireguard_tunnel * tunnel, wireguard_op * op)
+{
+	if (op->type == WIREGUARD_OP_UP) {
+		op->pid = startup_wireguard(tunnel, op->config);
+		if (op->pid == 0)
+			return 1;
+		op->network_data->wg_quick_pid = op->pid;
+	} else {
+		op->pid = shutdown_wireguard(tunnel);
+		if (op->pid == 0)
+			return 1;
+	}
+
+	/* The IAP may be gone by the time it exits, child exit looks it up
+	 * by pid */
+	op->network_data = NULL;
+	tunnel->op_running = op;
+
+	op->timeout = get_op_timeout();
+	if (op->timeout)
+		arm_watchdog(tunnel, op->timeout);
+
+	return 0;
+}
+
+/* Start op right away if nothing is running, so the caller sees it fail,
+ * queue it otherwise. Returns 0 if it runs or is queued. */
+static int submit_op(wireguard_tunnel * tunnel, wireguard_op * op)
+{
+	if (tunnel->op_running == NULL && g_queue_is_empty(&tunnel->ops)) {
+		if (start_op(tunnel, op) == 0)
+			return 0;
+
+		op_free(op);
+		return 1;
+	}
+
+	g_queue_push_tail(&tunnel->ops, op);
+	WN_INFO("Queued wg-quick %s, %u queued\n", op_names[op->type], g_queue_get_length(&tunnel->ops));
+
+	return 0;
+}
+
+/* Start queued operations until one is running */
+static void run_queued(wireguard_tunnel * tunnel)
+{
+	wireguard_op *op;
+
+	while (tunnel->op_running == NULL && (op = g_queue_pop_head(&tunnel->ops))) {
+		if (start_op(tunnel, op) == 0)
+			continue;
+
+		/* Nobody waits for a down, an up is answered as if wg-quick
+		 * failed; startup_wireguard() already set last_error */
+		if (op->type == WIREGUARD_OP_UP) {
+			wireguard_event event = {
+				.source = EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT,
+				.tunnel = tunnel,
+				.network_data = op->network_data,
+				.exit_status = -1,
+			};
+			wireguard_state_post(tunnel->private, &event);
+		}
+		op_free(op);
+	}
+}
+
+/**
+ * Bring the tunnel up with config for network_data. If wg-quick is already
+ * running the up is queued, or merged with the running one if that brings
+ * the tunnel up with the same config; its exit is reported as
+ * EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT for network_data either way.
+ *
+ * @param tunnel        the tunnel
+ * @param network_data  the IAP the tunnel is for, must stay around until
+ *                      the exit is reported or wireguard_tunnel_down() is
+ *                      called
+ * @param config        configuration name
+ * @return 0 if wg-quick is running or queued, 1 if it could not be started
+ */
+int wireguard_tunnel_up(wireguard_tunnel * tunnel, wireguard_network_data * network_data,
+			const char *config)
+{
+	wireguard_op *last;
+
+	cancel_queued(tunnel, WIREGUARD_OP_DOWN);
+
+	last = last_op(tunnel);
+	if (last && last->type == WIREGUARD_OP_UP) {
+		if (last != tunnel->op_running) {
+			/* Not started yet, bring it up with what we know now */
+			last->network_data = network_data;
+			g_free(last->config);
+			last->config = g_strdup(config);
+			return 0;
+		}
+
+		if (string_equal(last->config, config) && !last->cancelled) {
+			WN_INFO("wg-quick up %d already running for %s\n", last->pid, network_data->network_id);
+			network_data->wg_quick_pid = last->pid;
+			return 0;
+		}
+
+		submit_op(tunnel, op_new(WIREGUARD_OP_DOWN, NULL, NULL));
+	}
+
+	return submit_op(tunnel, op_new(WIREGUARD_OP_UP, network_data, config));
+}
+
+/**
+ * Take the tunnel down. Cancels a queued up, stops a running one if the
+ * helper runs it, and is dropped if the tunnel is going down already.
+ * Nothing is reported when it finished, netlink tells us when the interface
+ * is gone.
+ *
+ * @param tunnel  the tunnel
+ */
+void wireguard_tunnel_down(wireguard_tunnel * tunnel)
+{
+	wireguard_op *last;
+
+	cancel_queued(tunnel, WIREGUARD_OP_UP);
+
+	last = last_op(tunnel);
+	if (last && last->type == WIREGUARD_OP_DOWN)
+		return;
+
+	/* No use finishing an up that is undone right after */
+	if (last && last == tunnel->op_running && !last->cancelled)
+		last->cancelled = wireguard_helper_cancel(tunnel->private, last->pid);
+
+	if (submit_op(tunnel, op_new(WIREGUARD_OP_DOWN, NULL, NULL)) != 0)
+		WN_WARN("Failed to attempt to stop Wireguard\n");
+}
+
+/* The tunnel pid is the running wg-quick of */
+static wireguard_tunnel *find_running(network_wireguard_private * private, pid_t pid)
+{
+	GHashTableIter iter;
+	wireguard_tunnel *tunnel;
+
+	g_hash_table_iter_init(&iter, private->tunnels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		if (tunnel->op_running && tunnel->op_running->pid == pid)
+			return tunnel;
+	}
+
+	return NULL;
+}
+
+/* The running op is done, start whatever was queued behind it */
+static void finish_running(wireguard_tunnel * tunnel, gint exit_status)
+{
+	wireguard_op *op = tunnel->op_running;
+
+	tunnel->op_running = NULL;
+
+	/* Only if the IAP still waits for it */
+	if (op->type == WIREGUARD_OP_UP && tunnel->network_data && tunnel->network_data->wg_quick_pid == op->pid) {
+		wireguard_event event = {
+			.source = EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT,
+			.tunnel = tunnel,
+			.network_data = tunnel->network_data,
+			.exit_status = exit_status,
+			.timeout = op->overruns ? op->timeout : 0,
+		};
+		wireguard_state_post(tunnel->private, &event);
+	}
+	op_free(op);
+
+	run_queued(tunnel);
+}
+
+/* Nothing made it exit: take the interface away from under it and treat it
+ * as failed. Whatever wg-quick did besides the interface stays. */
+static void abandon_running(wireguard_tunnel * tunnel)
+{
+	network_wireguard_private *private = tunnel->private;
+	wireguard_op *op = tunnel->op_running;
+	wireguard_nl_batch *batch;
+	int fd = wireguard_rtnl_open();
+
+	WN_ERR("%s: wg-quick %s %d did not exit on SIGKILL, giving up on it", tunnel->interface_name,
+	       op_names[op->type], op->pid);
+
+	if (fd >= 0) {
+		batch = wireguard_nl_batch_new(fd, NULL, NULL);
+		wireguard_rtnl_link_delete(batch, tunnel->interface_name, NULL);
+		wireguard_nl_batch_commit(batch);
+		wireguard_nl_batch_free(batch);
+	}
+
+	private->abandoned = g_slist_prepend(private->abandoned, GINT_TO_POINTER(op->pid));
+	finish_running(tunnel, SIGKILL);
+}
+
+/* The running op overran its timeout, or the grace period after a signal */
+static gboolean watchdog_cb(gpointer user_data)
+{
+	wireguard_tunnel *tunnel = user_data;
+	wireguard_op *op = tunnel->op_running;
+	guint grace = MIN(op->timeout, WIREGUARD_OP_KILL_GRACE);
+
+	op->watchdog = 0;
+
+	switch (op->overruns++) {
+	case 0:
+		WN_WARN("%s: wg-quick %s %d still running after %u s, terminating it", tunnel->interface_name,
+			op_names[op->type], op->pid, op->timeout);
+		tunnel->timeouts++;
+		wireguard_spawn_kill(tunnel->private, op->pid, SIGTERM);
+		arm_watchdog(tunnel, grace);
+		break;
+	case 1:
+		WN_WARN("%s: wg-quick %s %d did not exit on SIGTERM, killing it", tunnel->interface_name,
+			op_names[op->type], op->pid);
+		wireguard_spawn_kill(tunnel->private, op->pid, SIGKILL);
+		arm_watchdog(tunnel, grace);
+		break;
+	default:
+		abandon_running(tunnel);
+		wireguard_tunnels_reap(tunnel->private);
+		break;
+	}
+
+	return FALSE;
+}
+
+/**
+ * Finish the running wg-quick and start whatever was queued behind it on
+ * the same tunnel.
+ *
+ * @param private      network module private data
+ * @param pid          the process that exited
+ * @param exit_status  its exit status
+ * @return TRUE if pid was a running wg-quick, or one we gave up on
+ */
+gboolean wireguard_tunnel_child_exit(network_wireguard_private * private, pid_t pid, gint exit_status)
+{
+	wireguard_tunnel *tunnel = find_running(private, pid);
+
+	if (tunnel == NULL) {
+		GSList *abandoned = g_slist_find(private->abandoned, GINT_TO_POINTER(pid));
+
+		if (abandoned == NULL)
+			return FALSE;
+
+		WN_INFO("wg-quick %d we gave up on exited with %d after all\n", pid, exit_status);
+		private->abandoned = g_slist_delete_link(private->abandoned, abandoned);
+		return TRUE;
+	}
+
+	WN_INFO("%s: wg-quick %s %d exited with %d\n", tunnel->interface_name, op_names[tunnel->op_running->type],
+		pid, exit_status);
+	finish_running(tunnel, exit_status);
+
+	return TRUE;
+}
+
+/**
+ * Forget about running and queued operations, on unload.
+ *
+ * @param tunnel  the tunnel
+ */
+void wireguard_tunnel_ops_free(wireguard_tunnel * tunnel)
+{
+	if (tunnel->op_running || !g_queue_is_empty(&tunnel->ops))
+		WN_WARN("Unloading with wg-quick running or queued\n");
+
+	if (tunnel->op_running)
+		op_free(tunnel->op_running);
+	tunnel->op_running = NULL;
+
+	g_queue_foreach(&tunnel->ops, (GFunc) op_free, NULL);
+	g_queue_clear(&tunnel->ops);
+}
@@ -0,0 +1,429 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+/*
+ * GC_PEER_IPS_FILE lists. They can be far too long to go through gconf or a
+ * generated config, so the file is parsed as a stream from a mapping into a
+ * cache file of wireguard_prefix records, below the user cache dir. The
+ * cache is mapped in turn and handed to the kernel straight from the
+ * mapping, WIREGUARD_ALLOWED_IPS_CHUNK per message and without waiting for
+ * each ACK: however long the list, what we allocate stays the same. A cache
+ * is rebuilt when the device, inode, mtime or size of its file change.
+ */
+
+#include "libicd_network_wireguard.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <errno.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CACHE_MAGIC "WGPFX\0\0\1"
+/* Records written at once while parsing */
+#define WRITE_BATCH 256
+/* Longer tokens are no prefix */
+#define TOKEN_MAX 64
+
+struct cache_header {
+	char magic[8];
+	guint64 dev;
+	guint64 ino;
+	gint64 mtime;
+	guint64 size;
+	guint64 count;
+};
+
+static gint64 stat_mtime(const struct stat *st)
+{
+	return (gint64) st->st_mtim.tv_sec * G_GINT64_CONSTANT(1000000000) + st->st_mtim.tv_nsec;
+}
+
+static gboolean same_file(const struct cache_header *header, const struct stat *st)
+{
+	return header->dev == (guint64) st->st_dev && header->ino == (guint64) st->st_ino
+	    && header->mtime == stat_mtime(st) && header->size == (guint64) st->st_size;
+}
+
+static gboolean is_separator(char c)
+{
+	return c == ',' || c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+/* Parse the file at path, mapped, into cache, a record at a time */
+static int build_cache(const char *path, int out, struct cache_header *header)
+{
+	wireguard_prefix batch[WRITE_BATCH];
+	guint batched = 0, invalid = 0;
+	const char *map = NULL, *p, *end;
+	struct stat st;
+	int fd, ret = 0;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0 || fstat(fd, &st) < 0) {
+		ret = -errno;
+		goto out;
+	}
+
+	memset(header, 0, sizeof(*header));
+	memcpy(header->magic, CACHE_MAGIC, sizeof(header->magic));
+	header->dev = st.st_dev;
+	header->ino = st.st_ino;
+	header->mtime = stat_mtime(&st);
+	header->size = st.st_size;
+
+	ret = wireguard_write_all(out, header, sizeof(*header));
+	if (ret < 0 || st.st_size == 0)
+		goto out;
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		map = NULL;
+		ret = -errno;
+		goto out;
+	}
+	madvise((void *)map, st.st_size, MADV_SEQUENTIAL);
+
+	for (p = map, end = map + st.st_size; p < end && ret == 0;) {
+		char token[TOKEN_MAX];
+		const char *start;
+
+		if (is_separator(*p)) {
+			p++;
+			continue;
+		}
+		if (*p == '#') {
+			while (p < end && *p != '\n')
+				p++;
+			continue;
+		}
+
+		for (start = p; p < end && !is_separator(*p) && *p != '#'; p++) ;
+
+		if (p - start >= TOKEN_MAX) {
+			invalid++;
+			continue;
+		}
+		memcpy(token, start, p - start);
+		token[p - start] = '\0';
+
+		if (!wireguard_prefix_parse(token, &batch[batched])) {
+			invalid++;
+			continue;
+		}
+
+		header->count++;
+		if (++batched == WRITE_BATCH) {
+			ret = wireguard_write_all(out, batch, sizeof(batch));
+			batched = 0;
+		}
+	}
+
+	if (ret == 0 && batched)
+		ret = wireguard_write_all(out, batch, batched * sizeof(batch[0]));
+	if (ret == 0 && pwrite(out, header, sizeof(*header), 0) != sizeof(*header))
+		ret = -errno;
+
+	if (invalid)
+		WN_WARN("%s: ignoring %u entries that are no prefix", path, invalid);
+
+ out:
+	if (map)
+		munmap((void *)map, st.st_size);
+	if (fd >= 0)
+		close(fd);
+
+	return ret;
+}
+
+/* Map the cache for the file st describes, NULL if there is none */
+static wireguard_prefix_list *map_cache(const char *cache, const struct stat *st)
+{
+	const struct cache_header *header;
+	wireguard_prefix_list *list;
+	struct stat cache_st;
+	gpointer map;
+	int fd;
+
+	fd = open(cache, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return NULL;
+
+	if (fstat(fd, &cache_st) < 0 || cache_st.st_size < (off_t) sizeof(*header)) {
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, cache_st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED)
+		return NULL;
+
+	header = map;
+	if (memcmp(header->magic, CACHE_MAGIC, sizeof(header->magic)) != 0 || !same_file(header, st)
+	    || header->count != (cache_st.st_size - sizeof(*header)) / sizeof(wireguard_prefix)
+	    || header->count > G_MAXUINT) {
+		munmap(map, cache_st.st_size);
+		return NULL;
+	}
+
+	list = g_new0(wireguard_prefix_list, 1);
+	list->dev = header->dev;
+	list->ino = header->ino;
+	list->mtime = header->mtime;
+	list->size = header->size;
+	list->prefixes = (const wireguard_prefix *)(header + 1);
+	list->count = header->count;
+	list->map = map;
+	list->map_size = cache_st.st_size;
+	list->refcount = 1;
+
+	return list;
+}
+
+/* Cache the file at path in cache, replacing what was there at once */
+static gboolean update_cache(const char *path, const char *cache)
+{
+	gchar *tmp = g_strconcat(cache, ".tmp", NULL);
+	struct cache_header header;
+	int out, ret;
+
+	out = open(tmp, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (out < 0) {
+		WN_WARN("Unable to create %s: %s", tmp, strerror(errno));
+		g_free(tmp);
+		return FALSE;
+	}
+
+	ret = build_cache(path, out, &header);
+	if (close(out) < 0 && ret == 0)
+		ret = -errno;
+	if (ret == 0 && rename(tmp, cache) < 0)
+		ret = -errno;
+
+	if (ret == 0) {
+		WN_INFO("%s: cached %" G_GUINT64_FORMAT " prefixes", path, header.count);
+	} else {
+		WN_WARN("Unable to cache %s: %s", path, strerror(-ret));
+		unlink(tmp);
+	}
+	g_free(tmp);
+
+	return ret == 0;
+}
+
+/**
+ * The prefixes listed in a file, from our cache of it, which is brought up
+ * to date first if needed.
+ *
+ * @param private  network module private data
+ * @param path     the file
+ * @return a new reference, or NULL if the file cannot be read
+ */
+wireguard_prefix_list *wireguard_prefix_list_get(network_wireguard_private * private, const char *path)
+{
+	wireguard_prefix_list *list = g_hash_table_lookup(private->prefix_lists, path);
+	gchar *dir, *name, *cache;
+	struct stat st;
+
+	if (stat(path, &st) < 0) {
+		WN_WARN("Unable to read %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	if (list && list->dev == (guint64) st.st_dev && list->ino == (guint64) st.st_ino
+	    && list->mtime == stat_mtime(&st) && list->size == (guint64) st.st_size)
+		return wireguard_prefix_list_ref(list);
+
+	dir = g_build_filename(g_get_user_cache_dir(), WIREGUARD_PREFIX_CACHE_DIR, NULL);
+	if (g_mkdir_with_parents(dir, 0700) < 0)
+		WN_WARN("Unable to create %s: %s", dir, strerror(errno));
+
+	/* One cache per file, mtime and size are in the header */
+	name = g_strdup_printf("%" G_GINT64_MODIFIER "x-%" G_GINT64_MODIFIER "x.prefixes", (guint64) st.st_dev,
+			       (guint64) st.st_ino);
+	cache = g_build_filename(dir, name, NULL);
+	g_free(name);
+	g_free(dir);
+
+	list = map_cache(cache, &st);
+	if (list == NULL && update_cache(path, cache))
+		list = map_cache(cache, &st);
+	g_free(cache);
+
+	if (list == NULL)
+		return NULL;
+
+	list->path = g_strdup(path);
+	g_hash_table_replace(private->prefix_lists, list->path, list);
+
+	return wireguard_prefix_list_ref(list);
+}
+
+wireguard_prefix_list *wireguard_prefix_list_ref(wireguard_prefix_list * list)
+{
+	list->refcount++;
+
+	return list;
+}
+
+void wireguard_prefix_list_unref(wireguard_prefix_list * list)
+{
+	if (--list->refcount)
+		return;
+
+	munmap(list->map, list->map_size);
+	g_free(list->path);
+	g_free(list);
+}
+
+/* Say which step of pushing the lists failed, in the log and last_error */
+static void push_failed(wireguard_tunnel * tunnel, const char *format, ...) G_GNUC_PRINTF(2, 3);
+static void push_failed(wireguard_tunnel * tunnel, const char *format, ...)
+{
+	va_list args;
+	gchar *error;
+
+	va_start(args, format);
+	error = g_strdup_vprintf(format, args);
+	va_end(args);
+
+	WN_WARN("%s: %s", tunnel->interface_name, error);
+	wireguard_set_last_error(tunnel, error);
+	g_free(error);
+}
+
+/* A message of the batch in push_lists() failed, item is the first prefix
+ * it had */
+static void push_chunk_failed(gpointer item, guint16 type, int error, gpointer user_data)
+{
+	wireguard_tunnel *tunnel = user_data;
+	const wireguard_prefix *first = item;
+	guint i;
+
+	for (i = 0; i < tunnel->prefix_lists->len; i++) {
+		const wireguard_prefix_list *list = g_ptr_array_index(tunnel->prefix_lists, i);
+		guint index;
+
+		if (first < list->prefixes || first >= list->prefixes + list->count)
+			continue;
+
+		index = first - list->prefixes;
+		push_failed(tunnel, "Unable to add AllowedIPs %u to %u of %u from %s: %s", index + 1,
+			    MIN(index + WIREGUARD_ALLOWED_IPS_CHUNK, list->count), list->count, list->path,
+			    strerror(-error));
+		return;
+	}
+}
+
+/* Push the lists of a tunnel that just came up, all in one batch */
+static void push_lists(network_wireguard_private * private, wireguard_tunnel * tunnel)
+{
+	guint16 family_id;
+	int fd = wireguard_genl_open(&family_id);
+	wireguard_nl_batch *batch = NULL;
+	GSList *l;
+	int ret;
+
+	tunnel->prefix_lists = g_ptr_array_new_with_free_func((GDestroyNotify) wireguard_prefix_list_unref);
+	if (fd >= 0)
+		batch = wireguard_nl_batch_new(fd, push_chunk_failed, tunnel);
+
+	for (l = tunnel->prefix_files; l; l = l->next) {
+		wireguard_prefix_file *file = l->data;
+		wireguard_prefix_list *list;
+		guchar *public_key;
+		gsize key_len = 0;
+
+		public_key = g_base64_decode(file->public_key, &key_len);
+		if (key_len != 32) {
+			push_failed(tunnel, "Bad public key for the AllowedIPs of %s", file->path);
+			g_free(public_key);
+			continue;
+		}
+
+		list = wireguard_prefix_list_get(private, file->path);
+		if (list == NULL) {
+			push_failed(tunnel, "Unable to read AllowedIPs from %s", file->path);
+			g_free(public_key);
+			continue;
+		}
+
+		if (batch) {
+			WN_INFO("%s: adding %u AllowedIPs from %s", tunnel->interface_name, list->count, file->path);
+			wireguard_genl_add_allowed_ips(batch, family_id, tunnel->interface_name, public_key,
+						       list->prefixes, list->count);
+		} else {
+			push_failed(tunnel, "Unable to add AllowedIPs from %s: %s", file->path, strerror(ENOTCONN));
+		}
+
+		/* Routed even if the kernel did not take them all, which the
+		 * user will notice sooner than a missing route */
+		g_ptr_array_add(tunnel->prefix_lists, list);
+		g_free(public_key);
+	}
+
+	if (batch == NULL)
+		return;
+
+	ret = wireguard_nl_batch_commit(batch);
+	if (ret < 0)
+		push_failed(tunnel, "Unable to add AllowedIPs: %s", strerror(-ret));
+	wireguard_nl_batch_free(batch);
+}
+
+/**
+ * Push the AllowedIPs files of tunnels that came up, and let go of those of
+ * tunnels that went down. Called after every state change.
+ *
+ * @param private  network module private data
+ */
+void wireguard_prefix_lists_update(network_wireguard_private * private)
+{
+	GHashTableIter iter;
+	wireguard_tunnel *tunnel;
+
+	g_hash_table_iter_init(&iter, private->tunnels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		gboolean up = tunnel->state.tunnel == WIREGUARD_STATE_RUNNING && tunnel->state.wireguard_interface_up;
+
+		if (!up && tunnel->prefix_lists) {
+			g_ptr_array_free(tunnel->prefix_lists, TRUE);
+			tunnel->prefix_lists = NULL;
+		} else if (up && tunnel->prefix_files && tunnel->prefix_lists == NULL) {
+			push_lists(private, tunnel);
+		}
+	}
+}
+
+void wireguard_prefix_lists_init(network_wireguard_private * private)
+{
+	private->prefix_lists = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+						      (GDestroyNotify) wireguard_prefix_list_unref);
+}
+
+void wireguard_prefix_lists_free(network_wireguard_private * private)
+{
+	g_hash_table_destroy(private->prefix_lists);
+	private->prefix_lists = NULL;
+}
@@ -0,0 +1,337 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+#include <glib.h>
+
+#include "libicd_wireguard.h"
+#include "dbus_wireguard.h"
+#include "libicd_network_wireguard.h"
+
+#define PROPERTY_STATE             (1 << 0)
+#define PROPERTY_MODE              (1 << 1)
+#define PROPERTY_ACTIVE_CONFIG     (1 << 2)
+#define PROPERTY_INTERFACE_INDEX   (1 << 3)
+#define PROPERTY_CONNECT_TIMESTAMP (1 << 4)
+#define PROPERTY_LAST_ERROR        (1 << 5)
+#define PROPERTY_TIMEOUTS          (1 << 6)
+#define PROPERTY_ALL               ((1 << 7) - 1)
+
+static const struct {
+	const char *name;
+	guint mask;
+} property_names[] = {
+	{ICD_WIREGUARD_PROPERTY_STATE, PROPERTY_STATE},
+	{ICD_WIREGUARD_PROPERTY_MODE, PROPERTY_MODE},
+	{ICD_WIREGUARD_PROPERTY_ACTIVE_CONFIG, PROPERTY_ACTIVE_CONFIG},
+	{ICD_WIREGUARD_PROPERTY_INTERFACE_INDEX, PROPERTY_INTERFACE_INDEX},
+	{ICD_WIREGUARD_PROPERTY_CONNECT_TIMESTAMP, PROPERTY_CONNECT_TIMESTAMP},
+	{ICD_WIREGUARD_PROPERTY_LAST_ERROR, PROPERTY_LAST_ERROR},
+	{ICD_WIREGUARD_PROPERTY_TIMEOUTS, PROPERTY_TIMEOUTS},
+
+	{NULL,}
+};
+
+static guint property_mask(const char *name)
+{
+	int i;
+
+	for (i = 0; property_names[i].name != NULL; i++) {
+		if (strcmp(property_names[i].name, name) == 0)
+			return property_names[i].mask;
+	}
+
+	return 0;
+}
+
+/* Fill in the current values, strings are borrowed from tunnel */
+static void properties_current(wireguard_tunnel * tunnel, wireguard_properties * props)
+{
+	props->state = wireguard_status_string(&tunnel->state);
+	props->mode = wireguard_mode_string(&tunnel->state);
+	props->active_config = tunnel->state.active_config ? tunnel->state.active_config : "";
+	props->interface_index = tunnel->state.wireguard_interface_index;
+	props->connect_timestamp = tunnel->connect_timestamp;
+	props->last_error = tunnel->last_error ? tunnel->last_error : "";
+	props->timeouts = tunnel->timeouts;
+}
+
+static void append_variant(DBusMessageIter * iter, int type, const void *value)
+{
+	DBusMessageIter variant;
+	char signature[2] = { (char)type, '\0' };
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_VARIANT, signature, &variant);
+	dbus_message_iter_append_basic(&variant, type, value);
+	dbus_message_iter_close_container(iter, &variant);
+}
+
+/* Append the value of a single property as a variant */
+static void append_value(DBusMessageIter * iter, const wireguard_properties * props, guint property)
+{
+	switch (property) {
+	case PROPERTY_STATE:
+		append_variant(iter, DBUS_TYPE_STRING, &props->state);
+		break;
+	case PROPERTY_MODE:
+		append_variant(iter, DBUS_TYPE_STRING, &props->mode);
+		break;
+	case PROPERTY_ACTIVE_CONFIG:
+		append_variant(iter, DBUS_TYPE_STRING, &props->active_config);
+		break;
+	case PROPERTY_INTERFACE_INDEX:
+		append_variant(iter, DBUS_TYPE_INT32, &props->interface_index);
+		break;
+	case PROPERTY_CONNECT_TIMESTAMP:
+		append_variant(iter, DBUS_TYPE_UINT64, &props->connect_timestamp);
+		break;
+	case PROPERTY_LAST_ERROR:
+		append_variant(iter, DBUS_TYPE_STRING, &props->last_error);
+		break;
+	case PROPERTY_TIMEOUTS:
+		append_variant(iter, DBUS_TYPE_UINT32, &props->timeouts);
+		break;
+	}
+}
+
+/* Append an a{sv} dictionary with the properties selected by mask */
+static void append_properties(DBusMessageIter * iter, const wireguard_properties * props, guint mask)
+{
+	DBusMessageIter dict, entry;
+	int i;
+
+	dbus_message_iter_open_container(iter, DBUS_TYPE_ARRAY,
+					 DBUS_DICT_ENTRY_BEGIN_CHAR_AS_STRING
+					 DBUS_TYPE_STRING_AS_STRING
+					 DBUS_TYPE_VARIANT_AS_STRING DBUS_DICT_ENTRY_END_CHAR_AS_STRING, &dict);
+
+	for (i = 0; property_names[i].name != NULL; i++) {
+		if (!(mask & property_names[i].mask))
+			continue;
+
+		dbus_message_iter_open_container(&dict, DBUS_TYPE_DICT_ENTRY, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &property_names[i].name);
+		append_value(&entry, props, property_names[i].mask);
+		dbus_message_iter_close_container(&dict, &entry);
+	}
+
+	dbus_message_iter_close_container(iter, &dict);
+}
+
+static DBusHandlerResult send_reply(DBusMessage * reply)
+{
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
+
+static DBusHandlerResult send_error(DBusMessage * message, const char *name, const char *error)
+{
+	DBusMessage *reply = dbus_message_new_error(message, name, error);
+	if (!reply) {
+		WN_WARN("Could not construct dbus error reply");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	return send_reply(reply);
+}
+
+static gboolean check_interface(const char *interface)
+{
+	return interface[0] == '\0' || strcmp(interface, ICD_WIREGUARD_DBUS_INTERFACE) == 0;
+}
+
+DBusHandlerResult properties_get_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
+	const char *interface = NULL;
+	const char *name = NULL;
+	wireguard_properties props;
+	DBusMessageIter iter;
+	guint mask;
+
+	if (!dbus_message_get_args(message, NULL,
+				   DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID)) {
+		return send_error(message, DBUS_ERROR_INVALID_ARGS, "Expected interface and property name");
+	}
+
+	if (!check_interface(interface))
+		return send_error(message, DBUS_ERROR_UNKNOWN_INTERFACE, "Unknown interface");
+
+	mask = property_mask(name);
+	if (mask == 0)
+		return send_error(message, DBUS_ERROR_UNKNOWN_PROPERTY, "Unknown property");
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	properties_current(tunnel, &props);
+	dbus_message_iter_init_append(reply, &iter);
+	append_value(&iter, &props, mask);
+
+	return send_reply(reply);
+}
+
+DBusHandlerResult properties_getall_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
+	const char *interface = NULL;
+	wireguard_properties props;
+	DBusMessageIter iter;
+
+	if (!dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID)) {
+		return send_error(message, DBUS_ERROR_INVALID_ARGS, "Expected interface name");
+	}
+
+	if (!check_interface(interface))
+		return send_error(message, DBUS_ERROR_UNKNOWN_INTERFACE, "Unknown interface");
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	properties_current(tunnel, &props);
+	dbus_message_iter_init_append(reply, &iter);
+	append_properties(&iter, &props, PROPERTY_ALL);
+
+	return send_reply(reply);
+}
+
+DBusHandlerResult properties_set_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	WG_PROFILE();
+	return send_error(message, DBUS_ERROR_PROPERTY_READ_ONLY, "All properties are read-only");
+}
+
+void wireguard_set_last_error(wireguard_tunnel * tunnel, const char *error)
+{
+	WN_INFO("%s: last error: %s", tunnel->interface_name, error);
+
+	g_free(tunnel->last_error);
+	tunnel->last_error = g_strdup(error);
+
+	/* Not every error comes with a state transition */
+	properties_update(tunnel);
+}
+
+/* Emit PropertiesChanged on path with what changed since published */
+static void publish(const char *path, wireguard_properties * published, const wireguard_properties * current)
+{
+	guint changed = 0;
+
+	/* state and mode point to static strings */
+	if (current->state != published->state)
+		changed |= PROPERTY_STATE;
+	if (current->mode != published->mode)
+		changed |= PROPERTY_MODE;
+	if (g_strcmp0(current->active_config, published->active_config) != 0)
+		changed |= PROPERTY_ACTIVE_CONFIG;
+	if (current->interface_index != published->interface_index)
+		changed |= PROPERTY_INTERFACE_INDEX;
+	if (current->connect_timestamp != published->connect_timestamp)
+		changed |= PROPERTY_CONNECT_TIMESTAMP;
+	if (g_strcmp0(current->last_error, published->last_error) != 0)
+		changed |= PROPERTY_LAST_ERROR;
+	if (current->timeouts != published->timeouts)
+		changed |= PROPERTY_TIMEOUTS;
+
+	if (changed == 0)
+		return;
+
+	published->state = current->state;
+	published->mode = current->mode;
+	published->interface_index = current->interface_index;
+	published->connect_timestamp = current->connect_timestamp;
+	published->timeouts = current->timeouts;
+	if (changed & PROPERTY_ACTIVE_CONFIG) {
+		g_free(published->active_config);
+		published->active_config = g_strdup(current->active_config);
+	}
+	if (changed & PROPERTY_LAST_ERROR) {
+		g_free(published->last_error);
+		published->last_error = g_strdup(current->last_error);
+	}
+
+	DBusMessage *msg = dbus_message_new_signal(path, DBUS_INTERFACE_PROPERTIES, "PropertiesChanged");
+	if (msg == NULL) {
+		WN_WARN("Could not construct dbus message for PropertiesChanged signal");
+		return;
+	}
+
+	DBusMessageIter iter, invalidated;
+	const char *interface = ICD_WIREGUARD_DBUS_INTERFACE;
+
+	dbus_message_iter_init_append(msg, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_STRING, &interface);
+	append_properties(&iter, current, changed);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, DBUS_TYPE_STRING_AS_STRING, &invalidated);
+	dbus_message_iter_close_container(&iter, &invalidated);
+
+	icd_dbus_send_system_msg(msg);
+
+	dbus_message_unref(msg);
+}
+
+/**
+ * Compare the current state against what we last published and emit
+ * PropertiesChanged with only the changed properties, on the tunnel's path
+ * and, for the main tunnel, on ICD_WIREGUARD_DBUS_PATH. Called after every
+ * state transition and whenever the last error changes.
+ *
+ * @param tunnel  the tunnel that changed
+ */
+void properties_update(wireguard_tunnel * tunnel)
+{
+	network_wireguard_private *priv = tunnel->private;
+	wireguard_properties current;
+
+	/* Stamp the connect time on the transition to Connected */
+	if (strcmp(wireguard_status_string(&tunnel->state), ICD_WIREGUARD_SIGNALS_STATUS_STATE_CONNECTED) == 0) {
+		if (tunnel->connect_timestamp == 0)
+			tunnel->connect_timestamp = g_get_real_time() / G_USEC_PER_SEC;
+	} else {
+		tunnel->connect_timestamp = 0;
+	}
+
+	properties_current(tunnel, &current);
+	publish(tunnel->object_path, &tunnel->properties, &current);
+
+	/* Which tunnel is the main one may just have changed */
+	properties_current(wireguard_main_tunnel(priv), &current);
+	publish(ICD_WIREGUARD_DBUS_PATH, &priv->properties, &current);
+}
+
+void properties_free(wireguard_properties * properties)
+{
+	g_free(properties->active_config);
+	properties->active_config = NULL;
+	g_free(properties->last_error);
+	properties->last_error = NULL;
+}
@@ -0,0 +1,619 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Policy routing. With GC_WIREGUARD_POLICY_ROUTING or GC_WIREGUARD_MULTIPATH
+ * set wg-quick leaves routing to us: AllowedIPs are routed in
+ * WIREGUARD_ROUTE_TABLE, which only packets without a more specific route in
+ * main get to, so local subnets stay local. The configured exclusions and the
+ * peers' endpoints are throw routes in it, sending their lookups back to the
+ * main table. The tunnels mark their own packets, which always go out through
+ * main.
+ *
+ * Multipath. The tunnels of IAPs that are up at the same time with the same
+ * config, typically over WLAN and cellular, form a bond. With
+ * GC_WIREGUARD_MULTIPATH its AllowedIPs are routed over every path that still
+ * sees handshakes, equal cost; otherwise only over its lowest tunnel.
+ */
+
+#include "libicd_network_wireguard.h"
+
+#include <arpa/inet.h>
+#include <linux/rtnetlink.h>
+#include <errno.h>
+
+/* What a bond should be routed like */
+struct candidate {
+	wireguard_tunnel *first;
+	GArray *all;
+	GArray *alive;
+	GArray *excludes;
+};
+
+static void candidate_free(struct candidate *candidate)
+{
+	g_array_free(candidate->all, TRUE);
+	g_array_free(candidate->alive, TRUE);
+	g_array_free(candidate->excludes, TRUE);
+	g_free(candidate);
+}
+
+static void bond_free(wireguard_bond * bond)
+{
+	g_array_free(bond->prefixes, TRUE);
+	g_array_free(bond->paths, TRUE);
+	g_array_free(bond->excludes, TRUE);
+	g_ptr_array_free(bond->lists, TRUE);
+	g_free(bond->config);
+	g_free(bond);
+}
+
+static GArray *prefix_array_new(void)
+{
+	return g_array_new(FALSE, FALSE, sizeof(wireguard_prefix));
+}
+
+/* Append the comma separated prefixes in value to prefixes */
+static void parse_prefixes(wireguard_tunnel * tunnel, GArray * prefixes, const char *value, const char *what)
+{
+	guint invalid = wireguard_prefixes_parse(prefixes, value);
+
+	if (invalid)
+		WN_WARN("%s: ignoring %u %s entries", tunnel->interface_name, invalid, what);
+}
+
+/* Key of a "Key = value" line, NULL for anything else */
+static gchar *line_key(const char *line, const char **value)
+{
+	const char *equals = strchr(line, '=');
+
+	if (equals == NULL)
+		return NULL;
+
+	*value = equals + 1;
+	return g_strstrip(g_strndup(line, equals - line));
+}
+
+/**
+ * Adapt a generated config for a tunnel we route: no routes from wg-quick,
+ * our fwmark, and for multipath keepalives so live paths keep shaking hands.
+ * Records the AllowedIPs of all peers and the exclusions in the tunnel,
+ * collapsed.
+ *
+ * @param tunnel    the tunnel
+ * @param config    the config as generated
+ * @param excludes  comma separated prefixes to keep off the tunnel, or NULL
+ * @return the config to write
+ */
+gchar *wireguard_routing_config(wireguard_tunnel * tunnel, const char *config, const char *excludes)
+{
+	GString *routed = g_string_sized_new(strlen(config) + 128);
+	gchar **lines = g_strsplit(config, "\n", -1);
+	guint i;
+
+	if (tunnel->prefixes) {
+		g_array_set_size(tunnel->prefixes, 0);
+		g_array_set_size(tunnel->excludes, 0);
+	} else {
+		tunnel->prefixes = prefix_array_new();
+		tunnel->excludes = prefix_array_new();
+	}
+
+	if (excludes)
+		parse_prefixes(tunnel, tunnel->excludes, excludes, GC_EXCLUDE);
+
+	for (i = 0; lines[i]; i++) {
+		gchar *section = g_strstrip(g_strdup(lines[i]));
+		const char *value = NULL;
+		gchar *key = line_key(lines[i], &value);
+		gboolean ours = FALSE;
+
+		if (key) {
+			if (g_ascii_strcasecmp(key, "AllowedIPs") == 0)
+				parse_prefixes(tunnel, tunnel->prefixes, value, "AllowedIPs");
+
+			/* We set these */
+			ours = g_ascii_strcasecmp(key, "Table") == 0 || g_ascii_strcasecmp(key, "FwMark") == 0
+			    || (tunnel->multipath && g_ascii_strcasecmp(key, "PersistentKeepalive") == 0);
+			g_free(key);
+		}
+
+		if (!ours) {
+			if (routed->len)
+				g_string_append_c(routed, '\n');
+			g_string_append(routed, lines[i]);
+		}
+
+		if (g_ascii_strcasecmp(section, "[Interface]") == 0)
+			g_string_append_printf(routed, "\nTable = off\nFwMark = 0x%x", WIREGUARD_FWMARK | tunnel->index);
+		else if (tunnel->multipath && g_ascii_strcasecmp(section, "[Peer]") == 0)
+			g_string_append_printf(routed, "\nPersistentKeepalive = %d", WIREGUARD_MULTIPATH_KEEPALIVE);
+		g_free(section);
+	}
+
+	g_strfreev(lines);
+
+	/* Routes do not care which peer a prefix is for */
+	wireguard_prefixes_collapse(tunnel->prefixes);
+	wireguard_prefixes_collapse(tunnel->excludes);
+
+	return g_string_free(routed, FALSE);
+}
+
+static gboolean is_member(const wireguard_tunnel * tunnel)
+{
+	return tunnel->routed && tunnel->prefixes && tunnel->state.active_config
+	    && tunnel->state.tunnel == WIREGUARD_STATE_RUNNING && tunnel->state.wireguard_interface_up;
+}
+
+/* Still seeing handshakes, or just connected */
+static gboolean path_alive(wireguard_tunnel * tunnel, gint64 now)
+{
+	gint64 newest = 0;
+	GSList *l;
+
+	if (now - (gint64) tunnel->connect_timestamp < WIREGUARD_MULTIPATH_GRACE)
+		return TRUE;
+
+	for (l = wireguard_stats_snapshot(tunnel); l; l = l->next) {
+		wireguard_peer_stats *peer = l->data;
+
+		newest = MAX(newest, peer->info.last_handshake);
+	}
+
+	return newest != 0 && now - newest < WIREGUARD_MULTIPATH_STALE;
+}
+
+/* Host routes for the endpoints the tunnel's peers currently use */
+static void add_endpoints(wireguard_tunnel * tunnel, GArray * excludes)
+{
+	GSList *l;
+
+	for (l = wireguard_stats_snapshot(tunnel); l; l = l->next) {
+		const struct sockaddr_storage *endpoint = &((wireguard_peer_stats *) l->data)->info.endpoint;
+		wireguard_prefix prefix;
+
+		memset(&prefix, 0, sizeof(prefix));
+		prefix.family = endpoint->ss_family;
+		if (endpoint->ss_family == AF_INET) {
+			prefix.len = 32;
+			memcpy(prefix.addr, &((const struct sockaddr_in *)endpoint)->sin_addr, 4);
+		} else if (endpoint->ss_family == AF_INET6) {
+			prefix.len = 128;
+			memcpy(prefix.addr, &((const struct sockaddr_in6 *)endpoint)->sin6_addr, 16);
+		} else {
+			continue;
+		}
+
+		g_array_append_val(excludes, prefix);
+	}
+}
+
+static gint compare_int(gconstpointer a, gconstpointer b)
+{
+	return *(const int *)a - *(const int *)b;
+}
+
+static gint compare_prefix(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, sizeof(wireguard_prefix));
+}
+
+static gboolean arrays_equal(const GArray * a, const GArray * b, guint element_size)
+{
+	return a->len == b->len && memcmp(a->data, b->data, a->len * element_size) == 0;
+}
+
+static gboolean has_prefix(const GArray * prefixes, const wireguard_prefix * prefix)
+{
+	guint i;
+
+	for (i = 0; i < prefixes->len; i++) {
+		if (compare_prefix(&g_array_index(prefixes, wireguard_prefix, i), prefix) == 0)
+			return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Sort prefixes and drop duplicates */
+static void sort_prefixes(GArray * prefixes)
+{
+	guint i, kept = 0;
+
+	g_array_sort(prefixes, compare_prefix);
+	for (i = 0; i < prefixes->len; i++) {
+		if (kept && compare_prefix(&g_array_index(prefixes, wireguard_prefix, kept - 1),
+					   &g_array_index(prefixes, wireguard_prefix, i)) == 0)
+			continue;
+		g_array_index(prefixes, wireguard_prefix, kept++) = g_array_index(prefixes, wireguard_prefix, i);
+	}
+	g_array_set_size(prefixes, kept);
+}
+
+/* A request of an update failed, item is its bond, NULL for a rule */
+static void request_failed(gpointer item, guint16 type, int error, gpointer user_data)
+{
+	wireguard_bond *bond = item;
+
+	switch (type) {
+	case RTM_NEWROUTE:
+		WN_WARN("Unable to add route of %s: %s", bond->config, strerror(-error));
+		break;
+	case RTM_DELROUTE:
+		/* Routes over an interface go away with it */
+		if (error != -ESRCH)
+			WN_WARN("Unable to remove route of %s: %s", bond->config, strerror(-error));
+		break;
+	case RTM_NEWRULE:
+	case RTM_DELRULE:
+		if (error != (type == RTM_NEWRULE ? -EEXIST : -ENOENT))
+			WN_WARN("Unable to %s routing rule: %s", type == RTM_NEWRULE ? "add" : "remove",
+				strerror(-error));
+		break;
+	}
+}
+
+/* Batch of this update, with its socket opened on first use */
+static wireguard_nl_batch *rtnl_batch(wireguard_nl_batch ** batch)
+{
+	int fd;
+
+	if (*batch == NULL && (fd = wireguard_rtnl_open()) >= 0)
+		*batch = wireguard_nl_batch_new(fd, request_failed, NULL);
+
+	return *batch;
+}
+
+/* Send the requests of an update, all at once */
+static void rtnl_commit(wireguard_nl_batch * batch)
+{
+	int ret;
+
+	if (batch == NULL)
+		return;
+
+	ret = wireguard_nl_batch_commit(batch);
+	if (ret < 0)
+		WN_WARN("Unable to update routing: %s", strerror(-ret));
+	wireguard_nl_batch_free(batch);
+}
+
+static void route_prefix(wireguard_nl_batch * batch, wireguard_bond * bond, const wireguard_prefix * prefix,
+			 const GArray * paths)
+{
+	if (paths->len)
+		wireguard_rtnl_route(batch, RTM_NEWROUTE, WIREGUARD_ROUTE_TABLE, prefix, (const int *)paths->data,
+				     paths->len, bond);
+	else
+		wireguard_rtnl_route(batch, RTM_DELROUTE, WIREGUARD_ROUTE_TABLE, prefix,
+				     (const int *)bond->paths->data, bond->paths->len, bond);
+}
+
+/* Route the bond's prefixes over paths, none to remove its routes */
+static void route_bond(wireguard_nl_batch ** batch, wireguard_bond * bond, const GArray * paths)
+{
+	guint i, j;
+
+	if (rtnl_batch(batch) == NULL || (paths->len == 0 && bond->paths->len == 0))
+		return;
+
+	for (i = 0; i < bond->prefixes->len; i++)
+		route_prefix(*batch, bond, &g_array_index(bond->prefixes, wireguard_prefix, i), paths);
+
+	/* Not collapsed, so only those excluded outright are left out. Removal
+	 * tries them all, the exclusions may have changed since. */
+	for (i = 0; i < bond->lists->len; i++) {
+		const wireguard_prefix_list *list = g_ptr_array_index(bond->lists, i);
+
+		for (j = 0; j < list->count; j++) {
+			if (paths->len == 0 || !has_prefix(bond->excludes, &list->prefixes[j]))
+				route_prefix(*batch, bond, &list->prefixes[j], paths);
+		}
+	}
+
+	g_array_set_size(bond->paths, 0);
+	g_array_append_vals(bond->paths, paths->data, paths->len);
+}
+
+/* Throw the bond's exclusions back to the main table, none to remove them */
+static void exclude_bond(wireguard_nl_batch ** batch, wireguard_bond * bond, const GArray * excludes)
+{
+	guint i;
+
+	if (rtnl_batch(batch) == NULL)
+		return;
+
+	for (i = 0; i < bond->excludes->len; i++) {
+		const wireguard_prefix *prefix = &g_array_index(bond->excludes, wireguard_prefix, i);
+
+		if (!has_prefix(excludes, prefix))
+			wireguard_rtnl_route(*batch, RTM_DELROUTE, WIREGUARD_ROUTE_TABLE, prefix, NULL, 0, bond);
+	}
+
+	for (i = 0; i < excludes->len; i++) {
+		const wireguard_prefix *prefix = &g_array_index(excludes, wireguard_prefix, i);
+
+		if (!has_prefix(bond->excludes, prefix))
+			wireguard_rtnl_route(*batch, RTM_NEWROUTE, WIREGUARD_ROUTE_TABLE, prefix, NULL, 0, bond);
+	}
+
+	g_array_set_size(bond->excludes, 0);
+	g_array_append_vals(bond->excludes, excludes->data, excludes->len);
+}
+
+static void set_rules(network_wireguard_private * private, wireguard_nl_batch ** batch, gboolean add)
+{
+	static const int families[] = { AF_INET, AF_INET6 };
+	int type = add ? RTM_NEWRULE : RTM_DELRULE;
+	guint i;
+
+	if (rtnl_batch(batch) == NULL)
+		return;
+
+	for (i = 0; i < G_N_ELEMENTS(families); i++) {
+		/* The tunnels' own packets go out over the uplinks */
+		wireguard_rtnl_rule(*batch, type, families[i], WIREGUARD_RULE_PRIORITY, RT_TABLE_MAIN,
+				    WIREGUARD_FWMARK, WIREGUARD_FWMARK_MASK, FALSE, NULL);
+		/* Anything more specific than a default route stays local */
+		wireguard_rtnl_rule(*batch, type, families[i], WIREGUARD_RULE_PRIORITY + 1, RT_TABLE_MAIN, 0, 0,
+				    TRUE, NULL);
+		wireguard_rtnl_rule(*batch, type, families[i], WIREGUARD_RULE_PRIORITY + 2, WIREGUARD_ROUTE_TABLE,
+				    0, 0, FALSE, NULL);
+	}
+
+	private->routing_rules = add;
+}
+
+static gboolean check_paths_cb(gpointer user_data)
+{
+	network_wireguard_private *private = user_data;
+
+	private->routing_timer = 0;
+	wireguard_routing_update(private);
+
+	return FALSE;
+}
+
+/* How every bond should be routed, by config */
+static GHashTable *find_candidates(network_wireguard_private * private)
+{
+	GHashTable *candidates = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) candidate_free);
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	GHashTableIter iter;
+	struct candidate *candidate;
+	wireguard_tunnel *tunnel;
+
+	g_hash_table_iter_init(&iter, private->tunnels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		int index = tunnel->state.wireguard_interface_index;
+
+		if (!is_member(tunnel))
+			continue;
+
+		candidate = g_hash_table_lookup(candidates, tunnel->state.active_config);
+		if (candidate == NULL) {
+			candidate = g_new0(struct candidate, 1);
+			candidate->all = g_array_new(FALSE, FALSE, sizeof(int));
+			candidate->alive = g_array_new(FALSE, FALSE, sizeof(int));
+			candidate->excludes = prefix_array_new();
+			g_hash_table_insert(candidates, tunnel->state.active_config, candidate);
+		}
+
+		/* The lowest tunnel says what the config routes */
+		if (candidate->first == NULL || tunnel->index < candidate->first->index)
+			candidate->first = tunnel;
+
+		add_endpoints(tunnel, candidate->excludes);
+
+		g_array_append_val(candidate->all, index);
+		if (!tunnel->multipath || path_alive(tunnel, now))
+			g_array_append_val(candidate->alive, index);
+		else
+			WN_DEBUG("%s: no handshake for %d seconds", tunnel->interface_name, WIREGUARD_MULTIPATH_STALE);
+	}
+
+	g_hash_table_iter_init(&iter, candidates);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & candidate)) {
+		g_array_append_vals(candidate->excludes, candidate->first->excludes->data,
+				    candidate->first->excludes->len);
+		sort_prefixes(candidate->excludes);
+
+		/* Only the lowest tunnel, without multipath */
+		if (!candidate->first->multipath) {
+			int index = candidate->first->state.wireguard_interface_index;
+
+			g_array_set_size(candidate->alive, 0);
+			g_array_append_val(candidate->alive, index);
+		}
+	}
+
+	return candidates;
+}
+
+/* Whether the bond routes exactly the lists, NULL for none */
+static gboolean has_lists(const wireguard_bond * bond, const GPtrArray * lists)
+{
+	guint len = lists ? lists->len : 0;
+
+	return bond->lists->len == len && (len == 0 || memcmp(bond->lists->pdata, lists->pdata,
+							       len * sizeof(gpointer)) == 0);
+}
+
+static void set_lists(wireguard_bond * bond, const GPtrArray * lists)
+{
+	guint i;
+
+	g_ptr_array_set_size(bond->lists, 0);
+	for (i = 0; lists && i < lists->len; i++)
+		g_ptr_array_add(bond->lists, wireguard_prefix_list_ref(g_ptr_array_index(lists, i)));
+}
+
+/* The candidate's AllowedIPs, without any it excludes outright */
+static GArray *routed_prefixes(const struct candidate *candidate)
+{
+	const GArray *all = candidate->first->prefixes;
+	GArray *prefixes = prefix_array_new();
+	guint i;
+
+	for (i = 0; i < all->len; i++) {
+		const wireguard_prefix *prefix = &g_array_index(all, wireguard_prefix, i);
+
+		if (!has_prefix(candidate->excludes, prefix))
+			g_array_append_vals(prefixes, prefix, 1);
+	}
+
+	return prefixes;
+}
+
+/**
+ * Bring the routes of every bond in line with its members, their health and
+ * their endpoints. Called after every state change, and periodically while
+ * there are bonds.
+ *
+ * @param private  network module private data
+ */
+void wireguard_routing_update(network_wireguard_private * private)
+{
+	GHashTable *candidates = find_candidates(private);
+	GArray *none_paths = g_array_new(FALSE, FALSE, sizeof(int));
+	GArray *none = prefix_array_new();
+	GHashTableIter iter;
+	struct candidate *candidate;
+	wireguard_bond *bond;
+	/* Freed once the requests for them went out */
+	GPtrArray *gone = g_ptr_array_new_with_free_func((GDestroyNotify) bond_free);
+	gboolean routed = FALSE;
+	wireguard_nl_batch *batch = NULL;
+
+	/* Bonds without members left */
+	g_hash_table_iter_init(&iter, private->bonds);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & bond)) {
+		if (g_hash_table_lookup(candidates, bond->config) == NULL) {
+			WN_INFO("Routing %s: no paths left", bond->config);
+			route_bond(&batch, bond, none_paths);
+			exclude_bond(&batch, bond, none);
+			g_hash_table_iter_steal(&iter);
+			g_ptr_array_add(gone, bond);
+		}
+	}
+
+	g_hash_table_iter_init(&iter, candidates);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & candidate)) {
+		const char *config = candidate->first->state.active_config;
+		GArray *prefixes = routed_prefixes(candidate);
+		/* Better a path that may be dead than none */
+		GArray *paths = candidate->alive->len ? candidate->alive : candidate->all;
+
+		bond = g_hash_table_lookup(private->bonds, config);
+		if (bond == NULL) {
+			bond = g_new0(wireguard_bond, 1);
+			bond->config = g_strdup(config);
+			bond->prefixes = prefix_array_new();
+			bond->paths = g_array_new(FALSE, FALSE, sizeof(int));
+			bond->excludes = prefix_array_new();
+			bond->lists = g_ptr_array_new_with_free_func((GDestroyNotify) wireguard_prefix_list_unref);
+			g_hash_table_insert(private->bonds, bond->config, bond);
+		}
+
+		g_array_sort(paths, compare_int);
+
+		/* Which of the lists are left out depends on the exclusions */
+		if (!has_lists(bond, candidate->first->prefix_lists)
+		    || (bond->lists->len && !arrays_equal(bond->excludes, candidate->excludes, sizeof(wireguard_prefix)))) {
+			route_bond(&batch, bond, none_paths);
+			set_lists(bond, candidate->first->prefix_lists);
+		}
+
+		/* Exclusions first, so nothing leaks while routes change */
+		if (!arrays_equal(bond->excludes, candidate->excludes, sizeof(wireguard_prefix))) {
+			WN_INFO("Routing %s: excluding %u prefixes", config, candidate->excludes->len);
+			exclude_bond(&batch, bond, candidate->excludes);
+		}
+
+		/* The config changed under us, start over */
+		if (!arrays_equal(bond->prefixes, prefixes, sizeof(wireguard_prefix))) {
+			route_bond(&batch, bond, none_paths);
+			g_array_set_size(bond->prefixes, 0);
+			g_array_append_vals(bond->prefixes, prefixes->data, prefixes->len);
+		}
+
+		if (!arrays_equal(bond->paths, paths, sizeof(int))) {
+			WN_INFO("Routing %s: %u prefixes and %u lists over %u of %u paths", config,
+				bond->prefixes->len, bond->lists->len, paths->len, candidate->all->len);
+			route_bond(&batch, bond, paths);
+		}
+
+		g_array_free(prefixes, TRUE);
+		routed = TRUE;
+	}
+
+	if (routed != private->routing_rules)
+		set_rules(private, &batch, routed);
+
+	rtnl_commit(batch);
+	g_ptr_array_free(gone, TRUE);
+	g_array_free(none_paths, TRUE);
+	g_array_free(none, TRUE);
+	g_hash_table_destroy(candidates);
+
+	if (routed && private->routing_timer == 0)
+		private->routing_timer = g_timeout_add(WIREGUARD_ROUTING_CHECK_INTERVAL, check_paths_cb, private);
+	else if (!routed && private->routing_timer != 0) {
+		g_source_remove(private->routing_timer);
+		private->routing_timer = 0;
+	}
+}
+
+void wireguard_routing_init(network_wireguard_private * private)
+{
+	private->bonds = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) bond_free);
+}
+
+/* Remove our routes and rules, on unload */
+void wireguard_routing_free(network_wireguard_private * private)
+{
+	GHashTableIter iter;
+	wireguard_bond *bond;
+	GArray *none_paths = g_array_new(FALSE, FALSE, sizeof(int));
+	GArray *none = prefix_array_new();
+	wireguard_nl_batch *batch = NULL;
+
+	g_hash_table_iter_init(&iter, private->bonds);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & bond)) {
+		route_bond(&batch, bond, none_paths);
+		exclude_bond(&batch, bond, none);
+	}
+	g_array_free(none_paths, TRUE);
+	g_array_free(none, TRUE);
+
+	if (private->routing_rules)
+		set_rules(private, &batch, FALSE);
+
+	rtnl_commit(batch);
+
+	if (private->routing_timer != 0)
+		g_source_remove(private->routing_timer);
+	private->routing_timer = 0;
+
+	g_hash_table_destroy(private->bonds);
+	private->bonds = NULL;
+}
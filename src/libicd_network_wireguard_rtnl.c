@@ -0,0 +1,191 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Route and rule requests over rtnetlink, added to a wireguard_nl_batch */
+
+#include <glib.h>
+
+#include "libicd_wireguard.h"
+#include "libicd_network_wireguard.h"
+
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/fib_rules.h>
+#include <net/if.h>
+#include <errno.h>
+#include <unistd.h>
+
+static struct rtattr *put_attr(struct nlmsghdr *header, int type, const void *data, size_t len)
+{
+	struct rtattr *rta = (struct rtattr *)((char *)header + NLMSG_ALIGN(header->nlmsg_len));
+
+	rta->rta_type = type;
+	rta->rta_len = RTA_LENGTH(len);
+	if (len)
+		memcpy(RTA_DATA(rta), data, len);
+	header->nlmsg_len = NLMSG_ALIGN(header->nlmsg_len) + RTA_ALIGN(rta->rta_len);
+
+	return rta;
+}
+
+static void put_u32(struct nlmsghdr *header, int type, guint32 value)
+{
+	put_attr(header, type, &value, sizeof(value));
+}
+
+/**
+ * Open a rtnetlink socket for a batch of wireguard_rtnl_route() and
+ * wireguard_rtnl_rule() requests.
+ *
+ * @return the socket, or -1 on error
+ */
+int wireguard_rtnl_open(void)
+{
+	int fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+
+	if (fd < 0)
+		WN_WARN("Unable to open rtnetlink socket: %s", strerror(errno));
+
+	return fd;
+}
+
+/**
+ * Add, replace or delete the device route for prefix.
+ *
+ * @param batch   batch on a socket from wireguard_rtnl_open()
+ * @param type    RTM_NEWROUTE to add or replace, RTM_DELROUTE to delete
+ * @param table   routing table
+ * @param prefix  destination
+ * @param paths   interface indexes to spread the traffic over, equal cost;
+ *                NULL for a throw route, which makes the lookup go on with
+ *                the next rule
+ * @param count   number of paths, ignored for RTM_DELROUTE
+ * @param item    handed to the error callback of the batch if it fails
+ */
+void wireguard_rtnl_route(wireguard_nl_batch * batch, int type, guint32 table, const wireguard_prefix * prefix,
+			  const int *paths, guint count, gpointer item)
+{
+	size_t size = NLMSG_SPACE(sizeof(struct rtmsg)) + RTA_SPACE(sizeof(prefix->addr)) + 2 * RTA_SPACE(4)
+	    + RTA_SPACE(count * RTNH_ALIGN(sizeof(struct rtnexthop)));
+	guint16 flags = type == RTM_DELROUTE ? 0 : NLM_F_CREATE | NLM_F_REPLACE;
+	struct nlmsghdr *header = wireguard_nl_batch_add(batch, type, flags, size, item);
+	struct rtmsg *rtm;
+
+	header->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+
+	rtm = NLMSG_DATA(header);
+	rtm->rtm_family = prefix->family;
+	rtm->rtm_dst_len = prefix->len;
+	rtm->rtm_table = table < 256 ? table : RT_TABLE_UNSPEC;
+	rtm->rtm_protocol = RTPROT_STATIC;
+	rtm->rtm_type = paths ? RTN_UNICAST : RTN_THROW;
+
+	put_attr(header, RTA_DST, prefix->addr, prefix->family == AF_INET ? 4 : 16);
+	put_u32(header, RTA_TABLE, table);
+
+	if (type == RTM_DELROUTE) {
+		rtm->rtm_scope = RT_SCOPE_NOWHERE;
+	} else if (paths == NULL) {
+		rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+	} else {
+		rtm->rtm_scope = RT_SCOPE_LINK;
+
+		if (count == 1) {
+			put_u32(header, RTA_OIF, paths[0]);
+		} else {
+			struct rtattr *multipath = put_attr(header, RTA_MULTIPATH, NULL, 0);
+			guint i;
+
+			for (i = 0; i < count; i++) {
+				struct rtnexthop *nexthop = (struct rtnexthop *)((char *)header + header->nlmsg_len);
+
+				memset(nexthop, 0, sizeof(*nexthop));
+				nexthop->rtnh_len = sizeof(*nexthop);
+				nexthop->rtnh_ifindex = paths[i];
+				header->nlmsg_len += RTNH_ALIGN(sizeof(*nexthop));
+			}
+			multipath->rta_len = (char *)header + header->nlmsg_len - (char *)multipath;
+		}
+	}
+}
+
+/**
+ * Add or delete a policy routing rule that looks up table.
+ *
+ * @param batch             batch on a socket from wireguard_rtnl_open()
+ * @param type              RTM_NEWRULE or RTM_DELRULE
+ * @param family            AF_INET or AF_INET6
+ * @param priority          rule priority
+ * @param table             table to look up
+ * @param fwmark            only for packets with this mark, if fwmask is not 0
+ * @param fwmask            mask for fwmark
+ * @param suppress_default  ignore default routes found in table
+ * @param item              handed to the error callback of the batch if it
+ *                          fails
+ */
+void wireguard_rtnl_rule(wireguard_nl_batch * batch, int type, int family, guint32 priority, guint32 table,
+			 guint32 fwmark, guint32 fwmask, gboolean suppress_default, gpointer item)
+{
+	guint16 flags = type == RTM_NEWRULE ? NLM_F_CREATE | NLM_F_EXCL : 0;
+	struct nlmsghdr *header = wireguard_nl_batch_add(batch, type, flags,
+							 NLMSG_SPACE(sizeof(struct fib_rule_hdr)) + 5 * RTA_SPACE(4),
+							 item);
+	struct fib_rule_hdr *rule;
+
+	header->nlmsg_len = NLMSG_LENGTH(sizeof(*rule));
+
+	rule = NLMSG_DATA(header);
+	rule->family = family;
+	rule->table = table < 256 ? table : RT_TABLE_UNSPEC;
+	rule->action = FR_ACT_TO_TBL;
+
+	put_u32(header, FRA_PRIORITY, priority);
+	put_u32(header, FRA_TABLE, table);
+	if (fwmask) {
+		put_u32(header, FRA_FWMARK, fwmark);
+		put_u32(header, FRA_FWMASK, fwmask);
+	}
+	if (suppress_default)
+		put_u32(header, FRA_SUPPRESS_PREFIXLEN, 0);
+}
+
+/**
+ * Delete a link by name.
+ *
+ * @param batch   batch on a socket from wireguard_rtnl_open()
+ * @param ifname  the link
+ * @param item    handed to the error callback of the batch if it fails
+ */
+void wireguard_rtnl_link_delete(wireguard_nl_batch * batch, const char *ifname, gpointer item)
+{
+	struct nlmsghdr *header = wireguard_nl_batch_add(batch, RTM_DELLINK, 0,
+							 NLMSG_SPACE(sizeof(struct ifinfomsg)) + RTA_SPACE(IFNAMSIZ),
+							 item);
+	struct ifinfomsg *ifi;
+
+	header->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+
+	ifi = NLMSG_DATA(header);
+	ifi->ifi_family = AF_UNSPEC;
+
+	put_attr(header, IFLA_IFNAME, ifname, MIN(strlen(ifname) + 1, IFNAMSIZ));
+}
@@ -0,0 +1,316 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+/*
+ * Child processes. icd2 can be large, and a fork() copies its page tables
+ * only for the child to exec right away, so whenever no credentials need to
+ * change children are started with posix_spawn(), which shares our memory
+ * until the exec. That needs posix_spawn_file_actions_addclosefrom_np() to
+ * keep the fds icd2 left open from the child, otherwise we fork. Their
+ * stderr goes to our log, a line at a time, from the main loop.
+ */
+
+#include "libicd_network_wireguard.h"
+
+#include <spawn.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+extern char **environ;
+
+/* Longer stderr lines are logged in parts */
+#define STDERR_LINE_MAX 512
+
+struct stderr_reader {
+	network_wireguard_private *private;
+	gchar *name;
+	pid_t pid;
+	GIOChannel *channel;
+	guint watch;
+	GString *line;
+};
+
+static void reader_free(struct stderr_reader *reader)
+{
+	if (reader->watch)
+		g_source_remove(reader->watch);
+	g_io_channel_unref(reader->channel);
+	g_string_free(reader->line, TRUE);
+	g_free(reader->name);
+	g_free(reader);
+}
+
+static void log_line(struct stderr_reader *reader)
+{
+	if (reader->line->len)
+		WN_INFO("%s %d: %s", reader->name, reader->pid, reader->line->str);
+	g_string_truncate(reader->line, 0);
+}
+
+static gboolean stderr_cb(GIOChannel * channel, GIOCondition condition, gpointer user_data)
+{
+	struct stderr_reader *reader = user_data;
+	char buf[STDERR_LINE_MAX];
+	ssize_t len, i;
+
+	len = read(g_io_channel_unix_get_fd(channel), buf, sizeof(buf));
+	if (len < 0 && (errno == EINTR || errno == EAGAIN))
+		return TRUE;
+
+	for (i = 0; i < len; i++) {
+		if (buf[i] == '\n' || reader->line->len == STDERR_LINE_MAX)
+			log_line(reader);
+		if (buf[i] != '\n')
+			g_string_append_c(reader->line, buf[i]);
+	}
+
+	if (len > 0)
+		return TRUE;
+
+	/* Every copy of the write end is closed, the child is done with it */
+	log_line(reader);
+	reader->private->spawn_readers = g_slist_remove(reader->private->spawn_readers, reader);
+	reader->watch = 0;
+	reader_free(reader);
+
+	return FALSE;
+}
+
+static void read_stderr(network_wireguard_private * private, const char *pathname, pid_t pid, int fd)
+{
+	struct stderr_reader *reader = g_new0(struct stderr_reader, 1);
+
+	reader->private = private;
+	reader->name = g_path_get_basename(pathname);
+	reader->pid = pid;
+	reader->line = g_string_sized_new(64);
+	reader->channel = g_io_channel_unix_new(fd);
+	g_io_channel_set_close_on_unref(reader->channel, TRUE);
+	reader->watch = g_io_add_watch(reader->channel, G_IO_IN | G_IO_HUP | G_IO_ERR, stderr_cb, reader);
+
+	private->spawn_readers = g_slist_prepend(private->spawn_readers, reader);
+}
+
+/* Look username up, unless it is who we ran as last time */
+static gboolean resolve_user(network_wireguard_private * private, const char *username)
+{
+	struct passwd *ent;
+
+	if (string_equal(private->spawn_user, username))
+		return TRUE;
+
+	ent = getpwnam(username);
+	if (ent == NULL)
+		return FALSE;
+
+	g_free(private->spawn_user);
+	private->spawn_user = g_strdup(username);
+	private->spawn_uid = ent->pw_uid;
+	private->spawn_gid = ent->pw_gid;
+
+	return TRUE;
+}
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+/* Our own fds are all close-on-exec, this covers those icd2 left open */
+static pid_t spawn(const char *pathname, char *args[], int input_fd, int err_fd)
+{
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t signals;
+	pid_t pid = 0;
+	int ret;
+
+	posix_spawn_file_actions_init(&actions);
+	if (input_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, input_fd, STDIN_FILENO);
+	if (err_fd >= 0)
+		posix_spawn_file_actions_adddup2(&actions, err_fd, STDERR_FILENO);
+	posix_spawn_file_actions_addclosefrom_np(&actions, STDERR_FILENO + 1);
+
+	/* Whatever icd2 blocks or ignores, the child should not */
+	posix_spawnattr_init(&attr);
+	sigemptyset(&signals);
+	posix_spawnattr_setsigmask(&attr, &signals);
+	sigaddset(&signals, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &signals);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK | POSIX_SPAWN_SETSIGDEF);
+
+	ret = posix_spawn(&pid, pathname, &actions, &attr, args, environ);
+	if (ret != 0) {
+		WN_CRIT("spawn_as: posix_spawn(%s) failed: %s\n", pathname, strerror(ret));
+		pid = 0;
+	}
+
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+
+	return pid;
+}
+#endif
+
+/* In a forked child, close the fds icd2 left open; ours are all
+ * close-on-exec */
+static void close_inherited(void)
+{
+#ifdef HAVE_CLOSEFROM
+	closefrom(STDERR_FILENO + 1);
+#else
+	long max = sysconf(_SC_OPEN_MAX);
+	int fd;
+
+	if (max < 0 || max > 65536)
+		max = 65536;
+
+	for (fd = STDERR_FILENO + 1; fd < max; fd++)
+		close(fd);
+#endif
+}
+
+/* setuid() has to be called in a process of its own, as does closing fds
+ * without posix_spawn_file_actions_addclosefrom_np() */
+static pid_t fork_as(network_wireguard_private * private, const char *pathname, char *args[], int input_fd,
+		     int err_fd)
+{
+	pid_t pid = fork();
+
+	if (pid < 0) {
+		WN_CRIT("spawn_as: fork() failed\n");
+		return 0;
+	} else if (pid == 0) {
+		if (input_fd >= 0 && dup2(input_fd, STDIN_FILENO) < 0)
+			_exit(1);
+		if (err_fd >= 0 && dup2(err_fd, STDERR_FILENO) < 0)
+			_exit(1);
+		if (setgid(private->spawn_gid)) {
+			WN_CRIT("setgid failed\n");
+			_exit(1);
+		}
+		if (setuid(private->spawn_uid)) {
+			WN_CRIT("setuid failed\n");
+			_exit(1);
+		}
+		WG_TRACE1(exec, pathname);
+		close_inherited();
+		execv(pathname, args);
+
+		WN_CRIT("execv failed\n");
+		_exit(1);
+	}
+
+	return pid;
+}
+
+/**
+ * Start pathname as username, with input_fd as its stdin. Its stderr is
+ * logged.
+ *
+ * @param private   network module private data
+ * @param username  user to run as
+ * @param pathname  executable, args are its argv as for execv()
+ * @param args      NULL terminated
+ * @param input_fd  stdin of the child, -1 for ours
+ * @return its pid, 0 if it could not be started
+ */
+pid_t spawn_as_with_input(network_wireguard_private * private, const char *username, const char *pathname,
+			  char *args[], int input_fd)
+{
+	int err[2] = { -1, -1 };
+	pid_t pid;
+
+	if (!resolve_user(private, username)) {
+		WN_CRIT("spawn_as: getpwnam failed\n");
+		return 0;
+	}
+
+	/* Not fatal, the child then writes wherever icd2's stderr goes */
+	if (pipe(err) < 0) {
+		WN_WARN("spawn_as: no pipe for stderr: %s\n", strerror(errno));
+		err[0] = err[1] = -1;
+	} else {
+		fcntl(err[0], F_SETFD, FD_CLOEXEC);
+		fcntl(err[1], F_SETFD, FD_CLOEXEC);
+	}
+
+#ifdef HAVE_POSIX_SPAWN_FILE_ACTIONS_ADDCLOSEFROM_NP
+	if (getuid() == private->spawn_uid && geteuid() == private->spawn_uid && getgid() == private->spawn_gid
+	    && getegid() == private->spawn_gid)
+		pid = spawn(pathname, args, input_fd, err[1]);
+	else
+#endif
+		pid = fork_as(private, pathname, args, input_fd, err[1]);
+
+	if (err[1] >= 0)
+		close(err[1]);
+
+	if (pid == 0) {
+		if (err[0] >= 0)
+			close(err[0]);
+		return 0;
+	}
+
+	if (err[0] >= 0)
+		read_stderr(private, pathname, pid, err[0]);
+
+	WG_TRACE2(spawn, pathname, pid);
+	WN_DEBUG("spawn_as got pid: %d\n", pid);
+
+	return pid;
+}
+
+/* pathname and args are like in execv, returns pid, 0 is error */
+pid_t spawn_as(network_wireguard_private * private, const char *username, const char *pathname, char *args[])
+{
+	return spawn_as_with_input(private, username, pathname, args, -1);
+}
+
+/**
+ * Signal a wg-quick run, whether we spawned it or the helper did.
+ *
+ * @param private  network module private data
+ * @param pid      the pid of wg-quick, or the negated id of the helper
+ *                 request running it
+ * @param sig      SIGTERM or SIGKILL
+ */
+void wireguard_spawn_kill(network_wireguard_private * private, pid_t pid, int sig)
+{
+	gboolean sent;
+
+	if (pid < 0)
+		sent = sig == SIGKILL ? wireguard_helper_kill(private, pid) : wireguard_helper_cancel(private, pid);
+	else
+		sent = pid > 0 && kill(pid, sig) == 0;
+
+	if (!sent)
+		WN_WARN("Unable to send signal %d to wg-quick %d", sig, pid);
+}
+
+/* Stop reading stderr, on unload */
+void wireguard_spawn_free(network_wireguard_private * private)
+{
+	g_slist_free_full(private->spawn_readers, (GDestroyNotify) reader_free);
+	private->spawn_readers = NULL;
+	g_free(private->spawn_user);
+	private->spawn_user = NULL;
+}
@@ -0,0 +1,252 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+#include <glib.h>
+
+#include "libicd_wireguard.h"
+#include "dbus_wireguard.h"
+#include "libicd_network_wireguard.h"
+
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <errno.h>
+#include <unistd.h>
+
+static wireguard_peer_stats *find_peer(GSList * peers, const guint8 * public_key)
+{
+	GSList *l;
+
+	for (l = peers; l; l = l->next) {
+		wireguard_peer_stats *peer = l->data;
+
+		if (memcmp(peer->info.public_key, public_key, sizeof(peer->info.public_key)) == 0)
+			return peer;
+	}
+
+	return NULL;
+}
+
+/* Collects the peers of a dump, which only replace the previous ones if the
+ * whole dump succeeded */
+static void snapshot_peer(const wireguard_peer_info * info, gpointer user_data)
+{
+	GArray *infos = user_data;
+	guint i;
+
+	/* Continuation of a peer that was split over several messages */
+	for (i = 0; i < infos->len; i++) {
+		if (memcmp(g_array_index(infos, wireguard_peer_info, i).public_key, info->public_key,
+			   sizeof(info->public_key)) == 0)
+			return;
+	}
+
+	g_array_append_val(infos, *info);
+}
+
+static GSList *replace_peers(GSList * old_peers, GArray * infos)
+{
+	GSList *new_peers = NULL;
+	guint i;
+
+	for (i = 0; i < infos->len; i++) {
+		wireguard_peer_info *info = &g_array_index(infos, wireguard_peer_info, i);
+		wireguard_peer_stats *peer;
+
+		/* Carry the samples of known peers over, so we can compute rates */
+		peer = find_peer(old_peers, info->public_key);
+		if (peer) {
+			old_peers = g_slist_remove(old_peers, peer);
+		} else {
+			peer = g_new0(wireguard_peer_stats, 1);
+		}
+
+		peer->info = *info;
+		new_peers = g_slist_prepend(new_peers, peer);
+	}
+
+	/* Peers that disappeared */
+	g_slist_free_full(old_peers, g_free);
+
+	return new_peers;
+}
+
+static void record_sample(wireguard_peer_stats * peer, gint64 now)
+{
+	guint head = (peer->sample_head + 1) % WIREGUARD_STATS_SAMPLES;
+
+	peer->sample_time[head] = now;
+	peer->sample_rx[head] = peer->info.rx_bytes;
+	peer->sample_tx[head] = peer->info.tx_bytes;
+	peer->sample_head = head;
+	if (peer->sample_count < WIREGUARD_STATS_SAMPLES)
+		peer->sample_count++;
+
+	peer->rx_rate = 0;
+	peer->tx_rate = 0;
+
+	if (peer->sample_count > 1) {
+		guint tail = (head + WIREGUARD_STATS_SAMPLES - (peer->sample_count - 1)) % WIREGUARD_STATS_SAMPLES;
+		gdouble elapsed = (gdouble) (now - peer->sample_time[tail]) / G_USEC_PER_SEC;
+
+		/* Counters reset when the interface is recreated */
+		if (elapsed > 0 && peer->info.rx_bytes >= peer->sample_rx[tail]
+		    && peer->info.tx_bytes >= peer->sample_tx[tail]) {
+			peer->rx_rate = (peer->info.rx_bytes - peer->sample_rx[tail]) / elapsed;
+			peer->tx_rate = (peer->info.tx_bytes - peer->sample_tx[tail]) / elapsed;
+		}
+	}
+}
+
+/**
+ * Return the per-peer statistics, querying the kernel at most once per
+ * statistics interval. All callers within an interval share one snapshot.
+ * If the query fails the previous snapshot is kept until the next interval.
+ *
+ * @param tunnel  the tunnel
+ * @return list of wireguard_peer_stats, owned by the tunnel
+ */
+GSList *wireguard_stats_snapshot(wireguard_tunnel * tunnel)
+{
+	wireguard_stats *stats = &tunnel->stats;
+	gint64 now = g_get_monotonic_time();
+	GArray *infos;
+	GSList *l;
+	int ret;
+
+	if (stats->last_refresh != 0 && now - stats->last_refresh < (gint64) stats->interval * 1000)
+		return stats->peers;
+
+	stats->last_refresh = now;
+
+	if (stats->fd < 0) {
+		stats->fd = wireguard_genl_open(&stats->family_id);
+		if (stats->fd < 0)
+			return stats->peers;
+	}
+
+	infos = g_array_new(FALSE, FALSE, sizeof(wireguard_peer_info));
+
+	ret = wireguard_genl_get_device(stats->fd, stats->family_id, tunnel->interface_name, snapshot_peer, infos);
+	if (ret == 0 || ret == -ENODEV) {
+		/* No tunnel, no peers */
+		if (ret == -ENODEV)
+			g_array_set_size(infos, 0);
+
+		stats->peers = replace_peers(stats->peers, infos);
+		for (l = stats->peers; l; l = l->next)
+			record_sample(l->data, now);
+	} else {
+		WN_WARN("Unable to query wireguard device: %s", strerror(-ret));
+		/* Don't trust the socket anymore, it may still get the reply */
+		close(stats->fd);
+		stats->fd = -1;
+	}
+
+	g_array_free(infos, TRUE);
+
+	return stats->peers;
+}
+
+void wireguard_stats_init(wireguard_tunnel * tunnel)
+{
+	tunnel->stats.fd = -1;
+	/* Read by wireguard_start(), not for every tunnel */
+	tunnel->stats.interval = tunnel->private->stats_interval;
+}
+
+void wireguard_stats_free(wireguard_tunnel * tunnel)
+{
+	if (tunnel->stats.fd >= 0)
+		close(tunnel->stats.fd);
+	tunnel->stats.fd = -1;
+
+	g_slist_free_full(tunnel->stats.peers, g_free);
+	tunnel->stats.peers = NULL;
+}
+
+static gchar *format_endpoint(const wireguard_peer_info * info)
+{
+	char addr[INET6_ADDRSTRLEN];
+
+	if (info->endpoint.ss_family == AF_INET) {
+		const struct sockaddr_in *sin = (const struct sockaddr_in *)&info->endpoint;
+		inet_ntop(AF_INET, &sin->sin_addr, addr, sizeof(addr));
+		return g_strdup_printf("%s:%u", addr, ntohs(sin->sin_port));
+	} else if (info->endpoint.ss_family == AF_INET6) {
+		const struct sockaddr_in6 *sin6 = (const struct sockaddr_in6 *)&info->endpoint;
+		inet_ntop(AF_INET6, &sin6->sin6_addr, addr, sizeof(addr));
+		return g_strdup_printf("[%s]:%u", addr, ntohs(sin6->sin6_port));
+	}
+
+	return g_strdup("");
+}
+
+DBusHandlerResult getstatistics_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
+	DBusMessageIter iter, array, entry;
+	gint64 now = g_get_real_time() / G_USEC_PER_SEC;
+	GSList *l;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, ICD_WIREGUARD_STATISTICS_SIGNATURE, &array);
+
+	for (l = wireguard_stats_snapshot(tunnel); l; l = l->next) {
+		wireguard_peer_stats *peer = l->data;
+		gchar *public_key = g_base64_encode(peer->info.public_key, sizeof(peer->info.public_key));
+		gchar *endpoint = format_endpoint(&peer->info);
+		dbus_uint64_t rx_bytes = peer->info.rx_bytes;
+		dbus_uint64_t tx_bytes = peer->info.tx_bytes;
+		dbus_int64_t handshake_age = peer->info.last_handshake ? now - peer->info.last_handshake : -1;
+		double rx_rate = peer->rx_rate;
+		double tx_rate = peer->tx_rate;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &public_key);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &endpoint);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &rx_bytes);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &tx_bytes);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT64, &handshake_age);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_DOUBLE, &rx_rate);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_DOUBLE, &tx_rate);
+		dbus_message_iter_close_container(&array, &entry);
+
+		g_free(public_key);
+		g_free(endpoint);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
@@ -0,0 +1,219 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+#include <glib.h>
+
+#include "libicd_wireguard.h"
+#include "libicd_network_wireguard.h"
+
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+
+static void write_begin(struct icd_wireguard_status_page *page)
+{
+	__atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void write_end(struct icd_wireguard_status_page *page)
+{
+	__atomic_store_n(&page->sequence, page->sequence + 1, __ATOMIC_RELEASE);
+}
+
+static guint32 page_state(const network_wireguard_state * state)
+{
+	const char *status = wireguard_status_string(state);
+
+	if (strcmp(status, ICD_WIREGUARD_SIGNALS_STATUS_STATE_CONNECTED) == 0)
+		return ICD_WIREGUARD_STATUS_PAGE_STATE_CONNECTED;
+	if (strcmp(status, ICD_WIREGUARD_SIGNALS_STATUS_STATE_STARTED) == 0)
+		return ICD_WIREGUARD_STATUS_PAGE_STATE_STARTED;
+
+	return ICD_WIREGUARD_STATUS_PAGE_STATE_STOPPED;
+}
+
+static gboolean status_page_counters_cb(gpointer user_data)
+{
+	WG_PROFILE();
+	network_wireguard_private *priv = user_data;
+
+	wireguard_stats_snapshot(wireguard_main_tunnel(priv));
+	status_page_update(priv);
+
+	return TRUE;
+}
+
+/**
+ * Create and map the status page at ICD_WIREGUARD_STATUS_PAGE_PATH. Failure
+ * is not fatal, the page is simply not published.
+ *
+ * @param private  network module private data
+ */
+void status_page_open(network_wireguard_private * private)
+{
+	status_page_open_at(private, ICD_WIREGUARD_STATUS_PAGE_PATH);
+}
+
+/**
+ * Like status_page_open(), somewhere else than where clients look for it.
+ *
+ * @param private  network module private data
+ * @param path     the file to publish the page in
+ */
+void status_page_open_at(network_wireguard_private * private, const char *path)
+{
+	struct icd_wireguard_status_page *page;
+	gchar *dir = g_path_get_dirname(path);
+	int fd;
+
+	if (g_mkdir_with_parents(dir, 0755) != 0) {
+		WN_WARN("Unable to create %s: %s", dir, strerror(errno));
+		g_free(dir);
+		return;
+	}
+	g_free(dir);
+
+	/* Start from a fresh file so no reader can see a stale layout */
+	unlink(path);
+
+	fd = open(path, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		WN_WARN("Unable to create status page: %s", strerror(errno));
+		return;
+	}
+
+	if (ftruncate(fd, sizeof(*page)) != 0) {
+		WN_WARN("Unable to size status page: %s", strerror(errno));
+		close(fd);
+		return;
+	}
+
+	page = mmap(NULL, sizeof(*page), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (page == MAP_FAILED) {
+		WN_WARN("Unable to map status page: %s", strerror(errno));
+		return;
+	}
+
+	/* The file is zero filled, so the sequence starts out even */
+	write_begin(page);
+	page->size = sizeof(*page);
+	page->version = ICD_WIREGUARD_STATUS_PAGE_VERSION;
+	page->interface_index = -1;
+	page->state_timestamp = g_get_real_time();
+	page->update_timestamp = page->state_timestamp;
+	page->magic = ICD_WIREGUARD_STATUS_PAGE_MAGIC;
+	write_end(page);
+
+	private->status_page = page;
+	private->status_page_path = g_strdup(path);
+}
+
+/**
+ * Publish the current state of the main tunnel, and the traffic counters of
+ * its last statistics snapshot. While the tunnel runs the counters are
+ * refreshed every statistics interval.
+ *
+ * @param private  network module private data
+ */
+void status_page_update(network_wireguard_private * private)
+{
+	struct icd_wireguard_status_page *page = private->status_page;
+	wireguard_tunnel *tunnel;
+	guint32 state;
+	guint64 rx_bytes = 0, tx_bytes = 0, last_handshake = 0;
+	guint32 peer_count = 0;
+	gint64 now;
+	GSList *l;
+
+	if (page == NULL)
+		return;
+
+	tunnel = wireguard_main_tunnel(private);
+	state = page_state(&tunnel->state);
+
+	if (state != ICD_WIREGUARD_STATUS_PAGE_STATE_STOPPED) {
+		if (private->status_page_timer == 0 && tunnel->stats.interval > 0)
+			private->status_page_timer = g_timeout_add(tunnel->stats.interval,
+								   status_page_counters_cb, private);
+
+		for (l = tunnel->stats.peers; l; l = l->next) {
+			wireguard_peer_stats *peer = l->data;
+
+			rx_bytes += peer->info.rx_bytes;
+			tx_bytes += peer->info.tx_bytes;
+			if ((guint64) peer->info.last_handshake > last_handshake)
+				last_handshake = peer->info.last_handshake;
+			peer_count++;
+		}
+	} else if (private->status_page_timer != 0) {
+		g_source_remove(private->status_page_timer);
+		private->status_page_timer = 0;
+	}
+
+	now = g_get_real_time();
+
+	write_begin(page);
+	if (page->state != state)
+		page->state_timestamp = now;
+	page->state = state;
+	page->mode = tunnel->state.service_provider_mode ?
+	    ICD_WIREGUARD_STATUS_PAGE_MODE_PROVIDER : ICD_WIREGUARD_STATUS_PAGE_MODE_NORMAL;
+	page->interface_index = tunnel->state.wireguard_interface_index;
+	page->connect_timestamp = tunnel->connect_timestamp;
+	page->update_timestamp = now;
+	page->peer_count = peer_count;
+	page->rx_bytes = rx_bytes;
+	page->tx_bytes = tx_bytes;
+	page->last_handshake = last_handshake;
+	g_strlcpy(page->active_config, tunnel->state.active_config ? tunnel->state.active_config : "",
+		  sizeof(page->active_config));
+	write_end(page);
+}
+
+void status_page_close(network_wireguard_private * private)
+{
+	struct icd_wireguard_status_page *page = private->status_page;
+
+	if (private->status_page_timer != 0) {
+		g_source_remove(private->status_page_timer);
+		private->status_page_timer = 0;
+	}
+
+	if (page == NULL)
+		return;
+
+	/* Readers that keep the mapping see that we are gone */
+	write_begin(page);
+	page->state = ICD_WIREGUARD_STATUS_PAGE_STATE_STOPPED;
+	page->interface_index = -1;
+	page->update_timestamp = g_get_real_time();
+	write_end(page);
+
+	munmap(page, sizeof(*page));
+	unlink(private->status_page_path);
+
+	private->status_page = NULL;
+	g_free(private->status_page_path);
+	private->status_page_path = NULL;
+}
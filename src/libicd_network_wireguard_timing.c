@@ -0,0 +1,337 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+#include <glib.h>
+
+#include "libicd_wireguard.h"
+#include "dbus_wireguard.h"
+#include "libicd_network_wireguard.h"
+
+/* How often and how long we look for the first handshake after wg-quick
+ * finished: first after HANDSHAKE_POLL_INTERVAL milliseconds, then twice as
+ * long every time up to HANDSHAKE_POLL_MAX_INTERVAL */
+#define HANDSHAKE_POLL_INTERVAL 100
+#define HANDSHAKE_POLL_MAX_INTERVAL 5000
+#define HANDSHAKE_POLL_TIMEOUT (30 * G_USEC_PER_SEC)
+
+static const char *phase_names[WIREGUARD_TIMING_PHASE_COUNT] = {
+	[WIREGUARD_TIMING_GENERATE_CONFIG] = "generate_config",
+	[WIREGUARD_TIMING_WRITE_CONFIG] = "write_config",
+	[WIREGUARD_TIMING_SPAWN] = "spawn",
+	[WIREGUARD_TIMING_WG_QUICK] = "wg_quick",
+	[WIREGUARD_TIMING_INTERFACE_UP] = "interface_up",
+	[WIREGUARD_TIMING_CONNECT] = "connect",
+	[WIREGUARD_TIMING_HANDSHAKE] = "handshake",
+};
+
+/* Log-linear buckets: values below 4 get their own bucket, above that every
+ * power of two is split in four, which bounds the error of a percentile to
+ * 25% of the value */
+static guint bucket_index(guint64 value)
+{
+	int msb;
+	guint index;
+
+	if (value < 4)
+		return value;
+
+	msb = 63 - __builtin_clzll(value);
+	index = (msb - 1) * 4 + ((value >> (msb - 2)) & 3);
+
+	return MIN(index, WIREGUARD_TIMING_BUCKETS - 1);
+}
+
+static guint64 bucket_upper(guint index)
+{
+	int msb;
+
+	if (index < 4)
+		return index;
+
+	msb = index / 4 + 1;
+
+	return ((guint64) (4 + index % 4 + 1) << (msb - 2)) - 1;
+}
+
+static void histogram_add(wireguard_histogram * histogram, guint64 value)
+{
+	histogram->buckets[bucket_index(value)]++;
+	histogram->count++;
+	if (value > histogram->max)
+		histogram->max = value;
+}
+
+static guint64 histogram_percentile(const wireguard_histogram * histogram, guint percentile)
+{
+	guint64 rank, seen = 0;
+	guint i;
+
+	if (histogram->count == 0)
+		return 0;
+
+	rank = (histogram->count * percentile + 99) / 100;
+
+	for (i = 0; i < WIREGUARD_TIMING_BUCKETS; i++) {
+		seen += histogram->buckets[i];
+		if (seen >= rank)
+			return MIN(bucket_upper(i), histogram->max);
+	}
+
+	return histogram->max;
+}
+
+static void record(wireguard_tunnel * tunnel, enum wireguard_timing_phase phase, gint64 since)
+{
+	wireguard_timing *timing = &tunnel->timing;
+	gint64 duration = g_get_monotonic_time() - since;
+
+	if (duration < 0)
+		duration = 0;
+
+	timing->current[phase] = duration;
+	histogram_add(&tunnel->private->timings[phase], duration);
+}
+
+static void log_connect(wireguard_tunnel * tunnel)
+{
+	wireguard_timing *timing = &tunnel->timing;
+	GString *line = g_string_new(tunnel->interface_name);
+	int i;
+
+	g_string_append(line, " connect timings (us):");
+	for (i = 0; i < WIREGUARD_TIMING_PHASE_COUNT; i++) {
+		if (timing->current[i] < 0)
+			g_string_append_printf(line, " %s=-", phase_names[i]);
+		else
+			g_string_append_printf(line, " %s=%" G_GINT64_FORMAT, phase_names[i], timing->current[i]);
+	}
+
+	WN_INFO("%s", line->str);
+	g_string_free(line, TRUE);
+}
+
+static void stop_handshake_poll(wireguard_timing * timing)
+{
+	if (timing->handshake_timer != 0) {
+		g_source_remove(timing->handshake_timer);
+		timing->handshake_timer = 0;
+	}
+}
+
+static gboolean handshake_poll_cb(gpointer user_data)
+{
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
+	wireguard_timing *timing = &tunnel->timing;
+	GSList *l;
+
+	if (tunnel->state.tunnel != WIREGUARD_STATE_RUNNING) {
+		WN_INFO("Tunnel stopped before the first handshake");
+		goto done;
+	}
+
+	/* Bypass the statistics interval while we poll more often than it */
+	if (timing->handshake_interval < tunnel->stats.interval)
+		tunnel->stats.last_refresh = 0;
+	for (l = wireguard_stats_snapshot(tunnel); l; l = l->next) {
+		wireguard_peer_stats *peer = l->data;
+
+		if (peer->info.last_handshake != 0) {
+			record(tunnel, WIREGUARD_TIMING_HANDSHAKE, timing->connected);
+			goto done;
+		}
+	}
+
+	if (g_get_monotonic_time() - timing->connected < HANDSHAKE_POLL_TIMEOUT) {
+		timing->handshake_interval = MIN(timing->handshake_interval * 2, HANDSHAKE_POLL_MAX_INTERVAL);
+		timing->handshake_timer = g_timeout_add(timing->handshake_interval, handshake_poll_cb, tunnel);
+		return FALSE;
+	}
+
+	WN_INFO("No handshake within %d seconds", (int)(HANDSHAKE_POLL_TIMEOUT / G_USEC_PER_SEC));
+
+ done:
+	log_connect(tunnel);
+	timing->handshake_timer = 0;
+	return FALSE;
+}
+
+/**
+ * Start timing a connect attempt, called before anything else is done for it.
+ *
+ * @param tunnel   the tunnel
+ */
+void wireguard_timing_begin(wireguard_tunnel * tunnel)
+{
+	wireguard_timing *timing = &tunnel->timing;
+	int i;
+
+	stop_handshake_poll(timing);
+
+	for (i = 0; i < WIREGUARD_TIMING_PHASE_COUNT; i++)
+		timing->current[i] = -1;
+
+	timing->phase_start = timing->connect_start = g_get_monotonic_time();
+	timing->spawned = 0;
+	timing->connected = 0;
+	timing->helper_up = 0;
+}
+
+/**
+ * Record the end of one of the synchronous phases in startup_wireguard(), the
+ * next phase starts right away.
+ *
+ * @param tunnel   the tunnel
+ * @param phase    the phase that just ended
+ */
+void wireguard_timing_phase_done(wireguard_tunnel * tunnel, enum wireguard_timing_phase phase)
+{
+	wireguard_timing *timing = &tunnel->timing;
+
+	record(tunnel, phase, timing->phase_start);
+	timing->phase_start = g_get_monotonic_time();
+
+	if (phase == WIREGUARD_TIMING_SPAWN)
+		timing->spawned = timing->phase_start;
+}
+
+/**
+ * The helper runs wg-quick up for the attempt. Writing the config and the
+ * spawn end when the helper says so, see wireguard_timing_helper_done().
+ *
+ * @param tunnel   the tunnel
+ * @param pid      what stands in for the wg-quick pid
+ */
+void wireguard_timing_helper_queued(wireguard_tunnel * tunnel, pid_t pid)
+{
+	tunnel->timing.helper_up = pid;
+}
+
+/**
+ * The helper wrote the config of the tunnel or started a wg-quick. Only the
+ * config and the wg-quick up of the current attempt count.
+ *
+ * @param tunnel   the tunnel
+ * @param phase    WIREGUARD_TIMING_WRITE_CONFIG or WIREGUARD_TIMING_SPAWN
+ * @param pid      for WIREGUARD_TIMING_SPAWN, what stands in for the pid of
+ *                 the wg-quick that started
+ */
+void wireguard_timing_helper_done(wireguard_tunnel * tunnel, enum wireguard_timing_phase phase, pid_t pid)
+{
+	wireguard_timing *timing = &tunnel->timing;
+
+	if (timing->helper_up == 0 || timing->current[phase] >= 0)
+		return;
+	if (phase == WIREGUARD_TIMING_SPAWN && pid != timing->helper_up)
+		return;
+
+	wireguard_timing_phase_done(tunnel, phase);
+	if (phase == WIREGUARD_TIMING_SPAWN)
+		timing->helper_up = 0;
+}
+
+void wireguard_timing_interface_up(wireguard_tunnel * tunnel)
+{
+	wireguard_timing *timing = &tunnel->timing;
+
+	/* Only the first UP event after the spawn counts */
+	if (timing->spawned == 0 || timing->current[WIREGUARD_TIMING_INTERFACE_UP] >= 0)
+		return;
+
+	record(tunnel, WIREGUARD_TIMING_INTERFACE_UP, timing->spawned);
+}
+
+/**
+ * wg-quick exited; on success the tunnel is connected and we start looking
+ * for the first handshake.
+ *
+ * @param tunnel   the tunnel
+ * @param success  whether wg-quick succeeded
+ */
+void wireguard_timing_wg_quick_exit(wireguard_tunnel * tunnel, gboolean success)
+{
+	wireguard_timing *timing = &tunnel->timing;
+
+	if (timing->spawned == 0)
+		return;
+
+	record(tunnel, WIREGUARD_TIMING_WG_QUICK, timing->spawned);
+	timing->spawned = 0;
+
+	if (!success) {
+		log_connect(tunnel);
+		return;
+	}
+
+	record(tunnel, WIREGUARD_TIMING_CONNECT, timing->connect_start);
+	timing->connected = g_get_monotonic_time();
+	timing->handshake_interval = HANDSHAKE_POLL_INTERVAL;
+	timing->handshake_timer = g_timeout_add(timing->handshake_interval, handshake_poll_cb, tunnel);
+}
+
+void wireguard_timing_free(wireguard_tunnel * tunnel)
+{
+	stop_handshake_poll(&tunnel->timing);
+}
+
+DBusHandlerResult gettimings_callback(DBusConnection * connection, DBusMessage * message, void *user_data)
+{
+	WG_PROFILE();
+	wireguard_tunnel *tunnel = user_data;
+	DBusMessageIter iter, array, entry;
+	int i;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, ICD_WIREGUARD_TIMINGS_SIGNATURE, &array);
+
+	for (i = 0; i < WIREGUARD_TIMING_PHASE_COUNT; i++) {
+		const wireguard_histogram *histogram = &tunnel->private->timings[i];
+		dbus_uint64_t count = histogram->count;
+		dbus_uint64_t p50 = histogram_percentile(histogram, 50);
+		dbus_uint64_t p95 = histogram_percentile(histogram, 95);
+		dbus_uint64_t p99 = histogram_percentile(histogram, 99);
+		dbus_uint64_t max = histogram->max;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &phase_names[i]);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &count);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &p50);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &p95);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &p99);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &max);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		WN_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
@@ -0,0 +1,230 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Every IAP gets its own tunnel: icdwg0 if that is free, otherwise the
+ * lowest free icdwgN. icdwg0 always exists, the others are created for an IAP
+ * and freed once the IAP is gone and their last wg-quick exited.
+ */
+
+#include "libicd_network_wireguard.h"
+
+static wireguard_tunnel *tunnel_new(network_wireguard_private * private, guint index)
+{
+	wireguard_tunnel *tunnel = g_new0(wireguard_tunnel, 1);
+
+	tunnel->private = private;
+	tunnel->index = index;
+	tunnel->interface_name = g_strdup_printf(WIREGUARD_INTERFACE_PREFIX "%u", index);
+	tunnel->config_path = g_strdup_printf("/etc/wireguard/%s.conf", tunnel->interface_name);
+	tunnel->object_path = g_strdup_printf(ICD_WIREGUARD_DBUS_PATH "/%s", tunnel->interface_name);
+
+	tunnel->state.tunnel = WIREGUARD_STATE_IDLE;
+	tunnel->state.system_wide_enabled = private->system_wide_enabled;
+	tunnel->state.wireguard_interface_index = -1;
+
+	g_queue_init(&tunnel->ops);
+	wireguard_stats_init(tunnel);
+
+	/* Not fatal, the tunnel is still reachable through the IAP */
+	if (setup_wireguard_dbus_path(tunnel->object_path, tunnel))
+		WN_WARN("Could not register %s", tunnel->object_path);
+
+	g_hash_table_insert(private->tunnels, tunnel->interface_name, tunnel);
+	WN_INFO("Created tunnel %s", tunnel->interface_name);
+
+	return tunnel;
+}
+
+static void tunnel_free(wireguard_tunnel * tunnel)
+{
+	WN_INFO("Freeing tunnel %s", tunnel->interface_name);
+
+	free_wireguard_dbus_path(tunnel->object_path);
+	wireguard_tunnel_ops_free(tunnel);
+	wireguard_timing_free(tunnel);
+	wireguard_stats_free(tunnel);
+	properties_free(&tunnel->properties);
+
+	if (tunnel->prefixes)
+		g_array_free(tunnel->prefixes, TRUE);
+	if (tunnel->excludes)
+		g_array_free(tunnel->excludes, TRUE);
+	if (tunnel->prefix_lists)
+		g_ptr_array_free(tunnel->prefix_lists, TRUE);
+	g_slist_free_full(tunnel->prefix_files, (GDestroyNotify) wireguard_prefix_file_free);
+	g_free(tunnel->last_error);
+	g_free(tunnel->state.active_config);
+	g_free(tunnel->interface_name);
+	g_free(tunnel->config_path);
+	g_free(tunnel->object_path);
+	g_free(tunnel);
+}
+
+/* Nothing to do for it anymore */
+static gboolean tunnel_unused(const wireguard_tunnel * tunnel)
+{
+	return tunnel->network_data == NULL && tunnel->state.tunnel == WIREGUARD_STATE_IDLE;
+}
+
+void wireguard_tunnels_init(network_wireguard_private * private)
+{
+	private->tunnels = g_hash_table_new_full(g_str_hash, g_str_equal, NULL, (GDestroyNotify) tunnel_free);
+	/* Keys are the network_id of the IAP */
+	private->tunnels_by_iap = g_hash_table_new(g_str_hash, g_str_equal);
+
+	private->first_tunnel = tunnel_new(private, 0);
+}
+
+void wireguard_tunnels_free(network_wireguard_private * private)
+{
+	if (g_hash_table_size(private->tunnels_by_iap) != 0)
+		WN_CRIT("ipv4 still has connected networks");
+
+	g_hash_table_destroy(private->tunnels_by_iap);
+	private->tunnels_by_iap = NULL;
+	g_hash_table_destroy(private->tunnels);
+	private->tunnels = NULL;
+	private->first_tunnel = NULL;
+
+	g_slist_free(private->abandoned);
+	private->abandoned = NULL;
+}
+
+/**
+ * Find the tunnel of an IAP, or pick one for a new IAP. wg-quick may still
+ * be taking down a picked tunnel for an earlier IAP; its operations queue
+ * behind that.
+ *
+ * @param private     network module private data
+ * @param network_id  the IAP
+ * @return the tunnel, attached to the IAP if it already was
+ */
+wireguard_tunnel *wireguard_tunnel_for_iap(network_wireguard_private * private, const gchar * network_id)
+{
+	wireguard_tunnel *tunnel = g_hash_table_lookup(private->tunnels_by_iap, network_id);
+	guint index;
+
+	if (tunnel)
+		return tunnel;
+
+	for (index = 0;; index++) {
+		gchar *name = g_strdup_printf(WIREGUARD_INTERFACE_PREFIX "%u", index);
+
+		tunnel = g_hash_table_lookup(private->tunnels, name);
+		g_free(name);
+
+		if (tunnel == NULL)
+			return tunnel_new(private, index);
+		if (tunnel_unused(tunnel))
+			return tunnel;
+	}
+}
+
+/**
+ * Make tunnel serve network_data, until wireguard_tunnel_detach().
+ *
+ * @param tunnel        tunnel from wireguard_tunnel_for_iap()
+ * @param network_data  the IAP
+ */
+void wireguard_tunnel_attach(wireguard_tunnel * tunnel, wireguard_network_data * network_data)
+{
+	network_data->tunnel = tunnel;
+	tunnel->network_data = network_data;
+	g_hash_table_insert(tunnel->private->tunnels_by_iap, network_data->network_id, tunnel);
+}
+
+void wireguard_tunnel_detach(wireguard_network_data * network_data)
+{
+	wireguard_tunnel *tunnel = network_data->tunnel;
+
+	if (tunnel == NULL || tunnel->network_data != network_data)
+		return;
+
+	g_hash_table_remove(tunnel->private->tunnels_by_iap, network_data->network_id);
+	tunnel->network_data = NULL;
+	network_data->tunnel = NULL;
+}
+
+wireguard_tunnel *wireguard_tunnel_by_interface(network_wireguard_private * private, const char *interface_name)
+{
+	return g_hash_table_lookup(private->tunnels, interface_name);
+}
+
+/* For links that are already gone, whose name we may not learn anymore */
+wireguard_tunnel *wireguard_tunnel_by_index(network_wireguard_private * private, int interface_index)
+{
+	GHashTableIter iter;
+	wireguard_tunnel *tunnel;
+
+	g_hash_table_iter_init(&iter, private->tunnels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		if (tunnel->state.wireguard_interface_up && tunnel->state.wireguard_interface_index == interface_index)
+			return tunnel;
+	}
+
+	return NULL;
+}
+
+/**
+ * The tunnel ICD_WIREGUARD_DBUS_PATH and the status page show: the one of a
+ * service provider IAP, as the provider module only knows that path, or
+ * else icdwg0.
+ *
+ * @param private  network module private data
+ * @return the tunnel
+ */
+wireguard_tunnel *wireguard_main_tunnel(network_wireguard_private * private)
+{
+	wireguard_tunnel *provider = NULL;
+	GHashTableIter iter;
+	wireguard_tunnel *tunnel;
+
+	g_hash_table_iter_init(&iter, private->tunnels_by_iap);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		if (tunnel->state.service_provider_mode && (provider == NULL || tunnel->index < provider->index))
+			provider = tunnel;
+	}
+
+	return provider ? provider : private->first_tunnel;
+}
+
+/**
+ * Free the tunnels other than icdwg0 that have nothing left to do. Does
+ * nothing while events are handled, queued ones may still refer to them.
+ *
+ * @param private  network module private data
+ */
+void wireguard_tunnels_reap(network_wireguard_private * private)
+{
+	GHashTableIter iter;
+	wireguard_tunnel *tunnel;
+
+	if (private->events_dispatching)
+		return;
+
+	g_hash_table_iter_init(&iter, private->tunnels);
+	while (g_hash_table_iter_next(&iter, NULL, (gpointer *) & tunnel)) {
+		if (tunnel != private->first_tunnel && tunnel_unused(tunnel) && tunnel->op_running == NULL
+		    && g_queue_is_empty(&tunnel->ops))
+			g_hash_table_iter_remove(&iter);
+	}
+}
@@ -36,6 +36,7 @@
 #include <srv_provider_api.h>
 
 #include "libicd_wireguard.h"
+#include "libicd_wireguard_profile.h"
 
 #define WP_DEBUG(fmt, ...) ILOG_DEBUG(("[WIREGUARD PROVIDER] "fmt), ##__VA_ARGS__)
 #define WP_INFO(fmt, ...) ILOG_INFO(("[WIREGUARD PROVIDER] " fmt), ##__VA_ARGS__)
@@ -52,6 +53,12 @@ struct _provider_wireguard_private {
 	icd_srv_limited_conn_fn limited_conn_fn;
 
 	GSList *network_data_list;
+
+	/* Whether the profiler is set up and we get the network module's
+	 * signals yet, see provider_start() */
+	gboolean profiling;
+	gboolean listening;
+	guint start_idle;
 };
 typedef struct _provider_wireguard_private provider_wireguard_private;
 
@@ -174,6 +181,7 @@ static void network_stop_all(wireguard_network_data * network_data)
 
 static void wireguard_get_start_reply(DBusPendingCall * pending, gpointer user_data)
 {
+	WG_PROFILE();
 	DBusMessage *message;
 	int reply = 0;
 	wireguard_network_data *network_data = user_data;
@@ -197,9 +205,12 @@ static void wireguard_get_start_reply(DBusPendingCall * pending, gpointer user_d
 static DBusHandlerResult
 wireguard_provider_statuschanged_sig(DBusConnection * connection, DBusMessage * message, void *user_data)
 {
+	WG_PROFILE();
 	provider_wireguard_private *priv = user_data;
 
-	if (dbus_message_is_signal(message, ICD_WIREGUARD_DBUS_INTERFACE, ICD_WIREGUARD_SIGNAL_STATUSCHANGED)) {
+	/* The tunnels signal on their own paths too, ours is on the main one */
+	if (dbus_message_is_signal(message, ICD_WIREGUARD_DBUS_INTERFACE, ICD_WIREGUARD_SIGNAL_STATUSCHANGED)
+	    && dbus_message_has_path(message, ICD_WIREGUARD_DBUS_PATH)) {
 		const char *status = NULL;
 		const char *mode = NULL;
 		int new_state = PROVIDER_WIREGUARD_STATE_NONE;
@@ -258,6 +269,66 @@ wireguard_provider_statuschanged_sig(DBusConnection * connection, DBusMessage *
 	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
 
+/**
+ * Serve GetProfile on the provider path; the service name itself belongs to
+ * the network module.
+ *
+ * @param connection  D-Bus connection
+ * @param message     D-Bus message
+ * @param user_data   provider private data
+ */
+static DBusHandlerResult wireguard_provider_dbus_request(DBusConnection * connection, DBusMessage * message,
+							 void *user_data)
+{
+	if (dbus_message_is_method_call(message, ICD_WIREGUARD_DBUS_INTERFACE, "GetProfile"))
+		return wireguard_profile_reply(message);
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * Set up the profiler and start listening to the network module's signals.
+ * Adding the bus match is a round trip to the bus, so icd_srv_init() leaves
+ * it for when the main loop is idle, unless a connect comes first. Only the
+ * bus match is retried if it failed.
+ *
+ * @param priv  provider private data
+ * @return TRUE if we get the signals
+ */
+static gboolean provider_start(provider_wireguard_private * priv)
+{
+	if (priv->start_idle != 0) {
+		g_source_remove(priv->start_idle);
+		priv->start_idle = 0;
+	}
+
+	if (!priv->profiling) {
+		wireguard_profile_init(get_profile_slow_threshold());
+		priv->profiling = TRUE;
+	}
+
+	if (priv->listening)
+		return TRUE;
+
+	priv->listening = icd_dbus_connect_system_bcast_signal(ICD_WIREGUARD_DBUS_INTERFACE,
+							       wireguard_provider_statuschanged_sig, priv,
+							       ICD_WIREGUARD_SIGNAL_STATUSCHANGED_FILTER);
+	if (!priv->listening)
+		WP_ERR("Unable to listen to icd2 wireguard signals");
+
+	return priv->listening;
+}
+
+static gboolean start_idle_cb(gpointer user_data)
+{
+	provider_wireguard_private *priv = user_data;
+
+	priv->start_idle = 0;
+	provider_start(priv);
+
+	return FALSE;
+}
+
 /**
  * Function to connect (or authenticate) to the service provider.
  *
@@ -282,9 +353,16 @@ static void wireguard_connect(const gchar * service_type,
 			const gchar * interface_name,
 			icd_srv_connect_cb_fn connect_cb, gpointer connect_cb_token, gpointer * private)
 {
+	WG_PROFILE();
 	provider_wireguard_private *priv = *private;
 	WP_DEBUG("wireguard_connect: %s\n", network_id);
 
+	/* We would never hear that the tunnel came up */
+	if (!provider_start(priv)) {
+		connect_cb(ICD_SRV_ERROR, NULL, connect_cb_token);
+		return;
+	}
+
 	wireguard_network_data *network_data = g_new0(wireguard_network_data, 1);
 
 	network_data->service_type = g_strdup(service_type);
@@ -346,6 +424,7 @@ static void wireguard_disconnect(const gchar * service_type,
 			   const gchar * interface_name,
 			   icd_srv_disconnect_cb_fn disconnect_cb, gpointer disconnect_cb_token, gpointer * private)
 {
+	WG_PROFILE();
 	WP_DEBUG("wireguard_disconnect: %s\n", network_id);
 	provider_wireguard_private *priv = *private;
 
@@ -386,6 +465,7 @@ static void wireguard_identify(enum icd_scan_status status,
 			 const gint dB,
 			 icd_srv_identify_cb_fn identify_cb, gpointer identify_cb_token, gpointer * private)
 {
+	WG_PROFILE();
 	WP_DEBUG("wireguard_identify: network_type: %s, network_name: %s, network_id: %s\n", network_type, network_name,
 		 network_id);
 
@@ -431,14 +511,21 @@ static void wireguard_srv_destruct(gpointer * private)
 
 	WP_DEBUG("wireguard_srv_destruct: priv %p\n", priv);
 
-	icd_dbus_disconnect_system_bcast_signal(ICD_WIREGUARD_DBUS_INTERFACE, wireguard_provider_statuschanged_sig, priv,
-						ICD_WIREGUARD_SIGNAL_STATUSCHANGED_FILTER);
+	if (priv->start_idle != 0)
+		g_source_remove(priv->start_idle);
+	if (priv->listening)
+		icd_dbus_disconnect_system_bcast_signal(ICD_WIREGUARD_DBUS_INTERFACE,
+							wireguard_provider_statuschanged_sig, priv,
+							ICD_WIREGUARD_SIGNAL_STATUSCHANGED_FILTER);
+	icd_dbus_unregister_system_service(ICD_WIREGUARD_PROVIDER_DBUS_PATH, NULL);
 
 	wireguard_network_data *data = NULL;
 	while (data = icd_wireguard_find_first_network_data(priv), data != NULL) {
 		network_free_all(data);
 	}
 
+	wireguard_profile_free();
+
 	g_free(priv);
 	return;
 }
@@ -471,11 +558,13 @@ gboolean icd_srv_init(struct icd_srv_api * srv_api,
 	priv->close_fn = close;
 	priv->limited_conn_fn = limited_conn;
 
-	if (!icd_dbus_connect_system_bcast_signal
-	    (ICD_WIREGUARD_DBUS_INTERFACE, wireguard_provider_statuschanged_sig, priv, ICD_WIREGUARD_SIGNAL_STATUSCHANGED_FILTER)) {
-		WP_ERR("Unable to listen to icd2 wireguard signals");
-		g_free(priv);
-		return FALSE;
+	/* Signals only matter once we connect, provider_start() */
+	priv->start_idle = g_idle_add_full(G_PRIORITY_LOW, start_idle_cb, priv, NULL);
+
+	/* Not fatal, we only lose GetProfile */
+	if (!icd_dbus_register_system_service(ICD_WIREGUARD_PROVIDER_DBUS_PATH, NULL, 0,
+					      wireguard_provider_dbus_request, priv)) {
+		WP_WARN("Unable to register " ICD_WIREGUARD_PROVIDER_DBUS_PATH);
 	}
 
 	return TRUE;
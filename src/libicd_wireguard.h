@@ -3,12 +3,19 @@
 
 #include <glib.h>
 #include "libicd_wireguard_shared.h"
+#include "libicd_wireguard_prefix.h"
 
 gboolean config_is_known(const char* config_name);
 gboolean network_is_wireguard_provider(const char* network_id, char **ret_gconf_service_id);
 gboolean get_system_wide_enabled(void);
-char *generate_config(const char *config_name);
 char *get_active_config(void);
+guint get_statistics_interval(void);
+guint get_profile_slow_threshold(void);
+guint get_op_timeout(void);
+gboolean get_multipath_enabled(void);
+gboolean get_policy_routing_enabled(void);
+char *get_config_excludes(const char *config_name);
+GSList *get_config_prefix_files(const char *config_name);
 
 #define WN_DEBUG(fmt, ...) ILOG_DEBUG(("[WIREGUARD NETWORK] "fmt), ##__VA_ARGS__)
 #define WN_INFO(fmt, ...) ILOG_INFO(("[WIREGUARD NETWORK] " fmt), ##__VA_ARGS__)
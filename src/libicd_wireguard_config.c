@@ -113,107 +113,153 @@ char *get_active_config(void)
 	return active_config;
 }
 
-char *generate_config(const char *config_name)
+guint get_statistics_interval(void)
 {
 	GConfClient *gconf;
-	gchar config[8192];
-	gchar *address, *dns, *privatekey, *configoverride;
-	GSList *peers, *iter;
+	GConfValue *value;
+	guint interval = 1000;
 
 	gconf = gconf_client_get_default();
 
-	gchar *cfgpath = g_strjoin("/", GC_WIREGUARD, config_name, NULL);
+	value = gconf_client_get(gconf, GC_WIREGUARD_STATISTICS_INTERVAL, NULL);
+	if (value) {
+		if (gconf_value_get_int(value) >= 0)
+			interval = gconf_value_get_int(value);
+		gconf_value_free(value);
+	}
 
-	gchar *gc_configoverride = g_strjoin("/", cfgpath, GC_CONFIG_FILE_OVERRIDE, NULL);
-	configoverride = gconf_client_get_string(gconf, gc_configoverride, NULL);
-	g_free(gc_configoverride);
+	g_object_unref(gconf);
 
-	if (configoverride) {
-		GError *error = NULL;
-		char *config_contents = NULL;
-		g_file_get_contents(configoverride, &config_contents, NULL, &error);
-		if (error != NULL) {
-			WN_WARN("Unable to read config override: %s\n", error->message);
-			g_clear_error(&error);
-			return NULL;
-		}
+	return interval;
+}
+
+guint get_profile_slow_threshold(void)
+{
+	GConfClient *gconf;
+	GConfValue *value;
+	guint threshold = 50;
+
+	gconf = gconf_client_get_default();
 
-		return config_contents;
+	value = gconf_client_get(gconf, GC_WIREGUARD_PROFILE_SLOW_THRESHOLD, NULL);
+	if (value) {
+		if (gconf_value_get_int(value) >= 0)
+			threshold = gconf_value_get_int(value);
+		gconf_value_free(value);
 	}
 
-	/* Interface configuration */
-	gchar *gc_privatekey = g_strjoin("/", cfgpath, GC_PRIVATEKEY, NULL);
-	privatekey = gconf_client_get_string(gconf, gc_privatekey, NULL);
-	g_free(gc_privatekey);
-
-	gchar *gc_address = g_strjoin("/", cfgpath, GC_ADDRESS, NULL);
-	address = gconf_client_get_string(gconf, gc_address, NULL);
-	g_free(gc_address);
-
-	gchar *gc_dns = g_strjoin("/", cfgpath, GC_DNS, NULL);
-	dns = gconf_client_get_string(gconf, gc_dns, NULL);
-	g_free(gc_dns);
-
-	if (privatekey == NULL || address == NULL)
-		goto out;
-
-	memset(config, '\0', sizeof(config));
-	strncat(config, "[Interface]", 12);
-	strncat(config, "\nPrivateKey = ", 15);
-	strncat(config, privatekey, strlen(privatekey));
-	strncat(config, "\nAddress = ", 12);
-	strncat(config, address, strlen(address));
-	if (dns) {
-		strncat(config, "\nDNS = ", 8);
-		strncat(config, dns, strlen(dns));
-		strncat(config, "\n", 2);
+	g_object_unref(gconf);
+
+	return threshold;
+}
+
+guint get_op_timeout(void)
+{
+	GConfClient *gconf;
+	GConfValue *value;
+	guint timeout = 30;
+
+	gconf = gconf_client_get_default();
+
+	value = gconf_client_get(gconf, GC_WIREGUARD_OP_TIMEOUT, NULL);
+	if (value) {
+		if (gconf_value_get_int(value) >= 0)
+			timeout = gconf_value_get_int(value);
+		gconf_value_free(value);
 	}
 
-	/* Peers configuration */
-	gchar *gc_peers = g_strjoin("/", cfgpath, GC_PEERS, NULL);
+	g_object_unref(gconf);
+
+	return timeout;
+}
+
+gboolean get_multipath_enabled(void)
+{
+	GConfClient *gconf;
+	gboolean enabled = FALSE;
+
+	gconf = gconf_client_get_default();
+
+	enabled = gconf_client_get_bool(gconf, GC_WIREGUARD_MULTIPATH, NULL);
+
+	g_object_unref(gconf);
+
+	return enabled;
+}
+
+gboolean get_policy_routing_enabled(void)
+{
+	GConfClient *gconf;
+	gboolean enabled = FALSE;
+
+	gconf = gconf_client_get_default();
+
+	enabled = gconf_client_get_bool(gconf, GC_WIREGUARD_POLICY_ROUTING, NULL);
+
+	g_object_unref(gconf);
+
+	return enabled;
+}
+
+char *get_config_excludes(const char *config_name)
+{
+	GConfClient *gconf;
+	gchar *excludes;
+
+	gconf = gconf_client_get_default();
+
+	gchar *gc_exclude = g_strjoin("/", GC_WIREGUARD, config_name, GC_EXCLUDE, NULL);
+	excludes = gconf_client_get_string(gconf, gc_exclude, NULL);
+	g_free(gc_exclude);
+
+	g_object_unref(gconf);
+
+	return excludes;
+}
+
+/**
+ * The peers of a config that have a GC_PEER_IPS_FILE, and a public key.
+ *
+ * @param config_name  the config
+ * @return list of wireguard_prefix_file, free with
+ *         wireguard_prefix_file_free()
+ */
+GSList *get_config_prefix_files(const char *config_name)
+{
+	GConfClient *gconf;
+	GSList *peers, *iter, *files = NULL;
+
+	gconf = gconf_client_get_default();
+
+	gchar *gc_peers = g_strjoin("/", GC_WIREGUARD, config_name, GC_PEERS, NULL);
 	peers = gconf_client_all_dirs(gconf, gc_peers, NULL);
 	g_free(gc_peers);
 
-	if (peers == NULL)
-		goto out;
-
 	for (iter = peers; iter; iter = iter->next) {
-		gchar *gc_peer_ips = g_strjoin("/", iter->data, GC_PEER_IPS, NULL);
-		gchar *peer_ips = gconf_client_get_string(gconf, gc_peer_ips, NULL);
-		g_free(gc_peer_ips);
+		gchar *gc_file = g_strjoin("/", iter->data, GC_PEER_IPS_FILE, NULL);
+		gchar *path = gconf_client_get_string(gconf, gc_file, NULL);
+		g_free(gc_file);
 
-		gchar *gc_endpoint = g_strjoin("/", iter->data, GC_PEER_ENDPOINT, NULL);
-		gchar *endpoint = gconf_client_get_string(gconf, gc_endpoint, NULL);
-		g_free(gc_endpoint);
+		if (path == NULL)
+			continue;
 
 		gchar *gc_pubkey = g_strjoin("/", iter->data, GC_PEER_PUBKEY, NULL);
 		gchar *pubkey = gconf_client_get_string(gconf, gc_pubkey, NULL);
 		g_free(gc_pubkey);
 
-		g_free(iter->data);
-
-		if (peer_ips == NULL || endpoint == NULL || pubkey == NULL)
-			continue;
+		if (pubkey) {
+			wireguard_prefix_file *file = g_new0(wireguard_prefix_file, 1);
 
-		strncat(config, "\n[Peer]", 8);
-		strncat(config, "\nPublicKey = ", 14);
-		strncat(config, pubkey, strlen(pubkey));
-		strncat(config, "\nEndPoint = ", 13);
-		strncat(config, endpoint, strlen(endpoint));
-		strncat(config, "\nAllowedIPs = ", 15);
-		strncat(config, peer_ips, strlen(peer_ips));
-		strncat(config, "\n", 2);
+			file->public_key = pubkey;
+			file->path = path;
+			files = g_slist_prepend(files, file);
+		} else {
+			g_free(path);
+		}
 	}
 
-	g_slist_free(iter);
-	g_slist_free(peers);
-
- out:
-	g_free(cfgpath);
+	g_slist_free_full(peers, g_free);
 	g_object_unref(gconf);
 
-	if (strlen(config) > 0)
-		return g_strdup(config);
-
-	return NULL;
+	return g_slist_reverse(files);
 }
@@ -0,0 +1,73 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __LIBICD_WIREGUARD_HELPER_H
+#define __LIBICD_WIREGUARD_HELPER_H
+
+/*
+ * Protocol between the network module and icd-wireguard-helper, over a
+ * stream socket that is the helper's stdin. Every message is a
+ * wireguard_helper_msg, followed by length bytes of payload. Requests are
+ * answered in any order, each with a message of the same type and id once
+ * it is done; the module may send more before that.
+ *
+ * WIREGUARD_HELPER_CONFIGURE  payload is the config of interface
+ * WIREGUARD_HELPER_UP         wg-quick up interface, fails right away if
+ *                             the last configure of it did
+ * WIREGUARD_HELPER_DOWN       wg-quick down interface
+ * WIREGUARD_HELPER_CANCEL     stop the up or down value, not answered
+ * WIREGUARD_HELPER_KILL       SIGKILL the up or down value, not answered
+ *
+ * Answers carry the wait status of wg-quick in value, or for a configure
+ * 0 or an errno. Before the answer to an up or down, the helper sends a
+ * WIREGUARD_HELPER_STARTED with the same id once wg-quick runs, with its
+ * pid in value.
+ */
+
+#include <stdint.h>
+
+#define WIREGUARD_HELPER_PATH "/usr/libexec/icd-wireguard-helper"
+
+/* The only interfaces the helper touches, followed by a number */
+#define WIREGUARD_INTERFACE_PREFIX "icdwg"
+
+/* Larger configs are refused */
+#define WIREGUARD_HELPER_MAX_PAYLOAD (16 * 1024 * 1024)
+
+enum wireguard_helper_type {
+	WIREGUARD_HELPER_CONFIGURE = 1,
+	WIREGUARD_HELPER_UP,
+	WIREGUARD_HELPER_DOWN,
+	WIREGUARD_HELPER_CANCEL,
+	WIREGUARD_HELPER_KILL,
+	WIREGUARD_HELPER_STARTED,
+};
+
+struct wireguard_helper_msg {
+	uint32_t type;
+	uint32_t id;
+	int32_t value;
+	uint32_t length;
+	char interface[16];
+};
+
+#endif
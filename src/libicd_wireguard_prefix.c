@@ -0,0 +1,364 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+/*
+ * Prefix sets. AllowedIPs lists, one set per peer, are collapsed to as few
+ * prefixes as route every address the way the kernel would route the lists
+ * as given: to the peer with the longest prefix containing it, the later
+ * peer for a prefix several have. Entries another entry of the same set
+ * already decides are dropped, and sibling halves of a set are merged, until
+ * nothing changes.
+ */
+
+#include <stdio.h>
+#include <string.h>
+
+#include <glib.h>
+
+#include "libicd_wireguard_prefix.h"
+
+struct entry {
+	wireguard_prefix prefix;
+	/* Index of the set, and position over all sets, later wins */
+	guint set;
+	guint order;
+	gboolean dead;
+};
+
+static gboolean bit_set(const wireguard_prefix * prefix, guint bit)
+{
+	return prefix->addr[bit / 8] & (0x80 >> (bit % 8));
+}
+
+/* "a.b.c.d/n" or "x::y/n", a single address without "/n" */
+gboolean wireguard_prefix_parse(const char *text, wireguard_prefix * prefix)
+{
+	gchar **parts = g_strsplit(text, "/", 2);
+	gchar *addr = g_strstrip(parts[0]);
+	gboolean ok = FALSE;
+	guint max, i;
+
+	memset(prefix, 0, sizeof(*prefix));
+	if (inet_pton(AF_INET, addr, prefix->addr) == 1) {
+		prefix->family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, addr, prefix->addr) == 1) {
+		prefix->family = AF_INET6;
+		max = 128;
+	} else {
+		goto out;
+	}
+
+	prefix->len = max;
+	if (parts[1]) {
+		gchar *len_text = g_strstrip(parts[1]);
+		gchar *end;
+		guint64 len = g_ascii_strtoull(len_text, &end, 10);
+
+		if (end == len_text || *end != '\0' || len > max)
+			goto out;
+		prefix->len = len;
+	}
+
+	/* The kernel wants them cleared */
+	for (i = prefix->len; i < max; i++)
+		prefix->addr[i / 8] &= ~(0x80 >> (i % 8));
+
+	ok = TRUE;
+
+ out:
+	g_strfreev(parts);
+	return ok;
+}
+
+/**
+ * Write prefix as "addr/len".
+ *
+ * @param prefix  the prefix
+ * @param buf     at least WIREGUARD_PREFIX_STRLEN bytes
+ */
+void wireguard_prefix_format(const wireguard_prefix * prefix, char *buf)
+{
+	inet_ntop(prefix->family, prefix->addr, buf, INET6_ADDRSTRLEN);
+	sprintf(buf + strlen(buf), "/%u", prefix->len);
+}
+
+gboolean wireguard_prefix_contains(const wireguard_prefix * outer, const wireguard_prefix * inner)
+{
+	guint bytes = outer->len / 8, bits = outer->len % 8;
+
+	if (outer->family != inner->family || outer->len > inner->len)
+		return FALSE;
+	if (memcmp(outer->addr, inner->addr, bytes) != 0)
+		return FALSE;
+
+	return bits == 0 || ((outer->addr[bytes] ^ inner->addr[bytes]) & (0xff00 >> bits)) == 0;
+}
+
+/**
+ * Append the comma separated prefixes in value to prefixes.
+ *
+ * @param prefixes  GArray of wireguard_prefix
+ * @param value     e.g. an AllowedIPs value
+ * @return the number of entries that are not a prefix, and were skipped
+ */
+guint wireguard_prefixes_parse(GArray * prefixes, const char *value)
+{
+	const char *start = value, *end;
+	guint invalid = 0;
+
+	/* Without splitting first, AllowedIPs get long */
+	do {
+		gchar *entry;
+		wireguard_prefix prefix;
+
+		end = strchr(start, ',');
+		entry = end ? g_strndup(start, end - start) : g_strdup(start);
+
+		if (wireguard_prefix_parse(entry, &prefix))
+			g_array_append_val(prefixes, prefix);
+		else if (*g_strstrip(entry))
+			invalid++;
+
+		g_free(entry);
+		start = end + 1;
+	} while (end);
+
+	return invalid;
+}
+
+/* The AllowedIPs syntax again, ", " separated */
+void wireguard_prefixes_append(GString * string, const GArray * prefixes)
+{
+	char buf[WIREGUARD_PREFIX_STRLEN];
+	guint i;
+
+	for (i = 0; i < prefixes->len; i++) {
+		wireguard_prefix_format(&g_array_index(prefixes, wireguard_prefix, i), buf);
+		if (i)
+			g_string_append(string, ", ");
+		g_string_append(string, buf);
+	}
+}
+
+/* By family and address, enclosing prefixes before what they contain */
+static gint compare_prefix(const wireguard_prefix * a, const wireguard_prefix * b)
+{
+	int ret;
+
+	if (a->family != b->family)
+		return a->family - b->family;
+	ret = memcmp(a->addr, b->addr, sizeof(a->addr));
+	if (ret)
+		return ret;
+	return a->len - b->len;
+}
+
+static gint compare_entry(gconstpointer a, gconstpointer b)
+{
+	const struct entry *x = a, *y = b;
+	gint ret = compare_prefix(&x->prefix, &y->prefix);
+
+	if (ret)
+		return ret;
+	return x->order < y->order ? -1 : x->order > y->order;
+}
+
+/* Look prefix up among the first count entries */
+static struct entry *find(GArray * entries, guint count, const wireguard_prefix * prefix)
+{
+	guint low = 0, high = count;
+
+	while (low < high) {
+		guint mid = (low + high) / 2;
+		struct entry *entry = &g_array_index(entries, struct entry, mid);
+		gint ret = compare_prefix(&entry->prefix, prefix);
+
+		if (ret == 0)
+			return entry;
+		if (ret < 0)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return NULL;
+}
+
+static void remove_dead(GArray * entries)
+{
+	guint i, kept = 0;
+
+	for (i = 0; i < entries->len; i++) {
+		if (!g_array_index(entries, struct entry, i).dead)
+			g_array_index(entries, struct entry, kept++) = g_array_index(entries, struct entry, i);
+	}
+	g_array_set_size(entries, kept);
+}
+
+/* Drop duplicates, and entries whose closest enclosing entry is of the same
+ * set; they route nothing differently. Entries must be sorted. */
+static void drop_redundant(GArray * entries, wireguard_prefix_overlap_fn overlap_fn, gpointer user_data)
+{
+	GArray *stack = g_array_new(FALSE, FALSE, sizeof(guint));
+	guint i;
+
+	for (i = 0; i < entries->len; i++) {
+		struct entry *entry = &g_array_index(entries, struct entry, i);
+
+		while (stack->len) {
+			struct entry *top = &g_array_index(entries, struct entry,
+							   g_array_index(stack, guint, stack->len - 1));
+
+			if (!wireguard_prefix_contains(&top->prefix, &entry->prefix)) {
+				g_array_set_size(stack, stack->len - 1);
+				continue;
+			}
+
+			if (top->set != entry->set && overlap_fn)
+				overlap_fn(&entry->prefix, entry->set, &top->prefix, top->set, user_data);
+
+			/* The later one of equal prefixes wins */
+			if (top->prefix.len == entry->prefix.len) {
+				top->dead = TRUE;
+				g_array_set_size(stack, stack->len - 1);
+				continue;
+			}
+
+			if (top->set == entry->set)
+				entry->dead = TRUE;
+			break;
+		}
+
+		if (!entry->dead)
+			g_array_append_val(stack, i);
+	}
+
+	g_array_free(stack, TRUE);
+	remove_dead(entries);
+}
+
+/* Replace sibling halves of the same set by the prefix they make up, unless
+ * that is an entry itself. Entries must be sorted and unique. Returns the
+ * number of merges. */
+static guint merge_siblings(GArray * entries)
+{
+	guint i, count = entries->len, merged = 0;
+
+	for (i = 0; i < count; i++) {
+		struct entry *low = &g_array_index(entries, struct entry, i);
+		struct entry parent, *high;
+		wireguard_prefix sibling;
+		guint bit;
+
+		if (low->dead || low->prefix.len == 0)
+			continue;
+
+		bit = low->prefix.len - 1;
+		if (bit_set(&low->prefix, bit))
+			continue;
+
+		sibling = low->prefix;
+		sibling.addr[bit / 8] |= 0x80 >> (bit % 8);
+		high = find(entries, count, &sibling);
+		if (high == NULL || high->dead || high->set != low->set)
+			continue;
+
+		parent = *low;
+		parent.prefix.len--;
+		if (find(entries, count, &parent.prefix))
+			continue;
+
+		parent.order = MAX(low->order, high->order);
+		low->dead = TRUE;
+		high->dead = TRUE;
+		/* Found next round, after sorting */
+		g_array_append_val(entries, parent);
+		merged++;
+	}
+
+	return merged;
+}
+
+/**
+ * Collapse sets of prefixes, e.g. the AllowedIPs of every peer, without
+ * changing where any address is routed. Each set ends up sorted.
+ *
+ * @param sets        GArrays of wireguard_prefix
+ * @param count       number of sets
+ * @param overlap_fn  called for every prefix another set covers too, or NULL
+ * @param user_data   for overlap_fn
+ */
+void wireguard_prefix_sets_collapse(GArray ** sets, guint count, wireguard_prefix_overlap_fn overlap_fn,
+				    gpointer user_data)
+{
+	GArray *entries = g_array_new(FALSE, FALSE, sizeof(struct entry));
+	guint set, i, order = 0;
+	guint merged;
+
+	for (set = 0; set < count; set++) {
+		for (i = 0; i < sets[set]->len; i++) {
+			struct entry entry = {
+				.prefix = g_array_index(sets[set], wireguard_prefix, i),
+				.set = set,
+				.order = order++,
+			};
+			g_array_append_val(entries, entry);
+		}
+	}
+
+	g_array_sort(entries, compare_entry);
+	/* Overlaps as configured, not as they end up after merging */
+	drop_redundant(entries, overlap_fn, user_data);
+
+	do {
+		merged = merge_siblings(entries);
+		if (merged) {
+			remove_dead(entries);
+			g_array_sort(entries, compare_entry);
+			drop_redundant(entries, NULL, NULL);
+		}
+	} while (merged);
+
+	for (set = 0; set < count; set++)
+		g_array_set_size(sets[set], 0);
+	for (i = 0; i < entries->len; i++) {
+		const struct entry *entry = &g_array_index(entries, struct entry, i);
+
+		g_array_append_vals(sets[entry->set], &entry->prefix, 1);
+	}
+
+	g_array_free(entries, TRUE);
+}
+
+/* A single set, e.g. everything routed over one tunnel */
+void wireguard_prefixes_collapse(GArray * prefixes)
+{
+	wireguard_prefix_sets_collapse(&prefixes, 1, NULL, NULL);
+}
+
+void wireguard_prefix_file_free(wireguard_prefix_file * file)
+{
+	g_free(file->public_key);
+	g_free(file->path);
+	g_free(file);
+}
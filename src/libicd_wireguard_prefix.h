@@ -0,0 +1,64 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+
+#ifndef __LIBICD_WIREGUARD_PREFIX_H
+#define __LIBICD_WIREGUARD_PREFIX_H
+
+#include <glib.h>
+#include <arpa/inet.h>
+
+/* Longest "addr/len" wireguard_prefix_format() writes, with its NUL */
+#define WIREGUARD_PREFIX_STRLEN (INET6_ADDRSTRLEN + 4)
+
+/* An AllowedIPs or exclusion entry, host bits cleared */
+struct _wireguard_prefix {
+	guint8 family;
+	guint8 len;
+	guint8 addr[16];
+};
+typedef struct _wireguard_prefix wireguard_prefix;
+
+/* Called for a prefix of one set that another set also covers: outer is
+ * equal to prefix or contains it. Equal ones are taken from the earlier set,
+ * as the kernel would move them to the later peer. */
+typedef void (*wireguard_prefix_overlap_fn) (const wireguard_prefix * prefix, guint set,
+					     const wireguard_prefix * outer, guint outer_set, gpointer user_data);
+
+/* A peer with more AllowedIPs in a file, see GC_PEER_IPS_FILE */
+struct _wireguard_prefix_file {
+	/* Base64, as configured */
+	gchar *public_key;
+	gchar *path;
+};
+typedef struct _wireguard_prefix_file wireguard_prefix_file;
+
+gboolean wireguard_prefix_parse(const char *text, wireguard_prefix * prefix);
+void wireguard_prefix_format(const wireguard_prefix * prefix, char *buf);
+gboolean wireguard_prefix_contains(const wireguard_prefix * outer, const wireguard_prefix * inner);
+guint wireguard_prefixes_parse(GArray * prefixes, const char *value);
+void wireguard_prefixes_append(GString * string, const GArray * prefixes);
+void wireguard_prefix_sets_collapse(GArray ** sets, guint count, wireguard_prefix_overlap_fn overlap_fn,
+				    gpointer user_data);
+void wireguard_prefixes_collapse(GArray * prefixes);
+void wireguard_prefix_file_free(wireguard_prefix_file * file);
+
+#endif				/* __LIBICD_WIREGUARD_PREFIX_H */
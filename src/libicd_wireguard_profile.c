@@ -0,0 +1,194 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#include <time.h>
+
+#include <glib.h>
+
+#include <support/icd_log.h>
+#include <support/icd_dbus.h>
+
+#include "libicd_wireguard.h"
+#include "libicd_wireguard_profile.h"
+
+#define WPROF_WARN(fmt, ...) ILOG_WARN(("[WIREGUARD PROFILE] " fmt), ##__VA_ARGS__)
+
+/* Number of slow calls we remember */
+#define SLOW_CALLS 32
+
+struct slow_call {
+	const char *name;
+	gint64 timestamp;
+	guint64 wall;
+	guint64 cpu;
+};
+
+/* Each module that links this file gets its own copy of this state */
+static GSList *entries = NULL;
+static guint64 slow_threshold = 0;
+static struct slow_call slow_calls[SLOW_CALLS];
+static guint slow_calls_head = 0;
+static guint slow_calls_count = 0;
+
+static gint64 thread_cpu_time(void)
+{
+	struct timespec ts;
+
+	if (clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts) != 0)
+		return 0;
+
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/**
+ * Set up the profiler.
+ *
+ * @param slow_threshold_ms  calls taking longer than this are logged and
+ *                           kept in the slow call log, 0 disables that
+ */
+void wireguard_profile_init(guint slow_threshold_ms)
+{
+	slow_threshold = (guint64) slow_threshold_ms * 1000;
+}
+
+void wireguard_profile_free(void)
+{
+	/* The entries themselves are static */
+	g_slist_free(entries);
+	entries = NULL;
+}
+
+wireguard_profile_sample wireguard_profile_enter(wireguard_profile_entry * entry)
+{
+	wireguard_profile_sample sample;
+
+	if (!entry->registered) {
+		entries = g_slist_append(entries, entry);
+		entry->registered = TRUE;
+	}
+
+	sample.entry = entry;
+	sample.wall_start = g_get_monotonic_time();
+	sample.cpu_start = thread_cpu_time();
+
+	return sample;
+}
+
+void wireguard_profile_leave(wireguard_profile_sample * sample)
+{
+	wireguard_profile_entry *entry = sample->entry;
+	gint64 wall = g_get_monotonic_time() - sample->wall_start;
+	gint64 cpu = thread_cpu_time() - sample->cpu_start;
+
+	if (wall < 0)
+		wall = 0;
+	if (cpu < 0)
+		cpu = 0;
+
+	entry->count++;
+	entry->wall_total += wall;
+	entry->cpu_total += cpu;
+	if ((guint64) wall > entry->wall_max)
+		entry->wall_max = wall;
+	if ((guint64) cpu > entry->cpu_max)
+		entry->cpu_max = cpu;
+
+	if (slow_threshold && (guint64) wall >= slow_threshold) {
+		struct slow_call *call = &slow_calls[slow_calls_head];
+
+		call->name = entry->name;
+		call->timestamp = g_get_real_time();
+		call->wall = wall;
+		call->cpu = cpu;
+
+		slow_calls_head = (slow_calls_head + 1) % SLOW_CALLS;
+		if (slow_calls_count < SLOW_CALLS)
+			slow_calls_count++;
+
+		WPROF_WARN("%s blocked the main loop for %" G_GINT64_FORMAT " us (%" G_GINT64_FORMAT " us cpu)",
+			   entry->name, wall, cpu);
+	}
+}
+
+/**
+ * Reply to a GetProfile method call with the per entry point counters and
+ * the slow call log, oldest first.
+ *
+ * @param message  the method call
+ */
+DBusHandlerResult wireguard_profile_reply(DBusMessage * message)
+{
+	DBusMessageIter iter, array, entry;
+	GSList *l;
+	guint i;
+
+	DBusMessage *reply = dbus_message_new_method_return(message);
+	if (!reply) {
+		WPROF_WARN("Unable to create GetProfile reply");
+		return DBUS_HANDLER_RESULT_NEED_MEMORY;
+	}
+
+	dbus_message_iter_init_append(reply, &iter);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, ICD_WIREGUARD_PROFILE_ENTRY_SIGNATURE, &array);
+	for (l = entries; l; l = l->next) {
+		wireguard_profile_entry *e = l->data;
+		dbus_uint64_t count = e->count;
+		dbus_uint64_t wall_total = e->wall_total;
+		dbus_uint64_t wall_max = e->wall_max;
+		dbus_uint64_t cpu_total = e->cpu_total;
+		dbus_uint64_t cpu_max = e->cpu_max;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &e->name);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &count);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &wall_total);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &wall_max);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &cpu_total);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &cpu_max);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+	dbus_message_iter_close_container(&iter, &array);
+
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_ARRAY, ICD_WIREGUARD_PROFILE_SLOW_CALL_SIGNATURE, &array);
+	for (i = 0; i < slow_calls_count; i++) {
+		struct slow_call *call = &slow_calls[(slow_calls_head + SLOW_CALLS - slow_calls_count + i) % SLOW_CALLS];
+		dbus_int64_t timestamp = call->timestamp;
+		dbus_uint64_t wall = call->wall;
+		dbus_uint64_t cpu = call->cpu;
+
+		dbus_message_iter_open_container(&array, DBUS_TYPE_STRUCT, NULL, &entry);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_STRING, &call->name);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_INT64, &timestamp);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &wall);
+		dbus_message_iter_append_basic(&entry, DBUS_TYPE_UINT64, &cpu);
+		dbus_message_iter_close_container(&array, &entry);
+	}
+	dbus_message_iter_close_container(&iter, &array);
+
+	if (icd_dbus_send_system_msg(reply) == FALSE) {
+		WPROF_WARN("icd_dbus_send_system_msg failed");
+	}
+
+	dbus_message_unref(reply);
+
+	return DBUS_HANDLER_RESULT_HANDLED;
+}
@@ -0,0 +1,65 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __LIBICD_WIREGUARD_PROFILE_H
+#define __LIBICD_WIREGUARD_PROFILE_H
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+/* Per entry point accounting, all times in microseconds */
+struct _wireguard_profile_entry {
+	const char *name;
+	gboolean registered;
+
+	guint64 count;
+	guint64 wall_total;
+	guint64 wall_max;
+	guint64 cpu_total;
+	guint64 cpu_max;
+};
+typedef struct _wireguard_profile_entry wireguard_profile_entry;
+
+struct _wireguard_profile_sample {
+	wireguard_profile_entry *entry;
+	gint64 wall_start;
+	gint64 cpu_start;
+};
+typedef struct _wireguard_profile_sample wireguard_profile_sample;
+
+void wireguard_profile_init(guint slow_threshold_ms);
+void wireguard_profile_free(void);
+wireguard_profile_sample wireguard_profile_enter(wireguard_profile_entry * entry);
+void wireguard_profile_leave(wireguard_profile_sample * sample);
+DBusHandlerResult wireguard_profile_reply(DBusMessage * message);
+
+/*
+ * Put WG_PROFILE() at the top of every function icd2's main loop calls into
+ * us. The time spent is accounted when the function returns, whichever way
+ * it returns.
+ */
+#define WG_PROFILE() \
+	static wireguard_profile_entry __wg_profile_entry = { __func__, }; \
+	wireguard_profile_sample __wg_profile_sample __attribute__ ((cleanup(wireguard_profile_leave))) = \
+		wireguard_profile_enter(&__wg_profile_entry); \
+	(void)__wg_profile_sample
+
+#endif				/* __LIBICD_WIREGUARD_PROFILE_H */
@@ -22,6 +22,9 @@
 #ifndef __LIBICD_WIREGUARD_SHARED_H
 #define __LIBICD_WIREGUARD_SHARED_H
 
+#include <stdint.h>
+#include <string.h>
+
 #define WIREGUARD_NETWORK_TYPE "WIREGUARD"
 #define WIREGUARD_PROVIDER_TYPE "WIREGUARD"
 #define WIREGUARD_PROVIDER_NAME "Wireguard Provider"
@@ -35,6 +38,17 @@
 #define GC_NETWORK_TYPE "/system/osso/connectivity/network_type/WIREGUARD"
 #define GC_WIREGUARD_ACTIVE  GC_NETWORK_TYPE"/active_config"
 #define GC_WIREGUARD_SYSTEM  GC_NETWORK_TYPE"/system_wide_enabled"
+#define GC_WIREGUARD_STATISTICS_INTERVAL GC_NETWORK_TYPE"/statistics_interval"
+#define GC_WIREGUARD_PROFILE_SLOW_THRESHOLD GC_NETWORK_TYPE"/profile_slow_threshold"
+/* Bond the tunnels of IAPs that are up at the same time with the same
+ * config, spreading traffic over them; read when a tunnel comes up */
+#define GC_WIREGUARD_MULTIPATH GC_NETWORK_TYPE"/multipath"
+/* Route AllowedIPs in our own table rather than letting wg-quick put them
+ * in main; implied by multipath, read when a tunnel comes up */
+#define GC_WIREGUARD_POLICY_ROUTING GC_NETWORK_TYPE"/policy_routing"
+/* Seconds a wg-quick up or down may take before it is stopped, 0 for no
+ * limit; read when it starts */
+#define GC_WIREGUARD_OP_TIMEOUT GC_NETWORK_TYPE"/op_timeout"
 
 #define GC_CFG_DNS           "DNS"
 #define GC_CFG_PRIVATEKEY    "PrivateKey"
@@ -49,14 +63,56 @@
 #define GC_PEER_ENDPOINT "EndPoint"
 #define GC_PEER_PUBKEY   "PublicKey"
 #define GC_PEER_PSK      "PresharedKey"
+/* A file listing more AllowedIPs of the peer, separated by commas or
+ * whitespace, # starts a comment; for lists too long for gconf */
+#define GC_PEER_IPS_FILE "AllowedIPsFile"
+/* Comma separated prefixes kept off the tunnel with policy routing */
+#define GC_EXCLUDE       "Exclude"
 
 #define ICD_WIREGUARD_DBUS_INTERFACE "org.maemo.Wireguard"
 #define ICD_WIREGUARD_DBUS_PATH "/org/maemo/Wireguard"
 
+/* Every tunnel serves the methods, the properties below and StatusChanged
+ * on ICD_WIREGUARD_DBUS_PATH "/" interface name, e.g.
+ * /org/maemo/Wireguard/icdwg1. ICD_WIREGUARD_DBUS_PATH itself serves the
+ * tunnel of the service provider IAP, or icdwg0 if there is none. */
+
 #define ICD_WIREGUARD_METHOD_GETSTATUS ICD_WIREGUARD_DBUS_INTERFACE".GetStatus"
+#define ICD_WIREGUARD_METHOD_GETSTATISTICS ICD_WIREGUARD_DBUS_INTERFACE".GetStatistics"
+
+/* GetStatistics returns one struct per peer: base64 public key, endpoint,
+ * rx bytes, tx bytes, seconds since the last handshake (-1 if none), and the
+ * rx and tx rates in bytes per second over the last few samples */
+#define ICD_WIREGUARD_STATISTICS_SIGNATURE "(ssttxdd)"
+
+#define ICD_WIREGUARD_METHOD_GETTIMINGS ICD_WIREGUARD_DBUS_INTERFACE".GetTimings"
+
+/* GetTimings returns one struct per connect phase: phase name, number of
+ * samples, and the p50, p95, p99 and maximum latency in microseconds, over
+ * the connects of all tunnels */
+#define ICD_WIREGUARD_TIMINGS_SIGNATURE "(sttttt)"
+
+#define ICD_WIREGUARD_METHOD_GETCONFIGCHECKS ICD_WIREGUARD_DBUS_INTERFACE".GetConfigChecks"
+
+/* GetConfigChecks returns one struct per config, as checked since it last
+ * changed: its name, why it cannot be used and what else is wrong with it,
+ * either empty if nothing. Start and ip_up refuse configs that cannot be
+ * used. */
+#define ICD_WIREGUARD_CONFIG_CHECKS_SIGNATURE "(sss)"
+
+/* Both modules serve GetProfile, the provider module on its own path. It
+ * returns the entry points icd2's main loop called into, as name, number of
+ * calls, total and maximum wall time, total and maximum cpu time; followed by
+ * the most recent calls that took longer than profile_slow_threshold as
+ * name, wall clock timestamp, wall time and cpu time. All times are in
+ * microseconds. */
+#define ICD_WIREGUARD_PROVIDER_DBUS_PATH ICD_WIREGUARD_DBUS_PATH"/Provider"
+#define ICD_WIREGUARD_METHOD_GETPROFILE ICD_WIREGUARD_DBUS_INTERFACE".GetProfile"
+#define ICD_WIREGUARD_PROFILE_ENTRY_SIGNATURE "(sttttt)"
+#define ICD_WIREGUARD_PROFILE_SLOW_CALL_SIGNATURE "(sxtt)"
 
 #define ICD_WIREGUARD_SIGNAL_STATUSCHANGED      "StatusChanged"
-#define ICD_WIREGUARD_SIGNAL_STATUSCHANGED_FILTER "member='" ICD_WIREGUARD_SIGNAL_STATUSCHANGED "'"
+#define ICD_WIREGUARD_SIGNAL_STATUSCHANGED_FILTER "member='" ICD_WIREGUARD_SIGNAL_STATUSCHANGED "',path='" ICD_WIREGUARD_DBUS_PATH "'"
 
 #define ICD_WIREGUARD_SIGNALS_STATUS_STATE_CONNECTED "Connected"
 #define ICD_WIREGUARD_SIGNALS_STATUS_STATE_STARTED "Started"
@@ -65,6 +121,106 @@
 #define ICD_WIREGUARD_SIGNALS_STATUS_MODE_NORMAL "Normal"
 #define ICD_WIREGUARD_SIGNALS_STATUS_MODE_PROVIDER "Provider"
 
+/* Properties exported on the tunnel paths through the standard
+ * org.freedesktop.DBus.Properties interface. Changes are announced with
+ * PropertiesChanged, which only carries the properties that changed. */
+#define ICD_WIREGUARD_PROPERTY_STATE "State"
+#define ICD_WIREGUARD_PROPERTY_MODE "Mode"
+#define ICD_WIREGUARD_PROPERTY_ACTIVE_CONFIG "ActiveConfig"
+#define ICD_WIREGUARD_PROPERTY_INTERFACE_INDEX "InterfaceIndex"
+#define ICD_WIREGUARD_PROPERTY_CONNECT_TIMESTAMP "ConnectTimestamp"
+#define ICD_WIREGUARD_PROPERTY_LAST_ERROR "LastError"
+/* wg-quick runs of the tunnel that overran GC_WIREGUARD_OP_TIMEOUT */
+#define ICD_WIREGUARD_PROPERTY_TIMEOUTS "Timeouts"
+
+/*
+ * Status page
+ *
+ * The network module publishes its status into a small read-only file that
+ * clients can mmap and poll without any syscalls or D-Bus round trips into
+ * icd2. The file is written by icd2 only; clients must map it PROT_READ.
+ *
+ * Updates are protected by a sequence counter: the writer increments
+ * `sequence` to an odd value, updates the page, and increments it to an even
+ * value again. A reader copies the page and retries if the sequence was odd
+ * or changed during the copy, see icd_wireguard_status_page_read().
+ *
+ * Readers must check `magic` and `version`. Fields are only ever appended;
+ * `size` is the size of the structure as written, so a reader built against
+ * an older version can still use the fields it knows about. The version is
+ * only bumped for incompatible changes.
+ */
+#define ICD_WIREGUARD_STATUS_PAGE_PATH "/run/icd-wireguard/status"
+#define ICD_WIREGUARD_STATUS_PAGE_MAGIC 0x50534757	/* "WGSP" */
+#define ICD_WIREGUARD_STATUS_PAGE_VERSION 1
+
+enum icd_wireguard_status_page_state {
+	ICD_WIREGUARD_STATUS_PAGE_STATE_STOPPED = 0,
+	ICD_WIREGUARD_STATUS_PAGE_STATE_STARTED = 1,
+	ICD_WIREGUARD_STATUS_PAGE_STATE_CONNECTED = 2,
+};
+
+enum icd_wireguard_status_page_mode {
+	ICD_WIREGUARD_STATUS_PAGE_MODE_NORMAL = 0,
+	ICD_WIREGUARD_STATUS_PAGE_MODE_PROVIDER = 1,
+};
+
+struct icd_wireguard_status_page {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t size;
+	/* Odd while an update is in progress */
+	uint32_t sequence;
+
+	/* enum icd_wireguard_status_page_state, same as the StatusChanged state */
+	uint32_t state;
+	/* enum icd_wireguard_status_page_mode */
+	uint32_t mode;
+	/* Interface index of the tunnel, -1 if it is not up */
+	int32_t interface_index;
+	uint32_t peer_count;
+
+	/* CLOCK_REALTIME microseconds of the last state change */
+	uint64_t state_timestamp;
+	/* CLOCK_REALTIME seconds at which the tunnel connected, 0 if it is not */
+	uint64_t connect_timestamp;
+	/* CLOCK_REALTIME microseconds of the last write to this page */
+	uint64_t update_timestamp;
+
+	/* Traffic counters summed over all peers */
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	/* CLOCK_REALTIME seconds of the most recent handshake, 0 if none */
+	uint64_t last_handshake;
+
+	/* NUL terminated, truncated if needed */
+	char active_config[128];
+};
+
+/**
+ * Take a consistent copy of a mapped status page.
+ *
+ * @param page  the mapped status page
+ * @param copy  destination
+ * @return 0 on success, -1 if the page is not a status page we understand
+ */
+static inline int icd_wireguard_status_page_read(const struct icd_wireguard_status_page *page,
+						 struct icd_wireguard_status_page *copy)
+{
+	uint32_t seq;
+
+	if (page->magic != ICD_WIREGUARD_STATUS_PAGE_MAGIC || page->version != ICD_WIREGUARD_STATUS_PAGE_VERSION)
+		return -1;
+
+	do {
+		seq = __atomic_load_n(&page->sequence, __ATOMIC_ACQUIRE);
+		memcpy(copy, (const void *)page, sizeof(*copy));
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+	} while ((seq & 1) || seq != __atomic_load_n(&page->sequence, __ATOMIC_RELAXED));
+
+	return 0;
+}
+
 enum WIREGUARD_DBUS_METHOD_START_RESULT {
 	WIREGUARD_DBUS_METHOD_START_RESULT_OK,
 	WIREGUARD_DBUS_METHOD_START_RESULT_FAILED,
@@ -0,0 +1,48 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __LIBICD_WIREGUARD_TRACE_H
+#define __LIBICD_WIREGUARD_TRACE_H
+
+/*
+ * Static tracepoints, enabled with --enable-usdt. A probe that is not attached
+ * costs a single nop, but its arguments are still computed, so only pass
+ * values that are already at hand. List them with e.g.
+ *
+ *   bpftrace -l 'usdt:/usr/lib/icd2/libicd_network_wireguard.so:*'
+ *
+ * All probes live in the icd_wireguard provider.
+ */
+#ifdef ENABLE_USDT
+#include <sys/sdt.h>
+
+#define WG_TRACE1(name, a) DTRACE_PROBE1(icd_wireguard, name, a)
+#define WG_TRACE2(name, a, b) DTRACE_PROBE2(icd_wireguard, name, a, b)
+#define WG_TRACE3(name, a, b, c) DTRACE_PROBE3(icd_wireguard, name, a, b, c)
+#define WG_TRACE4(name, a, b, c, d) DTRACE_PROBE4(icd_wireguard, name, a, b, c, d)
+#else
+#define WG_TRACE1(name, a) do { } while (0)
+#define WG_TRACE2(name, a, b) do { } while (0)
+#define WG_TRACE3(name, a, b, c) do { } while (0)
+#define WG_TRACE4(name, a, b, c, d) do { } while (0)
+#endif
+
+#endif				/* __LIBICD_WIREGUARD_TRACE_H */
@@ -0,0 +1,1860 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/*
+ * Drives both modules through icd2's module API with fake system calls.
+ *
+ *   wireguard-harness [check]   fixed scenarios and seeded random sequences
+ *   wireguard-harness bench     connect/disconnect cycles and random
+ *                               sequences, prints key=value lines
+ *   wireguard-harness bench-config
+ *                               wireguard_config_generate() and friends
+ *                               against 1 to 10000 peers, prints key=value
+ *                               lines
+ *   wireguard-harness netns     real wg-quick against a peer, see
+ *                               netns-bench.sh
+ *   wireguard-harness netlink-record|netlink-generate --file FILE
+ *                               write an rtnetlink stream
+ *   wireguard-harness netlink-replay|netlink-fuzz [--file FILE]
+ *                               feed a stream to the listener
+ *
+ * Options: --seed N, --iterations N, and for netns --config FILE,
+ * --label TEXT and --run COMMAND.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "harness.h"
+
+/* Exit status automake treats as a skipped test */
+#define EXIT_SKIP 77
+
+#define DEFAULT_SEED 1
+#define CHECK_RANDOM_RUNS 200
+#define BENCH_CYCLES 2000
+#define BENCH_RANDOM_RUNS 2000
+#define RANDOM_STEPS 40
+#define SETTLE_ROUNDS 100
+#define PROVIDER_TIMEOUT 5000
+#define NETNS_CYCLES 20
+#define NETLINK_RECORD_COUNT 1000
+#define CHECK_NETLINK_VETHS 256
+#define CHECK_NETLINK_FUZZ 5000
+#define BENCH_NETLINK_VETHS 20000
+#define CHECK_CONFIG_PEERS 1000
+#define BENCH_CONFIG_PEERS 10000
+#define BENCH_CONFIG_TIME 0.2
+
+struct harness harness;
+
+static guint closes_handled;
+
+void harness_fail(const char *func, int line, const char *fmt, ...)
+{
+	va_list ap;
+	gchar *message;
+
+	va_start(ap, fmt);
+	message = g_strdup_vprintf(fmt, ap);
+	va_end(ap);
+
+	g_printerr("FAIL: %s:%d: %s\n", func, line, message);
+	g_free(message);
+
+	harness.failures++;
+}
+
+static void reset_iap(struct harness_iap *iap, const char *network_id)
+{
+	memset(iap, 0, sizeof(*iap));
+	iap->network_id = network_id;
+}
+
+/* Configuration every scenario starts from */
+static void setup_gconf(gboolean system_wide)
+{
+	harness_gconf_reset();
+	harness_gconf_add_config(HARNESS_CONFIG, 1, 2);
+	harness_gconf_set_string(GC_WIREGUARD_ACTIVE, HARNESS_CONFIG);
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, system_wide);
+	harness_gconf_set_string("/system/osso/connectivity/IAP/" HARNESS_PROVIDER_IAP "/service_type",
+				 WIREGUARD_PROVIDER_TYPE);
+	harness_gconf_set_string("/system/osso/connectivity/IAP/" HARNESS_PROVIDER_IAP "/service_id", HARNESS_CONFIG);
+}
+
+gboolean harness_setup(gboolean system_wide)
+{
+	setup_gconf(system_wide);
+
+	reset_iap(&harness.iap, HARNESS_IAP);
+	reset_iap(&harness.provider_iap, HARNESS_PROVIDER_IAP);
+	reset_iap(&harness.second_iap, HARNESS_SECOND_IAP);
+	memset(&harness.srv, 0, sizeof(harness.srv));
+	closes_handled = 0;
+
+	harness_system_init();
+
+	return harness_load_modules();
+}
+
+void harness_teardown(void)
+{
+	harness_unload_modules();
+	harness_system_free();
+	harness_gconf_reset();
+}
+
+static void check_iap_settled(const struct harness_iap *iap)
+{
+	if (iap->ip_up_requests != iap->ip_up_answers)
+		HARNESS_FAIL("%s: %u ip_up requests, %u answers", iap->network_id, iap->ip_up_requests,
+			     iap->ip_up_answers);
+	if (iap->ip_down_requests != iap->ip_down_answers)
+		HARNESS_FAIL("%s: %u ip_down requests, %u answers", iap->network_id, iap->ip_down_requests,
+			     iap->ip_down_answers);
+	if (iap->up)
+		HARNESS_FAIL("%s is still up", iap->network_id);
+}
+
+/* The tunnel serving an IAP, NULL if it has none */
+static wireguard_tunnel *iap_tunnel(const struct harness_iap *iap)
+{
+	return g_hash_table_lookup(harness_network_private()->tunnels_by_iap, iap->network_id);
+}
+
+/* Everything is down: the module must be back in its initial state */
+static void check_idle(void)
+{
+	network_wireguard_private *priv = harness_network_private();
+	wireguard_tunnel *tunnel = priv->first_tunnel;
+	network_wireguard_state *state = &tunnel->state;
+	int i;
+
+	check_iap_settled(&harness.iap);
+	check_iap_settled(&harness.provider_iap);
+	check_iap_settled(&harness.second_iap);
+
+	if (g_hash_table_size(priv->tunnels_by_iap) != 0)
+		HARNESS_FAIL("%u IAPs left with a tunnel", g_hash_table_size(priv->tunnels_by_iap));
+	if (g_hash_table_size(priv->tunnels) != 1)
+		HARNESS_FAIL("%u tunnels left besides %s", g_hash_table_size(priv->tunnels) - 1,
+			     tunnel->interface_name);
+	if (tunnel->network_data)
+		HARNESS_FAIL("network_data left");
+	if (!g_queue_is_empty(&priv->events))
+		HARNESS_FAIL("%u events left", g_queue_get_length(&priv->events));
+	if (tunnel->op_running || !g_queue_is_empty(&tunnel->ops))
+		HARNESS_FAIL("wg-quick still running or queued");
+	if (state->tunnel != WIREGUARD_STATE_IDLE)
+		HARNESS_FAIL("Tunnel left %s", wireguard_tunnel_state_string(state->tunnel));
+	if (state->service_provider_mode)
+		HARNESS_FAIL("service_provider_mode left set");
+	if (state->wireguard_interface_up)
+		HARNESS_FAIL("wireguard_interface_up left set");
+	if (!g_queue_is_empty(&harness.spawns))
+		HARNESS_FAIL("%u wg-quick runs left", g_queue_get_length(&harness.spawns));
+	for (i = 0; i < HARNESS_TUNNELS; i++) {
+		if (harness.links[i].exists)
+			HARNESS_FAIL(WIREGUARD_INTERFACE_PREFIX "%d left behind", i);
+	}
+	if (g_hash_table_size(harness.routes) != 0 || harness.rules != 0)
+		HARNESS_FAIL("%u routes and %d rules left behind", g_hash_table_size(harness.routes), harness.rules);
+}
+
+static void complete_next_spawn(gboolean success)
+{
+	struct harness_spawn *spawn = harness_next_spawn();
+
+	if (spawn == NULL) {
+		HARNESS_FAIL("Expected a wg-quick run");
+		return;
+	}
+
+	harness_complete_spawn(spawn, success);
+}
+
+/* Like icd2, take the IAP down when the module asked us to close it */
+static void handle_close(struct harness_iap *iap)
+{
+	if (iap->close_requests == closes_handled)
+		return;
+
+	if (iap->up) {
+		closes_handled = iap->close_requests;
+		harness_ip_down(iap);
+	} else if (iap->ip_up_requests == iap->ip_up_answers) {
+		/* Nothing left to close */
+		closes_handled = iap->close_requests;
+	}
+}
+
+/* Finish all wg-quick runs and take the IAP down */
+static void settle(struct harness_iap *iap)
+{
+	int round;
+
+	for (round = 0; round < SETTLE_ROUNDS; round++) {
+		handle_close(iap);
+
+		if (harness_next_spawn()) {
+			complete_next_spawn(TRUE);
+			continue;
+		}
+
+		if (iap->up) {
+			harness_ip_down(iap);
+			continue;
+		}
+
+		if (iap->ip_up_requests != iap->ip_up_answers) {
+			HARNESS_FAIL("ip_up pending without anything to wait for");
+			return;
+		}
+
+		return;
+	}
+
+	HARNESS_FAIL("Did not settle after %d rounds", SETTLE_ROUNDS);
+}
+
+/* Scenarios */
+
+static void scenario_connect_disconnect(void)
+{
+	harness_ip_up(&harness.iap);
+	if (harness.iap.ip_up_answers != 0)
+		HARNESS_FAIL("ip_up answered before wg-quick finished");
+
+	complete_next_spawn(TRUE);
+	if (!harness.iap.up)
+		HARNESS_FAIL("ip_up did not succeed");
+	if (!harness_network_private()->first_tunnel->state.wireguard_interface_up)
+		HARNESS_FAIL("interface not seen going up");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+}
+
+static void scenario_disabled(void)
+{
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+
+	harness_ip_up(&harness.iap);
+	if (!harness.iap.up)
+		HARNESS_FAIL("ip_up did not succeed right away");
+	if (harness_next_spawn())
+		HARNESS_FAIL("wg-quick started while disabled");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+}
+
+static void scenario_wg_quick_fails(void)
+{
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(FALSE);
+
+	if (harness.iap.ip_up_answers != 1 || harness.iap.ip_up_status != ICD_NW_ERROR)
+		HARNESS_FAIL("ip_up did not fail");
+
+	/* The module cleans up after itself with wg-quick down */
+	complete_next_spawn(TRUE);
+}
+
+static void scenario_unexpected_down(void)
+{
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	/* Someone else removes the interface */
+	harness_link_remove(0);
+
+	if (harness.iap.close_requests != 1)
+		HARNESS_FAIL("IAP not closed after the interface went away");
+	if (g_strcmp0(harness_network_private()->first_tunnel->last_error, "Wireguard interface down (unexpectedly)") != 0)
+		HARNESS_FAIL("last_error not set");
+
+	settle(&harness.iap);
+}
+
+static void scenario_gconf_toggle(void)
+{
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+	harness_ip_up(&harness.iap);
+
+	/* Enabling while connected brings the tunnel up without a new ip_up */
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, TRUE);
+	complete_next_spawn(TRUE);
+	if (harness_network_private()->first_tunnel->state.tunnel != WIREGUARD_STATE_RUNNING)
+		HARNESS_FAIL("Tunnel not running after enabling");
+
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+	complete_next_spawn(TRUE);
+	if (harness.iap.close_requests != 0)
+		HARNESS_FAIL("Disabling closed the IAP");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+}
+
+static void scenario_config_missing(void)
+{
+	gchar *key = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_PRIVATEKEY, NULL);
+
+	harness_gconf_unset(key);
+	g_free(key);
+
+	harness_ip_up(&harness.iap);
+	if (harness.iap.ip_up_answers != 1 || harness.iap.ip_up_status != ICD_NW_ERROR)
+		HARNESS_FAIL("ip_up did not fail without a private key");
+	if (harness_next_spawn())
+		HARNESS_FAIL("wg-quick started without a config");
+	if (harness.config_writes != 0)
+		HARNESS_FAIL("Config written without a private key");
+	if (g_strcmp0(harness_network_private()->first_tunnel->last_error,
+		      "Invalid config " HARNESS_CONFIG ": " GC_PRIVATEKEY " missing") != 0)
+		HARNESS_FAIL("last_error not set");
+}
+
+static void expect_spawn(enum harness_spawn_type type, const char *what)
+{
+	struct harness_spawn *spawn = harness_next_spawn();
+
+	if (spawn == NULL || spawn->type != type)
+		HARNESS_FAIL("%s: expected wg-quick %s", what, type == HARNESS_SPAWN_UP ? "up" : "down");
+}
+
+static void scenario_toggle_coalesce(void)
+{
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+
+	harness_ip_up(&harness.iap);
+
+	/* Toggling while wg-quick up runs ends up enabled, nothing to do
+	 * once it finished */
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, TRUE);
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, TRUE);
+	if (g_queue_get_length(&tunnel->ops) != 0)
+		HARNESS_FAIL("%u operations queued after toggling back", g_queue_get_length(&tunnel->ops));
+
+	complete_next_spawn(TRUE);
+	if (!harness.iap.up || tunnel->state.tunnel != WIREGUARD_STATE_RUNNING)
+		HARNESS_FAIL("Tunnel not running after toggling while connecting");
+	if (harness_next_spawn())
+		HARNESS_FAIL("wg-quick started again after toggling back");
+
+	/* Toggling while wg-quick down runs ends up disabled */
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, TRUE);
+	if (g_queue_get_length(&tunnel->ops) != 1)
+		HARNESS_FAIL("Enabling while stopping did not queue wg-quick up");
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+	if (g_queue_get_length(&tunnel->ops) != 0)
+		HARNESS_FAIL("Disabling did not cancel the queued wg-quick up");
+
+	expect_spawn(HARNESS_SPAWN_DOWN, "Disabled");
+	complete_next_spawn(TRUE);
+	if (harness_next_spawn())
+		HARNESS_FAIL("wg-quick started again after toggling back");
+	if (tunnel->state.tunnel != WIREGUARD_STATE_STOPPED)
+		HARNESS_FAIL("Tunnel %s after disabling", wireguard_tunnel_state_string(tunnel->state.tunnel));
+
+	/* Enabling while stopping brings it up once wg-quick down finished */
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, TRUE);
+	complete_next_spawn(TRUE);
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, FALSE);
+	harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, TRUE);
+	complete_next_spawn(TRUE);
+	expect_spawn(HARNESS_SPAWN_UP, "Enabled while stopping");
+	complete_next_spawn(TRUE);
+	if (tunnel->state.tunnel != WIREGUARD_STATE_RUNNING || !harness.links[0].running)
+		HARNESS_FAIL("Tunnel not running after enabling while stopping");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+}
+
+/* Two IAPs, each with its own tunnel and wg-quick runs */
+static void scenario_concurrent(void)
+{
+	wireguard_tunnel *first, *second;
+
+	harness_ip_up(&harness.iap);
+	harness_ip_up(&harness.second_iap);
+	if (g_queue_get_length(&harness.spawns) != 2)
+		HARNESS_FAIL("wg-quick up did not run for both IAPs");
+
+	first = iap_tunnel(&harness.iap);
+	second = iap_tunnel(&harness.second_iap);
+	if (first == NULL || second == NULL || first == second) {
+		HARNESS_FAIL("IAPs do not have a tunnel each");
+		return;
+	}
+	if (g_strcmp0(first->interface_name, WIREGUARD_INTERFACE_PREFIX "0") != 0
+	    || g_strcmp0(second->interface_name, WIREGUARD_INTERFACE_PREFIX "1") != 0)
+		HARNESS_FAIL("Tunnels %s and %s", first->interface_name, second->interface_name);
+
+	complete_next_spawn(TRUE);
+	complete_next_spawn(TRUE);
+	if (!harness.iap.up || !harness.second_iap.up)
+		HARNESS_FAIL("ip_up did not succeed for both IAPs");
+	if (first->state.tunnel != WIREGUARD_STATE_RUNNING || second->state.tunnel != WIREGUARD_STATE_RUNNING)
+		HARNESS_FAIL("Tunnels %s and %s", wireguard_tunnel_state_string(first->state.tunnel),
+			     wireguard_tunnel_state_string(second->state.tunnel));
+	if (first->state.wireguard_interface_index == second->state.wireguard_interface_index)
+		HARNESS_FAIL("Tunnels share interface index %d", first->state.wireguard_interface_index);
+
+	/* Losing one interface only closes its IAP */
+	harness_link_remove(1);
+	if (harness.second_iap.close_requests != 1 || harness.iap.close_requests != 0)
+		HARNESS_FAIL("Wrong IAP closed after icdwg1 went away");
+	if (first->state.tunnel != WIREGUARD_STATE_RUNNING)
+		HARNESS_FAIL("%s %s after icdwg1 went away", first->interface_name,
+			     wireguard_tunnel_state_string(first->state.tunnel));
+	harness_ip_down(&harness.second_iap);
+	complete_next_spawn(TRUE);
+
+	/* The next IAP gets the lowest free tunnel back */
+	harness_ip_up(&harness.second_iap);
+	second = iap_tunnel(&harness.second_iap);
+	if (second == NULL || second->index != 1)
+		HARNESS_FAIL("Second IAP did not get icdwg1 again");
+	complete_next_spawn(TRUE);
+
+	harness_ip_down(&harness.iap);
+	harness_ip_down(&harness.second_iap);
+	complete_next_spawn(TRUE);
+	complete_next_spawn(TRUE);
+}
+
+static void check_route(const char *prefix, guint paths, const char *what)
+{
+	guint found = GPOINTER_TO_UINT(g_hash_table_lookup(harness.routes, prefix));
+
+	if (found != paths)
+		HARNESS_FAIL("%s: %s over %u paths, expected %u", what, prefix, found, paths);
+}
+
+/* The AllowedIPs of HARNESS_CONFIG, 10.0.0.0/24 and 10.0.1.0/24 collapsed,
+ * are routed over that many paths, and the peer's endpoint is excluded
+ * while they are */
+static void check_routes(guint paths, const char *what)
+{
+	check_route("10.0.0.0/23", paths, what);
+	check_route("192.0.2.1/32", paths ? HARNESS_ROUTE_THROW : 0, what);
+
+	if (g_hash_table_size(harness.routes) != (paths ? 2 : 0))
+		HARNESS_FAIL("%s: %u routes", what, g_hash_table_size(harness.routes));
+}
+
+/* Check the paths again now, as the module does periodically */
+static void check_paths(wireguard_tunnel * tunnel)
+{
+	void (*update)(network_wireguard_private *) = harness_module_symbol("wireguard_routing_update");
+
+	tunnel->stats.last_refresh = 0;
+	update(harness_network_private());
+}
+
+/* Two IAPs with the same config bonded, one path losing its handshakes */
+static void scenario_multipath(void)
+{
+	wireguard_tunnel *second;
+	gchar *path, *config = NULL;
+
+	harness_gconf_set_bool(GC_WIREGUARD_MULTIPATH, TRUE);
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	check_routes(1, "One IAP");
+	if (harness.rules == 0)
+		HARNESS_FAIL("No policy rules");
+
+	harness_ip_up(&harness.second_iap);
+	complete_next_spawn(TRUE);
+	check_routes(2, "Two IAPs");
+
+	/* wg-quick leaves routing to us */
+	path = g_build_filename(harness.config_dir, WIREGUARD_INTERFACE_PREFIX "1.conf", NULL);
+	if (!g_file_get_contents(path, &config, NULL, NULL) || strstr(config, "\nTable = off\n") == NULL
+	    || strstr(config, "\nFwMark = 0xca6d0001\n") == NULL)
+		HARNESS_FAIL("Config not set up for multipath:\n%s", config);
+	g_free(config);
+	g_free(path);
+
+	second = iap_tunnel(&harness.second_iap);
+	if (second == NULL) {
+		HARNESS_FAIL("Second IAP has no tunnel");
+		return;
+	}
+
+	/* A path without handshakes is dropped once it had time to shake
+	 * hands, and comes back with them */
+	harness.links[1].handshake_age = WIREGUARD_MULTIPATH_STALE;
+	check_paths(second);
+	check_routes(2, "Stale but just connected");
+
+	second->connect_timestamp -= WIREGUARD_MULTIPATH_GRACE;
+	check_paths(second);
+	check_routes(1, "Stale");
+
+	harness.links[1].handshake_age = 0;
+	check_paths(second);
+	check_routes(2, "Shaking hands again");
+
+	harness_ip_down(&harness.second_iap);
+	complete_next_spawn(TRUE);
+	check_routes(1, "Second IAP down");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+	check_routes(0, "Both IAPs down");
+}
+
+/* Our own table with exclusions, and no bonding without multipath */
+static void scenario_policy_routing(void)
+{
+	gchar *key = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_EXCLUDE, NULL);
+	gchar *path, *config = NULL;
+
+	harness_gconf_set_bool(GC_WIREGUARD_POLICY_ROUTING, TRUE);
+	harness_gconf_set_string(key, "10.0.1.128/25, 10.0.0.7/24,not-a-prefix");
+	g_free(key);
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	check_route("10.0.0.0/23", 1, "Routed");
+	check_route("10.0.0.0/24", HARNESS_ROUTE_THROW, "Excluded");
+	check_route("10.0.1.128/25", HARNESS_ROUTE_THROW, "Excluded");
+	check_route("192.0.2.1/32", HARNESS_ROUTE_THROW, "Endpoint");
+	if (g_hash_table_size(harness.routes) != 4)
+		HARNESS_FAIL("%u routes", g_hash_table_size(harness.routes));
+	if (harness.rules != 6)
+		HARNESS_FAIL("%d policy rules", harness.rules);
+
+	path = g_build_filename(harness.config_dir, WIREGUARD_INTERFACE_NAME ".conf", NULL);
+	if (!g_file_get_contents(path, &config, NULL, NULL) || strstr(config, "\nTable = off\n") == NULL
+	    || strstr(config, "\nFwMark = 0xca6d0000\n") == NULL || strstr(config, "PersistentKeepalive"))
+		HARNESS_FAIL("Config not set up for policy routing:\n%s", config);
+	g_free(config);
+	g_free(path);
+
+	/* Same config, still routed over the first tunnel only */
+	harness_ip_up(&harness.second_iap);
+	complete_next_spawn(TRUE);
+	check_route("10.0.0.0/23", 1, "Two IAPs");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+	check_route("10.0.0.0/23", 1, "First IAP down");
+	check_route("10.0.0.0/24", HARNESS_ROUTE_THROW, "First IAP down");
+
+	harness_ip_down(&harness.second_iap);
+	complete_next_spawn(TRUE);
+	if (g_hash_table_size(harness.routes) != 0 || harness.rules != 0)
+		HARNESS_FAIL("%u routes and %d rules left", g_hash_table_size(harness.routes), harness.rules);
+}
+
+/* A failed query keeps the previous statistics until the next interval */
+static void scenario_stats_error(void)
+{
+	GSList *(*snapshot)(wireguard_tunnel *) = harness_module_symbol("wireguard_stats_snapshot");
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+	wireguard_peer_stats *peer;
+	gint64 refreshed;
+	guint samples;
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	tunnel->stats.last_refresh = 0;
+	if (g_slist_length(snapshot(tunnel)) != 1)
+		HARNESS_FAIL("No peer in the statistics");
+	peer = tunnel->stats.peers->data;
+	samples = peer->sample_count;
+	refreshed = tunnel->stats.last_refresh;
+
+	harness.genl_error = -EIO;
+	tunnel->stats.last_refresh = 1;
+	if (snapshot(tunnel) != tunnel->stats.peers || g_slist_length(tunnel->stats.peers) != 1 ||
+	    tunnel->stats.peers->data != peer || peer->sample_count != samples)
+		HARNESS_FAIL("Failed query replaced the statistics");
+	if (tunnel->stats.last_refresh < refreshed || tunnel->stats.fd >= 0)
+		HARNESS_FAIL("Failed query not accounted");
+
+	harness.genl_error = 0;
+	tunnel->stats.last_refresh = 0;
+	if (snapshot(tunnel) == NULL || tunnel->stats.peers->data != peer ||
+	    peer->sample_count != MIN(samples + 1, WIREGUARD_STATS_SAMPLES))
+		HARNESS_FAIL("Statistics not carried over the failed query");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+}
+
+#define TUNNEL_PATH ICD_WIREGUARD_DBUS_PATH "/icdwg0"
+#define DBUS_CYCLES 50
+
+/* Look up a property in the a{sv} at iter */
+static gboolean property_lookup(DBusMessageIter * iter, const char *name, int type, void *value)
+{
+	DBusMessageIter dict, entry, variant;
+	const char *key;
+
+	if (dbus_message_iter_get_arg_type(iter) != DBUS_TYPE_ARRAY)
+		return FALSE;
+
+	dbus_message_iter_recurse(iter, &dict);
+	for (; dbus_message_iter_get_arg_type(&dict) == DBUS_TYPE_DICT_ENTRY; dbus_message_iter_next(&dict)) {
+		dbus_message_iter_recurse(&dict, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+		if (strcmp(key, name) != 0)
+			continue;
+
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_recurse(&entry, &variant);
+		if (dbus_message_iter_get_arg_type(&variant) != type)
+			return FALSE;
+		dbus_message_iter_get_basic(&variant, value);
+		return TRUE;
+	}
+
+	return FALSE;
+}
+
+/* Whether a reply is a method return with the given signature, or the given
+ * error if signature starts with "org." */
+static gboolean reply_is(DBusMessage * reply, const char *signature)
+{
+	if (reply == NULL)
+		return FALSE;
+	if (g_str_has_prefix(signature, "org."))
+		return dbus_message_is_error(reply, signature);
+	return dbus_message_get_type(reply) == DBUS_MESSAGE_TYPE_METHOD_RETURN &&
+	    dbus_message_has_signature(reply, signature);
+}
+
+static void reply_free(DBusMessage * reply)
+{
+	if (reply)
+		dbus_message_unref(reply);
+}
+
+/* Wait for a PropertiesChanged on path that sets the string property name
+ * to value */
+static gboolean property_changed(const char *path, const char *name, const char *value)
+{
+	DBusMessage *signal;
+	DBusMessageIter iter;
+	const char *changed;
+	gboolean found = FALSE;
+
+	while (!found && (signal = harness_dbus_next_signal(path, "PropertiesChanged"))) {
+		dbus_message_iter_init(signal, &iter);
+		dbus_message_iter_next(&iter);
+		found = property_lookup(&iter, name, DBUS_TYPE_STRING, &changed) && strcmp(changed, value) == 0;
+		dbus_message_unref(signal);
+	}
+
+	return found;
+}
+
+static gboolean state_changed(const char *path, const char *state)
+{
+	return property_changed(path, ICD_WIREGUARD_PROPERTY_STATE, state);
+}
+
+static DBusMessage *wireguard_call(const char *path, const char *method)
+{
+	return harness_dbus_call(path, ICD_WIREGUARD_DBUS_INTERFACE, method, DBUS_TYPE_INVALID);
+}
+
+static void check_properties(void)
+{
+	const char *interface = ICD_WIREGUARD_DBUS_INTERFACE, *name = ICD_WIREGUARD_PROPERTY_STATE;
+	const char *unknown = "Colour", *state = NULL, *value = "Connected";
+	dbus_int32_t index = 0;
+	dbus_uint32_t timeouts = 1;
+	DBusMessage *message, *reply;
+	DBusMessageIter iter, variant;
+
+	reply = harness_dbus_call(TUNNEL_PATH, DBUS_INTERFACE_PROPERTIES, "GetAll",
+				  DBUS_TYPE_STRING, &interface, DBUS_TYPE_INVALID);
+	if (!reply_is(reply, "a{sv}") || !dbus_message_iter_init(reply, &iter) ||
+	    !property_lookup(&iter, ICD_WIREGUARD_PROPERTY_STATE, DBUS_TYPE_STRING, &state) ||
+	    strcmp(state, ICD_WIREGUARD_SIGNALS_STATUS_STATE_STOPPED) != 0 ||
+	    !property_lookup(&iter, ICD_WIREGUARD_PROPERTY_INTERFACE_INDEX, DBUS_TYPE_INT32, &index) || index != -1 ||
+	    !property_lookup(&iter, ICD_WIREGUARD_PROPERTY_TIMEOUTS, DBUS_TYPE_UINT32, &timeouts) || timeouts != 0)
+		HARNESS_FAIL("GetAll of a stopped tunnel");
+	reply_free(reply);
+
+	reply = harness_dbus_call(TUNNEL_PATH, DBUS_INTERFACE_PROPERTIES, "Get",
+				  DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+	if (!reply_is(reply, "v") || !dbus_message_iter_init(reply, &iter))
+		HARNESS_FAIL("Get State");
+	else {
+		dbus_message_iter_recurse(&iter, &variant);
+		dbus_message_iter_get_basic(&variant, &state);
+		if (strcmp(state, ICD_WIREGUARD_SIGNALS_STATUS_STATE_STOPPED) != 0)
+			HARNESS_FAIL("Get State returned %s", state);
+	}
+	reply_free(reply);
+
+	reply = harness_dbus_call(TUNNEL_PATH, DBUS_INTERFACE_PROPERTIES, "Get",
+				  DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &unknown, DBUS_TYPE_INVALID);
+	if (!reply_is(reply, DBUS_ERROR_UNKNOWN_PROPERTY))
+		HARNESS_FAIL("Get of an unknown property");
+	reply_free(reply);
+
+	message = dbus_message_new_method_call(ICD_WIREGUARD_DBUS_INTERFACE, TUNNEL_PATH,
+					       DBUS_INTERFACE_PROPERTIES, "Set");
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &interface, DBUS_TYPE_STRING, &name, DBUS_TYPE_INVALID);
+	dbus_message_iter_init_append(message, &iter);
+	dbus_message_iter_open_container(&iter, DBUS_TYPE_VARIANT, DBUS_TYPE_STRING_AS_STRING, &variant);
+	dbus_message_iter_append_basic(&variant, DBUS_TYPE_STRING, &value);
+	dbus_message_iter_close_container(&iter, &variant);
+	reply = harness_dbus_send(message);
+	if (!reply_is(reply, DBUS_ERROR_PROPERTY_READ_ONLY))
+		HARNESS_FAIL("Set of a read-only property");
+	reply_free(reply);
+	dbus_message_unref(message);
+}
+
+static void check_statistics(void)
+{
+	DBusMessage *reply = wireguard_call(TUNNEL_PATH, "GetStatistics");
+	DBusMessageIter iter, array, peer;
+	const char *key, *endpoint;
+	dbus_uint64_t rx, tx;
+	guint peers = 0;
+
+	if (!reply_is(reply, "a" ICD_WIREGUARD_STATISTICS_SIGNATURE)) {
+		HARNESS_FAIL("GetStatistics");
+		reply_free(reply);
+		return;
+	}
+
+	dbus_message_iter_init(reply, &iter);
+	dbus_message_iter_recurse(&iter, &array);
+	for (; dbus_message_iter_get_arg_type(&array) == DBUS_TYPE_STRUCT; dbus_message_iter_next(&array)) {
+		dbus_message_iter_recurse(&array, &peer);
+		dbus_message_iter_get_basic(&peer, &key);
+		dbus_message_iter_next(&peer);
+		dbus_message_iter_get_basic(&peer, &endpoint);
+		dbus_message_iter_next(&peer);
+		dbus_message_iter_get_basic(&peer, &rx);
+		dbus_message_iter_next(&peer);
+		dbus_message_iter_get_basic(&peer, &tx);
+		if (strcmp(endpoint, "192.0.2.1:51820") != 0 || rx != 1024 || tx != 2048)
+			HARNESS_FAIL("GetStatistics peer %s: %s rx %" G_GUINT64_FORMAT " tx %" G_GUINT64_FORMAT,
+				     key, endpoint, (guint64) rx, (guint64) tx);
+		peers++;
+	}
+	if (peers != 1)
+		HARNESS_FAIL("GetStatistics returned %u peers", peers);
+
+	reply_free(reply);
+}
+
+/* Number of samples of a GetTimings or GetProfile entry */
+static guint64 entry_count(DBusMessageIter * array, const char *name)
+{
+	DBusMessageIter entry;
+	const char *entry_name;
+	dbus_uint64_t count;
+
+	for (; dbus_message_iter_get_arg_type(array) == DBUS_TYPE_STRUCT; dbus_message_iter_next(array)) {
+		dbus_message_iter_recurse(array, &entry);
+		dbus_message_iter_get_basic(&entry, &entry_name);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_get_basic(&entry, &count);
+		if (strcmp(entry_name, name) == 0)
+			return count;
+	}
+
+	return 0;
+}
+
+static void check_introspection(void)
+{
+	DBusMessage *reply;
+	DBusMessageIter iter, array, entry;
+	const char *name, *error, *warnings;
+
+	reply = wireguard_call(TUNNEL_PATH, "GetTimings");
+	if (!reply_is(reply, "a" ICD_WIREGUARD_TIMINGS_SIGNATURE) || !dbus_message_iter_init(reply, &iter))
+		HARNESS_FAIL("GetTimings");
+	else {
+		dbus_message_iter_recurse(&iter, &array);
+		if (entry_count(&array, "connect") == 0)
+			HARNESS_FAIL("GetTimings has no connect sample");
+	}
+	reply_free(reply);
+
+	reply = wireguard_call(ICD_WIREGUARD_DBUS_PATH, "GetProfile");
+	if (!reply_is(reply, "a" ICD_WIREGUARD_PROFILE_ENTRY_SIGNATURE "a" ICD_WIREGUARD_PROFILE_SLOW_CALL_SIGNATURE) ||
+	    !dbus_message_iter_init(reply, &iter))
+		HARNESS_FAIL("GetProfile");
+	else {
+		dbus_message_iter_recurse(&iter, &array);
+		if (entry_count(&array, "wireguard_ip_up") == 0)
+			HARNESS_FAIL("GetProfile has no ip_up call");
+	}
+	reply_free(reply);
+
+	reply = wireguard_call(ICD_WIREGUARD_PROVIDER_DBUS_PATH, "GetProfile");
+	if (!reply_is(reply, "a" ICD_WIREGUARD_PROFILE_ENTRY_SIGNATURE "a" ICD_WIREGUARD_PROFILE_SLOW_CALL_SIGNATURE))
+		HARNESS_FAIL("GetProfile of the provider module");
+	reply_free(reply);
+
+	reply = wireguard_call(TUNNEL_PATH, "GetConfigChecks");
+	if (!reply_is(reply, "a" ICD_WIREGUARD_CONFIG_CHECKS_SIGNATURE) || !dbus_message_iter_init(reply, &iter))
+		HARNESS_FAIL("GetConfigChecks");
+	else {
+		dbus_message_iter_recurse(&iter, &array);
+		if (dbus_message_iter_get_arg_type(&array) != DBUS_TYPE_STRUCT) {
+			HARNESS_FAIL("GetConfigChecks is empty");
+		} else {
+			dbus_message_iter_recurse(&array, &entry);
+			dbus_message_iter_get_basic(&entry, &name);
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_get_basic(&entry, &error);
+			dbus_message_iter_next(&entry);
+			dbus_message_iter_get_basic(&entry, &warnings);
+			if (strcmp(name, HARNESS_CONFIG) != 0 || *error || *warnings)
+				HARNESS_FAIL("GetConfigChecks: %s \"%s\" \"%s\"", name, error, warnings);
+		}
+	}
+	reply_free(reply);
+}
+
+struct page_reader {
+	const struct icd_wireguard_status_page *page;
+	gint stop;
+	guint reads;
+	guint torn;
+};
+
+/* Read the status page as a client would, while the main loop writes it */
+static gpointer page_reader(gpointer data)
+{
+	struct page_reader *reader = data;
+	struct icd_wireguard_status_page copy;
+
+	while (!g_atomic_int_get(&reader->stop)) {
+		if (icd_wireguard_status_page_read(reader->page, &copy) != 0 || (copy.sequence & 1) ||
+		    copy.update_timestamp < copy.state_timestamp ||
+		    copy.state > ICD_WIREGUARD_STATUS_PAGE_STATE_CONNECTED)
+			reader->torn++;
+		reader->reads++;
+	}
+
+	return NULL;
+}
+
+static void check_page(const struct icd_wireguard_status_page *page, guint32 state, const char *what)
+{
+	struct icd_wireguard_status_page copy;
+
+	if (icd_wireguard_status_page_read(page, &copy) != 0)
+		HARNESS_FAIL("%s: status page not readable", what);
+	else if (copy.state != state)
+		HARNESS_FAIL("%s: status page state %u", what, copy.state);
+	else if (state == ICD_WIREGUARD_STATUS_PAGE_STATE_CONNECTED &&
+		 (copy.interface_index < 0 || strcmp(copy.active_config, HARNESS_CONFIG) != 0))
+		HARNESS_FAIL("%s: status page has index %d, config %s", what, copy.interface_index, copy.active_config);
+}
+
+/* The D-Bus interfaces as a client sees them, and the status page */
+static void scenario_dbus(void)
+{
+	gchar *path = g_build_filename(harness.config_dir, HARNESS_STATUS_PAGE, NULL);
+	struct page_reader reader = { NULL, 0, 0, 0 };
+	void (*set_last_error)(wireguard_tunnel *, const char *) = harness_module_symbol("wireguard_set_last_error");
+	struct icd_wireguard_status_page *page;
+	GThread *thread;
+	int fd, cycle;
+
+	check_properties();
+
+	harness_dbus_signals_clear();
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (!harness.iap.up)
+		HARNESS_FAIL("ip_up did not succeed");
+	if (!state_changed(TUNNEL_PATH, ICD_WIREGUARD_SIGNALS_STATUS_STATE_CONNECTED))
+		HARNESS_FAIL("No PropertiesChanged to Connected");
+
+	check_statistics();
+	check_introspection();
+
+	/* Errors that do not change the state are published too */
+	set_last_error(harness_network_private()->first_tunnel, "harness error");
+	if (!property_changed(TUNNEL_PATH, ICD_WIREGUARD_PROPERTY_LAST_ERROR, "harness error"))
+		HARNESS_FAIL("No PropertiesChanged for LastError");
+
+	fd = open(path, O_RDONLY);
+	page = fd < 0 ? MAP_FAILED : mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+	if (fd >= 0)
+		close(fd);
+	if (page == MAP_FAILED) {
+		HARNESS_FAIL("Unable to map %s: %s", path, g_strerror(errno));
+		g_free(path);
+		return;
+	}
+	check_page(page, ICD_WIREGUARD_STATUS_PAGE_STATE_CONNECTED, "up");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (!state_changed(TUNNEL_PATH, ICD_WIREGUARD_SIGNALS_STATUS_STATE_STOPPED))
+		HARNESS_FAIL("No PropertiesChanged to Stopped");
+	check_page(page, ICD_WIREGUARD_STATUS_PAGE_STATE_STOPPED, "down");
+
+	/* The seqlock: a reader never sees a half written page */
+	reader.page = page;
+	thread = g_thread_new("page-reader", page_reader, &reader);
+	for (cycle = 0; cycle < DBUS_CYCLES; cycle++) {
+		harness_ip_up(&harness.iap);
+		complete_next_spawn(TRUE);
+		harness_ip_down(&harness.iap);
+		complete_next_spawn(TRUE);
+	}
+	g_atomic_int_set(&reader.stop, 1);
+	g_thread_join(thread);
+	if (reader.reads == 0 || reader.torn != 0)
+		HARNESS_FAIL("Status page: %u torn reads out of %u", reader.torn, reader.reads);
+	check_page(page, ICD_WIREGUARD_STATUS_PAGE_STATE_STOPPED, "after cycles");
+
+	munmap(page, sizeof(*page));
+	g_free(path);
+}
+
+static gboolean spawn_pending(void)
+{
+	return harness_next_spawn() != NULL;
+}
+
+static gboolean srv_connected(void)
+{
+	return harness.srv.connect_answers > 0;
+}
+
+static void scenario_provider(void)
+{
+	harness_ip_up(&harness.provider_iap);
+	if (!harness.provider_iap.up || harness_next_spawn())
+		HARNESS_FAIL("Provider IAP should come up without a tunnel");
+
+	/* The provider asks the network module over D-Bus */
+	harness_srv_connect();
+	if (!harness_iterate(PROVIDER_TIMEOUT, spawn_pending)) {
+		HARNESS_FAIL("Start never reached the network module");
+		return;
+	}
+
+	complete_next_spawn(TRUE);
+	if (!harness_iterate(PROVIDER_TIMEOUT, srv_connected)) {
+		HARNESS_FAIL("Provider never connected");
+		return;
+	}
+	if (harness.srv.connect_status != ICD_SRV_SUCCESS)
+		HARNESS_FAIL("Provider connect failed");
+
+	harness_srv_disconnect();
+	if (!harness_iterate(PROVIDER_TIMEOUT, spawn_pending)) {
+		HARNESS_FAIL("Stop never reached the network module");
+		return;
+	}
+	complete_next_spawn(TRUE);
+
+	harness_ip_down(&harness.provider_iap);
+	complete_next_spawn(TRUE);
+
+	/* Let the Stop reply reach the provider before it is unloaded */
+	harness_dbus_sync();
+
+	if (harness.srv.close_requests != 0)
+		HARNESS_FAIL("Provider closed the service");
+}
+
+/* Random sequences */
+
+enum random_action {
+	ACTION_IP_UP,
+	ACTION_IP_DOWN,
+	ACTION_COMPLETE,
+	ACTION_TOGGLE,
+	ACTION_KILL,
+	ACTION_COUNT
+};
+
+static gboolean action_allowed(enum random_action action, const struct harness_iap *iap)
+{
+	switch (action) {
+	case ACTION_IP_UP:
+		return !iap->up && iap->ip_up_requests == iap->ip_up_answers;
+	case ACTION_IP_DOWN:
+		return iap->up;
+	case ACTION_COMPLETE:
+		return harness_next_spawn() != NULL;
+	case ACTION_TOGGLE:
+		/* Also while wg-quick runs or ip_up is pending */
+		return TRUE;
+	case ACTION_KILL:
+		return iap->up && harness.links[0].running;
+	default:
+		return FALSE;
+	}
+}
+
+static void random_step(GRand * rand, struct harness_iap *iap)
+{
+	enum random_action allowed[ACTION_COUNT], action;
+	gboolean system_wide;
+	int i, count = 0;
+
+	for (i = 0; i < ACTION_COUNT; i++) {
+		if (action_allowed(i, iap))
+			allowed[count++] = i;
+	}
+
+	if (count == 0) {
+		HARNESS_FAIL("Stuck: ip_up pending without anything to wait for");
+		return;
+	}
+
+	action = allowed[g_rand_int_range(rand, 0, count)];
+
+	switch (action) {
+	case ACTION_IP_UP:
+		harness_ip_up(iap);
+		break;
+	case ACTION_IP_DOWN:
+		harness_ip_down(iap);
+		break;
+	case ACTION_COMPLETE:
+		complete_next_spawn(g_rand_int_range(rand, 0, 8) != 0);
+		break;
+	case ACTION_TOGGLE:
+		system_wide = harness_network_private()->system_wide_enabled;
+		harness_gconf_set_bool(GC_WIREGUARD_SYSTEM, !system_wide);
+		break;
+	case ACTION_KILL:
+		harness_link_remove(0);
+		break;
+	default:
+		break;
+	}
+
+	handle_close(iap);
+}
+
+/* One random sequence ending with everything down, on loaded modules */
+static void random_run(GRand * rand, guint steps)
+{
+	guint i;
+
+	for (i = 0; i < steps; i++)
+		random_step(rand, &harness.iap);
+
+	settle(&harness.iap);
+	check_idle();
+}
+
+/* Runners */
+
+/* Write a GC_PEER_IPS_FILE of count /32s, in every syntax it may use */
+static void write_prefix_file(const char *path, guint count)
+{
+	GString *text = g_string_new("# Generated by the harness\n\n");
+	guint i;
+
+	for (i = 0; i < count; i++)
+		g_string_append_printf(text, "172.16.%u.%u/32%s", i / 256, i % 256,
+				       i % 8 == 7 ? " # eight\n" : i % 2 ? ",\n" : ", ");
+	g_string_append(text, "\nnot-a-prefix 10.0.0.0/99\n");
+
+	if (!g_file_set_contents(path, text->str, text->len, NULL))
+		HARNESS_FAIL("Unable to write %s", path);
+	g_string_free(text, TRUE);
+}
+
+/* How many caches of one kind, by file name suffix, there are and when the
+ * newest was written; removing all caches if asked to */
+static guint caches(const char *suffix, gint64 * newest, gboolean remove)
+{
+	gchar *dir = g_build_filename(g_get_user_cache_dir(), WIREGUARD_PREFIX_CACHE_DIR, NULL);
+	GDir *entries = g_dir_open(dir, 0, NULL);
+	const gchar *name;
+	guint count = 0;
+
+	*newest = 0;
+	while (entries && (name = g_dir_read_name(entries))) {
+		gchar *path = g_build_filename(dir, name, NULL);
+		struct stat st;
+
+		if (g_str_has_suffix(name, suffix) && stat(path, &st) == 0) {
+			*newest = MAX(*newest, (gint64) st.st_mtim.tv_sec * G_USEC_PER_SEC + st.st_mtim.tv_nsec / 1000);
+			count++;
+		}
+		if (remove)
+			g_unlink(path);
+		g_free(path);
+	}
+
+	if (entries)
+		g_dir_close(entries);
+	g_free(dir);
+
+	return count;
+}
+
+static void check_prefix_file(guint count, guint chunks, const char *what)
+{
+	guint i;
+
+	if (harness.allowed_ips != count || harness.allowed_ips_chunks != chunks)
+		HARNESS_FAIL("%s: %" G_GUINT64_FORMAT " AllowedIPs in %u chunks, expected %u in %u",
+			     what, harness.allowed_ips, harness.allowed_ips_chunks, count, chunks);
+
+	for (i = 0; i < count; i++) {
+		gchar *prefix = g_strdup_printf("172.16.%u.%u/32", i / 256, i % 256);
+
+		check_route(prefix, 1, what);
+		g_free(prefix);
+	}
+
+	/* And the AllowedIPs and endpoint of HARNESS_CONFIG */
+	if (g_hash_table_size(harness.routes) != count + 2)
+		HARNESS_FAIL("%s: %u routes", what, g_hash_table_size(harness.routes));
+}
+
+/* A long AllowedIPs file handed to the kernel in chunks and routed, parsed
+ * once for as long as it does not change */
+static void scenario_prefix_file(void)
+{
+	gchar *key = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_PEERS, "peer0", GC_PEER_IPS_FILE, NULL);
+	gchar *path = g_build_filename(harness.config_dir, "prefixes", NULL);
+	guint count = 4 * WIREGUARD_ALLOWED_IPS_CHUNK + 100;
+	gint64 written, rewritten;
+	wireguard_tunnel *tunnel;
+
+	write_prefix_file(path, count);
+	harness_gconf_set_string(key, path);
+	g_free(key);
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	check_prefix_file(count, 5, "Up");
+	if (caches(".prefixes", &written, FALSE) != 1)
+		HARNESS_FAIL("No cache");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (g_hash_table_size(harness.routes) != 0)
+		HARNESS_FAIL("%u routes left", g_hash_table_size(harness.routes));
+
+	harness.allowed_ips = 0;
+	harness.allowed_ips_chunks = 0;
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	check_prefix_file(count, 5, "Up again");
+	if (caches(".prefixes", &rewritten, FALSE) != 1 || rewritten != written)
+		HARNESS_FAIL("Cache written again");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	/* A changed file is parsed again */
+	harness.allowed_ips = 0;
+	harness.allowed_ips_chunks = 0;
+	write_prefix_file(path, 10);
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	check_prefix_file(10, 1, "Changed");
+	if (caches(".prefixes", &rewritten, TRUE) != 2 || rewritten < written)
+		HARNESS_FAIL("Cache not rebuilt");
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (g_hash_table_size(harness.routes) != 0 || harness.rules != 0)
+		HARNESS_FAIL("%u routes and %d rules left", g_hash_table_size(harness.routes), harness.rules);
+
+	/* The message that failed is named, those before it went through */
+	harness.allowed_ips = 0;
+	harness.allowed_ips_chunks = 0;
+	harness.allowed_ips_error = -ENOMEM;
+	write_prefix_file(path, 2 * WIREGUARD_ALLOWED_IPS_CHUNK + 5);
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	tunnel = iap_tunnel(&harness.iap);
+	if (tunnel == NULL || tunnel->last_error == NULL
+	    || strstr(tunnel->last_error, "AllowedIPs 1025 to 1029 of 1029") == NULL)
+		HARNESS_FAIL("Failure not named: %s", tunnel ? tunnel->last_error : NULL);
+	if (harness.allowed_ips != 2 * WIREGUARD_ALLOWED_IPS_CHUNK)
+		HARNESS_FAIL("%" G_GUINT64_FORMAT " AllowedIPs added before the failure", harness.allowed_ips);
+
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+	caches(".prefixes", &written, TRUE);
+
+	g_unlink(path);
+	g_free(path);
+}
+
+/* Loading does only what D-Bus needs, the rest waits for idle time */
+static void scenario_lazy_start(void)
+{
+	network_wireguard_private *priv = harness_network_private();
+
+	if (priv->started || priv->gconf_client != NULL || priv->first_tunnel->stats.interval != 0)
+		HARNESS_FAIL("gconf read during init");
+
+	harness_drain();
+	if (!priv->started || priv->gconf_cb_id_systemwide == 0 || !priv->system_wide_enabled)
+		HARNESS_FAIL("Not started once idle");
+	if (priv->first_tunnel->stats.interval != 1000)
+		HARNESS_FAIL("Statistics interval not read once idle");
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+}
+
+/* Whether the cached HARNESS_CONFIG holds the key the base64 value decodes
+ * to */
+static gboolean cache_holds_key(const char *value)
+{
+	gchar *path = g_build_filename(g_get_user_cache_dir(), WIREGUARD_PREFIX_CACHE_DIR, HARNESS_CONFIG ".config",
+				       NULL);
+	gsize key_len, len = 0, i;
+	guchar *key = g_base64_decode(value, &key_len);
+	gchar *cache = NULL;
+	gboolean found = FALSE;
+
+	g_file_get_contents(path, &cache, &len, NULL);
+	for (i = 0; cache && i + key_len <= len && !found; i++)
+		found = memcmp(cache + i, key, key_len) == 0;
+
+	g_free(cache);
+	g_free(key);
+	g_free(path);
+
+	return found;
+}
+
+/* A config is compiled once, and not used if it does not compile */
+static void scenario_config_cache(void)
+{
+	gchar *key = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_PEERS, "peer0", GC_PEER_ENDPOINT, NULL);
+	gchar *private_key = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_PRIVATEKEY, NULL);
+	gchar *conf = g_build_filename(harness.config_dir, "icdwg0.conf", NULL);
+	gchar *text = NULL;
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+	gint64 written, rewritten;
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (caches(".config", &written, FALSE) != 1)
+		HARNESS_FAIL("Not compiled");
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (caches(".config", &rewritten, FALSE) != 1 || rewritten != written)
+		HARNESS_FAIL("Compiled again");
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	/* The private key is never cached, a new one is used as it is */
+	if (cache_holds_key("yAnz5TF+lXXJte14tji3zlMNq+hd2rYUIgJBgB3fBmk="))
+		HARNESS_FAIL("Private key cached");
+	harness_gconf_set_string(private_key, "ICEiIyQlJicoKSorLC0uLzAxMjM0NTY3ODk6Ozw9Pj8=");
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (caches(".config", &rewritten, FALSE) != 1 || rewritten != written)
+		HARNESS_FAIL("Compiled again for a new private key");
+	if (!g_file_get_contents(conf, &text, NULL, NULL)
+	    || strstr(text, "\nPrivateKey = ICEiIyQlJicoKSorLC0uLzAxMjM0NTY3ODk6Ozw9Pj8=\n") == NULL)
+		HARNESS_FAIL("New private key not used");
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	harness_gconf_set_string(key, "192.0.2.1");
+	harness_ip_up(&harness.iap);
+	if (harness.iap.ip_up_answers != 4 || harness.iap.ip_up_status != ICD_NW_ERROR)
+		HARNESS_FAIL("ip_up did not fail");
+	if (harness_next_spawn())
+		HARNESS_FAIL("wg-quick started with an invalid config");
+	if (g_strcmp0(tunnel->last_error,
+		      "Invalid config " HARNESS_CONFIG ": peer0: EndPoint '192.0.2.1' is not host:port") != 0)
+		HARNESS_FAIL("Not rejected: %s", tunnel->last_error);
+
+	caches(".config", &written, TRUE);
+	g_free(text);
+	g_free(conf);
+	g_free(private_key);
+	g_free(key);
+}
+
+static const wireguard_config_verdict *verdict(void)
+{
+	return g_hash_table_lookup(harness_network_private()->config_checks, HARNESS_CONFIG);
+}
+
+/* A config is checked once it changes, and a connect to one that failed
+ * its check is refused without generating it again */
+static void scenario_config_checks(void)
+{
+	gchar *pubkey = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_PEERS, "peer0", GC_PEER_PUBKEY, NULL);
+	gchar *endpoint = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_PEERS, "peer1", GC_PEER_ENDPOINT, NULL);
+	gchar *override = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_CONFIG_FILE_OVERRIDE, NULL);
+	gchar *file = g_build_filename(harness.config_dir, "override.conf", NULL);
+	gboolean (*check)(const char *, gchar **, gchar **) = harness_module_symbol("wireguard_config_check");
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+	gchar *error = NULL, *warnings = NULL;
+	gint64 written, rewritten;
+
+	caches(".config", &written, TRUE);
+	harness_drain();
+	if (verdict() == NULL || verdict()->error || verdict()->warnings)
+		HARNESS_FAIL("Not checked once idle");
+	if (caches(".config", &written, FALSE) != 1)
+		HARNESS_FAIL("Not compiled ahead of the first connect");
+
+	harness_gconf_set_string(pubkey, "not a key");
+	if (verdict())
+		HARNESS_FAIL("Verdict kept after a change");
+	harness_drain();
+	if (verdict() == NULL || g_strcmp0(verdict()->error, "peer0: " GC_PEER_PUBKEY " is not a base64 32 byte key"))
+		HARNESS_FAIL("Not found invalid: %s", verdict() ? verdict()->error : "not checked");
+
+	harness_ip_up(&harness.iap);
+	if (harness.iap.ip_up_answers != 1 || harness.iap.ip_up_status != ICD_NW_ERROR)
+		HARNESS_FAIL("ip_up did not fail");
+	if (harness_next_spawn() || harness.config_writes != 0)
+		HARNESS_FAIL("wg-quick started with an invalid config");
+	if (g_strcmp0(tunnel->last_error,
+		      "Invalid config " HARNESS_CONFIG ": peer0: " GC_PEER_PUBKEY " is not a base64 32 byte key"))
+		HARNESS_FAIL("Not rejected: %s", tunnel->last_error);
+
+	/* What does not keep it from being used is only reported */
+	harness_gconf_set_string(pubkey, "xTIBA5rboUvnH4htodjb6e697QjLERt1NAB4mZqp8Dg=");
+	harness_gconf_set_string(endpoint, "192.0.2.2:51820");
+	harness_drain();
+	if (verdict() == NULL || verdict()->error
+	    || g_strcmp0(verdict()->warnings, "peer1: no " GC_PEER_PUBKEY " yet, left out"))
+		HARNESS_FAIL("Warnings: %s", verdict() ? verdict()->warnings : "not checked");
+
+	/* Checked again from the cache, which keeps the warnings */
+	caches(".config", &written, FALSE);
+	if (!check(HARNESS_CONFIG, &error, &warnings) || error
+	    || g_strcmp0(warnings, "peer1: no " GC_PEER_PUBKEY " yet, left out"))
+		HARNESS_FAIL("Warnings from the cache: %s", warnings);
+	if (caches(".config", &rewritten, FALSE) != 1 || rewritten != written)
+		HARNESS_FAIL("Cache written again");
+	g_free(warnings);
+	g_free(error);
+
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (!harness.iap.up)
+		HARNESS_FAIL("Not connected once fixed");
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+
+	/* A config file override is checked again once it is found missing,
+	 * gconf does not tell when the file shows up */
+	harness_gconf_set_string(override, file);
+	harness_drain();
+	if (verdict() == NULL || verdict()->error == NULL)
+		HARNESS_FAIL("Missing override file not found");
+	g_file_set_contents(file, "[Interface]\n", -1, NULL);
+	harness_ip_up(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (!harness.iap.up)
+		HARNESS_FAIL("Refused once the override file is there: %s", tunnel->last_error);
+	harness_ip_down(&harness.iap);
+	complete_next_spawn(TRUE);
+	if (verdict() == NULL || verdict()->error)
+		HARNESS_FAIL("Stale verdict on the override");
+
+	harness_gconf_unset(override);
+	g_unlink(file);
+	harness_gconf_unset(endpoint);
+	caches(".config", &written, TRUE);
+	g_free(file);
+	g_free(override);
+	g_free(endpoint);
+	g_free(pubkey);
+}
+
+static gboolean got_sigterm(void)
+{
+	return harness.signal_sent == SIGTERM;
+}
+
+static gboolean ip_up_answered(void)
+{
+	return harness.iap.ip_up_answers == harness.iap.ip_up_requests;
+}
+
+/* A wg-quick that hangs is stopped, and given up on when it does not stop */
+static void scenario_watchdog(void)
+{
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+	struct harness_spawn *spawn;
+
+	harness_gconf_set_int(GC_WIREGUARD_OP_TIMEOUT, 1);
+
+	/* Exits on SIGTERM */
+	harness_ip_up(&harness.iap);
+	if (!harness_iterate(3000, got_sigterm))
+		HARNESS_FAIL("No SIGTERM");
+	complete_next_spawn(FALSE);
+	if (harness.iap.ip_up_answers != 1 || harness.iap.ip_up_status != ICD_NW_ERROR)
+		HARNESS_FAIL("ip_up did not fail");
+	if (g_strcmp0(tunnel->last_error, "wg-quick timed out after 1 s") != 0)
+		HARNESS_FAIL("Timeout not named: %s", tunnel->last_error);
+	if (tunnel->timeouts != 1)
+		HARNESS_FAIL("%u timeouts", tunnel->timeouts);
+	complete_next_spawn(TRUE);
+
+	/* Ignores SIGTERM, ip_up fails without waiting for it */
+	harness.signal_sent = 0;
+	harness_ip_up(&harness.iap);
+	spawn = harness_next_spawn();
+	if (!harness_iterate(5000, ip_up_answered))
+		HARNESS_FAIL("ip_up not answered");
+	if (spawn == NULL || !spawn->killed || harness.links_deleted != 1)
+		HARNESS_FAIL("Not killed and cleaned up");
+	if (harness.iap.ip_up_status != ICD_NW_ERROR || tunnel->timeouts != 2)
+		HARNESS_FAIL("ip_up did not time out");
+
+	/* The module started wg-quick down without waiting for it */
+	if (spawn)
+		harness_complete_spawn(spawn, FALSE);
+	complete_next_spawn(TRUE);
+}
+
+static gboolean ip_down_answered(void)
+{
+	return harness.iap.ip_down_answers == harness.iap.ip_down_requests;
+}
+
+static gboolean tunnel_ops_done(void)
+{
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+
+	return tunnel->op_running == NULL && g_queue_is_empty(&tunnel->ops);
+}
+
+/* Lines wg-quick-stub logged */
+static guint helper_runs(const char *line)
+{
+	gchar *path = g_build_filename(HARNESS_HELPER_DIR, "wg-quick.log", NULL);
+	gchar *log = NULL, **lines;
+	guint i, count = 0;
+
+	g_file_get_contents(path, &log, NULL, NULL);
+	lines = g_strsplit(log ? log : "", "\n", -1);
+	for (i = 0; lines[i]; i++)
+		count += strcmp(lines[i], line) == 0;
+
+	g_strfreev(lines);
+	g_free(log);
+	g_free(path);
+
+	return count;
+}
+
+static guint hung_up;
+
+static gboolean helper_hangs(void)
+{
+	return helper_runs("up icdwg0") > hung_up;
+}
+
+static void helper_hang(gboolean hang)
+{
+	gchar *path = g_build_filename(HARNESS_HELPER_DIR, "hang", NULL);
+
+	if (hang)
+		g_file_set_contents(path, "", 0, NULL);
+	else
+		g_unlink(path);
+
+	g_free(path);
+}
+
+/* icd-wireguard-helper writes the config and runs wg-quick over its socket,
+ * is asked to stop a wg-quick that hangs, and dies with one running */
+static void scenario_helper(void)
+{
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+	gchar *path = g_build_filename(HARNESS_HELPER_DIR, "icdwg0.conf", NULL);
+	gchar *config = NULL;
+	int round;
+
+	harness.real_helper = TRUE;
+	g_mkdir_with_parents(HARNESS_HELPER_DIR, 0700);
+	g_setenv("HARNESS_HELPER_DIR", HARNESS_HELPER_DIR, TRUE);
+
+	/* Up and down */
+	harness_ip_up(&harness.iap);
+	if (!harness_iterate(5000, ip_up_answered) || harness.iap.ip_up_status != ICD_NW_SUCCESS)
+		HARNESS_FAIL("ip_up did not succeed through the helper");
+	if (harness.helper_pid == 0 || !harness.helper_watched)
+		HARNESS_FAIL("Helper not started or not watched");
+	if (!g_file_get_contents(path, &config, NULL, NULL) || strstr(config, "[Peer]") == NULL)
+		HARNESS_FAIL("Helper did not write the config");
+	if (helper_runs("up icdwg0") != 1)
+		HARNESS_FAIL("Helper did not run wg-quick up");
+	if (tunnel->timing.current[WIREGUARD_TIMING_WRITE_CONFIG] < 0 ||
+	    tunnel->timing.current[WIREGUARD_TIMING_SPAWN] < 0 || tunnel->timing.helper_up != 0)
+		HARNESS_FAIL("Helper answers not timed");
+	if (harness.config_writes != 0 || harness_next_spawn())
+		HARNESS_FAIL("Module ran wg-quick itself");
+
+	harness_ip_down(&harness.iap);
+	if (!harness_iterate(5000, ip_down_answered))
+		HARNESS_FAIL("ip_down not answered");
+	if (helper_runs("down icdwg0") != 1)
+		HARNESS_FAIL("Helper did not run wg-quick down");
+
+	/* Killed through the helper when it ignores SIGTERM */
+	harness_gconf_set_int(GC_WIREGUARD_OP_TIMEOUT, 1);
+	helper_hang(TRUE);
+	harness_ip_up(&harness.iap);
+	if (!harness_iterate(5000, ip_up_answered) || harness.iap.ip_up_status != ICD_NW_ERROR)
+		HARNESS_FAIL("Hanging ip_up did not fail");
+	if (harness.signal_sent != SIGKILL || tunnel->timeouts != 1)
+		HARNESS_FAIL("Not killed: signal %d, %u timeouts", harness.signal_sent, tunnel->timeouts);
+	helper_hang(FALSE);
+	if (!harness_iterate(5000, tunnel_ops_done))
+		HARNESS_FAIL("wg-quick down after the kill did not finish");
+
+	/* The helper dies with wg-quick up running, which then failed; wg-quick
+	 * down runs through a new helper or ourselves */
+	harness_gconf_set_int(GC_WIREGUARD_OP_TIMEOUT, 30);
+	hung_up = helper_runs("up icdwg0");
+	helper_hang(TRUE);
+	harness_ip_up(&harness.iap);
+	if (!harness_iterate(5000, helper_hangs))
+		HARNESS_FAIL("Helper did not run wg-quick up");
+	harness_helper_kill();
+	if (!harness_iterate(5000, ip_up_answered) || harness.iap.ip_up_status != ICD_NW_ERROR)
+		HARNESS_FAIL("ip_up did not fail with the helper");
+	for (round = 0; round < SETTLE_ROUNDS && !tunnel_ops_done(); round++) {
+		if (harness_next_spawn())
+			complete_next_spawn(TRUE);
+		else
+			harness_iterate(100, tunnel_ops_done);
+	}
+	if (!tunnel_ops_done())
+		HARNESS_FAIL("wg-quick down without the helper did not finish");
+	helper_hang(FALSE);
+
+	g_free(config);
+	g_free(path);
+}
+
+struct scenario {
+	const char *name;
+	void (*run)(void);
+	gboolean system_wide;
+};
+
+static const struct scenario scenarios[] = {
+	{"connect_disconnect", scenario_connect_disconnect, TRUE},
+	{"disabled", scenario_disabled, TRUE},
+	{"wg_quick_fails", scenario_wg_quick_fails, TRUE},
+	{"unexpected_down", scenario_unexpected_down, TRUE},
+	{"gconf_toggle", scenario_gconf_toggle, TRUE},
+	{"config_missing", scenario_config_missing, TRUE},
+	{"toggle_coalesce", scenario_toggle_coalesce, TRUE},
+	{"concurrent", scenario_concurrent, TRUE},
+	{"multipath", scenario_multipath, TRUE},
+	{"policy_routing", scenario_policy_routing, TRUE},
+	{"prefix_file", scenario_prefix_file, TRUE},
+	{"watchdog", scenario_watchdog, TRUE},
+	{"helper", scenario_helper, TRUE},
+	{"lazy_start", scenario_lazy_start, TRUE},
+	{"stats_error", scenario_stats_error, TRUE},
+	{"config_cache", scenario_config_cache, TRUE},
+	{"config_checks", scenario_config_checks, TRUE},
+	{"dbus", scenario_dbus, TRUE},
+	{"provider", scenario_provider, FALSE},
+};
+
+static void run_scenario(const struct scenario *scenario)
+{
+	guint failures = harness.failures;
+
+	if (!harness_setup(scenario->system_wide)) {
+		HARNESS_FAIL("Unable to load the modules");
+	} else {
+		scenario->run();
+		check_idle();
+	}
+	harness_teardown();
+
+	g_print("%s: %s\n", harness.failures == failures ? "PASS" : "FAIL", scenario->name);
+}
+
+static void run_random(guint32 seed, guint runs)
+{
+	guint failures = harness.failures;
+	GRand *rand = g_rand_new_with_seed(seed);
+	guint i;
+
+	if (!harness_setup(TRUE)) {
+		HARNESS_FAIL("Unable to load the modules");
+		g_rand_free(rand);
+		return;
+	}
+
+	/* State must not leak from one sequence into the next */
+	for (i = 0; i < runs && harness.failures == failures; i++)
+		random_run(rand, RANDOM_STEPS);
+
+	harness_teardown();
+	g_rand_free(rand);
+
+	g_print("%s: random seed=%u runs=%u\n", harness.failures == failures ? "PASS" : "FAIL", seed, i);
+}
+
+/* Replay file, or a generated stream of veths links, then fuzz with it */
+static void run_netlink(const char *prefix, const char *file, guint veths, guint32 seed, guint fuzz)
+{
+	guint failures = harness.failures;
+	GPtrArray *stream;
+
+	stream = file ? harness_netlink_load(file) : harness_netlink_generate(veths);
+	if (stream == NULL)
+		return;
+
+	if (harness_setup(FALSE)) {
+		harness_netlink_replay(prefix, stream);
+		if (fuzz)
+			harness_netlink_fuzz(stream, seed, fuzz);
+	} else {
+		HARNESS_FAIL("Unable to load the modules");
+	}
+	harness_teardown();
+	g_ptr_array_free(stream, TRUE);
+
+	g_print("%s: %s seed=%u fuzz=%u\n", harness.failures == failures ? "PASS" : "FAIL", prefix, seed, fuzz);
+}
+
+/* Configuration helpers against growing peer sets */
+static void run_config(const char *prefix, guint max_peers, gdouble min_time)
+{
+	guint failures = harness.failures;
+
+	if (harness_setup(FALSE))
+		harness_config_bench(prefix, max_peers, min_time);
+	else
+		HARNESS_FAIL("Unable to load the modules");
+	harness_teardown();
+
+	g_print("%s: %s max_peers=%u\n", harness.failures == failures ? "PASS" : "FAIL", prefix, max_peers);
+}
+
+static int check(guint32 seed, guint iterations)
+{
+	guint i;
+
+	for (i = 0; i < G_N_ELEMENTS(scenarios); i++)
+		run_scenario(&scenarios[i]);
+
+	run_random(seed, iterations ? iterations : CHECK_RANDOM_RUNS);
+	run_netlink("check-netlink", NULL, CHECK_NETLINK_VETHS, seed, CHECK_NETLINK_FUZZ);
+	run_config("check-config", CHECK_CONFIG_PEERS, 0);
+
+	return harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+static void bench_cycles(guint cycles)
+{
+	GTimer *timer;
+	guint64 reads;
+	guint i;
+
+	if (!harness_setup(TRUE)) {
+		HARNESS_FAIL("Unable to load the modules");
+		return;
+	}
+
+	harness_transitions_reset();
+	reads = harness_gconf_reads();
+	timer = g_timer_new();
+
+	for (i = 0; i < cycles; i++)
+		scenario_connect_disconnect();
+
+	g_timer_stop(timer);
+	check_idle();
+
+	harness_transitions_report("bench-cycle", g_timer_elapsed(timer, NULL));
+	g_print("bench-cycle cycles=%u cycles_per_s=%.0f gconf_reads_per_cycle=%.1f config_writes=%u\n", cycles,
+		cycles / g_timer_elapsed(timer, NULL), (gdouble) (harness_gconf_reads() - reads) / cycles,
+		harness.config_writes);
+
+	g_timer_destroy(timer);
+	harness_teardown();
+}
+
+static void bench_random(guint32 seed, guint runs)
+{
+	GRand *rand = g_rand_new_with_seed(seed);
+	GTimer *timer;
+	guint i;
+
+	if (!harness_setup(TRUE)) {
+		HARNESS_FAIL("Unable to load the modules");
+		g_rand_free(rand);
+		return;
+	}
+
+	harness_transitions_reset();
+	timer = g_timer_new();
+
+	for (i = 0; i < runs; i++)
+		random_run(rand, RANDOM_STEPS);
+
+	g_timer_stop(timer);
+	harness_transitions_report("bench-random", g_timer_elapsed(timer, NULL));
+
+	g_timer_destroy(timer);
+	g_rand_free(rand);
+	harness_teardown();
+}
+
+static int bench(guint32 seed, guint iterations)
+{
+	bench_cycles(iterations ? iterations : BENCH_CYCLES);
+	bench_random(seed, iterations ? iterations : BENCH_RANDOM_RUNS);
+	run_netlink("bench-netlink", NULL, iterations ? iterations : BENCH_NETLINK_VETHS, seed, 0);
+	run_config("bench-config", BENCH_CONFIG_PEERS, BENCH_CONFIG_TIME);
+
+	return harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+int main(int argc, char **argv)
+{
+	const char *mode = "check";
+	guint32 seed = DEFAULT_SEED;
+	guint iterations = 0;
+	const char *config = NULL, *label = "", *run = NULL, *file = NULL;
+	gchar *cache_dir, *module_cache;
+	int i, ret;
+
+	for (i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--seed") == 0 && i + 1 < argc)
+			seed = g_ascii_strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--iterations") == 0 && i + 1 < argc)
+			iterations = g_ascii_strtoull(argv[++i], NULL, 10);
+		else if (strcmp(argv[i], "--config") == 0 && i + 1 < argc)
+			config = argv[++i];
+		else if (strcmp(argv[i], "--file") == 0 && i + 1 < argc)
+			file = argv[++i];
+		else if (strcmp(argv[i], "--label") == 0 && i + 1 < argc)
+			label = argv[++i];
+		else if (strcmp(argv[i], "--run") == 0 && i + 1 < argc)
+			run = argv[++i];
+		else if (argv[i][0] != '-')
+			mode = argv[i];
+		else {
+			g_printerr("Usage: %s [check|bench|netns] [--seed N] [--iterations N] [--config FILE] [--label TEXT] [--run COMMAND] [--file FILE]\n", argv[0]);
+			return EXIT_FAILURE;
+		}
+	}
+
+	/* Needs neither D-Bus nor the modules */
+	if (strcmp(mode, "netlink-record") == 0 && file)
+		return harness_netlink_record(file, iterations ? iterations : NETLINK_RECORD_COUNT);
+	if (strcmp(mode, "netlink-generate") == 0 && file) {
+		GPtrArray *stream = harness_netlink_generate(iterations ? iterations : BENCH_NETLINK_VETHS);
+
+		harness_netlink_save(file, stream);
+		g_ptr_array_free(stream, TRUE);
+		return harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+	}
+
+	if (!harness_dbus_start()) {
+		g_printerr("SKIP: no dbus-daemon\n");
+		return EXIT_SKIP;
+	}
+
+	/* Keep what the module caches out of the user's cache */
+	cache_dir = g_dir_make_tmp("icd-wireguard-cache-XXXXXX", NULL);
+	if (cache_dir)
+		g_setenv("XDG_CACHE_HOME", cache_dir, TRUE);
+
+	if (strcmp(mode, "bench") == 0)
+		ret = bench(seed, iterations);
+	else if (strcmp(mode, "check") == 0)
+		ret = check(seed, iterations);
+	else if (strcmp(mode, "bench-config") == 0) {
+		run_config("bench-config", BENCH_CONFIG_PEERS, BENCH_CONFIG_TIME);
+		ret = harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+	} else if (strcmp(mode, "netlink-replay") == 0) {
+		run_netlink("netlink-replay", file, iterations ? iterations : BENCH_NETLINK_VETHS, seed, 0);
+		ret = harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+	} else if (strcmp(mode, "netlink-fuzz") == 0) {
+		run_netlink("netlink-fuzz", file, CHECK_NETLINK_VETHS, seed, iterations ? iterations : CHECK_NETLINK_FUZZ);
+		ret = harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+	} else if (strcmp(mode, "netns") == 0 && config)
+		ret = harness_netns(config, iterations ? iterations : NETNS_CYCLES, label, run);
+	else {
+		g_printerr("Unknown mode %s\n", mode);
+		ret = EXIT_FAILURE;
+	}
+
+	harness_dbus_stop();
+
+	if (cache_dir) {
+		module_cache = g_build_filename(cache_dir, WIREGUARD_PREFIX_CACHE_DIR, NULL);
+		g_rmdir(module_cache);
+		g_rmdir(cache_dir);
+		g_free(module_cache);
+		g_free(cache_dir);
+	}
+
+	return ret;
+}
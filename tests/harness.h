@@ -0,0 +1,240 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+#ifndef __WIREGUARD_HARNESS_H
+#define __WIREGUARD_HARNESS_H
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include <network_api.h>
+#include <srv_provider_api.h>
+
+#include "libicd_network_wireguard.h"
+
+/*
+ * The harness plays icd2: it dlopens the modules and provides the icd2
+ * symbols they resolve at load time (icd_dbus_*, icd_log_*). It is linked
+ * with -export-dynamic, so its definitions of gconf_client_*, spawn_as,
+ * g_file_set_contents, wireguard_genl_* and wireguard_state_change take
+ * precedence over the real ones for the modules.
+ *
+ * With real_helper set the module gets HARNESS_HELPER as its
+ * icd-wireguard-helper, which runs tests/wg-quick-stub in HARNESS_HELPER_DIR.
+ */
+
+#define HARNESS_LOG(fmt, ...) g_print("harness: " fmt "\n", ##__VA_ARGS__)
+#define HARNESS_FAIL(fmt, ...) harness_fail(__func__, __LINE__, fmt, ##__VA_ARGS__)
+
+#define HARNESS_IAP "harness-iap"
+#define HARNESS_PROVIDER_IAP "harness-provider-iap"
+#define HARNESS_SECOND_IAP "harness-second-iap"
+#define HARNESS_CONFIG "harness-config"
+#define HARNESS_FIRST_PID 100000
+#define HARNESS_FIRST_IFINDEX 1000
+/* Fake icdwgN interfaces */
+#define HARNESS_TUNNELS 4
+/* The status page, in config_dir unless real_system is set */
+#define HARNESS_STATUS_PAGE "status"
+
+/* What the fake spawn_as was asked to run */
+enum harness_spawn_type {
+	HARNESS_SPAWN_UP,
+	HARNESS_SPAWN_DOWN,
+	HARNESS_SPAWN_OTHER
+};
+
+struct harness_spawn {
+	pid_t pid;
+	enum harness_spawn_type type;
+	/* N of the icdwgN it works on */
+	guint tunnel;
+	/* Set once the module passed the pid to watch_pid */
+	gboolean watched;
+	/* Got SIGKILL, the module gives up on it if it still runs */
+	gboolean killed;
+};
+
+/* Outstanding icd2 requests and the answers we got, per IAP */
+struct harness_iap {
+	const char *network_id;
+
+	guint ip_up_requests;
+	guint ip_up_answers;
+	enum icd_nw_status ip_up_status;
+
+	guint ip_down_requests;
+	guint ip_down_answers;
+
+	/* The module asked icd2 to close the IAP */
+	guint close_requests;
+
+	/* icd2's view: ip_up succeeded and ip_down was not called yet */
+	gboolean up;
+};
+
+/* A fake icdwgN as the kernel sees it */
+#define HARNESS_ROUTE_THROW G_MAXUINT
+
+struct harness_link {
+	gboolean exists;
+	gboolean running;
+	int index;
+	/* Seconds since the last handshake its peer reports */
+	gint64 handshake_age;
+};
+
+struct harness_srv {
+	guint connect_requests;
+	guint connect_answers;
+	enum icd_srv_status connect_status;
+	guint disconnect_answers;
+	guint close_requests;
+};
+
+struct harness_transitions {
+	guint64 count;
+	/* wireguard_interface_up changes */
+	guint64 interface_edges;
+	/* Duration of wireguard_state_change() per event source */
+	GArray *durations[EVENT_SOURCE_COUNT];
+};
+
+struct harness {
+	/* icd2 side */
+	struct icd_nw_api nw_api;
+	struct icd_srv_api srv_api;
+	gpointer network_module;
+	gpointer provider_module;
+
+	struct harness_iap iap;
+	struct harness_iap provider_iap;
+	struct harness_iap second_iap;
+	struct harness_srv srv;
+
+	/* System side */
+	gboolean real_system;
+	GQueue spawns;
+	pid_t next_pid;
+	gchar *config_dir;
+	guint config_writes;
+
+	/* By N */
+	struct harness_link links[HARNESS_TUNNELS];
+	int next_ifindex;
+	int netlink_fd;
+
+	/* Fake routes as "prefix/len" to their number of paths or
+	 * HARNESS_ROUTE_THROW, and how many policy rules are installed */
+	GHashTable *routes;
+	int rules;
+
+	/* Messages wireguard_genl_add_allowed_ips() would add and the
+	 * prefixes they added, and the error its last message gets */
+	guint allowed_ips_chunks;
+	guint64 allowed_ips;
+	int allowed_ips_error;
+
+	/* The error wireguard_genl_get_device() fails with after the peers */
+	int genl_error;
+
+	/* The signal the module last sent a wg-quick, and how many links it
+	 * deleted */
+	int signal_sent;
+	guint links_deleted;
+
+	/* Run the helper for real, its pid and whether the module watches it */
+	gboolean real_helper;
+	pid_t helper_pid;
+	guint helper_watch;
+	gboolean helper_watched;
+
+	struct harness_transitions transitions;
+	guint64 allocations;
+
+	guint failures;
+};
+
+extern struct harness harness;
+
+void harness_fail(const char *func, int line, const char *fmt, ...) G_GNUC_PRINTF(3, 4);
+gboolean harness_setup(gboolean system_wide);
+void harness_teardown(void);
+
+/* harness_icd.c */
+gboolean harness_dbus_start(void);
+void harness_dbus_stop(void);
+void harness_dbus_sync(void);
+DBusMessage *harness_dbus_send(DBusMessage * message);
+DBusMessage *harness_dbus_call(const char *path, const char *interface, const char *method, int first_arg_type, ...);
+DBusMessage *harness_dbus_next_signal(const char *path, const char *member);
+void harness_dbus_signals_clear(void);
+gboolean harness_load_modules(void);
+void harness_unload_modules(void);
+network_wireguard_private *harness_network_private(void);
+void harness_ip_up(struct harness_iap *iap);
+void harness_ip_down(struct harness_iap *iap);
+void harness_srv_connect(void);
+void harness_srv_disconnect(void);
+void harness_child_exit(pid_t pid, int status);
+gboolean harness_iterate(guint timeout_ms, gboolean(*done) (void));
+void harness_drain(void);
+
+/* harness_gconf.c */
+void harness_gconf_reset(void);
+void harness_gconf_set_string(const char *key, const char *value);
+void harness_gconf_set_int(const char *key, int value);
+void harness_gconf_set_bool(const char *key, gboolean value);
+void harness_gconf_set_list(const char *key, GSList * values);
+void harness_gconf_unset(const char *key);
+void harness_gconf_add_config(const char *name, guint peers, guint allowed_ips);
+guint64 harness_gconf_reads(void);
+
+/* harness_config.c */
+gboolean harness_config_bench(const char *prefix, guint max_peers, gdouble min_time);
+
+/* harness_netns.c */
+int harness_netns(const char *config_file, guint cycles, const char *label, const char *run);
+
+/* harness_netlink.c */
+GPtrArray *harness_netlink_generate(guint veths);
+GPtrArray *harness_netlink_load(const char *path);
+gboolean harness_netlink_save(const char *path, GPtrArray * stream);
+int harness_netlink_record(const char *path, guint count);
+gboolean harness_netlink_replay(const char *prefix, GPtrArray * stream);
+gboolean harness_netlink_fuzz(GPtrArray * corpus, guint32 seed, guint iterations);
+
+/* harness_system.c */
+void harness_system_init(void);
+gpointer harness_module_symbol(const char *name);
+void harness_system_free(void);
+struct harness_spawn *harness_next_spawn(void);
+void harness_complete_spawn(struct harness_spawn *spawn, gboolean success);
+void harness_link_remove(guint tunnel);
+void harness_helper_kill(void);
+GByteArray *harness_netlink_message(int type, const char *ifname, int index, guint flags);
+void harness_netlink_link(const char *ifname, int index, gboolean running);
+void harness_netlink_attach(void);
+void harness_report_durations(const char *prefix, const char *name, GArray * durations);
+void harness_transitions_report(const char *prefix, gdouble elapsed);
+void harness_transitions_reset(void);
+
+#endif				/* __WIREGUARD_HARNESS_H */
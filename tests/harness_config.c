@@ -0,0 +1,361 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* How the gconf configuration helpers scale with the number of peers,
+ * AllowedIPs entries and known configurations. Allocations include the
+ * copies our gconf fake hands out, a real GConfClient makes those too.
+ * Also checks the AllowedIPs collapsing they rely on. */
+
+#include <string.h>
+
+#include <glib.h>
+
+#include "harness.h"
+
+#define BENCH_IAP "harness-bench-iap"
+#define UNKNOWN_CONFIG "harness-unknown-config"
+/* Largest peers * AllowedIPs entries to try, about 15 MB of config */
+#define MAX_ALLOWED_IPS_TOTAL 1000000
+
+static const guint peer_counts[] = { 1, 10, 100, 1000, 10000 };
+static const guint allowed_ips_counts[] = { 1, 16, 256 };
+
+/* The helpers as built into the network module */
+struct config_api {
+	gchar *(*config_generate)(const char *config_name, gchar ** error);
+	gboolean(*config_is_known) (const char *config_name);
+	gboolean(*network_is_wireguard_provider) (const char *network_id, char **ret_gconf_service_id);
+	guint(*prefixes_parse) (GArray * prefixes, const char *value);
+	void (*prefixes_append)(GString * string, const GArray * prefixes);
+	void (*prefix_sets_collapse)(GArray ** sets, guint count, wireguard_prefix_overlap_fn overlap_fn,
+				     gpointer user_data);
+};
+
+enum config_function {
+	FUNCTION_GENERATE_CONFIG,
+	FUNCTION_CONFIG_IS_KNOWN,
+	FUNCTION_NETWORK_IS_WIREGUARD_PROVIDER,
+	FUNCTION_COUNT
+};
+
+static const char *function_names[FUNCTION_COUNT] = {
+	[FUNCTION_GENERATE_CONFIG] = "generate_config",
+	[FUNCTION_CONFIG_IS_KNOWN] = "config_is_known",
+	[FUNCTION_NETWORK_IS_WIREGUARD_PROVIDER] = "network_is_wireguard_provider",
+};
+
+/* AllowedIPs of up to three peers, as configured and as collapsed */
+struct prefix_case {
+	const char *in[3];
+	const char *out[3];
+	guint overlaps;
+};
+
+static const struct prefix_case prefix_cases[] = {
+	/* Adjacent and nested entries, and ones that are not prefixes */
+	{{"10.0.0.0/24, 10.0.1.0/24, 10.0.2.0/24,10.0.3.0/24, 10.0.3.7/32, bogus, ,192.168.0.1"},
+	 {"10.0.0.0/22, 192.168.0.1/32"}, 0},
+	{{"fd00::/64, fd00:0:0:1::/64, 2001:db8::1/128"}, {"2001:db8::1/128, fd00::/63"}, 0},
+	/* The later peer gets a prefix both have */
+	{{"10.0.0.0/24, 10.0.1.0/24, 10.0.2.0/24", "10.0.1.0/24, 10.0.2.0/24, 10.0.3.0/24"},
+	 {"10.0.0.0/24", "10.0.1.0/24, 10.0.2.0/23"}, 2},
+	/* More specific prefixes of another peer stay, they win lookups */
+	{{"10.0.0.0/24, 10.0.1.0/24", "10.0.0.5/32"}, {"10.0.0.0/23", "10.0.0.5/32"}, 1},
+	{{"10.0.2.0/24, 10.0.3.0/24", "10.0.0.0/22"}, {"10.0.2.0/23", "10.0.0.0/22"}, 2},
+	/* Halves are not merged over a prefix another peer has */
+	{{"10.0.0.0/23", "10.0.0.0/24", "10.0.1.0/24"}, {"10.0.0.0/23", "10.0.0.0/24", "10.0.1.0/24"}, 2},
+	{{"0.0.0.0/0, ::/0", "10.0.0.0/8"}, {"0.0.0.0/0, ::/0", "10.0.0.0/8"}, 1},
+};
+
+static void count_overlap(const wireguard_prefix * prefix, guint set, const wireguard_prefix * outer,
+			  guint outer_set, gpointer user_data)
+{
+	(*(guint *) user_data)++;
+}
+
+static void check_prefixes(const struct config_api *api)
+{
+	guint i, j;
+
+	for (i = 0; i < G_N_ELEMENTS(prefix_cases); i++) {
+		const struct prefix_case *c = &prefix_cases[i];
+		GArray *sets[G_N_ELEMENTS(c->in)];
+		guint count, overlaps = 0;
+
+		for (count = 0; count < G_N_ELEMENTS(c->in) && c->in[count]; count++) {
+			sets[count] = g_array_new(FALSE, FALSE, sizeof(wireguard_prefix));
+			api->prefixes_parse(sets[count], c->in[count]);
+		}
+
+		api->prefix_sets_collapse(sets, count, count_overlap, &overlaps);
+		if (overlaps != c->overlaps)
+			HARNESS_FAIL("Case %u: %u overlaps, expected %u", i, overlaps, c->overlaps);
+
+		for (j = 0; j < count; j++) {
+			GString *out = g_string_new(NULL);
+
+			api->prefixes_append(out, sets[j]);
+			if (strcmp(out->str, c->out[j]) != 0)
+				HARNESS_FAIL("Case %u peer %u: '%s', expected '%s'", i, j, out->str, c->out[j]);
+			g_string_free(out, TRUE);
+			g_array_free(sets[j], TRUE);
+		}
+	}
+}
+
+/* Fewest prefixes that make up count /24 blocks from block first on */
+static guint blocks_cover(guint first, guint count)
+{
+	guint prefixes = 0;
+
+	while (count) {
+		guint size = 1;
+
+		while (first % (size * 2) == 0 && size * 2 <= count)
+			size *= 2;
+		first += size;
+		count -= size;
+		prefixes++;
+	}
+
+	return prefixes;
+}
+
+struct config_case {
+	gchar *name;
+	guint peers;
+	guint allowed_ips;
+};
+
+static guint count_lines(const char *config, const char *prefix)
+{
+	size_t prefix_len = strlen(prefix);
+	const char *line;
+	guint count = 0;
+
+	for (line = config; line; line = strchr(line, '\n')) {
+		if (*line == '\n')
+			line++;
+		if (strncmp(line, prefix, prefix_len) == 0)
+			count++;
+	}
+
+	return count;
+}
+
+/* Reads each helper must make for a case, anything else is a regression */
+static guint64 expected_reads(enum config_function function, const struct config_case *c)
+{
+	switch (function) {
+	case FUNCTION_GENERATE_CONFIG:
+		/* Override, PrivateKey, Address, DNS, the peer directories,
+		 * then three keys per peer */
+		return 5 + 3 * (guint64) c->peers;
+	case FUNCTION_CONFIG_IS_KNOWN:
+		return 1;
+	case FUNCTION_NETWORK_IS_WIREGUARD_PROVIDER:
+		/* service_type, service_id, then config_is_known */
+		return 3;
+	default:
+		return 0;
+	}
+}
+
+/* One call, checking the result. Returns the size of the generated config. */
+static gsize call(const struct config_api *api, enum config_function function, const struct config_case *c)
+{
+	gchar *config, *error = NULL, *service_id = NULL;
+	gsize size = 0;
+
+	switch (function) {
+	case FUNCTION_GENERATE_CONFIG:
+		config = api->config_generate(c->name, &error);
+		if (config == NULL) {
+			HARNESS_FAIL("%s: no config generated: %s", c->name, error);
+			g_free(error);
+			break;
+		}
+		size = strlen(config);
+		g_free(config);
+		break;
+	case FUNCTION_CONFIG_IS_KNOWN:
+		if (!api->config_is_known(c->name))
+			HARNESS_FAIL("%s not known", c->name);
+		break;
+	case FUNCTION_NETWORK_IS_WIREGUARD_PROVIDER:
+		if (!api->network_is_wireguard_provider(BENCH_IAP, &service_id))
+			HARNESS_FAIL("%s is not a wireguard provider", BENCH_IAP);
+		if (g_strcmp0(service_id, c->name) != 0)
+			HARNESS_FAIL("%s has service_id %s", BENCH_IAP, service_id);
+		g_free(service_id);
+		break;
+	default:
+		break;
+	}
+
+	return size;
+}
+
+/* Call function for at least min_time seconds and at least once */
+static void measure(const char *prefix, const struct config_api *api, enum config_function function,
+		    const struct config_case *c, guint known_configs, gdouble min_time)
+{
+	guint64 reads, allocations;
+	GTimer *timer;
+	gdouble elapsed;
+	gsize size = 0;
+	guint calls = 0;
+
+	reads = harness_gconf_reads();
+	allocations = harness.allocations;
+	timer = g_timer_new();
+
+	do {
+		size = call(api, function, c);
+		calls++;
+	} while (g_timer_elapsed(timer, NULL) < min_time);
+
+	g_timer_stop(timer);
+	elapsed = g_timer_elapsed(timer, NULL);
+	reads = harness_gconf_reads() - reads;
+	allocations = harness.allocations - allocations;
+
+	if (reads != expected_reads(function, c) * calls)
+		HARNESS_FAIL("%s %s: %" G_GUINT64_FORMAT " gconf reads for %u calls, expected %" G_GUINT64_FORMAT
+			     " per call", function_names[function], c->name, reads, calls,
+			     expected_reads(function, c));
+
+	g_print("%s function=%s peers=%u allowed_ips=%u known_configs=%u calls=%u us_per_call=%.2f"
+		" allocs_per_call=%.1f gconf_reads_per_call=%.1f config_bytes=%" G_GSIZE_FORMAT "\n", prefix,
+		function_names[function], c->peers, c->allowed_ips, known_configs, calls, elapsed * 1e6 / calls,
+		(gdouble) allocations / calls, (gdouble) reads / calls, size);
+
+	g_timer_destroy(timer);
+}
+
+/* The generated config must carry every peer, and the AllowedIPs entries
+ * collapsed: peer i has the /24 blocks i to i + allowed_ips - 1, so every
+ * peer but the last only keeps its first one */
+static void check_config(const struct config_api *api, const struct config_case *c)
+{
+	gchar *error = NULL;
+	gchar *config = api->config_generate(c->name, &error);
+	guint peers, separators = 0, expected;
+	const char *p;
+
+	g_free(error);
+	if (config == NULL)
+		return;
+
+	peers = count_lines(config, "[Peer]");
+	if (peers != c->peers)
+		HARNESS_FAIL("%s: %u peers in the config, expected %u", c->name, peers, c->peers);
+
+	for (p = strstr(config, "\n[Peer]"); p && (p = strchr(p, ',')); p++)
+		separators++;
+	expected = blocks_cover(c->peers - 1, c->allowed_ips) - 1;
+	if (separators != expected)
+		HARNESS_FAIL("%s: %u AllowedIPs separators, expected %u", c->name, separators, expected);
+
+	g_free(config);
+}
+
+/* Make c the active config and provider, known after known_configs - 1
+ * other names so config_is_known has to walk the whole list */
+static void add_case(const struct config_case *c, guint known_configs)
+{
+	GSList *known = NULL;
+	guint i;
+
+	harness_gconf_add_config(c->name, c->peers, c->allowed_ips);
+
+	known = g_slist_prepend(known, g_strdup(c->name));
+	for (i = 1; i < known_configs; i++)
+		known = g_slist_prepend(known, g_strdup_printf("harness-other-config%u", i));
+	harness_gconf_set_list(GC_ICD_WIREGUARD_AVAILABLE_IDS, known);
+	g_slist_free_full(known, g_free);
+
+	harness_gconf_set_string("/system/osso/connectivity/IAP/" BENCH_IAP "/service_type", WIREGUARD_PROVIDER_TYPE);
+	harness_gconf_set_string("/system/osso/connectivity/IAP/" BENCH_IAP "/service_id", c->name);
+}
+
+static void remove_case(const struct config_case *c)
+{
+	gchar *path = g_strjoin("/", GC_WIREGUARD, c->name, NULL);
+
+	harness_gconf_unset(path);
+	g_free(path);
+}
+
+/**
+ * Run the configuration helpers against growing peer sets and print one
+ * key=value line per function and size, starting with prefix. Fails if a
+ * helper returns the wrong result or its number of gconf reads changes, or
+ * if AllowedIPs do not collapse as they should. Needs loaded modules.
+ *
+ * @param prefix     first word of every line
+ * @param max_peers  largest peer set to try
+ * @param min_time   seconds to spend per function and size, 0 for one call
+ * @return TRUE if nothing failed
+ */
+gboolean harness_config_bench(const char *prefix, guint max_peers, gdouble min_time)
+{
+	guint failures = harness.failures;
+	struct config_api api;
+	guint i, j, f;
+
+	api.config_generate = harness_module_symbol("wireguard_config_generate");
+	api.config_is_known = harness_module_symbol("config_is_known");
+	api.network_is_wireguard_provider = harness_module_symbol("network_is_wireguard_provider");
+	api.prefixes_parse = harness_module_symbol("wireguard_prefixes_parse");
+	api.prefixes_append = harness_module_symbol("wireguard_prefixes_append");
+	api.prefix_sets_collapse = harness_module_symbol("wireguard_prefix_sets_collapse");
+
+	check_prefixes(&api);
+
+	for (i = 0; i < G_N_ELEMENTS(peer_counts) && peer_counts[i] <= max_peers; i++) {
+		for (j = 0; j < G_N_ELEMENTS(allowed_ips_counts); j++) {
+			struct config_case c;
+
+			if ((guint64) peer_counts[i] * allowed_ips_counts[j] > MAX_ALLOWED_IPS_TOTAL)
+				continue;
+
+			c.name = g_strdup_printf("harness-bench-%u-%u", peer_counts[i], allowed_ips_counts[j]);
+			c.peers = peer_counts[i];
+			c.allowed_ips = allowed_ips_counts[j];
+
+			/* Known configurations grow with the peer count */
+			add_case(&c, c.peers);
+			check_config(&api, &c);
+
+			for (f = 0; f < FUNCTION_COUNT; f++)
+				measure(prefix, &api, f, &c, c.peers, min_time);
+
+			remove_case(&c);
+			g_free(c.name);
+		}
+	}
+
+	if (api.config_is_known(UNKNOWN_CONFIG))
+		HARNESS_FAIL("%s is known", UNKNOWN_CONFIG);
+
+	return harness.failures == failures;
+}
@@ -0,0 +1,364 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* In-memory replacement for the GConfClient calls the modules make. Values
+ * are real GConfValues, only the client and the storage are ours. */
+
+#include <string.h>
+
+#include <glib.h>
+#include <glib-object.h>
+#include <gconf/gconf-client.h>
+
+#include "harness.h"
+
+struct notify {
+	guint id;
+	gchar *namespace_section;
+	GConfClientNotifyFunc func;
+	gpointer user_data;
+	GFreeFunc destroy_notify;
+};
+
+static GObject *client = NULL;
+static GHashTable *store = NULL;
+static GSList *notifies = NULL;
+static guint next_notify_id = 1;
+static guint64 reads = 0;
+
+static GHashTable *get_store(void)
+{
+	if (store == NULL)
+		store = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, (GDestroyNotify) gconf_value_free);
+
+	return store;
+}
+
+static const GConfValue *lookup(const gchar * key, GConfValueType type)
+{
+	const GConfValue *value;
+
+	reads++;
+
+	value = g_hash_table_lookup(get_store(), key);
+	if (value == NULL || value->type != type)
+		return NULL;
+
+	return value;
+}
+
+GConfClient *gconf_client_get_default(void)
+{
+	/* The harness keeps one reference, the modules unref what they get */
+	if (client == NULL)
+		client = g_object_new(G_TYPE_OBJECT, NULL);
+
+	return (GConfClient *) g_object_ref(client);
+}
+
+void gconf_client_add_dir(GConfClient * gconf, const gchar * dir, GConfClientPreloadType preload, GError ** err)
+{
+}
+
+guint gconf_client_notify_add(GConfClient * gconf, const gchar * namespace_section, GConfClientNotifyFunc func,
+			      gpointer user_data, GFreeFunc destroy_notify, GError ** err)
+{
+	struct notify *notify = g_new0(struct notify, 1);
+
+	notify->id = next_notify_id++;
+	notify->namespace_section = g_strdup(namespace_section);
+	notify->func = func;
+	notify->user_data = user_data;
+	notify->destroy_notify = destroy_notify;
+
+	notifies = g_slist_append(notifies, notify);
+
+	return notify->id;
+}
+
+void gconf_client_notify_remove(GConfClient * gconf, guint cnxn)
+{
+	GSList *l;
+
+	for (l = notifies; l; l = l->next) {
+		struct notify *notify = l->data;
+
+		if (notify->id != cnxn)
+			continue;
+
+		notifies = g_slist_delete_link(notifies, l);
+		if (notify->destroy_notify)
+			notify->destroy_notify(notify->user_data);
+		g_free(notify->namespace_section);
+		g_free(notify);
+		return;
+	}
+
+	HARNESS_FAIL("Removing unknown notify %u", cnxn);
+}
+
+GConfValue *gconf_client_get(GConfClient * gconf, const gchar * key, GError ** err)
+{
+	const GConfValue *value;
+
+	reads++;
+
+	value = g_hash_table_lookup(get_store(), key);
+
+	return value ? gconf_value_copy(value) : NULL;
+}
+
+gchar *gconf_client_get_string(GConfClient * gconf, const gchar * key, GError ** err)
+{
+	const GConfValue *value = lookup(key, GCONF_VALUE_STRING);
+
+	return value ? g_strdup(gconf_value_get_string(value)) : NULL;
+}
+
+gboolean gconf_client_get_bool(GConfClient * gconf, const gchar * key, GError ** err)
+{
+	const GConfValue *value = lookup(key, GCONF_VALUE_BOOL);
+
+	return value ? gconf_value_get_bool(value) : FALSE;
+}
+
+gint gconf_client_get_int(GConfClient * gconf, const gchar * key, GError ** err)
+{
+	const GConfValue *value = lookup(key, GCONF_VALUE_INT);
+
+	return value ? gconf_value_get_int(value) : 0;
+}
+
+GSList *gconf_client_get_list(GConfClient * gconf, const gchar * key, GConfValueType list_type, GError ** err)
+{
+	const GConfValue *value = lookup(key, GCONF_VALUE_LIST);
+	GSList *l, *list = NULL;
+
+	if (value == NULL || gconf_value_get_list_type(value) != list_type || list_type != GCONF_VALUE_STRING)
+		return NULL;
+
+	for (l = gconf_value_get_list(value); l; l = l->next)
+		list = g_slist_prepend(list, g_strdup(gconf_value_get_string(l->data)));
+
+	return g_slist_reverse(list);
+}
+
+GSList *gconf_client_all_dirs(GConfClient * gconf, const gchar * dir, GError ** err)
+{
+	GHashTable *dirs = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	gchar *prefix = g_strconcat(dir, "/", NULL);
+	size_t prefix_len = strlen(prefix);
+	GSList *list = NULL;
+	GHashTableIter iter;
+	gpointer key;
+
+	reads++;
+
+	g_hash_table_iter_init(&iter, get_store());
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		const char *slash;
+
+		if (strncmp(key, prefix, prefix_len) != 0)
+			continue;
+
+		/* Only keys below a subdirectory make a directory */
+		slash = strchr((const char *)key + prefix_len, '/');
+		if (slash == NULL)
+			continue;
+
+		g_hash_table_replace(dirs, g_strndup(key, slash - (const char *)key), NULL);
+	}
+
+	g_hash_table_iter_init(&iter, dirs);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		list = g_slist_prepend(list, g_strdup(key));
+
+	g_hash_table_destroy(dirs);
+	g_free(prefix);
+
+	return list;
+}
+
+/* Run the notifies that cover key, value is NULL if it was unset */
+static void notify_changed(const char *key, const GConfValue * value)
+{
+	GSList *l;
+
+	for (l = notifies; l; l = l->next) {
+		struct notify *notify = l->data;
+		GConfEntry *entry;
+
+		if (!g_str_has_prefix(key, notify->namespace_section))
+			continue;
+
+		entry = gconf_entry_new(key, value);
+		notify->func((GConfClient *) client, notify->id, entry, notify->user_data);
+		gconf_entry_free(entry);
+	}
+}
+
+/* Store value (taking ownership) and run the notifies that cover key */
+static void set_value(const char *key, GConfValue * value)
+{
+	g_hash_table_replace(get_store(), g_strdup(key), value);
+	notify_changed(key, value);
+}
+
+void harness_gconf_set_string(const char *key, const char *string)
+{
+	GConfValue *value = gconf_value_new(GCONF_VALUE_STRING);
+
+	gconf_value_set_string(value, string);
+	set_value(key, value);
+}
+
+void harness_gconf_set_int(const char *key, int integer)
+{
+	GConfValue *value = gconf_value_new(GCONF_VALUE_INT);
+
+	gconf_value_set_int(value, integer);
+	set_value(key, value);
+}
+
+void harness_gconf_set_bool(const char *key, gboolean boolean)
+{
+	GConfValue *value = gconf_value_new(GCONF_VALUE_BOOL);
+
+	gconf_value_set_bool(value, boolean);
+	set_value(key, value);
+}
+
+/* Remove key and everything below it, like gconf_client_recursive_unset.
+ * Notifies are not run, no module watches keys that get removed. */
+void harness_gconf_unset(const char *key)
+{
+	gchar *prefix = g_strconcat(key, "/", NULL);
+	GSList *removed = NULL, *l;
+	GHashTableIter iter;
+	gpointer stored;
+
+	g_hash_table_iter_init(&iter, get_store());
+	while (g_hash_table_iter_next(&iter, &stored, NULL)) {
+		if (strcmp(stored, key) == 0 || g_str_has_prefix(stored, prefix)) {
+			removed = g_slist_prepend(removed, g_strdup(stored));
+			g_hash_table_iter_remove(&iter);
+		}
+	}
+
+	/* Like gconfd, once they are all gone */
+	for (l = removed; l; l = l->next)
+		notify_changed(l->data, NULL);
+
+	g_slist_free_full(removed, g_free);
+	g_free(prefix);
+}
+
+/* Set a list of strings */
+void harness_gconf_set_list(const char *key, GSList * strings)
+{
+	GConfValue *value = gconf_value_new(GCONF_VALUE_LIST);
+	GSList *l, *values = NULL;
+
+	for (l = strings; l; l = l->next) {
+		GConfValue *string = gconf_value_new(GCONF_VALUE_STRING);
+
+		gconf_value_set_string(string, l->data);
+		values = g_slist_append(values, string);
+	}
+
+	gconf_value_set_list_type(value, GCONF_VALUE_STRING);
+	gconf_value_set_list_nocopy(value, values);
+	set_value(key, value);
+}
+
+/**
+ * Add a wireguard configuration and make it known to the provider.
+ *
+ * @param name         configuration name
+ * @param peers        number of peers
+ * @param allowed_ips  number of AllowedIPs entries per peer
+ */
+void harness_gconf_add_config(const char *name, guint peers, guint allowed_ips)
+{
+	gchar *path = g_strjoin("/", GC_WIREGUARD, name, NULL);
+	gchar *key;
+	GSList *known;
+	guint i, j;
+
+	key = g_strjoin("/", path, GC_PRIVATEKEY, NULL);
+	harness_gconf_set_string(key, "yAnz5TF+lXXJte14tji3zlMNq+hd2rYUIgJBgB3fBmk=");
+	g_free(key);
+
+	key = g_strjoin("/", path, GC_ADDRESS, NULL);
+	harness_gconf_set_string(key, "10.200.0.2/32");
+	g_free(key);
+
+	key = g_strjoin("/", path, GC_DNS, NULL);
+	harness_gconf_set_string(key, "10.200.0.1");
+	g_free(key);
+
+	for (i = 0; i < peers; i++) {
+		GString *ips = g_string_new(NULL);
+		gchar *peer = g_strdup_printf("%s/%s/peer%u", path, GC_PEERS, i);
+
+		for (j = 0; j < allowed_ips; j++)
+			g_string_append_printf(ips, "%s10.%u.%u.0/24", j ? ", " : "", (i + j) / 256 % 256, (i + j) % 256);
+
+		key = g_strjoin("/", peer, GC_PEER_IPS, NULL);
+		harness_gconf_set_string(key, ips->str);
+		g_free(key);
+
+		key = g_strjoin("/", peer, GC_PEER_ENDPOINT, NULL);
+		harness_gconf_set_string(key, "192.0.2.1:51820");
+		g_free(key);
+
+		key = g_strjoin("/", peer, GC_PEER_PUBKEY, NULL);
+		harness_gconf_set_string(key, "xTIBA5rboUvnH4htodjb6e697QjLERt1NAB4mZqp8Dg=");
+		g_free(key);
+
+		g_string_free(ips, TRUE);
+		g_free(peer);
+	}
+
+	known = gconf_client_get_list(NULL, GC_ICD_WIREGUARD_AVAILABLE_IDS, GCONF_VALUE_STRING, NULL);
+	known = g_slist_append(known, g_strdup(name));
+	harness_gconf_set_list(GC_ICD_WIREGUARD_AVAILABLE_IDS, known);
+	g_slist_free_full(known, g_free);
+
+	g_free(path);
+}
+
+/* Number of gconf reads so far, the round trips a real client would make */
+guint64 harness_gconf_reads(void)
+{
+	return reads;
+}
+
+void harness_gconf_reset(void)
+{
+	if (store)
+		g_hash_table_remove_all(store);
+
+	if (notifies)
+		HARNESS_FAIL("%u gconf notifies were not removed", g_slist_length(notifies));
+
+	reads = 0;
+}
@@ -0,0 +1,649 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* The parts of icd2 the modules use: the D-Bus helpers, running against a
+ * private dbus-daemon, logging and the module APIs */
+
+#include <dlfcn.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+#include <dbus/dbus-glib-lowlevel.h>
+
+#include <support/icd_dbus.h>
+#include <support/icd_log.h>
+
+#include "harness.h"
+
+#define NETWORK_TYPE "WLAN_INFRA"
+#define INTERFACE_NAME "wlan0"
+
+static DBusConnection *connection = NULL;
+static GPid daemon_pid = 0;
+
+/* A D-Bus client of the modules, with the signals it got */
+static DBusConnection *client = NULL;
+static GQueue client_signals = G_QUEUE_INIT;
+
+/* icd2 logging */
+
+enum icd_loglevel icd_log_get_level(void)
+{
+	return g_getenv("HARNESS_VERBOSE") ? ICD_DEBUG : ICD_CRIT;
+}
+
+/* icd2 D-Bus helpers */
+
+gboolean icd_dbus_send_system_msg(DBusMessage * message)
+{
+	if (connection == NULL)
+		return FALSE;
+
+	return dbus_connection_send(connection, message, NULL);
+}
+
+gboolean icd_dbus_send_system_mcall(DBusMessage * message, gint timeout, DBusPendingCallNotifyFunction cb,
+				    void *user_data)
+{
+	DBusPendingCall *pending = NULL;
+
+	if (connection == NULL)
+		return FALSE;
+
+	if (!dbus_connection_send_with_reply(connection, message, &pending, timeout) || pending == NULL)
+		return FALSE;
+
+	if (cb)
+		dbus_pending_call_set_notify(pending, cb, user_data, NULL);
+	dbus_pending_call_unref(pending);
+
+	return TRUE;
+}
+
+gboolean icd_dbus_register_system_service(const char *path, const char *service, guint service_flags,
+					  DBusHandleMessageFunction cb, void *user_data)
+{
+	DBusObjectPathVTable vtable = { NULL, cb, };
+	DBusError error;
+
+	if (connection == NULL)
+		return FALSE;
+
+	if (!dbus_connection_register_object_path(connection, path, &vtable, user_data))
+		return FALSE;
+
+	if (service == NULL)
+		return TRUE;
+
+	dbus_error_init(&error);
+	if (dbus_bus_request_name(connection, service, service_flags, &error) != DBUS_REQUEST_NAME_REPLY_PRIMARY_OWNER) {
+		HARNESS_LOG("Unable to own %s: %s", service, dbus_error_is_set(&error) ? error.message : "in use");
+		dbus_error_free(&error);
+		dbus_connection_unregister_object_path(connection, path);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+void icd_dbus_unregister_system_service(const char *path, const char *service)
+{
+	if (connection == NULL)
+		return;
+
+	dbus_connection_unregister_object_path(connection, path);
+	if (service)
+		dbus_bus_release_name(connection, service, NULL);
+}
+
+static gchar *signal_match(const char *interface, const char *extra_filters)
+{
+	return g_strdup_printf("type='signal',interface='%s'%s%s", interface,
+			       extra_filters ? "," : "", extra_filters ? extra_filters : "");
+}
+
+gboolean icd_dbus_connect_system_bcast_signal(const char *interface, DBusHandleMessageFunction signal_cb,
+					      void *user_data, const char *extra_filters)
+{
+	gchar *match;
+
+	if (connection == NULL)
+		return FALSE;
+
+	if (!dbus_connection_add_filter(connection, signal_cb, user_data, NULL))
+		return FALSE;
+
+	match = signal_match(interface, extra_filters);
+	dbus_bus_add_match(connection, match, NULL);
+	g_free(match);
+
+	return TRUE;
+}
+
+gboolean icd_dbus_disconnect_system_bcast_signal(const char *interface, DBusHandleMessageFunction signal_cb,
+						 void *user_data, const char *extra_filters)
+{
+	gchar *match;
+
+	if (connection == NULL)
+		return FALSE;
+
+	match = signal_match(interface, extra_filters);
+	dbus_bus_remove_match(connection, match, NULL);
+	g_free(match);
+
+	dbus_connection_remove_filter(connection, signal_cb, user_data);
+
+	return TRUE;
+}
+
+DBusConnection *icd_dbus_get_system_bus(void)
+{
+	return connection;
+}
+
+/* Keep the signals the client gets for harness_dbus_next_signal() */
+static DBusHandlerResult client_filter(DBusConnection * bus, DBusMessage * message, void *user_data)
+{
+	if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL)
+		g_queue_push_tail(&client_signals, dbus_message_ref(message));
+
+	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+}
+
+/**
+ * Start a private dbus-daemon and connect to it, the modules never see the
+ * real system bus.
+ *
+ * @return TRUE on success
+ */
+gboolean harness_dbus_start(void)
+{
+	gchar *argv[] = { "dbus-daemon", "--session", "--nofork", "--nopidfile", "--print-address", NULL };
+	GError *error = NULL;
+	DBusError dbus_error;
+	char address[512];
+	gsize len = 0;
+	int out;
+
+	if (!g_spawn_async_with_pipes(NULL, argv, NULL, G_SPAWN_SEARCH_PATH | G_SPAWN_DO_NOT_REAP_CHILD, NULL, NULL,
+				      &daemon_pid, NULL, &out, NULL, &error)) {
+		HARNESS_LOG("Unable to start dbus-daemon: %s", error->message);
+		g_clear_error(&error);
+		return FALSE;
+	}
+
+	/* The address is the first line dbus-daemon prints */
+	while (len < sizeof(address) - 1) {
+		ssize_t ret = read(out, address + len, 1);
+
+		if (ret <= 0 || address[len] == '\n')
+			break;
+		len++;
+	}
+	address[len] = '\0';
+	close(out);
+
+	if (len == 0) {
+		HARNESS_LOG("dbus-daemon did not print its address");
+		harness_dbus_stop();
+		return FALSE;
+	}
+
+	dbus_error_init(&dbus_error);
+	connection = dbus_connection_open_private(address, &dbus_error);
+	if (connection == NULL || !dbus_bus_register(connection, &dbus_error)) {
+		HARNESS_LOG("Unable to connect to %s: %s", address, dbus_error.message);
+		dbus_error_free(&dbus_error);
+		harness_dbus_stop();
+		return FALSE;
+	}
+
+	dbus_connection_set_exit_on_disconnect(connection, FALSE);
+	dbus_connection_setup_with_g_main(connection, NULL);
+
+	client = dbus_connection_open_private(address, &dbus_error);
+	if (client == NULL || !dbus_bus_register(client, &dbus_error)) {
+		HARNESS_LOG("Unable to connect a client to %s: %s", address, dbus_error.message);
+		dbus_error_free(&dbus_error);
+		harness_dbus_stop();
+		return FALSE;
+	}
+
+	dbus_connection_set_exit_on_disconnect(client, FALSE);
+	dbus_connection_setup_with_g_main(client, NULL);
+	dbus_connection_add_filter(client, client_filter, NULL, NULL);
+	dbus_bus_add_match(client, "type='signal',interface='" DBUS_INTERFACE_PROPERTIES "'", NULL);
+	dbus_bus_add_match(client, "type='signal',interface='" ICD_WIREGUARD_DBUS_INTERFACE "'", NULL);
+
+	return TRUE;
+}
+
+void harness_dbus_stop(void)
+{
+	harness_dbus_signals_clear();
+	if (client) {
+		dbus_connection_close(client);
+		dbus_connection_unref(client);
+		client = NULL;
+	}
+
+	if (connection) {
+		dbus_connection_close(connection);
+		dbus_connection_unref(connection);
+		connection = NULL;
+	}
+
+	if (daemon_pid) {
+		kill(daemon_pid, SIGTERM);
+		waitpid(daemon_pid, NULL, 0);
+		g_spawn_close_pid(daemon_pid);
+		daemon_pid = 0;
+	}
+}
+
+/* icd2 module API */
+
+static struct harness_iap *find_iap(const gchar * network_id)
+{
+	if (g_strcmp0(network_id, harness.iap.network_id) == 0)
+		return &harness.iap;
+	if (g_strcmp0(network_id, harness.provider_iap.network_id) == 0)
+		return &harness.provider_iap;
+	if (g_strcmp0(network_id, harness.second_iap.network_id) == 0)
+		return &harness.second_iap;
+
+	HARNESS_FAIL("Unknown network id %s", network_id);
+	return NULL;
+}
+
+static void nw_watch_pid(const pid_t pid, gpointer watch_cb_token)
+{
+	GList *l;
+
+	for (l = harness.spawns.head; l; l = l->next) {
+		struct harness_spawn *spawn = l->data;
+
+		if (spawn->pid == pid) {
+			spawn->watched = TRUE;
+			return;
+		}
+	}
+
+	if (pid != 0 && pid == harness.helper_pid) {
+		harness.helper_watched = TRUE;
+		return;
+	}
+
+	HARNESS_FAIL("watch_pid for unknown pid %d", pid);
+}
+
+static void nw_close(enum icd_nw_status status, const gchar * err_str, const gchar * network_type,
+		     const guint network_attrs, const gchar * network_id)
+{
+	struct harness_iap *iap = find_iap(network_id);
+
+	if (iap)
+		iap->close_requests++;
+}
+
+static void nw_status_change(gchar * network_type, guint network_attrs, gchar * network_id,
+			     enum icd_nw_status status, const gchar * err_str)
+{
+}
+
+static void nw_renew(int renew_layer, const gchar * network_type, const guint network_attrs,
+		     const gchar * network_id)
+{
+}
+
+static void nw_ip_up_cb(const enum icd_nw_status status, const gchar * err_str, const gpointer ip_up_cb_token, ...)
+{
+	struct harness_iap *iap = ip_up_cb_token;
+
+	iap->ip_up_answers++;
+	iap->ip_up_status = status;
+	iap->up = status == ICD_NW_SUCCESS;
+
+	if (iap->ip_up_answers > iap->ip_up_requests)
+		HARNESS_FAIL("ip_up of %s answered more often than requested", iap->network_id);
+}
+
+static void nw_ip_down_cb(const enum icd_nw_status status, const gpointer ip_down_cb_token)
+{
+	struct harness_iap *iap = ip_down_cb_token;
+
+	iap->ip_down_answers++;
+
+	if (iap->ip_down_answers > iap->ip_down_requests)
+		HARNESS_FAIL("ip_down of %s answered more often than requested", iap->network_id);
+}
+
+static void srv_watch_pid(const pid_t pid, gpointer watch_cb_token)
+{
+	HARNESS_FAIL("The provider module does not spawn processes");
+}
+
+static void srv_close(enum icd_srv_status status, const gchar * err_str, const gchar * service_type,
+		      const guint service_attrs, const gchar * service_id, const gchar * network_type,
+		      const guint network_attrs, const gchar * network_id)
+{
+	harness.srv.close_requests++;
+}
+
+static void srv_limited_conn(const gchar * service_type, const guint service_attrs, const gchar * service_id,
+			     const gchar * network_type, const guint network_attrs, const gchar * network_id,
+			     gboolean conn_is_limited)
+{
+}
+
+static void srv_connect_cb(enum icd_srv_status status, gchar * err_str, gpointer connect_cb_token)
+{
+	struct harness_srv *srv = connect_cb_token;
+
+	srv->connect_answers++;
+	srv->connect_status = status;
+}
+
+static void srv_disconnect_cb(enum icd_srv_status status, gpointer disconnect_cb_token)
+{
+	struct harness_srv *srv = disconnect_cb_token;
+
+	srv->disconnect_answers++;
+}
+
+static gpointer load_module(const char *name, const char *init_name, gpointer * init)
+{
+	const char *dir = g_getenv("HARNESS_MODULE_DIR");
+	gchar *path = g_build_filename(dir ? dir : MODULE_DIR, name, NULL);
+	gpointer handle;
+
+	/* Like icd2, every module gets its own symbol scope */
+	handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+	if (handle == NULL) {
+		HARNESS_LOG("Unable to load %s: %s", path, dlerror());
+		g_free(path);
+		return NULL;
+	}
+	g_free(path);
+
+	*init = dlsym(handle, init_name);
+	if (*init == NULL) {
+		HARNESS_LOG("%s has no %s", name, init_name);
+		dlclose(handle);
+		return NULL;
+	}
+
+	return handle;
+}
+
+/**
+ * Load and initialise both modules the way icd2 does.
+ *
+ * @return TRUE on success
+ */
+gboolean harness_load_modules(void)
+{
+	gboolean(*nw_init) (struct icd_nw_api *, icd_nw_watch_pid_fn, gpointer, icd_nw_close_fn,
+			    icd_nw_status_change_fn, icd_nw_renew_fn);
+	gboolean(*srv_init) (struct icd_srv_api *, icd_srv_watch_pid_fn, gpointer, icd_srv_close_fn,
+			     icd_srv_limited_conn_fn);
+
+	memset(&harness.nw_api, 0, sizeof(harness.nw_api));
+	memset(&harness.srv_api, 0, sizeof(harness.srv_api));
+
+	harness.network_module = load_module("libicd_network_wireguard.so", "icd_nw_init", (gpointer *) & nw_init);
+	if (harness.network_module == NULL)
+		return FALSE;
+
+	harness.provider_module = load_module("libicd_provider_wireguard.so", "icd_srv_init", (gpointer *) & srv_init);
+	if (harness.provider_module == NULL)
+		return FALSE;
+
+	if (!nw_init(&harness.nw_api, nw_watch_pid, &harness, nw_close, nw_status_change, nw_renew)) {
+		HARNESS_LOG("icd_nw_init failed");
+		return FALSE;
+	}
+
+	if (!srv_init(&harness.srv_api, srv_watch_pid, &harness, srv_close, srv_limited_conn)) {
+		HARNESS_LOG("icd_srv_init failed");
+		return FALSE;
+	}
+
+	if (!harness.real_system)
+		harness_netlink_attach();
+
+	return TRUE;
+}
+
+void harness_unload_modules(void)
+{
+	if (harness.srv_api.srv_destruct)
+		harness.srv_api.srv_destruct(&harness.srv_api.private);
+	if (harness.nw_api.network_destruct)
+		harness.nw_api.network_destruct(&harness.nw_api.private);
+
+	memset(&harness.nw_api, 0, sizeof(harness.nw_api));
+	memset(&harness.srv_api, 0, sizeof(harness.srv_api));
+
+	/* Let the main loop drop what the modules left behind */
+	harness_drain();
+
+	if (harness.provider_module)
+		dlclose(harness.provider_module);
+	if (harness.network_module)
+		dlclose(harness.network_module);
+	harness.provider_module = NULL;
+	harness.network_module = NULL;
+}
+
+network_wireguard_private *harness_network_private(void)
+{
+	return harness.nw_api.private;
+}
+
+void harness_ip_up(struct harness_iap *iap)
+{
+	iap->ip_up_requests++;
+	harness.nw_api.ip_up(NETWORK_TYPE, 0, iap->network_id, INTERFACE_NAME, nw_ip_up_cb, iap,
+			     &harness.nw_api.private);
+}
+
+void harness_ip_down(struct harness_iap *iap)
+{
+	iap->ip_down_requests++;
+	iap->up = FALSE;
+	harness.nw_api.ip_down(NETWORK_TYPE, 0, iap->network_id, INTERFACE_NAME, nw_ip_down_cb, iap,
+			       &harness.nw_api.private);
+}
+
+void harness_srv_connect(void)
+{
+	harness.srv.connect_requests++;
+	harness.srv_api.connect(WIREGUARD_PROVIDER_TYPE, 0, HARNESS_CONFIG, NETWORK_TYPE, 0,
+				harness.provider_iap.network_id, INTERFACE_NAME, srv_connect_cb, &harness.srv,
+				&harness.srv_api.private);
+}
+
+void harness_srv_disconnect(void)
+{
+	harness.srv_api.disconnect(WIREGUARD_PROVIDER_TYPE, 0, HARNESS_CONFIG, NETWORK_TYPE, 0,
+				   harness.provider_iap.network_id, INTERFACE_NAME, srv_disconnect_cb, &harness.srv,
+				   &harness.srv_api.private);
+}
+
+void harness_child_exit(pid_t pid, int status)
+{
+	harness.nw_api.child_exit(pid, status, &harness.nw_api.private);
+}
+
+static gboolean timeout_cb(gpointer user_data)
+{
+	gboolean *timed_out = user_data;
+
+	*timed_out = TRUE;
+	return FALSE;
+}
+
+/**
+ * Run the main loop until done() returns TRUE.
+ *
+ * @param timeout_ms  give up after this long
+ * @param done        condition to wait for
+ * @return FALSE on timeout
+ */
+gboolean harness_iterate(guint timeout_ms, gboolean(*done) (void))
+{
+	gboolean timed_out = FALSE;
+	guint timer = g_timeout_add(timeout_ms, timeout_cb, &timed_out);
+
+	while (!done() && !timed_out)
+		g_main_context_iteration(NULL, TRUE);
+
+	if (!timed_out)
+		g_source_remove(timer);
+
+	return !timed_out;
+}
+
+/**
+ * Wait until the bus delivered everything we sent so far, including
+ * messages the modules sent to each other, and dispatch it.
+ */
+void harness_dbus_sync(void)
+{
+	DBusMessage *message, *reply;
+
+	message = dbus_message_new_method_call(DBUS_SERVICE_DBUS, DBUS_PATH_DBUS, DBUS_INTERFACE_DBUS, "GetId");
+	reply = dbus_connection_send_with_reply_and_block(connection, message, 5000, NULL);
+	dbus_message_unref(message);
+	if (reply)
+		dbus_message_unref(reply);
+	else
+		HARNESS_FAIL("The bus did not answer");
+
+	harness_drain();
+}
+
+/**
+ * Send a method call to the modules as a D-Bus client would, running the
+ * main loop until it is answered.
+ *
+ * @param message  the method call, to ICD_WIREGUARD_DBUS_INTERFACE
+ * @return the reply or error, NULL if there was none; free with
+ *         dbus_message_unref()
+ */
+DBusMessage *harness_dbus_send(DBusMessage * message)
+{
+	DBusPendingCall *pending = NULL;
+	DBusMessage *reply;
+
+	if (!dbus_connection_send_with_reply(client, message, &pending, 5000) || pending == NULL) {
+		HARNESS_FAIL("Unable to call %s", dbus_message_get_member(message));
+		return NULL;
+	}
+
+	while (!dbus_pending_call_get_completed(pending))
+		g_main_context_iteration(NULL, TRUE);
+
+	reply = dbus_pending_call_steal_reply(pending);
+	dbus_pending_call_unref(pending);
+	if (reply == NULL)
+		HARNESS_FAIL("No reply to %s", dbus_message_get_member(message));
+
+	return reply;
+}
+
+/**
+ * Like harness_dbus_send(), for a method call with basic arguments.
+ *
+ * @param path            object path
+ * @param interface       interface of the method
+ * @param method          method name
+ * @param first_arg_type  arguments as for dbus_message_append_args()
+ * @return the reply or error, NULL if there was none
+ */
+DBusMessage *harness_dbus_call(const char *path, const char *interface, const char *method, int first_arg_type, ...)
+{
+	DBusMessage *message, *reply;
+	va_list args;
+
+	message = dbus_message_new_method_call(ICD_WIREGUARD_DBUS_INTERFACE, path, interface, method);
+	va_start(args, first_arg_type);
+	dbus_message_append_args_valist(message, first_arg_type, args);
+	va_end(args);
+
+	reply = harness_dbus_send(message);
+	dbus_message_unref(message);
+
+	return reply;
+}
+
+/**
+ * The next signal the client got from path, waiting a while for one if
+ * there is none yet. Signals before it are dropped.
+ *
+ * @param path    object path
+ * @param member  signal name
+ * @return the signal, NULL if none came; free with dbus_message_unref()
+ */
+DBusMessage *harness_dbus_next_signal(const char *path, const char *member)
+{
+	gint64 deadline = g_get_monotonic_time() + G_USEC_PER_SEC;
+
+	harness_dbus_sync();
+
+	for (;;) {
+		DBusMessage *message = g_queue_pop_head(&client_signals);
+
+		if (message == NULL) {
+			if (g_get_monotonic_time() >= deadline)
+				return NULL;
+			g_main_context_iteration(NULL, FALSE);
+			g_usleep(1000);
+			continue;
+		}
+
+		if (dbus_message_has_path(message, path) && dbus_message_has_member(message, member))
+			return message;
+		dbus_message_unref(message);
+	}
+}
+
+/* Forget the signals the client got so far */
+void harness_dbus_signals_clear(void)
+{
+	DBusMessage *message;
+
+	while ((message = g_queue_pop_head(&client_signals)))
+		dbus_message_unref(message);
+}
+
+/* Dispatch everything that is ready without blocking */
+void harness_drain(void)
+{
+	while (g_main_context_iteration(NULL, FALSE)) ;
+}
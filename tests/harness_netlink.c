@@ -0,0 +1,457 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* rtnetlink streams for the network module's listener: recorded from the
+ * kernel or generated, replayed through the harness socketpair, and mutated
+ * to fuzz the parser.
+ *
+ * A stream file is a sequence of datagrams, each stored as a little endian
+ * 32 bit length followed by the datagram as received. */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+
+#include <glib.h>
+
+#include "harness.h"
+
+/* Datagrams sent before letting the listener catch up */
+#define REPLAY_BATCH 64
+/* The listener reads into a buffer of this size */
+#define MAX_DATAGRAM 4096
+
+/* Generated stream layout: interface indexes per kind of link */
+#define WLAN_INDEX 3
+#define VETH_FIRST_INDEX 100000
+#define WIREGUARD_FIRST_INDEX 50000
+
+/* Index the fuzzer uses to check the listener still works */
+#define FUZZ_CHECK_INDEX 49999
+
+static void free_message(gpointer message)
+{
+	g_byte_array_free(message, TRUE);
+}
+
+static void add(GPtrArray * stream, int type, const char *ifname, int index, guint flags)
+{
+	g_ptr_array_add(stream, harness_netlink_message(type, ifname, index, flags));
+}
+
+/**
+ * Generate the link messages of a busy host: veth pairs coming and going,
+ * a flapping WLAN and icdwg0 being created and removed in between.
+ *
+ * @param veths  number of veth links to create and remove
+ * @return the stream, free with g_ptr_array_free()
+ */
+GPtrArray *harness_netlink_generate(guint veths)
+{
+	GPtrArray *stream = g_ptr_array_new_with_free_func(free_message);
+	guint i;
+
+	for (i = 0; i < veths; i++) {
+		int veth = VETH_FIRST_INDEX + i;
+		int wg = WIREGUARD_FIRST_INDEX + i;
+		gchar name[IF_NAMESIZE];
+
+		g_snprintf(name, sizeof(name), "veth%u", i);
+
+		add(stream, RTM_NEWLINK, name, veth, 0);
+		add(stream, RTM_NEWLINK, name, veth, IFF_UP | IFF_RUNNING);
+
+		if (i % 4 == 0)
+			add(stream, RTM_NEWLINK, "wlan0", WLAN_INDEX, i % 8 ? IFF_UP : IFF_UP | IFF_RUNNING);
+
+		/* wg-quick up and down */
+		if (i % 16 == 0) {
+			add(stream, RTM_NEWLINK, WIREGUARD_INTERFACE_NAME, wg, 0);
+			add(stream, RTM_NEWLINK, WIREGUARD_INTERFACE_NAME, wg, IFF_UP | IFF_RUNNING);
+			add(stream, RTM_NEWLINK, WIREGUARD_INTERFACE_NAME, wg, 0);
+			add(stream, RTM_DELLINK, WIREGUARD_INTERFACE_NAME, wg, 0);
+		}
+
+		/* Removed while running, e.g. with its namespace */
+		if (i % 64 == 8) {
+			add(stream, RTM_NEWLINK, WIREGUARD_INTERFACE_NAME, wg, 0);
+			add(stream, RTM_NEWLINK, WIREGUARD_INTERFACE_NAME, wg, IFF_UP | IFF_RUNNING);
+			add(stream, RTM_DELLINK, WIREGUARD_INTERFACE_NAME, wg, IFF_UP | IFF_RUNNING);
+		}
+
+		add(stream, RTM_NEWLINK, name, veth, 0);
+		add(stream, RTM_DELLINK, name, veth, 0);
+	}
+
+	return stream;
+}
+
+GPtrArray *harness_netlink_load(const char *path)
+{
+	GPtrArray *stream;
+	FILE *file;
+	guint32 len;
+
+	file = fopen(path, "rb");
+	if (file == NULL) {
+		HARNESS_FAIL("Unable to open %s: %s", path, strerror(errno));
+		return NULL;
+	}
+
+	stream = g_ptr_array_new_with_free_func(free_message);
+
+	while (fread(&len, sizeof(len), 1, file) == 1) {
+		GByteArray *message = g_byte_array_new();
+
+		len = GUINT32_FROM_LE(len);
+		if (len > MAX_DATAGRAM) {
+			HARNESS_FAIL("%s: datagram of %u bytes", path, len);
+			g_byte_array_free(message, TRUE);
+			break;
+		}
+
+		g_byte_array_set_size(message, len);
+		if (len && fread(message->data, len, 1, file) != 1) {
+			HARNESS_FAIL("%s is truncated", path);
+			g_byte_array_free(message, TRUE);
+			break;
+		}
+
+		g_ptr_array_add(stream, message);
+	}
+
+	fclose(file);
+
+	return stream;
+}
+
+gboolean harness_netlink_save(const char *path, GPtrArray * stream)
+{
+	FILE *file;
+	guint i;
+
+	file = fopen(path, "wb");
+	if (file == NULL) {
+		HARNESS_FAIL("Unable to create %s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	for (i = 0; i < stream->len; i++) {
+		GByteArray *message = g_ptr_array_index(stream, i);
+		guint32 len = GUINT32_TO_LE(message->len);
+
+		fwrite(&len, sizeof(len), 1, file);
+		fwrite(message->data, message->len, 1, file);
+	}
+
+	if (fclose(file) != 0) {
+		HARNESS_FAIL("Unable to write %s: %s", path, strerror(errno));
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+/**
+ * Record link messages from the kernel, as the network module would
+ * receive them.
+ *
+ * @param path   stream file to write
+ * @param count  number of datagrams to record
+ * @return exit status
+ */
+int harness_netlink_record(const char *path, guint count)
+{
+	GPtrArray *stream = g_ptr_array_new_with_free_func(free_message);
+	struct sockaddr_nl addr;
+	guint8 buf[MAX_DATAGRAM];
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+	if (fd < 0) {
+		HARNESS_FAIL("Unable to open rtnetlink socket: %s", strerror(errno));
+		goto out;
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = RTMGRP_LINK;
+
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+		HARNESS_FAIL("Unable to bind rtnetlink socket: %s", strerror(errno));
+		goto out;
+	}
+
+	HARNESS_LOG("Recording %u datagrams to %s", count, path);
+
+	while (stream->len < count) {
+		ssize_t len = recv(fd, buf, sizeof(buf), 0);
+		GByteArray *message;
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+			HARNESS_FAIL("recv: %s", strerror(errno));
+			break;
+		}
+
+		message = g_byte_array_sized_new(len);
+		g_byte_array_append(message, buf, len);
+		g_ptr_array_add(stream, message);
+	}
+
+	harness_netlink_save(path, stream);
+
+ out:
+	if (fd >= 0)
+		close(fd);
+	g_ptr_array_free(stream, TRUE);
+
+	return harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
+
+/* Bounded copy of IFLA_IFNAME into name, which has IF_NAMESIZE bytes */
+static gboolean message_name(struct nlmsghdr *header, char *name)
+{
+	struct rtattr *rta;
+	int len = IFLA_PAYLOAD(header);
+
+	for (rta = IFLA_RTA(NLMSG_DATA(header)); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == IFLA_IFNAME) {
+			size_t size = MIN(RTA_PAYLOAD(rta), IF_NAMESIZE - 1);
+
+			memcpy(name, RTA_DATA(rta), size);
+			name[size] = '\0';
+			return TRUE;
+		}
+	}
+
+	return FALSE;
+}
+
+/* How often icdwg0 starts or stops running in stream, independent of the
+ * listener. This is what the listener must see. */
+static guint64 expected_edges(GPtrArray * stream)
+{
+	gboolean running = FALSE;
+	int index = -1;
+	guint64 edges = 0;
+	guint i;
+
+	for (i = 0; i < stream->len; i++) {
+		GByteArray *message = g_ptr_array_index(stream, i);
+		struct nlmsghdr *header;
+		int len = message->len;
+
+		for (header = (struct nlmsghdr *)message->data; NLMSG_OK(header, len); header = NLMSG_NEXT(header, len)) {
+			struct ifinfomsg *info = NLMSG_DATA(header);
+			char name[IF_NAMESIZE];
+			gboolean now;
+
+			if (header->nlmsg_type != RTM_NEWLINK && header->nlmsg_type != RTM_DELLINK)
+				continue;
+			if (header->nlmsg_len < NLMSG_LENGTH(sizeof(*info)))
+				continue;
+
+			if (!(message_name(header, name) && strcmp(name, WIREGUARD_INTERFACE_NAME) == 0)
+			    && !(running && info->ifi_index == index))
+				continue;
+
+			now = header->nlmsg_type == RTM_NEWLINK && (info->ifi_flags & IFF_RUNNING);
+			if (now != running)
+				edges++;
+			running = now;
+			index = now ? info->ifi_index : -1;
+		}
+	}
+
+	return edges;
+}
+
+static gboolean send_message(GByteArray * message)
+{
+	while (send(harness.netlink_fd, message->data, message->len, MSG_DONTWAIT) < 0) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			HARNESS_FAIL("Unable to send rtnetlink message: %s", strerror(errno));
+			return FALSE;
+		}
+
+		/* The socket is full, let the listener read */
+		harness_drain();
+	}
+
+	return TRUE;
+}
+
+static gint64 cpu_time(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &ts);
+
+	return (gint64) ts.tv_sec * G_USEC_PER_SEC + ts.tv_nsec / 1000;
+}
+
+/**
+ * Feed stream to the listener and report events per second, CPU time and
+ * allocations per event, and whether the listener saw every time icdwg0
+ * started or stopped running.
+ *
+ * @param prefix  first word of the report line
+ * @param stream  datagrams to replay
+ * @return FALSE if the listener missed an edge
+ */
+gboolean harness_netlink_replay(const char *prefix, GPtrArray * stream)
+{
+	guint64 expected = expected_edges(stream);
+	guint64 allocations;
+	gint64 cpu;
+	GTimer *timer;
+	gdouble elapsed;
+	guint i, events;
+
+	harness_drain();
+	harness_transitions_reset();
+
+	timer = g_timer_new();
+	cpu = cpu_time();
+	allocations = harness.allocations;
+
+	for (i = 0; i < stream->len; i++) {
+		if (!send_message(g_ptr_array_index(stream, i)))
+			break;
+		if (i % REPLAY_BATCH == REPLAY_BATCH - 1)
+			harness_drain();
+	}
+	harness_drain();
+
+	allocations = harness.allocations - allocations;
+	cpu = cpu_time() - cpu;
+	g_timer_stop(timer);
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+
+	events = MAX(i, 1);
+	g_print("%s events=%u elapsed_s=%.3f events_per_s=%.0f cpu_us_per_event=%.3f allocs_per_event=%.2f"
+		" edges_expected=%" G_GUINT64_FORMAT " edges_seen=%" G_GUINT64_FORMAT "\n", prefix, i, elapsed,
+		elapsed > 0 ? i / elapsed : 0.0, (gdouble) cpu / events, (gdouble) allocations / events, expected,
+		harness.transitions.interface_edges);
+
+	if (harness.transitions.interface_edges != expected) {
+		HARNESS_FAIL("Listener saw %" G_GUINT64_FORMAT " of %" G_GUINT64_FORMAT " icdwg0 edges",
+			     harness.transitions.interface_edges, expected);
+		return FALSE;
+	}
+
+	return TRUE;
+}
+
+static GByteArray *mutate(GPtrArray * corpus, GRand * rand)
+{
+	GByteArray *source = g_ptr_array_index(corpus, g_rand_int_range(rand, 0, corpus->len));
+	GByteArray *message = g_byte_array_sized_new(source->len);
+	int mutations = g_rand_int_range(rand, 1, 5);
+
+	g_byte_array_append(message, source->data, source->len);
+
+	while (mutations--) {
+		GByteArray *other;
+		guint32 len;
+
+		switch (g_rand_int_range(rand, 0, 5)) {
+		case 0:
+			if (message->len)
+				message->data[g_rand_int_range(rand, 0, message->len)] ^= 1 << g_rand_int_range(rand, 0, 8);
+			break;
+		case 1:
+			if (message->len)
+				message->data[g_rand_int_range(rand, 0, message->len)] = g_rand_int_range(rand, 0, 256);
+			break;
+		case 2:
+			g_byte_array_set_size(message, g_rand_int_range(rand, 0, message->len + 1));
+			break;
+		case 3:
+			/* nlmsg_len */
+			if (message->len >= sizeof(len)) {
+				len = g_rand_int(rand) % (MAX_DATAGRAM * 2);
+				memcpy(message->data, &len, sizeof(len));
+			}
+			break;
+		case 4:
+			/* Several messages in one datagram */
+			other = g_ptr_array_index(corpus, g_rand_int_range(rand, 0, corpus->len));
+			if (message->len + other->len <= MAX_DATAGRAM)
+				g_byte_array_append(message, other->data, other->len);
+			break;
+		}
+	}
+
+	return message;
+}
+
+/**
+ * Send mutated corpus datagrams to the listener. Afterwards the listener
+ * must still follow icdwg0 going up and down.
+ *
+ * @param corpus      datagrams to start from
+ * @param seed        random seed, the same seed gives the same datagrams
+ * @param iterations  number of datagrams to send
+ * @return FALSE if the listener no longer works
+ */
+gboolean harness_netlink_fuzz(GPtrArray * corpus, guint32 seed, guint iterations)
+{
+	wireguard_tunnel *tunnel = harness_network_private()->first_tunnel;
+	GRand *rand = g_rand_new_with_seed(seed);
+	guint i;
+
+	for (i = 0; i < iterations && corpus->len; i++) {
+		GByteArray *message = mutate(corpus, rand);
+
+		send_message(message);
+		g_byte_array_free(message, TRUE);
+
+		if (i % REPLAY_BATCH == REPLAY_BATCH - 1)
+			harness_drain();
+	}
+	harness_drain();
+	g_rand_free(rand);
+
+	harness_netlink_link(WIREGUARD_INTERFACE_NAME, FUZZ_CHECK_INDEX, TRUE);
+	if (!tunnel->state.wireguard_interface_up || tunnel->state.wireguard_interface_index != FUZZ_CHECK_INDEX) {
+		HARNESS_FAIL("Listener missed icdwg0 going up after fuzzing with seed %u", seed);
+		return FALSE;
+	}
+
+	harness_netlink_link(WIREGUARD_INTERFACE_NAME, FUZZ_CHECK_INDEX, FALSE);
+	if (tunnel->state.wireguard_interface_up) {
+		HARNESS_FAIL("Listener missed icdwg0 going down after fuzzing with seed %u", seed);
+		return FALSE;
+	}
+
+	return TRUE;
+}
@@ -0,0 +1,160 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* ip_up/ip_down cycles with the real wg-quick, netlink and kernel. Meant to
+ * run as root inside the client namespace netns-bench.sh sets up, where
+ * /etc/wireguard is private and the peer is reachable over a veth pair. */
+
+#include <stdlib.h>
+#include <string.h>
+#include <net/if.h>
+
+#include <glib.h>
+
+#include "harness.h"
+
+#define CONNECT_TIMEOUT 30000
+#define TEARDOWN_TIMEOUT 10000
+/* Link removal only shows up as an rtnetlink event, poll as a fallback */
+#define POLL_INTERVAL 5
+
+static gboolean ip_up_answered(void)
+{
+	return harness.iap.ip_up_answers == harness.iap.ip_up_requests;
+}
+
+static gboolean link_gone(void)
+{
+	return if_nametoindex(WIREGUARD_INTERFACE_NAME) == 0;
+}
+
+static gboolean spawns_done(void)
+{
+	return g_queue_is_empty(&harness.spawns);
+}
+
+static gboolean poll_cb(gpointer user_data)
+{
+	return TRUE;
+}
+
+/* Run command while the tunnel is up and pass its output through */
+static void run_command(const char *run)
+{
+	gchar *output = NULL;
+	GError *error = NULL;
+	gint status;
+
+	if (!g_spawn_command_line_sync(run, &output, NULL, &status, &error)) {
+		HARNESS_FAIL("Unable to run %s: %s", run, error->message);
+		g_clear_error(&error);
+		return;
+	}
+
+	g_print("%s", output);
+	g_free(output);
+
+	if (status != 0)
+		HARNESS_FAIL("%s failed", run);
+}
+
+/**
+ * Bring the tunnel up and down cycles times and report how long each step
+ * took, as key=value lines starting with "netns" and label.
+ *
+ * @param config_file  wg-quick configuration, used as config_file_override
+ * @param cycles       number of ip_up/ip_down cycles
+ * @param label        added to every line, e.g. "mtu=1420"
+ * @param run          command to run while the tunnel is up in the last
+ *                     cycle, or NULL
+ * @return exit status
+ */
+int harness_netns(const char *config_file, guint cycles, const char *label, const char *run)
+{
+	GArray *cold = g_array_new(FALSE, FALSE, sizeof(gint64));
+	GArray *warm = g_array_new(FALSE, FALSE, sizeof(gint64));
+	GArray *teardown = g_array_new(FALSE, FALSE, sizeof(gint64));
+	gchar *prefix = g_strdup_printf("netns %s", label);
+	gchar *key;
+	guint poll, i;
+
+	harness.real_system = TRUE;
+
+	if (!harness_setup(TRUE)) {
+		HARNESS_FAIL("Unable to load the modules");
+		goto unload;
+	}
+
+	key = g_strjoin("/", GC_WIREGUARD, HARNESS_CONFIG, GC_CONFIG_FILE_OVERRIDE, NULL);
+	harness_gconf_set_string(key, config_file);
+	g_free(key);
+
+	if (!link_gone())
+		HARNESS_FAIL("%s already exists", WIREGUARD_INTERFACE_NAME);
+
+	poll = g_timeout_add(POLL_INTERVAL, poll_cb, NULL);
+
+	for (i = 0; i < cycles && harness.failures == 0; i++) {
+		gint64 start, duration;
+
+		start = g_get_monotonic_time();
+		harness_ip_up(&harness.iap);
+		if (!harness_iterate(CONNECT_TIMEOUT, ip_up_answered) || !harness.iap.up) {
+			HARNESS_FAIL("Connect %u failed", i);
+			break;
+		}
+		duration = g_get_monotonic_time() - start;
+		/* The first connect after loading the modules pays for the
+		 * kernel module, the namespace's first route lookups, etc */
+		g_array_append_val(i == 0 ? cold : warm, duration);
+
+		if (run && i == cycles - 1)
+			run_command(run);
+
+		start = g_get_monotonic_time();
+		harness_ip_down(&harness.iap);
+		if (!harness_iterate(TEARDOWN_TIMEOUT, link_gone)) {
+			HARNESS_FAIL("Teardown %u did not remove %s", i, WIREGUARD_INTERFACE_NAME);
+			break;
+		}
+		duration = g_get_monotonic_time() - start;
+		g_array_append_val(teardown, duration);
+
+		/* wg-quick down may still be cleaning up after the link is gone */
+		if (!harness_iterate(TEARDOWN_TIMEOUT, spawns_done))
+			HARNESS_FAIL("wg-quick did not exit");
+	}
+
+	g_source_remove(poll);
+
+	harness_report_durations(prefix, "phase=cold_connect", cold);
+	harness_report_durations(prefix, "phase=warm_reconnect", warm);
+	harness_report_durations(prefix, "phase=teardown", teardown);
+
+ unload:
+	harness_teardown();
+	g_array_free(cold, TRUE);
+	g_array_free(warm, TRUE);
+	g_array_free(teardown, TRUE);
+	g_free(prefix);
+
+	return harness.failures ? EXIT_FAILURE : EXIT_SUCCESS;
+}
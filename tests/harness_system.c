@@ -0,0 +1,819 @@
+/*
+ * This file is part of libicd-wireguard
+ *
+ * Copyright (C) 2021, Merlijn Wajer <merlijn@wizzup.org>
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public License
+ * version 3.0 as published by the Free Software Foundation.
+ *
+ * This library is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU Lesser General Public
+ * License along with this library; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA
+ * 02110-1301 USA
+ *
+ */
+
+/* Everything the network module does to the system: spawning wg-quick,
+ * writing the config, generic netlink and rtnetlink. Unless real_system is
+ * set these are faked and the harness decides when and how wg-quick
+ * finishes. With real_helper set icd-wireguard-helper is real, only the
+ * wg-quick it runs is not. */
+
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+
+#include <glib.h>
+#include <glib/gstdio.h>
+
+#include "harness.h"
+
+/* The definition in the network module, bypassing our own */
+gpointer harness_module_symbol(const char *name)
+{
+	gpointer symbol = dlsym(harness.network_module, name);
+
+	if (symbol == NULL)
+		g_error("network module has no %s", name);
+
+	return symbol;
+}
+
+/* A real wg-quick exited; like icd2 we reap every child but only report
+ * the watched ones */
+static void real_child_cb(GPid pid, gint status, gpointer user_data)
+{
+	struct harness_spawn *spawn = user_data;
+
+	g_queue_remove(&harness.spawns, spawn);
+	g_spawn_close_pid(pid);
+
+	if (spawn->watched)
+		harness_child_exit(pid, status);
+
+	g_free(spawn);
+}
+
+/* Count allocations; glibc also exports its allocator under these names */
+extern void *__libc_malloc(size_t size);
+extern void *__libc_calloc(size_t nmemb, size_t size);
+extern void *__libc_realloc(void *ptr, size_t size);
+
+void *malloc(size_t size)
+{
+	harness.allocations++;
+	return __libc_malloc(size);
+}
+
+void *calloc(size_t nmemb, size_t size)
+{
+	harness.allocations++;
+	return __libc_calloc(nmemb, size);
+}
+
+void *realloc(void *ptr, size_t size)
+{
+	harness.allocations++;
+	return __libc_realloc(ptr, size);
+}
+
+/* N of an icdwgN we fake, -1 for anything else */
+static int tunnel_index(const char *ifname)
+{
+	const char *n;
+	gchar *end;
+	guint64 index;
+
+	if (ifname == NULL || !g_str_has_prefix(ifname, WIREGUARD_INTERFACE_PREFIX))
+		return -1;
+
+	n = ifname + strlen(WIREGUARD_INTERFACE_PREFIX);
+	index = g_ascii_strtoull(n, &end, 10);
+	if (end == n || *end != '\0' || index >= HARNESS_TUNNELS)
+		return -1;
+
+	return index;
+}
+
+pid_t spawn_as(network_wireguard_private * private, const char *username, const char *pathname, char *args[])
+{
+	struct harness_spawn *spawn;
+	int tunnel = -1;
+	GList *l;
+
+	spawn = g_new0(struct harness_spawn, 1);
+	if (args[0] && args[1] && args[2])
+		tunnel = tunnel_index(args[2]);
+
+	if (tunnel >= 0 && strcmp(args[1], "up") == 0)
+		spawn->type = HARNESS_SPAWN_UP;
+	else if (tunnel >= 0 && strcmp(args[1], "down") == 0)
+		spawn->type = HARNESS_SPAWN_DOWN;
+	else
+		spawn->type = HARNESS_SPAWN_OTHER;
+	spawn->tunnel = MAX(tunnel, 0);
+
+	/* The network module runs one wg-quick at a time per tunnel */
+	for (l = harness.spawns.head; l; l = l->next) {
+		struct harness_spawn *other = l->data;
+
+		if (other->tunnel == spawn->tunnel && !other->killed)
+			HARNESS_FAIL("wg-quick %s while another one runs on %s", args[1], args[2]);
+	}
+
+	if (harness.real_system) {
+		pid_t(*real) (network_wireguard_private *, const char *, const char *, char *[]) =
+		    harness_module_symbol("spawn_as");
+
+		spawn->pid = real(private, username, pathname, args);
+		if (spawn->pid == 0) {
+			g_free(spawn);
+			return 0;
+		}
+		g_child_watch_add(spawn->pid, real_child_cb, spawn);
+	} else {
+		spawn->pid = harness.next_pid++;
+	}
+
+	g_queue_push_tail(&harness.spawns, spawn);
+
+	return spawn->pid;
+}
+
+void wireguard_spawn_kill(network_wireguard_private * private, pid_t pid, int sig)
+{
+	GList *l;
+
+	if (harness.real_system || (harness.real_helper && pid < 0)) {
+		void (*real)(network_wireguard_private *, pid_t, int) = harness_module_symbol("wireguard_spawn_kill");
+
+		harness.signal_sent = sig;
+		real(private, pid, sig);
+		return;
+	}
+
+	/* Fake wg-quick ignores signals, the scenario decides when it exits */
+	harness.signal_sent = sig;
+	for (l = harness.spawns.head; l; l = l->next) {
+		struct harness_spawn *spawn = l->data;
+
+		if (spawn->pid == pid && sig == SIGKILL)
+			spawn->killed = TRUE;
+	}
+}
+
+/* No icd-wireguard-helper unless the scenario asks for it, also for real:
+ * every wg-quick goes through spawn_as() above, which tracks them */
+pid_t wireguard_helper_up(wireguard_tunnel * tunnel, const char *config)
+{
+	if (harness.real_helper) {
+		pid_t(*real) (wireguard_tunnel *, const char *) = harness_module_symbol("wireguard_helper_up");
+		return real(tunnel, config);
+	}
+
+	return 0;
+}
+
+pid_t wireguard_helper_down(wireguard_tunnel * tunnel)
+{
+	if (harness.real_helper) {
+		pid_t(*real) (wireguard_tunnel *) = harness_module_symbol("wireguard_helper_down");
+		return real(tunnel);
+	}
+
+	return 0;
+}
+
+/* The module looks for the installed helper first */
+int access(const char *pathname, int mode)
+{
+	static int (*real)(const char *, int) = NULL;
+
+	if (real == NULL)
+		real = dlsym(RTLD_NEXT, "access");
+
+	if (harness.real_helper && strcmp(pathname, WIREGUARD_HELPER_PATH) == 0)
+		pathname = HARNESS_HELPER;
+
+	return real(pathname, mode);
+}
+
+/* The helper exited; like icd2 we only report it if it was watched */
+static void helper_exit_cb(GPid pid, gint status, gpointer user_data)
+{
+	gboolean watched = harness.helper_watched;
+
+	g_spawn_close_pid(pid);
+	if (pid != harness.helper_pid)
+		return;
+
+	harness.helper_pid = 0;
+	harness.helper_watch = 0;
+	harness.helper_watched = FALSE;
+	if (watched && harness.nw_api.child_exit)
+		harness_child_exit(pid, status);
+}
+
+/* Starts HARNESS_HELPER as ourselves for WIREGUARD_HELPER_PATH, anything
+ * else the module runs goes through as it is */
+pid_t spawn_as_with_input(network_wireguard_private * private, const char *username, const char *pathname,
+			  char *args[], int input_fd)
+{
+	pid_t(*real) (network_wireguard_private *, const char *, const char *, char *[], int) =
+	    harness_module_symbol("spawn_as_with_input");
+	char *helper_args[] = { HARNESS_HELPER, NULL };
+	pid_t pid;
+
+	if (!harness.real_helper || strcmp(pathname, WIREGUARD_HELPER_PATH) != 0)
+		return real(private, username, pathname, args, input_fd);
+
+	if (harness.helper_pid)
+		HARNESS_FAIL("Helper started while %d runs", harness.helper_pid);
+
+	pid = real(private, g_get_user_name(), HARNESS_HELPER, helper_args, input_fd);
+	if (pid == 0)
+		return 0;
+
+	harness.helper_pid = pid;
+	harness.helper_watched = FALSE;
+	harness.helper_watch = g_child_watch_add(pid, helper_exit_cb, NULL);
+
+	return pid;
+}
+
+/**
+ * Kill the helper, as if it crashed.
+ */
+void harness_helper_kill(void)
+{
+	if (harness.helper_pid == 0) {
+		HARNESS_FAIL("No helper running");
+		return;
+	}
+
+	kill(harness.helper_pid, SIGKILL);
+}
+
+gboolean g_file_set_contents(const gchar * filename, const gchar * contents, gssize length, GError ** error)
+{
+	static gboolean(*real) (const gchar *, const gchar *, gssize, GError **) = NULL;
+	gboolean ret;
+
+	if (real == NULL)
+		real = dlsym(RTLD_NEXT, "g_file_set_contents");
+
+	if (harness.real_system || !g_str_has_prefix(filename, "/etc/wireguard/"))
+		return real(filename, contents, length, error);
+
+	gchar *basename = g_path_get_basename(filename);
+	gchar *path = g_build_filename(harness.config_dir, basename, NULL);
+
+	harness.config_writes++;
+	ret = real(path, contents, length, error);
+
+	g_free(path);
+	g_free(basename);
+
+	return ret;
+}
+
+void status_page_open(network_wireguard_private * private)
+{
+	void (*open_at)(network_wireguard_private *, const char *) = harness_module_symbol("status_page_open_at");
+	gchar *path;
+
+	if (harness.real_system) {
+		void (*real)(network_wireguard_private *) = harness_module_symbol("status_page_open");
+		real(private);
+		return;
+	}
+
+	/* Leave /run alone */
+	path = g_build_filename(harness.config_dir, HARNESS_STATUS_PAGE, NULL);
+	open_at(private, path);
+	g_free(path);
+}
+
+int wireguard_genl_open(guint16 * family_id)
+{
+	if (harness.real_system) {
+		int (*real)(guint16 *) = harness_module_symbol("wireguard_genl_open");
+		return real(family_id);
+	}
+
+	*family_id = 1;
+
+	return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+int wireguard_genl_get_device(int fd, guint16 family_id, const char *ifname,
+			      wireguard_genl_peer_fn peer_fn, gpointer user_data)
+{
+	wireguard_peer_info peer;
+	struct sockaddr_in *endpoint;
+	int tunnel;
+
+	if (harness.real_system) {
+		int (*real)(int, guint16, const char *, wireguard_genl_peer_fn, gpointer) =
+		    harness_module_symbol("wireguard_genl_get_device");
+		return real(fd, family_id, ifname, peer_fn, user_data);
+	}
+
+	tunnel = tunnel_index(ifname);
+	if (tunnel < 0 || !harness.links[tunnel].running)
+		return -ENODEV;
+
+	/* One peer that shook hands right away */
+	memset(&peer, 0x42, sizeof(peer.public_key));
+	memset(&peer.endpoint, 0, sizeof(peer.endpoint));
+	endpoint = (struct sockaddr_in *)&peer.endpoint;
+	endpoint->sin_family = AF_INET;
+	endpoint->sin_port = htons(51820);
+	inet_pton(AF_INET, "192.0.2.1", &endpoint->sin_addr);
+	peer.rx_bytes = 1024;
+	peer.tx_bytes = 2048;
+	peer.last_handshake = g_get_real_time() / G_USEC_PER_SEC - harness.links[tunnel].handshake_age;
+	peer_fn(&peer, user_data);
+
+	return harness.genl_error;
+}
+
+/* Report a message of batch as refused, as the real batch would */
+static void batch_fail(wireguard_nl_batch * batch, gpointer item, guint16 type, int error)
+{
+	void (*fail)(wireguard_nl_batch *, gpointer, guint16, int) = harness_module_symbol("wireguard_nl_batch_fail");
+
+	fail(batch, item, type, error);
+}
+
+void wireguard_genl_add_allowed_ips(wireguard_nl_batch * batch, guint16 family_id, const char *ifname,
+				    const guint8 * public_key, const wireguard_prefix * prefixes, guint count)
+{
+	guint last;
+	int tunnel;
+
+	if (harness.real_system) {
+		void (*real)(wireguard_nl_batch *, guint16, const char *, const guint8 *, const wireguard_prefix *,
+			     guint) = harness_module_symbol("wireguard_genl_add_allowed_ips");
+		real(batch, family_id, ifname, public_key, prefixes, count);
+		return;
+	}
+
+	if (count == 0)
+		return;
+
+	tunnel = tunnel_index(ifname);
+	if (tunnel < 0 || !harness.links[tunnel].running) {
+		batch_fail(batch, (gpointer) prefixes, family_id, -ENODEV);
+		return;
+	}
+
+	/* Fails the last message, after the ones before it went through */
+	if (harness.allowed_ips_error) {
+		last = (count - 1) / WIREGUARD_ALLOWED_IPS_CHUNK * WIREGUARD_ALLOWED_IPS_CHUNK;
+		harness.allowed_ips_chunks += last / WIREGUARD_ALLOWED_IPS_CHUNK;
+		harness.allowed_ips += last;
+		batch_fail(batch, (gpointer) & prefixes[last], family_id, harness.allowed_ips_error);
+		return;
+	}
+
+	harness.allowed_ips_chunks += (count + WIREGUARD_ALLOWED_IPS_CHUNK - 1) / WIREGUARD_ALLOWED_IPS_CHUNK;
+	harness.allowed_ips += count;
+}
+
+int wireguard_rtnl_open(void)
+{
+	if (harness.real_system) {
+		int (*real)(void) = harness_module_symbol("wireguard_rtnl_open");
+		return real();
+	}
+
+	return open("/dev/null", O_RDONLY | O_CLOEXEC);
+}
+
+void wireguard_rtnl_route(wireguard_nl_batch * batch, int type, guint32 table, const wireguard_prefix * prefix,
+			  const int *paths, guint count, gpointer item)
+{
+	char addr[INET6_ADDRSTRLEN];
+	gchar *key;
+
+	if (harness.real_system) {
+		void (*real)(wireguard_nl_batch *, int, guint32, const wireguard_prefix *, const int *, guint,
+			     gpointer) = harness_module_symbol("wireguard_rtnl_route");
+		real(batch, type, table, prefix, paths, count, item);
+		return;
+	}
+
+	inet_ntop(prefix->family, prefix->addr, addr, sizeof(addr));
+	key = g_strdup_printf("%s/%u", addr, prefix->len);
+
+	if (type == RTM_DELROUTE) {
+		gpointer value;
+
+		/* Only a route of the same type */
+		if (g_hash_table_lookup_extended(harness.routes, key, NULL, &value)
+		    && (GPOINTER_TO_UINT(value) == HARNESS_ROUTE_THROW) == (paths == NULL))
+			g_hash_table_remove(harness.routes, key);
+		else
+			batch_fail(batch, item, type, -ESRCH);
+		g_free(key);
+	} else {
+		g_hash_table_replace(harness.routes, key, GUINT_TO_POINTER(paths ? count : HARNESS_ROUTE_THROW));
+	}
+}
+
+void wireguard_rtnl_rule(wireguard_nl_batch * batch, int type, int family, guint32 priority, guint32 table,
+			 guint32 fwmark, guint32 fwmask, gboolean suppress_default, gpointer item)
+{
+	if (harness.real_system) {
+		void (*real)(wireguard_nl_batch *, int, int, guint32, guint32, guint32, guint32, gboolean, gpointer) =
+		    harness_module_symbol("wireguard_rtnl_rule");
+		real(batch, type, family, priority, table, fwmark, fwmask, suppress_default, item);
+		return;
+	}
+
+	harness.rules += type == RTM_NEWRULE ? 1 : -1;
+}
+
+void wireguard_rtnl_link_delete(wireguard_nl_batch * batch, const char *ifname, gpointer item)
+{
+	int tunnel;
+
+	if (harness.real_system) {
+		void (*real)(wireguard_nl_batch *, const char *, gpointer) =
+		    harness_module_symbol("wireguard_rtnl_link_delete");
+		real(batch, ifname, item);
+		return;
+	}
+
+	harness.links_deleted++;
+	tunnel = tunnel_index(ifname);
+	if (tunnel >= 0 && harness.links[tunnel].exists)
+		harness_link_remove(tunnel);
+	else
+		batch_fail(batch, item, RTM_DELLINK, -ENODEV);
+}
+
+void wireguard_state_change(network_wireguard_private * private, wireguard_event * event)
+{
+	/* Not cached, the module may be loaded somewhere else next time */
+	void (*real)(network_wireguard_private *, wireguard_event *) = harness_module_symbol("wireguard_state_change");
+	enum icd_wireguard_event_source_type source = event->source;
+	wireguard_tunnel *tunnel = event->tunnel;
+	gint64 start, duration;
+	gboolean was_up;
+
+	if (private->events_dispatching == FALSE)
+		HARNESS_FAIL("Event %d handled outside of wireguard_state_post()", source);
+
+	was_up = tunnel->state.wireguard_interface_up;
+
+	start = g_get_monotonic_time();
+	real(private, event);
+	duration = g_get_monotonic_time() - start;
+
+	/* Tunnels are only freed outside of event handling */
+	if (tunnel->state.wireguard_interface_up != was_up)
+		harness.transitions.interface_edges++;
+	harness.transitions.count++;
+	if (source < EVENT_SOURCE_COUNT)
+		g_array_append_val(harness.transitions.durations[source], duration);
+}
+
+/* rtnetlink */
+
+/**
+ * Hand one end of a socketpair to the network module as its rtnetlink
+ * socket, harness_netlink_link() writes to the other end.
+ */
+void harness_netlink_attach(void)
+{
+	void (*attach)(network_wireguard_private *, int) = harness_module_symbol("netlink_listener_attach");
+	int fds[2];
+
+	if (socketpair(AF_UNIX, SOCK_DGRAM | SOCK_CLOEXEC, 0, fds) != 0)
+		g_error("socketpair: %s", strerror(errno));
+
+	attach(harness_network_private(), fds[0]);
+
+	if (harness.netlink_fd >= 0)
+		close(harness.netlink_fd);
+	harness.netlink_fd = fds[1];
+}
+
+/**
+ * Build a link message like the ones the kernel sends on RTMGRP_LINK.
+ *
+ * @param type    RTM_NEWLINK or RTM_DELLINK
+ * @param ifname  interface name, or NULL to leave out IFLA_IFNAME
+ * @param index   interface index
+ * @param flags   ifi_flags
+ * @return the message, free with g_byte_array_free()
+ */
+GByteArray *harness_netlink_message(int type, const char *ifname, int index, guint flags)
+{
+	GByteArray *message = g_byte_array_new();
+	struct nlmsghdr *header;
+	struct ifinfomsg *info;
+	size_t len = NLMSG_LENGTH(sizeof(*info));
+
+	if (ifname)
+		len = NLMSG_ALIGN(len) + RTA_SPACE(strlen(ifname) + 1);
+
+	g_byte_array_set_size(message, NLMSG_ALIGN(len));
+	memset(message->data, 0, message->len);
+
+	header = (struct nlmsghdr *)message->data;
+	header->nlmsg_type = type;
+	header->nlmsg_len = len;
+
+	info = NLMSG_DATA(header);
+	info->ifi_family = AF_UNSPEC;
+	info->ifi_index = index;
+	info->ifi_flags = flags;
+	info->ifi_change = ~0U;
+
+	if (ifname) {
+		struct rtattr *rta = IFLA_RTA(info);
+
+		rta->rta_type = IFLA_IFNAME;
+		rta->rta_len = RTA_LENGTH(strlen(ifname) + 1);
+		strcpy(RTA_DATA(rta), ifname);
+	}
+
+	return message;
+}
+
+/**
+ * Send an RTM_NEWLINK to the network module, like the kernel does when a link
+ * is created or changes state.
+ *
+ * @param ifname   interface name
+ * @param index    interface index
+ * @param running  whether IFF_RUNNING is set
+ */
+void harness_netlink_link(const char *ifname, int index, gboolean running)
+{
+	GByteArray *message = harness_netlink_message(RTM_NEWLINK, ifname, index, running ? IFF_UP | IFF_RUNNING : 0);
+
+	if (send(harness.netlink_fd, message->data, message->len, 0) < 0)
+		HARNESS_FAIL("Unable to send rtnetlink message: %s", strerror(errno));
+
+	g_byte_array_free(message, TRUE);
+	harness_drain();
+}
+
+/* Fake wg-quick */
+
+struct harness_spawn *harness_next_spawn(void)
+{
+	return g_queue_peek_head(&harness.spawns);
+}
+
+/**
+ * Let a fake wg-quick finish, with the link changes the real one causes.
+ *
+ * @param spawn    spawn from harness_next_spawn()
+ * @param success  whether wg-quick up succeeds, wg-quick down always does
+ */
+void harness_complete_spawn(struct harness_spawn *spawn, gboolean success)
+{
+	struct harness_link *link = &harness.links[spawn->tunnel];
+	gchar *ifname = g_strdup_printf(WIREGUARD_INTERFACE_PREFIX "%u", spawn->tunnel);
+	int status = 0;
+
+	g_queue_remove(&harness.spawns, spawn);
+
+	switch (spawn->type) {
+	case HARNESS_SPAWN_UP:
+		/* wg-quick refuses to touch an existing interface */
+		if (!success || link->exists) {
+			status = 1;
+			break;
+		}
+
+		link->exists = TRUE;
+		link->index = harness.next_ifindex++;
+		harness_netlink_link(ifname, link->index, FALSE);
+
+		link->running = TRUE;
+		harness_netlink_link(ifname, link->index, TRUE);
+		break;
+	case HARNESS_SPAWN_DOWN:
+		if (!link->exists) {
+			status = 1;
+			break;
+		}
+
+		harness_link_remove(spawn->tunnel);
+		break;
+	case HARNESS_SPAWN_OTHER:
+		HARNESS_FAIL("Unexpected spawn");
+		break;
+	}
+
+	if (spawn->watched)
+		harness_child_exit(spawn->pid, status);
+
+	g_free(ifname);
+	g_free(spawn);
+	harness_drain();
+}
+
+/**
+ * Remove a fake icdwgN, like wg-quick down or someone else would.
+ *
+ * @param tunnel  N
+ */
+void harness_link_remove(guint tunnel)
+{
+	struct harness_link *link = &harness.links[tunnel];
+	gchar *ifname = g_strdup_printf(WIREGUARD_INTERFACE_PREFIX "%u", tunnel);
+
+	link->running = FALSE;
+	link->exists = FALSE;
+	harness_netlink_link(ifname, link->index, FALSE);
+
+	g_free(ifname);
+}
+
+void harness_system_init(void)
+{
+	GError *error = NULL;
+	int i;
+
+	g_queue_init(&harness.spawns);
+	harness.next_pid = HARNESS_FIRST_PID;
+	harness.next_ifindex = HARNESS_FIRST_IFINDEX;
+	harness.netlink_fd = -1;
+	memset(harness.links, 0, sizeof(harness.links));
+	harness.genl_error = 0;
+	harness.config_writes = 0;
+	harness.routes = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	harness.rules = 0;
+	harness.allowed_ips_chunks = 0;
+	harness.allowed_ips = 0;
+	harness.allowed_ips_error = 0;
+	harness.signal_sent = 0;
+	harness.links_deleted = 0;
+	harness.real_helper = FALSE;
+	harness.helper_pid = 0;
+	harness.helper_watch = 0;
+	harness.helper_watched = FALSE;
+
+	harness.config_dir = g_dir_make_tmp("icd-wireguard-harness-XXXXXX", &error);
+	if (harness.config_dir == NULL)
+		g_error("Unable to create a temporary directory: %s", error->message);
+
+	for (i = 0; i < EVENT_SOURCE_COUNT; i++)
+		harness.transitions.durations[i] = g_array_new(FALSE, FALSE, sizeof(gint64));
+	harness_transitions_reset();
+}
+
+void harness_system_free(void)
+{
+	int i;
+
+	while (!g_queue_is_empty(&harness.spawns))
+		g_free(g_queue_pop_head(&harness.spawns));
+
+	if (harness.netlink_fd >= 0)
+		close(harness.netlink_fd);
+	harness.netlink_fd = -1;
+
+	/* The module closed its end, so the helper exits by itself */
+	if (harness.helper_pid) {
+		g_source_remove(harness.helper_watch);
+		waitpid(harness.helper_pid, NULL, 0);
+		g_spawn_close_pid(harness.helper_pid);
+	}
+	harness.helper_pid = 0;
+	harness.helper_watch = 0;
+	if (harness.real_helper) {
+		GDir *dir = g_dir_open(HARNESS_HELPER_DIR, 0, NULL);
+		const gchar *name;
+
+		while (dir && (name = g_dir_read_name(dir))) {
+			gchar *path = g_build_filename(HARNESS_HELPER_DIR, name, NULL);
+
+			g_unlink(path);
+			g_free(path);
+		}
+		if (dir)
+			g_dir_close(dir);
+		harness.real_helper = FALSE;
+	}
+
+	for (i = 0; i < HARNESS_TUNNELS; i++) {
+		gchar *name = g_strdup_printf(WIREGUARD_INTERFACE_PREFIX "%d.conf", i);
+		gchar *path = g_build_filename(harness.config_dir, name, NULL);
+
+		g_unlink(path);
+		g_free(path);
+		g_free(name);
+	}
+	g_hash_table_destroy(harness.routes);
+	harness.routes = NULL;
+
+	g_rmdir(harness.config_dir);
+	g_free(harness.config_dir);
+	harness.config_dir = NULL;
+
+	for (i = 0; i < EVENT_SOURCE_COUNT; i++)
+		g_array_free(harness.transitions.durations[i], TRUE);
+}
+
+/* Reporting */
+
+static const char *source_names[EVENT_SOURCE_COUNT] = {
+	[EVENT_SOURCE_IP_UP] = "ip_up",
+	[EVENT_SOURCE_IP_DOWN] = "ip_down",
+	[EVENT_SOURCE_GCONF_CHANGE] = "gconf_change",
+	[EVENT_SOURCE_WIREGUARD_UP] = "interface_up",
+	[EVENT_SOURCE_WIREGUARD_DOWN] = "interface_down",
+	[EVENT_SOURCE_WIREGUARD_QUICK_PID_EXIT] = "wg_quick_exit",
+	[EVENT_SOURCE_DBUS_CALL_START] = "dbus_start",
+	[EVENT_SOURCE_DBUS_CALL_STOP] = "dbus_stop",
+};
+
+static gint compare_duration(gconstpointer a, gconstpointer b)
+{
+	gint64 x = *(const gint64 *)a, y = *(const gint64 *)b;
+
+	return x < y ? -1 : x > y;
+}
+
+static gint64 percentile(GArray * sorted, guint p)
+{
+	guint rank = (sorted->len * p + 99) / 100;
+
+	return g_array_index(sorted, gint64, rank ? rank - 1 : 0);
+}
+
+/**
+ * Print the distribution of a set of durations as one key=value line.
+ *
+ * @param prefix     first word of the line, names the run
+ * @param name       what was measured
+ * @param durations  durations in microseconds, sorted in place
+ */
+void harness_report_durations(const char *prefix, const char *name, GArray * durations)
+{
+	if (durations->len == 0)
+		return;
+
+	g_array_sort(durations, compare_duration);
+	g_print("%s %s count=%u p50_us=%" G_GINT64_FORMAT " p95_us=%" G_GINT64_FORMAT " p99_us=%" G_GINT64_FORMAT
+		" max_us=%" G_GINT64_FORMAT "\n", prefix, name, durations->len, percentile(durations, 50),
+		percentile(durations, 95), percentile(durations, 99),
+		g_array_index(durations, gint64, durations->len - 1));
+}
+
+/**
+ * Print the transition latencies as key=value lines, one per event source,
+ * and the overall throughput.
+ *
+ * @param prefix   first word of every line, names the run
+ * @param elapsed  wall time of the run in seconds
+ */
+void harness_transitions_report(const char *prefix, gdouble elapsed)
+{
+	int i;
+
+	for (i = 0; i < EVENT_SOURCE_COUNT; i++) {
+		gchar *name = g_strconcat("source=", source_names[i], NULL);
+
+		harness_report_durations(prefix, name, harness.transitions.durations[i]);
+		g_free(name);
+	}
+
+	g_print("%s transitions=%" G_GUINT64_FORMAT " elapsed_s=%.3f transitions_per_s=%.0f\n", prefix,
+		harness.transitions.count, elapsed, elapsed > 0 ? harness.transitions.count / elapsed : 0.0);
+}
+
+void harness_transitions_reset(void)
+{
+	int i;
+
+	harness.transitions.count = 0;
+	harness.transitions.interface_edges = 0;
+	for (i = 0; i < EVENT_SOURCE_COUNT; i++)
+		g_array_set_size(harness.transitions.durations[i], 0);
+}
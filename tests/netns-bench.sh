@@ -0,0 +1,115 @@
+#!/bin/sh
+#
+# End-to-end benchmark of the network module against a real WireGuard peer.
+#
+# Creates a client and a peer network namespace joined by a veth pair and
+# runs a plain kernel WireGuard interface as the peer. wireguard-harness then
+# drives the module through ip_up/ip_down cycles inside the client namespace,
+# with the real wg-quick, and measures ping latency and iperf3 throughput
+# through the tunnel for every MTU in $MTUS. Nothing leaves the machine.
+#
+# Needs root, iproute2, wireguard-tools and ping; iperf3 is optional.
+# Output is key=value lines, one set per MTU.
+
+set -e
+
+HARNESS=${HARNESS:-./wireguard-harness}
+CYCLES=${CYCLES:-20}
+MTUS=${MTUS:-"1280 1420"}
+DURATION=${DURATION:-5}
+
+CLIENT=icdwg-bench-client
+PEER=icdwg-bench-peer
+CLIENT_VETH=172.31.250.2
+PEER_VETH=172.31.250.1
+CLIENT_TUNNEL=10.250.0.2
+PEER_TUNNEL=10.250.0.1
+PORT=51820
+
+skip() {
+	echo "SKIP: $*"
+	exit 77
+}
+
+[ "$(id -u)" = 0 ] || skip "needs root"
+for tool in ip wg ping; do
+	command -v $tool >/dev/null 2>&1 || skip "$tool not found"
+done
+# The module runs wg-quick by absolute path
+[ -x /usr/bin/wg-quick ] || skip "/usr/bin/wg-quick not found"
+
+WORK=$(mktemp -d)
+
+cleanup() {
+	[ -f "$WORK/iperf3.pid" ] && kill "$(cat "$WORK/iperf3.pid")" 2>/dev/null
+	ip netns del $CLIENT 2>/dev/null
+	ip netns del $PEER 2>/dev/null
+	rm -rf /etc/netns/$CLIENT "$WORK"
+}
+trap cleanup EXIT INT TERM
+
+ip netns add $CLIENT
+ip netns add $PEER
+ip link add veth-icdwg-c netns $CLIENT type veth peer name veth-icdwg-p netns $PEER
+ip -n $CLIENT addr add $CLIENT_VETH/24 dev veth-icdwg-c
+ip -n $PEER addr add $PEER_VETH/24 dev veth-icdwg-p
+for ns in $CLIENT $PEER; do
+	ip -n $ns link set lo up
+done
+ip -n $CLIENT link set veth-icdwg-c up
+ip -n $PEER link set veth-icdwg-p up
+
+umask 077
+wg genkey >"$WORK/client.key"
+wg pubkey <"$WORK/client.key" >"$WORK/client.pub"
+wg genkey >"$WORK/peer.key"
+wg pubkey <"$WORK/peer.key" >"$WORK/peer.pub"
+
+# The stand-in peer
+ip -n $PEER link add wg-peer type wireguard
+ip netns exec $PEER wg set wg-peer listen-port $PORT private-key "$WORK/peer.key" \
+	peer "$(cat "$WORK/client.pub")" allowed-ips $CLIENT_TUNNEL/32
+ip -n $PEER addr add $PEER_TUNNEL/24 dev wg-peer
+ip -n $PEER link set wg-peer up
+
+if command -v iperf3 >/dev/null 2>&1; then
+	ip netns exec $PEER iperf3 -s -D -B $PEER_TUNNEL --pidfile "$WORK/iperf3.pid"
+fi
+
+# ip netns exec bind mounts /etc/netns/$CLIENT/* over /etc, so wg-quick and
+# the module get a private /etc/wireguard
+mkdir -p /etc/netns/$CLIENT/wireguard
+
+# Runs in the client namespace while the tunnel is up
+cat >"$WORK/traffic.sh" <<TRAFFIC
+#!/bin/sh
+label=\$1
+# The first packet pays for the handshake
+ping -q -c 1 -W 5 $PEER_TUNNEL >/dev/null
+ping -q -c 200 -i 0.01 $PEER_TUNNEL |
+	sed -n "s|^rtt min/avg/max/mdev = \([^/]*\)/\([^/]*\)/\([^/]*\)/\([^ ]*\) ms|netns \$label ping_min_ms=\1 ping_avg_ms=\2 ping_max_ms=\3 ping_mdev_ms=\4|p"
+if [ -f "$WORK/iperf3.pid" ]; then
+	iperf3 -c $PEER_TUNNEL -t $DURATION -f m |
+		awk -v label="\$label" '/receiver/ { print "netns " label " throughput_mbit_s=" \$7 }'
+fi
+TRAFFIC
+chmod +x "$WORK/traffic.sh"
+
+for mtu in $MTUS; do
+	ip -n $PEER link set wg-peer mtu $mtu
+
+	cat >"$WORK/icdwg0-$mtu.conf" <<CONF
+[Interface]
+PrivateKey = $(cat "$WORK/client.key")
+Address = $CLIENT_TUNNEL/24
+MTU = $mtu
+
+[Peer]
+PublicKey = $(cat "$WORK/peer.pub")
+Endpoint = $PEER_VETH:$PORT
+AllowedIPs = $PEER_TUNNEL/32
+CONF
+
+	ip netns exec $CLIENT "$HARNESS" netns --config "$WORK/icdwg0-$mtu.conf" \
+		--iterations "$CYCLES" --label "mtu=$mtu" --run "$WORK/traffic.sh mtu=$mtu"
+done